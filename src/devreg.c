@@ -0,0 +1,390 @@
+/* devreg.c
+ *
+ * USB device registry of ptpcam.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The busses are enumerated once, by the first lookup; later lookups by
+ * bus/dev numbers, serial number or vendor/product ID are answered from
+ * the registry. On Linux the usbfs device nodes are watched by inotify:
+ * a device gone is dropped from the registry right away, an arrival makes
+ * the next lookup rescan. Elsewhere the registry only changes when
+ * devreg_poll() is called, which rescans every PTPCAM_DEVREG_POLL ms. USB
+ * serial numbers are read the first time they are asked for, then kept.
+ */
+
+#include <config.h>
+#include "ptp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <usb.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include "ptpcam.h"
+
+/* where usbfs keeps the device nodes, one directory per bus */
+#ifndef PTPCAM_USB_DEVFS
+#define PTPCAM_USB_DEVFS	"/dev/bus/usb"
+#endif
+
+/* a bus directory watched, see devreg_watch() */
+typedef struct {
+	int wd;
+	int busn;
+} DevRegWatch;
+
+static PTPDevice *devreg_devs=NULL;
+static int devreg_n=0;
+static int devreg_scanned=0;
+static int devreg_dirty=0;		/* a device arrived, rescan */
+static int devreg_fd=-1;		/* inotify, -1 if none */
+static DevRegWatch *devreg_watches=NULL;
+static int devreg_nwatches=0;
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* watches the device nodes of a bus directory */
+static void
+devreg_watch (const char *dirname)
+{
+	char path[sizeof(PTPCAM_USB_DEVFS)+32];
+	DevRegWatch *w;
+	int i, wd, busn=strtol(dirname,NULL,10);
+
+	for (i=0; i<devreg_nwatches; i++)
+		if (devreg_watches[i].busn==busn)
+			return;
+	snprintf(path, sizeof(path), "%s/%.24s", PTPCAM_USB_DEVFS, dirname);
+	wd=inotify_add_watch(devreg_fd, path, IN_CREATE|IN_DELETE);
+	if (wd<0)
+		return;
+	w=realloc(devreg_watches, (devreg_nwatches+1)*sizeof(DevRegWatch));
+	if (w==NULL)
+		return;
+	devreg_watches=w;
+	devreg_watches[devreg_nwatches].wd=wd;
+	devreg_watches[devreg_nwatches].busn=busn;
+	devreg_nwatches++;
+}
+#endif
+
+static int
+devreg_same (PTPDevice *a, PTPDevice *b)
+{
+	return a->busn==b->busn && a->devn==b->devn &&
+		a->vendor==b->vendor && a->product==b->product;
+}
+
+/*
+ * enumerates the busses; serial numbers read already are kept and, if
+ * changed is given, it is told about the devices come and gone; returns
+ * how many did
+ */
+static int
+devreg_scan (PTPDeviceFunc changed)
+{
+	struct usb_bus *bus;
+	struct usb_device *dev;
+	PTPDevice *devs=NULL, *d, *old=devreg_devs;
+	int i, j, n=0, nold=devreg_n, ret=0;
+
+	if (!devreg_scanned) {
+		usb_init();
+#ifdef HAVE_SYS_INOTIFY_H
+		devreg_fd=inotify_init();
+		if (devreg_fd>=0)
+			inotify_add_watch(devreg_fd, PTPCAM_USB_DEVFS,
+				IN_CREATE);
+#endif
+	}
+	usb_find_busses();
+	usb_find_devices();
+	for (bus=usb_get_busses(); bus; bus=bus->next) {
+#ifdef HAVE_SYS_INOTIFY_H
+		if (devreg_fd>=0)
+			devreg_watch(bus->dirname);
+#endif
+		for (dev=bus->devices; dev; dev=dev->next) {
+			if (dev->config==NULL ||
+			    dev->descriptor.bDeviceClass==USB_CLASS_HUB)
+				continue;
+			d=realloc(devs, (n+1)*sizeof(PTPDevice));
+			if (d==NULL)
+				break;
+			devs=d;
+			d=&devs[n++];
+			memset(d, 0, sizeof(PTPDevice));
+			d->bus=bus;
+			d->dev=dev;
+			d->busn=strtol(bus->dirname,NULL,10);
+			d->devn=strtol(dev->filename,NULL,10);
+			d->vendor=dev->descriptor.idVendor;
+			d->product=dev->descriptor.idProduct;
+			d->ptp=dev->config->interface->altsetting->
+				bInterfaceClass==USB_CLASS_PTP;
+			for (j=0; j<nold; j++)
+				if (devreg_same(&old[j], d))
+					break;
+			if (j<nold) {
+				d->serial_read=old[j].serial_read;
+				memcpy(d->serial, old[j].serial,
+					sizeof(d->serial));
+			} else if (devreg_scanned) {
+				if (changed!=NULL)
+					changed(d, 1);
+				ret++;
+			}
+		}
+	}
+	for (i=0; i<nold; i++) {
+		for (j=0; j<n; j++)
+			if (devreg_same(&old[i], &devs[j]))
+				break;
+		if (j<n)
+			continue;
+		if (changed!=NULL)
+			changed(&old[i], 0);
+		ret++;
+	}
+	free(old);
+	devreg_devs=devs;
+	devreg_n=n;
+	devreg_scanned=1;
+	devreg_dirty=0;
+	return ret;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* drops bus/dev from the registry, telling changed about it */
+static void
+devreg_remove (int busn, int devn, PTPDeviceFunc changed)
+{
+	int i;
+
+	for (i=0; i<devreg_n; i++)
+		if (devreg_devs[i].busn==busn && devreg_devs[i].devn==devn) {
+			if (changed!=NULL)
+				changed(&devreg_devs[i], 0);
+			memmove(&devreg_devs[i], &devreg_devs[i+1],
+				(devreg_n-i-1)*sizeof(PTPDevice));
+			devreg_n--;
+			return;
+		}
+}
+#endif
+
+/*
+ * devreg_poll:
+ *	int timeout		- ms to wait for a change, -1 forever
+ *	PTPDeviceFunc changed	- told about every device come or gone,
+ *				  may be NULL
+ *
+ * Follows the hot-plug notifications: waits for the first one, up to
+ * timeout ms, then takes all pending. Without notifications (not Linux)
+ * the busses are rescanned every PTPCAM_DEVREG_POLL ms.
+ *
+ * Returns 1 if something changed, 0 if not, -1 on errors.
+ */
+int
+devreg_poll (int timeout, PTPDeviceFunc changed)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	struct pollfd pfd;
+	ssize_t len;
+	char *p;
+	int i, n, ret=0;
+#endif
+
+	if (!devreg_scanned)
+		devreg_scan(NULL);
+#ifdef HAVE_SYS_INOTIFY_H
+	if (devreg_fd>=0) {
+		pfd.fd=devreg_fd;
+		pfd.events=POLLIN;
+		n=poll(&pfd, 1, timeout);
+		if (n<0)
+			return -1;
+		while (n>0) {
+			len=read(devreg_fd, buf, sizeof(buf));
+			if (len<=0)
+				break;
+			for (p=buf; p<buf+len;
+			    p+=sizeof(struct inotify_event)+ev->len) {
+				ev=(struct inotify_event *)p;
+				ret=1;
+				if (ev->mask&IN_CREATE) {
+					/* a bus or a device arrived */
+					devreg_dirty=1;
+					continue;
+				}
+				if (!(ev->mask&IN_DELETE) || ev->len==0)
+					continue;
+				for (i=0; i<devreg_nwatches; i++)
+					if (devreg_watches[i].wd==ev->wd)
+						devreg_remove(devreg_watches[i].busn,
+							strtol(ev->name,NULL,10),
+							changed);
+			}
+			n=poll(&pfd, 1, 0);
+		}
+		if (devreg_dirty)
+			devreg_scan(changed);
+		return ret;
+	}
+#endif
+	if (timeout<0 || timeout>PTPCAM_DEVREG_POLL)
+		timeout=PTPCAM_DEVREG_POLL;
+	usleep(timeout*1000);
+	return devreg_scan(changed)>0;
+}
+
+/* brings the registry up to date before a lookup */
+static void
+devreg_update (void)
+{
+	if (!devreg_scanned)
+		devreg_scan(NULL);
+	else if (devreg_fd>=0)
+		devreg_poll(0, NULL);
+}
+
+/*
+ * devreg_count / devreg_device:
+ *
+ * The devices in the registry (all but hubs), i from 0 to count-1. The
+ * pointers are good until the next lookup.
+ */
+int
+devreg_count (void)
+{
+	devreg_update();
+	return devreg_n;
+}
+
+PTPDevice *
+devreg_device (int i)
+{
+	return i>=0 && i<devreg_n?&devreg_devs[i]:NULL;
+}
+
+/* does d count as a camera, force takes any device */
+static int
+devreg_match (PTPDevice *d, short force)
+{
+	return d->ptp || force;
+}
+
+/*
+ * devreg_find:
+ *	int busn, devn		- bus and device numbers, 0 for any
+ *	short force		- not only PTP devices
+ *
+ * Returns the first camera matching like find_device() does, or NULL.
+ */
+PTPDevice *
+devreg_find (int busn, int devn, short force)
+{
+	PTPDevice *d;
+	int i;
+
+	devreg_update();
+	for (i=0; i<devreg_n; i++) {
+		d=&devreg_devs[i];
+		if (!devreg_match(d, force))
+			continue;
+		if ((busn==0 || d->busn==busn) && (devn==0 || d->devn==devn))
+			return d;
+	}
+	return NULL;
+}
+
+/* the USB serial number of d, "" if it has none */
+const char *
+devreg_serial (PTPDevice *d)
+{
+	usb_dev_handle *h;
+
+	if (d->serial_read)
+		return d->serial;
+	d->serial_read=1;
+	d->serial[0]='\0';
+	if (d->dev->descriptor.iSerialNumber==0)
+		return d->serial;
+	h=usb_open(d->dev);
+	if (h==NULL)
+		return d->serial;
+	if (usb_get_string_simple(h, d->dev->descriptor.iSerialNumber,
+	    d->serial, sizeof(d->serial))<0)
+		d->serial[0]='\0';
+	usb_close(h);
+	return d->serial;
+}
+
+/* returns the camera with the USB serial number given, or NULL */
+PTPDevice *
+devreg_find_serial (const char *serial, short force)
+{
+	PTPDevice *d;
+	int i;
+
+	devreg_update();
+	for (i=0; i<devreg_n; i++) {
+		d=&devreg_devs[i];
+		if (devreg_match(d, force) && !strcmp(devreg_serial(d), serial))
+			return d;
+	}
+	return NULL;
+}
+
+/* returns the first camera of vendor:product, or NULL */
+PTPDevice *
+devreg_find_id (uint16_t vendor, uint16_t product, short force)
+{
+	PTPDevice *d;
+	int i;
+
+	devreg_update();
+	for (i=0; i<devreg_n; i++) {
+		d=&devreg_devs[i];
+		if (devreg_match(d, force) && d->vendor==vendor &&
+		    d->product==product)
+			return d;
+	}
+	return NULL;
+}
+
+/* frees the registry and stops following hot-plug notifications */
+void
+devreg_close (void)
+{
+	if (devreg_fd>=0)
+		close(devreg_fd);
+	devreg_fd=-1;
+	free(devreg_watches);
+	devreg_watches=NULL;
+	devreg_nwatches=0;
+	free(devreg_devs);
+	devreg_devs=NULL;
+	devreg_n=0;
+	devreg_scanned=0;
+}
@@ -0,0 +1,366 @@
+/* libusb1.c
+ *
+ * Asynchronous libusb-1.0 transport for ptpcam.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The libusb-0.1 transport issues one blocking usb_bulk_read() per
+ * PTPCAM_USB_URB chunk, so the bus is idle between two submissions.
+ * Here a bulk read or write is split into ptp_usb->urb sized
+ * transfers and up to ptp_usb1->queue of them are kept submitted at a
+ * time, each one landing directly in its slice of the caller's buffer.
+ * The device still sees a single bulk stream, so the PTP container
+ * layer (ptp_usb_getdata() and friends) does not notice the difference.
+ */
+
+#include <config.h>
+#ifdef HAVE_LIBUSB1
+
+#include "ptp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <usb.h>
+#include <libusb-1.0/libusb.h>
+
+#include "ptpcam.h"
+
+/* A vectored write starts with the container header followed by the
+ * payload; they are packed together into a bounce buffer whose length is
+ * a multiple of any bulk wMaxPacketSize, the rest of the payload is then
+ * sent straight from the caller's buffer without a short packet between. */
+#define PTP_USB1_BOUNCE_LEN	4096
+
+struct _PTP_USB1 {
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	int interface;
+	int queue;		/* bulk transfers kept in flight */
+	struct libusb_transfer *xfer[PTPCAM_USB_MAX_QUEUE];
+	unsigned char bounce[PTP_USB1_BOUNCE_LEN];
+};
+
+/* per transfer state of the bulk read/write in progress */
+typedef struct _PTPUSB1Slot PTPUSB1Slot;
+struct _PTPUSB1Slot {
+	int busy;
+	int status;		/* libusb_transfer_status of the last run */
+	int actual;		/* bytes moved by the last run */
+	int length;		/* bytes requested by the last run */
+};
+
+static void LIBUSB_CALL
+ptp_usb1_callback (struct libusb_transfer *transfer)
+{
+	PTPUSB1Slot *slot=(PTPUSB1Slot *)transfer->user_data;
+
+	slot->status=transfer->status;
+	slot->actual=transfer->actual_length;
+	slot->length=transfer->length;
+	slot->busy=0;
+}
+
+/*
+ * Moves the iovcnt buffers on endpoint ep as one bulk transfer, keeping
+ * up to u->queue transfers of urb bytes submitted. All buffers but the
+ * last one must be a multiple of wMaxPacketSize long, or the device sees
+ * a short packet. Transfers are submitted and reaped in order; the first
+ * short or failed one ends the bulk transfer and whatever is queued
+ * behind it is cancelled and reaped before returning. Callers always
+ * ask for exactly the number of bytes the container header announced,
+ * so a short chunk in the middle only happens when the device gives up.
+ * Returns the number of bytes moved or a negative LIBUSB_ERROR_* code.
+ */
+static int
+ptp_usb1_bulk (PTP_USB1 *u, unsigned char ep, PTPIOVec *iov, int iovcnt,
+		unsigned int urb, unsigned int timeout)
+{
+	PTPUSB1Slot slot[PTPCAM_USB_MAX_QUEUE];
+	unsigned int size=0, submitted=0, done=0, segoff=0;
+	int head=0, count=0, stop=0, ret=0, seg=0;
+	int nslots=u->queue, i, r;
+
+	for (i=0;i<iovcnt;i++)
+		size+=iov[i].len;
+	/* a container sized read has nothing to queue behind it */
+	if (size<=urb) nslots=1;
+	memset(slot, 0, sizeof(slot));
+
+	for (;;) {
+		/* keep the queue full */
+		while (!stop && submitted<size && count<nslots) {
+			unsigned int chunk;
+			struct libusb_transfer *t;
+
+			while (segoff==iov[seg].len) {
+				seg++;
+				segoff=0;
+			}
+			chunk=iov[seg].len-segoff;
+			if (chunk>urb) chunk=urb;
+			i=(head+count)%nslots;
+			t=u->xfer[i];
+			libusb_fill_bulk_transfer(t, u->handle, ep,
+				iov[seg].base+segoff, chunk, ptp_usb1_callback,
+				&slot[i], timeout);
+			t->flags=0;
+			/* terminate an OUT data phase ending on a packet
+			   boundary with a zero length packet */
+			if (!(ep&0x80) && submitted+chunk==size)
+				t->flags|=LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+			slot[i].busy=1;
+			if ((r=libusb_submit_transfer(t))<0) {
+				slot[i].busy=0;
+				ret=r;
+				stop=1;
+				for (i=0;i<nslots;i++)
+					if (slot[i].busy)
+						libusb_cancel_transfer(u->xfer[i]);
+				break;
+			}
+			submitted+=chunk;
+			segoff+=chunk;
+			count++;
+		}
+		if (count==0) break;
+
+		/* wait for the oldest one */
+		while (slot[head].busy) {
+			r=libusb_handle_events(u->ctx);
+			if (r<0 && r!=LIBUSB_ERROR_INTERRUPTED && !ret)
+				ret=r;
+		}
+		done+=slot[head].actual;
+		if (!stop) {
+			if (slot[head].status!=LIBUSB_TRANSFER_COMPLETED) {
+				if (!ret) ret=
+				  slot[head].status==LIBUSB_TRANSFER_TIMED_OUT?
+					LIBUSB_ERROR_TIMEOUT:
+				  slot[head].status==LIBUSB_TRANSFER_STALL?
+					LIBUSB_ERROR_PIPE:
+				  slot[head].status==LIBUSB_TRANSFER_NO_DEVICE?
+					LIBUSB_ERROR_NO_DEVICE:
+					LIBUSB_ERROR_IO;
+				stop=1;
+			} else if (slot[head].actual<slot[head].length)
+				stop=1;
+			if (stop) for (i=0;i<nslots;i++)
+				if (slot[i].busy)
+					libusb_cancel_transfer(u->xfer[i]);
+		}
+		head=(head+1)%nslots;
+		count--;
+	}
+	if (ret<0) return ret;
+	return done;
+}
+
+short
+ptp_usb1_read_func (unsigned char *bytes, unsigned int size, void *data)
+{
+	PTP_USB *ptp_usb=(PTP_USB *)data;
+	PTPIOVec iov;
+	int result;
+
+	if (ptp_usb->usb1==NULL) return PTP_ERROR_IO;
+	iov.base=bytes;
+	iov.len=size;
+	result=ptp_usb1_bulk(ptp_usb->usb1, ptp_usb->inep, &iov, 1,
+		ptp_usb->urb, ptp_timeout_left(ptp_usb->params));
+	/* sometimes retry might help */
+	if (result==0)
+		result=ptp_usb1_bulk(ptp_usb->usb1, ptp_usb->inep, &iov, 1,
+			ptp_usb->urb, ptp_timeout_left(ptp_usb->params));
+	if (result >= 0)
+		return (PTP_RC_OK);
+	if (verbose) fprintf(stderr, "ptp_usb1_read_func: %s\n",
+		libusb_error_name(result));
+	return PTP_ERROR_IO;
+}
+
+short
+ptp_usb1_write_func (unsigned char *bytes, unsigned int size, void *data)
+{
+	PTP_USB *ptp_usb=(PTP_USB *)data;
+	PTPIOVec iov;
+	int result;
+
+	if (ptp_usb->usb1==NULL) return PTP_ERROR_IO;
+	iov.base=bytes;
+	iov.len=size;
+	result=ptp_usb1_bulk(ptp_usb->usb1, ptp_usb->outep, &iov, 1,
+		ptp_usb->urb, ptp_timeout_left(ptp_usb->params));
+	if (result >= 0)
+		return (PTP_RC_OK);
+	if (verbose) fprintf(stderr, "ptp_usb1_write_func: %s\n",
+		libusb_error_name(result));
+	return PTP_ERROR_IO;
+}
+
+/* header + payload as sent by ptp_usb_senddata(), see PTP_USB1_BOUNCE_LEN */
+short
+ptp_usb1_writev_func (PTPIOVec *iov, int iovcnt, void *data)
+{
+	PTP_USB *ptp_usb=(PTP_USB *)data;
+	PTP_USB1 *u=ptp_usb->usb1;
+	PTPIOVec out[2];
+	unsigned int len=0, n;
+	int i, result;
+
+	if (u==NULL) return PTP_ERROR_IO;
+	if (iovcnt<1 || iovcnt>2) return PTP_ERROR_BADPARAM;
+	out[1].base=NULL;
+	out[1].len=0;
+	/* pack the head into the bounce buffer */
+	for (i=0;i<iovcnt;i++) {
+		n=iov[i].len;
+		if (n>PTP_USB1_BOUNCE_LEN-len)
+			n=PTP_USB1_BOUNCE_LEN-len;
+		memcpy(u->bounce+len, iov[i].base, n);
+		len+=n;
+		if (n<iov[i].len) {
+			/* the rest goes from where it is */
+			if (i!=iovcnt-1) return PTP_ERROR_BADPARAM;
+			out[1].base=iov[i].base+n;
+			out[1].len=iov[i].len-n;
+		}
+	}
+	out[0].base=u->bounce;
+	out[0].len=len;
+	result=ptp_usb1_bulk(u, ptp_usb->outep, out, out[1].len?2:1,
+		ptp_usb->urb, ptp_timeout_left(ptp_usb->params));
+	if (result >= 0)
+		return (PTP_RC_OK);
+	if (verbose) fprintf(stderr, "ptp_usb1_writev_func: %s\n",
+		libusb_error_name(result));
+	return PTP_ERROR_IO;
+}
+
+/* returns the number of bytes read, or a negative error like ptp_check_int */
+short
+ptp_usb1_check_int (unsigned char *bytes, unsigned int size, void *data)
+{
+	PTP_USB *ptp_usb=(PTP_USB *)data;
+	int result, transferred=0;
+
+	if (ptp_usb->usb1==NULL) return -1;
+	result=libusb_interrupt_transfer(ptp_usb->usb1->handle,
+		ptp_usb->intep, bytes, size, &transferred,
+		ptp_event_timeout(ptp_usb->params));
+	if (verbose>2) fprintf (stderr, "libusb_interrupt_transfer "
+		"returned %i, size=%i\n", result, transferred);
+	if (result<0) {
+		if (verbose) fprintf(stderr, "ptp_usb1_check_int: %s\n",
+			libusb_error_name(result));
+		return result;
+	}
+	return transferred;
+}
+
+int
+ptp_usb1_control_msg (PTP_USB *ptp_usb, int requesttype, int request,
+		int value, int index, char *bytes, int size, int timeout)
+{
+	return libusb_control_transfer(ptp_usb->usb1->handle, requesttype,
+		request, value, index, (unsigned char *)bytes, size, timeout);
+}
+
+/*
+ * Opens the device found by find_device() through libusb-1.0, the two
+ * libraries agree on bus and device numbers.
+ */
+int
+ptp_usb1_open (PTP_USB *ptp_usb, struct usb_device *dev, int queue)
+{
+	PTP_USB1 *u;
+	libusb_device **list;
+	ssize_t n, i;
+	int busn, devn, ret;
+
+	ptp_usb->usb1=NULL;
+	if (queue<1) queue=1;
+	if (queue>PTPCAM_USB_MAX_QUEUE) queue=PTPCAM_USB_MAX_QUEUE;
+	busn=strtol(dev->bus->dirname,NULL,10);
+	devn=strtol(dev->filename,NULL,10);
+
+	u=calloc(1, sizeof(PTP_USB1));
+	if (u==NULL) return LIBUSB_ERROR_NO_MEM;
+	u->queue=queue;
+	u->interface=dev->config->interface->altsetting->bInterfaceNumber;
+	if ((ret=libusb_init(&u->ctx))<0) {
+		free(u);
+		return ret;
+	}
+	ret=LIBUSB_ERROR_NOT_FOUND;
+	if ((n=libusb_get_device_list(u->ctx, &list))<0) {
+		ret=n;
+		goto err;
+	}
+	for (i=0;i<n;i++)
+		if (libusb_get_bus_number(list[i])==busn &&
+		    libusb_get_device_address(list[i])==devn) {
+			ret=libusb_open(list[i], &u->handle);
+			break;
+		}
+	libusb_free_device_list(list, 1);
+	if (ret<0) goto err;
+
+	libusb_set_auto_detach_kernel_driver(u->handle, 1);
+	if ((ret=libusb_claim_interface(u->handle, u->interface))<0)
+		goto err;
+	for (i=0;i<queue;i++)
+		if ((u->xfer[i]=libusb_alloc_transfer(0))==NULL) {
+			ret=LIBUSB_ERROR_NO_MEM;
+			libusb_release_interface(u->handle, u->interface);
+			goto err;
+		}
+	ptp_usb->usb1=u;
+	return 0;
+err:
+	for (i=0;i<PTPCAM_USB_MAX_QUEUE;i++)
+		if (u->xfer[i]) libusb_free_transfer(u->xfer[i]);
+	if (u->handle) libusb_close(u->handle);
+	libusb_exit(u->ctx);
+	free(u);
+	return ret;
+}
+
+/* releases the interface, resetting the device too if reset is set */
+void
+ptp_usb1_close (PTP_USB *ptp_usb, int reset)
+{
+	PTP_USB1 *u=ptp_usb->usb1;
+	int i;
+
+	if (u==NULL) return;
+	for (i=0;i<u->queue;i++)
+		libusb_free_transfer(u->xfer[i]);
+	libusb_release_interface(u->handle, u->interface);
+	if (reset) libusb_reset_device(u->handle);
+	libusb_close(u->handle);
+	libusb_exit(u->ctx);
+	free(u);
+	ptp_usb->usb1=NULL;
+}
+
+const char *
+ptp_usb1_strerror (int error)
+{
+	return libusb_error_name(error);
+}
+
+#endif /* HAVE_LIBUSB1 */
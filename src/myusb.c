@@ -6,137 +6,415 @@
  *  it under the terms of the GNU General Public License as published by
  *  the Free Software Foundation; either version 2 of the License, or
  *  (at your option) any later version.
- *  
+ *
  *  This program is distributed in the hope that it will be useful,
  *  but WITHOUT ANY WARRANTY; without even the implied warranty of
  *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  *  GNU General Public License for more details.
- *  
+ *
  *  You should have received a copy of the GNU General Public License
  *  along with this program; if not, write to the Free Software
  *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 #include <config.h>
-#if 0	/* Seems this is no longer needed at all */
-//#ifdef LINUX_OS
+#if defined(LINUX_OS) && defined(HAVE_LINUX_USBDEVICE_FS_H)
 
 /*
- * libusb has changed the kernel interface used for bulk read/write operations.
- * the new, threaded (URB) interface is not required in this application
- * especially that it fails sometimes unexpectedly.
- * to avoid using TheNewBetterInterface we redefine the old one in this place.
- * most of the code below is copied from libusb 0.1.8 or so.
+ * Native Linux usbfs transport.
+ *
+ * Bulk transfers are split into ptp_usb->urb sized URBs submitted with
+ * USBDEVFS_SUBMITURB, up to ptp_usb->usbfs->queue of them at a time, and
+ * reaped with USBDEVFS_REAPURB. Kernels with USBDEVFS_CAP_MMAP also hand
+ * out a DMA-able buffer which the library uses for the streamed data
+ * phase (see myusb_bufalloc()); URBs pointing into it are filled by the
+ * controller directly, without a bounce buffer or copy_to_user().
  */
 
-#include <sys/ioctl.h>
+#include "ptp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/usbdevice_fs.h>
 #include <usb.h>
 
-#define IOCTL_USB_CONTROL       _IOWR('U', 0, struct usb_ctrltransfer)
-#define IOCTL_USB_BULK          _IOWR('U', 2, struct usb_bulktransfer)
-#define IOCTL_USB_RESETEP       _IOR('U', 3, unsigned int)
-#define IOCTL_USB_SETINTF       _IOR('U', 4, struct usb_setinterface)
-#define IOCTL_USB_SETCONFIG     _IOR('U', 5, unsigned int)
-#define IOCTL_USB_GETDRIVER     _IOW('U', 8, struct usb_getdriver)
-#define IOCTL_USB_SUBMITURB     _IOR('U', 10, struct usb_urb)
-#define IOCTL_USB_DISCARDURB    _IO('U', 11)
-#define IOCTL_USB_REAPURB       _IOW('U', 12, void *)
-#define IOCTL_USB_REAPURBNDELAY _IOW('U', 13, void *)
-#define IOCTL_USB_CLAIMINTF     _IOR('U', 15, unsigned int)
-#define IOCTL_USB_RELEASEINTF   _IOR('U', 16, unsigned int)
-#define IOCTL_USB_IOCTL         _IOWR('U', 18, struct usb_ioctl)
-#define IOCTL_USB_RESET         _IO('U', 20)
-#define IOCTL_USB_CLEAR_HALT    _IOR('U', 21, unsigned int)
-#define IOCTL_USB_DISCONNECT    _IO('U', 22)    /* via IOCTL_USB_IOCTL */
-#define IOCTL_USB_CONNECT       _IO('U', 23)    /* via IOCTL_USB_IOCTL */
-
-
-struct usb_bulktransfer {
-	/* keep in sync with usbdevice_fs.h:usbdevfs_bulktransfer */
-	unsigned int ep;
-	unsigned int len;
-	unsigned int timeout;   /* in milliseconds */
-	
-	/* pointer to data */
-	void *data;
-};
+#include "ptpcam.h"
+
+/* URB size limit of kernels without USBDEVFS_CAP_NO_PACKET_SIZE_LIM */
+#define MYUSB_URB_LIMIT		16384
 
-struct usb_dev_handle {
+/* header + first part of payload of a vectored write, see libusb1.c */
+#define MYUSB_BOUNCE_LEN	4096
+
+struct _PTP_USBFS {
 	int fd;
-	
-	struct usb_bus *bus;
-	struct usb_device *device;
-	
-	int config;
 	int interface;
-	int altsetting;
-	
-	/* Added by RMT so implementations can store other per-open-device data */
-	void *impl_info;
+	int queue;		/* URBs kept in flight */
+	uint32_t caps;		/* USBDEVFS_CAP_* */
+	unsigned int urblimit;	/* max URB length, 0 if unlimited */
+	struct usbdevfs_urb urb[PTPCAM_USB_MAX_QUEUE];
+	unsigned char *dma;	/* usbfs mmap()ed buffer, or NULL */
+	size_t dmalen;
+	int dmabusy;
+	unsigned char bounce[MYUSB_BOUNCE_LEN];
 };
 
+/* discards the count URBs starting at head which were not reaped yet */
+static void
+myusb_discard (PTP_USBFS *u, int head, int count, int nslots, int *reaped)
+{
+	int i, j;
+
+	for (j=0;j<count;j++) {
+		i=(head+j)%nslots;
+		if (!reaped[i])
+			ioctl(u->fd, USBDEVFS_DISCARDURB, &u->urb[i]);
+	}
+}
+
+/*
+ * Moves the iovcnt buffers on endpoint ep as one bulk transfer, keeping
+ * up to u->queue URBs of urblen bytes submitted. Same rules as
+ * ptp_usb1_bulk(): URBs are reaped in order and the first short or
+ * failed one cancels everything behind it.
+ * Returns the number of bytes moved or a negative errno.
+ */
+static int
+myusb_bulk (PTP_USBFS *u, unsigned char ep, PTPIOVec *iov, int iovcnt,
+		unsigned int urblen, int timeout)
+{
+	int reaped[PTPCAM_USB_MAX_QUEUE];
+	unsigned int size=0, submitted=0, done=0, segoff=0;
+	int head=0, count=0, stop=0, ret=0, seg=0;
+	int nslots=u->queue, i, n;
+
+	if (u->urblimit && urblen>u->urblimit) urblen=u->urblimit;
+	for (i=0;i<iovcnt;i++)
+		size+=iov[i].len;
+	if (size<=urblen) nslots=1;
+	memset(reaped, 0, sizeof(reaped));
+
+	for (;;) {
+		/* keep the queue full */
+		while (!stop && submitted<size && count<nslots) {
+			struct usbdevfs_urb *urb;
+			unsigned int chunk;
+
+			while (segoff==iov[seg].len) {
+				seg++;
+				segoff=0;
+			}
+			chunk=iov[seg].len-segoff;
+			if (chunk>urblen) chunk=urblen;
+			i=(head+count)%nslots;
+			urb=&u->urb[i];
+			memset(urb, 0, sizeof(struct usbdevfs_urb));
+			urb->type=USBDEVFS_URB_TYPE_BULK;
+			urb->endpoint=ep;
+			urb->buffer=iov[seg].base+segoff;
+			urb->buffer_length=chunk;
+			/* terminate an OUT data phase ending on a packet
+			   boundary with a zero length packet */
+			if (!(ep&0x80) && submitted+chunk==size &&
+			    (u->caps&USBDEVFS_CAP_ZERO_PACKET))
+				urb->flags|=USBDEVFS_URB_ZERO_PACKET;
+			if (ioctl(u->fd, USBDEVFS_SUBMITURB, urb)<0) {
+				ret=-errno;
+				stop=1;
+				myusb_discard(u, head, count, nslots, reaped);
+				break;
+			}
+			submitted+=chunk;
+			segoff+=chunk;
+			count++;
+		}
+		if (count==0) break;
+
+		if (!reaped[head]) {
+			struct usbdevfs_urb *urb=NULL;
+
+			/* REAPURB itself has no timeout */
+			if (!stop) {
+				struct pollfd pfd;
+
+				pfd.fd=u->fd;
+				pfd.events=POLLOUT;
+				n=poll(&pfd, 1, timeout);
+				if (n<0 && errno==EINTR)
+					continue;
+				if (n<=0) {
+					ret=n<0?-errno:-ETIMEDOUT;
+					stop=1;
+					myusb_discard(u, head, count, nslots,
+						reaped);
+				}
+			}
+			if (ioctl(u->fd, USBDEVFS_REAPURB, &urb)<0) {
+				if (errno==EINTR) continue;
+				/* device gone, nothing is coming back */
+				if (!ret) ret=-errno;
+				break;
+			}
+			reaped[urb-u->urb]=1;
+			continue;
+		}
+
+		/* account the oldest one */
+		reaped[head]=0;
+		done+=u->urb[head].actual_length;
+		if (!stop) {
+			if (u->urb[head].status!=0) {
+				ret=u->urb[head].status<0?
+					u->urb[head].status:-EIO;
+				stop=1;
+			} else if (u->urb[head].actual_length<
+					u->urb[head].buffer_length)
+				stop=1;
+			if (stop)
+				myusb_discard(u, (head+1)%nslots, count-1,
+					nslots, reaped);
+		}
+		head=(head+1)%nslots;
+		count--;
+	}
+	if (ret<0) return ret;
+	return done;
+}
+
+short
+myusb_read_func (unsigned char *bytes, unsigned int size, void *data)
+{
+	PTP_USB *ptp_usb=(PTP_USB *)data;
+	PTPIOVec iov;
+	int result;
+
+	if (ptp_usb->usbfs==NULL) return PTP_ERROR_IO;
+	iov.base=bytes;
+	iov.len=size;
+	result=myusb_bulk(ptp_usb->usbfs, ptp_usb->inep, &iov, 1,
+		ptp_usb->urb, ptp_timeout_left(ptp_usb->params));
+	/* sometimes retry might help */
+	if (result==0)
+		result=myusb_bulk(ptp_usb->usbfs, ptp_usb->inep, &iov, 1,
+			ptp_usb->urb, ptp_timeout_left(ptp_usb->params));
+	if (result >= 0)
+		return (PTP_RC_OK);
+	if (verbose) fprintf(stderr, "myusb_read_func: %s\n",
+		strerror(-result));
+	return PTP_ERROR_IO;
+}
+
+short
+myusb_write_func (unsigned char *bytes, unsigned int size, void *data)
+{
+	PTP_USB *ptp_usb=(PTP_USB *)data;
+	PTPIOVec iov;
+	int result;
 
-/* Linux usbdevfs has a limit of one page size per read/write. 4096 is */
-/* the most portable maximum we can do for now */
-#define MAX_READ_WRITE	4096
+	if (ptp_usb->usbfs==NULL) return PTP_ERROR_IO;
+	iov.base=bytes;
+	iov.len=size;
+	result=myusb_bulk(ptp_usb->usbfs, ptp_usb->outep, &iov, 1,
+		ptp_usb->urb, ptp_timeout_left(ptp_usb->params));
+	if (result >= 0)
+		return (PTP_RC_OK);
+	if (verbose) fprintf(stderr, "myusb_write_func: %s\n",
+		strerror(-result));
+	return PTP_ERROR_IO;
+}
 
-int myusb_bulk_write(usb_dev_handle *dev, int ep, char *bytes, int length,
-	int timeout);
-int myusb_bulk_write(usb_dev_handle *dev, int ep, char *bytes, int length,
-	int timeout)
+/* header + payload as sent by ptp_usb_senddata(), see MYUSB_BOUNCE_LEN */
+short
+myusb_writev_func (PTPIOVec *iov, int iovcnt, void *data)
 {
-	struct usb_bulktransfer bulk;
-	int ret, sent = 0;
+	PTP_USB *ptp_usb=(PTP_USB *)data;
+	PTP_USBFS *u=ptp_usb->usbfs;
+	PTPIOVec out[2];
+	unsigned int len=0, n;
+	int i, result;
 
-	/* Ensure the endpoint address is correct */
-	if (ep < 0 || ep > 0x0f)
-		return (-EINVAL);
+	if (u==NULL) return PTP_ERROR_IO;
+	if (iovcnt<1 || iovcnt>2) return PTP_ERROR_BADPARAM;
+	out[1].base=NULL;
+	out[1].len=0;
+	for (i=0;i<iovcnt;i++) {
+		n=iov[i].len;
+		if (n>MYUSB_BOUNCE_LEN-len)
+			n=MYUSB_BOUNCE_LEN-len;
+		memcpy(u->bounce+len, iov[i].base, n);
+		len+=n;
+		if (n<iov[i].len) {
+			if (i!=iovcnt-1) return PTP_ERROR_BADPARAM;
+			out[1].base=iov[i].base+n;
+			out[1].len=iov[i].len-n;
+		}
+	}
+	out[0].base=u->bounce;
+	out[0].len=len;
+	result=myusb_bulk(u, ptp_usb->outep, out, out[1].len?2:1,
+		ptp_usb->urb, ptp_timeout_left(ptp_usb->params));
+	if (result >= 0)
+		return (PTP_RC_OK);
+	if (verbose) fprintf(stderr, "myusb_writev_func: %s\n",
+		strerror(-result));
+	return PTP_ERROR_IO;
+}
+
+/* returns the number of bytes read, or a negative error like ptp_check_int */
+short
+myusb_check_int (unsigned char *bytes, unsigned int size, void *data)
+{
+	PTP_USB *ptp_usb=(PTP_USB *)data;
+	struct usbdevfs_bulktransfer bulk;
+	int result;
+
+	if (ptp_usb->usbfs==NULL) return -1;
+	/* usbfs does interrupt endpoints through USBDEVFS_BULK as well */
+	bulk.ep=ptp_usb->intep;
+	bulk.len=size;
+	bulk.timeout=ptp_event_timeout(ptp_usb->params);
+	bulk.data=bytes;
+	result=ioctl(ptp_usb->usbfs->fd, USBDEVFS_BULK, &bulk);
+	if (result<0) result=-errno;
+	if (verbose>2) fprintf (stderr, "USBDEVFS_BULK returned %i, "
+		"size=%i\n", result, size);
+	if (result<0 && verbose)
+		fprintf(stderr, "myusb_check_int: %s\n", strerror(-result));
+	return result;
+}
+
+int
+myusb_control_msg (PTP_USB *ptp_usb, int requesttype, int request,
+		int value, int index, char *bytes, int size, int timeout)
+{
+	struct usbdevfs_ctrltransfer ctrl;
+	int result;
+
+	ctrl.bRequestType=requesttype;
+	ctrl.bRequest=request;
+	ctrl.wValue=value;
+	ctrl.wIndex=index;
+	ctrl.wLength=size;
+	ctrl.timeout=timeout;
+	ctrl.data=bytes;
+	result=ioctl(ptp_usb->usbfs->fd, USBDEVFS_CONTROL, &ctrl);
+	return result<0?-errno:result;
+}
 
-	do {
-		bulk.ep = ep;
-		bulk.len = length - sent;
-		if (bulk.len > MAX_READ_WRITE)
-			bulk.len = MAX_READ_WRITE;
-		bulk.timeout = timeout;
-		bulk.data = (unsigned char *)bytes + sent;
+/*
+ * Hands the usbfs mapped buffer to the library for the streamed data
+ * phase, URBs reading into it skip the kernel side copy.
+ */
+unsigned char *
+myusb_bufalloc (unsigned int size, void *data)
+{
+	PTP_USBFS *u=((PTP_USB *)data)->usbfs;
 
-		ret = ioctl(dev->fd, IOCTL_USB_BULK, &bulk);
-		if (ret < 0)
-			return (-errno);
+	if (u==NULL || u->dma==NULL || u->dmabusy || size>u->dmalen)
+		return NULL;
+	u->dmabusy=1;
+	return u->dma;
+}
 
-		sent += ret;
-	} while (ret > 0 && sent < length);
+void
+myusb_buffree (unsigned char *buf, unsigned int size, void *data)
+{
+	PTP_USBFS *u=((PTP_USB *)data)->usbfs;
 
-	return sent;
+	if (u!=NULL && buf==u->dma)
+		u->dmabusy=0;
 }
 
-int myusb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size,
-	int timeout);
-int myusb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size,
-	int timeout)
+/*
+ * Opens the device found by find_device() through its usbfs node and
+ * claims the PTP interface. dmalen is the size of the mapped buffer to
+ * ask for, the transport works without it too.
+ */
+int
+myusb_open (PTP_USB *ptp_usb, struct usb_device *dev, int queue,
+		size_t dmalen)
 {
-	struct usb_bulktransfer bulk;
-	int ret, retrieved = 0, requested;
+	PTP_USBFS *u;
+	char path[64];
+	int busn, devn, ret;
 
-	/* Ensure the endpoint address is correct */
-	ep |= USB_ENDPOINT_IN;
+	ptp_usb->usbfs=NULL;
+	if (queue<1) queue=1;
+	if (queue>PTPCAM_USB_MAX_QUEUE) queue=PTPCAM_USB_MAX_QUEUE;
 
-	do {
-		bulk.ep = ep;
-		requested = size - retrieved;
-		if (requested > MAX_READ_WRITE)
-			requested = MAX_READ_WRITE;
-		bulk.len = requested;
-		bulk.timeout = timeout;
-		bulk.data = (unsigned char *)bytes + retrieved;
+	u=calloc(1, sizeof(PTP_USBFS));
+	if (u==NULL) return -ENOMEM;
+	u->queue=queue;
+	u->interface=dev->config->interface->altsetting->bInterfaceNumber;
 
-		ret = ioctl(dev->fd, IOCTL_USB_BULK, &bulk);
-		if (ret < 0)
-			return (-errno);
+	busn=strtol(dev->bus->dirname,NULL,10);
+	devn=strtol(dev->filename,NULL,10);
+	snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d", busn, devn);
+	if ((u->fd=open(path, O_RDWR))<0) {
+		snprintf(path, sizeof(path), "/proc/bus/usb/%03d/%03d",
+			busn, devn);
+		u->fd=open(path, O_RDWR);
+	}
+	if (u->fd<0) {
+		ret=-errno;
+		free(u);
+		return ret;
+	}
+	if (ioctl(u->fd, USBDEVFS_GET_CAPABILITIES, &u->caps)<0)
+		u->caps=0;
+	if (!(u->caps&USBDEVFS_CAP_NO_PACKET_SIZE_LIM))
+		u->urblimit=MYUSB_URB_LIMIT;
 
-		retrieved += ret;
-	} while (ret > 0 && retrieved < size && ret == requested);
+	if (ioctl(u->fd, USBDEVFS_CLAIMINTERFACE, &u->interface)<0) {
+		struct usbdevfs_ioctl command;
 
-	return retrieved;
+		/* kick out the kernel driver and try again */
+		command.ifno=u->interface;
+		command.ioctl_code=USBDEVFS_DISCONNECT;
+		command.data=NULL;
+		if (errno!=EBUSY ||
+		    ioctl(u->fd, USBDEVFS_IOCTL, &command)<0 ||
+		    ioctl(u->fd, USBDEVFS_CLAIMINTERFACE, &u->interface)<0) {
+			ret=-errno;
+			close(u->fd);
+			free(u);
+			return ret;
+		}
+	}
+
+	if ((u->caps&USBDEVFS_CAP_MMAP) && dmalen>0) {
+		u->dma=mmap(NULL, dmalen, PROT_READ|PROT_WRITE, MAP_SHARED,
+			u->fd, 0);
+		if (u->dma==MAP_FAILED) {
+			/* usbfs_memory_mb exceeded or so, do without */
+			if (verbose) perror("usbfs mmap");
+			u->dma=NULL;
+		} else
+			u->dmalen=dmalen;
+	}
+	ptp_usb->usbfs=u;
+	return 0;
+}
+
+/* releases the interface, resetting the device too if reset is set */
+void
+myusb_close (PTP_USB *ptp_usb, int reset)
+{
+	PTP_USBFS *u=ptp_usb->usbfs;
+
+	if (u==NULL) return;
+	if (u->dma!=NULL)
+		munmap(u->dma, u->dmalen);
+	ioctl(u->fd, USBDEVFS_RELEASEINTERFACE, &u->interface);
+	if (reset) ioctl(u->fd, USBDEVFS_RESET, NULL);
+	close(u->fd);
+	free(u);
+	ptp_usb->usbfs=NULL;
 }
-#endif /* LINUX_OS */
+
+#endif /* LINUX_OS && HAVE_LINUX_USBDEVICE_FS_H */
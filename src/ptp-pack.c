@@ -73,6 +73,21 @@ dtoh32ap (PTPParams *params, unsigned char *a)
 	return ((params->byteorder==PTP_DL_LE)?le32atoh(a):be32atoh(a));
 }
 
+static inline uint64_t
+dtoh64ap (PTPParams *params, unsigned char *a)
+{
+	uint64_t lo, hi;
+
+	if (params->byteorder==PTP_DL_LE) {
+		lo=le32atoh(a);
+		hi=le32atoh(a+4);
+	} else {
+		hi=be32atoh(a);
+		lo=be32atoh(a+4);
+	}
+	return (hi<<32)|lo;
+}
+
 #define htod8a(a,x)	*(uint8_t*)(a) = x
 #define htod16a(a,x)	htod16ap(params,(unsigned char *)a,x)
 #define htod32a(a,x)	htod32ap(params,(unsigned char *)a,x)
@@ -82,6 +97,7 @@ dtoh32ap (PTPParams *params, unsigned char *a)
 #define dtoh8a(x)	(*(uint8_t*)(x))
 #define dtoh16a(a)	dtoh16ap(params,(unsigned char *)a)
 #define dtoh32a(a)	dtoh32ap(params,(unsigned char *)a)
+#define dtoh64a(a)	dtoh64ap(params,(unsigned char *)a)
 #define dtoh16(x)	dtoh16p(params,x)
 #define dtoh32(x)	dtoh32p(params,x)
 
@@ -249,7 +265,8 @@ ptp_unpack_SI (PTPParams *params, char* data, PTPStorageInfo *si)
 	si->StorageType=dtoh16a(&data[PTP_si_StorageType]);
 	si->FilesystemType=dtoh16a(&data[PTP_si_FilesystemType]);
 	si->AccessCapability=dtoh16a(&data[PTP_si_AccessCapability]);
-	/* XXX no dtoh64a !!! skiping next two */
+	si->MaxCapability=dtoh64a(&data[PTP_si_MaxCapability]);
+	si->FreeSpaceInBytes=dtoh64a(&data[PTP_si_FreeSpaceInBytes]);
 	si->FreeSpaceInImages=dtoh32a(&data[PTP_si_FreeSpaceInImages]);
 	si->StorageDescription=ptp_unpack_string(params, data,
 		PTP_si_StorageDescription, &storagedescriptionlen);
@@ -26,6 +26,22 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#ifndef HAVE_CLOCK_GETTIME
+#include <sys/time.h>
+#endif
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#define PTP_EVENT_PUMP
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#endif
 
 #ifdef ENABLE_NLS
 #  include <libintl.h>
@@ -48,6 +64,93 @@
 
 #define CHECK_PTP_RC(result)	{uint16_t r=(result); if (r!=PTP_RC_OK) return r;}
 
+/* transaction statistics hooks, see stats.c; nothing unless --enable-stats */
+#ifdef PTP_STATS
+#define STATS_BEGIN(params, code)					\
+	do { if ((params)->stats!=NULL) ptp_stats_begin(params, code); } while (0)
+#define STATS_BYTES(params, n)						\
+	do { if ((params)->stats!=NULL) ptp_stats_bytes(params, n); } while (0)
+#define STATS_PHASE(params, phase, rc)					\
+	((params)->stats!=NULL?ptp_stats_phase(params, phase, rc):(rc))
+#else
+#define STATS_BEGIN(params, code)	do { } while (0)
+#define STATS_BYTES(params, n)		do { } while (0)
+#define STATS_PHASE(params, phase, rc)	(rc)
+#endif
+
+/* session trace hooks, see trace.c; a NULL check unless tracing */
+#define TRACE_BEGIN(params, ptp)					\
+	do { if ((params)->trace!=NULL)					\
+		ptp_trace_put(params, PTP_TRACE_BEGIN, (ptp)->Code, 0,	\
+			(ptp)->Transaction_ID, ptp_trace_now(params), 0); \
+	} while (0)
+#define TRACE_PHASE(params, phase, rc)					\
+	((params)->trace!=NULL?ptp_trace_phase(params, phase, rc):(rc))
+
+/* both around a transaction and its phases */
+#define TRANSACTION_BEGIN(params, ptp)					\
+	do { STATS_BEGIN(params, (ptp)->Code); TRACE_BEGIN(params, ptp); } while (0)
+#define PHASE_END(params, phase, rc)					\
+	TRACE_PHASE(params, phase, STATS_PHASE(params, phase, rc))
+
+static uint16_t
+ptp_trace_phase (PTPParams* params, int phase, uint16_t rc)
+{
+	ptp_trace_put(params, PTP_TRACE_PHASE, phase, rc, 0,
+		ptp_trace_now(params), 0);
+	return rc;
+}
+
+/* read_func, write_func and writev_func, traced if the session is */
+static short
+ptp_io_read (PTPParams* params, unsigned char *bytes, unsigned int size)
+{
+	uint64_t ts;
+	short ret;
+
+	if (params->trace==NULL)
+		return params->read_func(bytes, size, params->data);
+	ts=ptp_trace_now(params);
+	ret=params->read_func(bytes, size, params->data);
+	ptp_trace_put(params, PTP_TRACE_READ, 0, ret, size, ts,
+		ptp_trace_now(params)-ts);
+	return ret;
+}
+
+static short
+ptp_io_write (PTPParams* params, unsigned char *bytes, unsigned int size)
+{
+	uint64_t ts;
+	short ret;
+
+	if (params->trace==NULL)
+		return params->write_func(bytes, size, params->data);
+	ts=ptp_trace_now(params);
+	ret=params->write_func(bytes, size, params->data);
+	ptp_trace_put(params, PTP_TRACE_WRITE, 0, ret, size, ts,
+		ptp_trace_now(params)-ts);
+	return ret;
+}
+
+static short
+ptp_io_writev (PTPParams* params, PTPIOVec *iov, int iovcnt)
+{
+	uint64_t ts;
+	uint32_t size=0;
+	short ret;
+	int i;
+
+	if (params->trace==NULL)
+		return params->writev_func(iov, iovcnt, params->data);
+	for (i=0; i<iovcnt; i++)
+		size+=iov[i].len;
+	ts=ptp_trace_now(params);
+	ret=params->writev_func(iov, iovcnt, params->data);
+	ptp_trace_put(params, PTP_TRACE_WRITE, 0, ret, size, ts,
+		ptp_trace_now(params)-ts);
+	return ret;
+}
+
 #define PTP_CNT_INIT(cnt) {memset(&cnt,0,sizeof(cnt));}
 
 static void
@@ -90,11 +193,53 @@ ptp_error (PTPParams *params, const char *format, ...)
 
 /* send / receive functions */
 
+/*
+ * The containers below live on the stack of the call using them, so the
+ * transport keeps no state between calls besides what is in PTPParams.
+ * Distinct PTPParams may therefore be driven from different threads at
+ * the same time; a single PTPParams must not be used by two threads at
+ * once (ptp_usb_event_check() and ptp_usb_event_wait() excepted, they
+ * only touch the interrupt pipe).
+ */
+
+/* one bulk packet of any speed, starting with the container header */
+typedef union _PTPUSBBulkPacket PTPUSBBulkPacket;
+union _PTPUSBBulkPacket {
+	PTPUSBBulkContainer cnt;
+	unsigned char raw[PTP_USB_BULK_SS_MAX_PACKET_LEN];
+};
+
+/*
+ * Length of the packet sharing the container header with the data. It
+ * must be a multiple of the endpoint wMaxPacketSize, or the device would
+ * see a short packet (OUT) or babble (IN); 512 is fine up to high speed.
+ */
+static inline unsigned int
+ptp_usb_packet_len (PTPParams* params)
+{
+	if (params->maxpacket>PTP_USB_BULK_HS_MAX_PACKET_LEN &&
+	    params->maxpacket<=PTP_USB_BULK_SS_MAX_PACKET_LEN)
+		return params->maxpacket;
+	return PTP_USB_BULK_HS_MAX_PACKET_LEN;
+}
+
+/* read_func chunk for the streamed data phase, whole packets only */
+static inline unsigned int
+ptp_usb_chunk_len (PTPParams* params)
+{
+	unsigned int chunk=params->chunk_size?
+		params->chunk_size:PTP_USB_DATA_CHUNK_LEN;
+	unsigned int packet=ptp_usb_packet_len(params);
+
+	chunk-=chunk%packet;
+	return chunk?chunk:packet;
+}
+
 uint16_t
 ptp_usb_sendreq (PTPParams* params, PTPContainer* req)
 {
-	static uint16_t ret;
-	static PTPUSBBulkContainer usbreq;
+	uint16_t ret;
+	PTPUSBBulkContainer usbreq;
 
 	PTP_CNT_INIT(usbreq);
 	/* build appropriate USB container */
@@ -109,9 +254,8 @@ ptp_usb_sendreq (PTPParams* params, PTPContainer* req)
 	usbreq.payload.params.param4=htod32(req->Param4);
 	usbreq.payload.params.param5=htod32(req->Param5);
 	/* send it to responder */
-	ret=params->write_func((unsigned char *)&usbreq,
-		PTP_USB_BULK_REQ_LEN-(sizeof(uint32_t)*(5-req->Nparam)),
-		params->data);
+	ret=ptp_io_write(params, (unsigned char *)&usbreq,
+		PTP_USB_BULK_REQ_LEN-(sizeof(uint32_t)*(5-req->Nparam)));
 	if (ret!=PTP_RC_OK) {
 		ret = PTP_ERROR_IO;
 /*		ptp_error (params,
@@ -125,20 +269,34 @@ uint16_t
 ptp_usb_senddata (PTPParams* params, PTPContainer* ptp,
 			unsigned char *data, unsigned int size)
 {
-	static uint16_t ret;
-	static PTPUSBBulkContainer usbdata;
+	uint16_t ret;
+	PTPUSBBulkPacket usbdata;
+	unsigned int first;
 
 	/* build appropriate USB container */
-	usbdata.length=htod32(PTP_USB_BULK_HDR_LEN+size);
-	usbdata.type=htod16(PTP_USB_CONTAINER_DATA);
-	usbdata.code=htod16(ptp->Code);
-	usbdata.trans_id=htod32(ptp->Transaction_ID);
-	memcpy(usbdata.payload.data,data,
-		(size<PTP_USB_BULK_PAYLOAD_LEN)?size:PTP_USB_BULK_PAYLOAD_LEN);
+	usbdata.cnt.length=htod32(PTP_USB_BULK_HDR_LEN+size);
+	usbdata.cnt.type=htod16(PTP_USB_CONTAINER_DATA);
+	usbdata.cnt.code=htod16(ptp->Code);
+	usbdata.cnt.trans_id=htod32(ptp->Transaction_ID);
+	/* send header and the caller's buffer at once, if we can */
+	if (params->writev_func!=NULL) {
+		PTPIOVec iov[2];
+
+		iov[0].base=usbdata.raw;
+		iov[0].len=PTP_USB_BULK_HDR_LEN;
+		iov[1].base=data;
+		iov[1].len=size;
+		ret=ptp_io_writev(params, iov, size?2:1);
+		if (ret!=PTP_RC_OK)
+			ret = PTP_ERROR_IO;
+		return ret;
+	}
+	/* the first packet carries the header and first part of data */
+	first=ptp_usb_packet_len(params)-PTP_USB_BULK_HDR_LEN;
+	if (size<first) first=size;
+	memcpy(usbdata.raw+PTP_USB_BULK_HDR_LEN,data,first);
 	/* send first part of data */
-	ret=params->write_func((unsigned char *)&usbdata, PTP_USB_BULK_HDR_LEN+
-		((size<PTP_USB_BULK_PAYLOAD_LEN)?size:PTP_USB_BULK_PAYLOAD_LEN),
-		params->data);
+	ret=ptp_io_write(params, usbdata.raw, PTP_USB_BULK_HDR_LEN+first);
 	if (ret!=PTP_RC_OK) {
 		ret = PTP_ERROR_IO;
 /*		ptp_error (params,
@@ -146,10 +304,9 @@ ptp_usb_senddata (PTPParams* params, PTPContainer* ptp,
 			ptp->Code,ret);*/
 		return ret;
 	}
-	if (size<=PTP_USB_BULK_PAYLOAD_LEN) return ret;
+	if (size<=first) return ret;
 	/* if everything OK send the rest */
-	ret=params->write_func (data+PTP_USB_BULK_PAYLOAD_LEN,
-				size-PTP_USB_BULK_PAYLOAD_LEN, params->data);
+	ret=ptp_io_write(params, data+first, size-first);
 	if (ret!=PTP_RC_OK) {
 		ret = PTP_ERROR_IO;
 /*		ptp_error (params,
@@ -159,54 +316,267 @@ ptp_usb_senddata (PTPParams* params, PTPContainer* ptp,
 	return ret;
 }
 
+/* Data phase buffers allocated by the library are page aligned (but still
+ * free()able) so the transport may move the data straight into them. */
+#define PTP_USB_DATA_ALIGN	4096
+
+static unsigned char*
+ptp_usb_data_alloc (unsigned int size)
+{
+	void *data=NULL;
+
+#ifdef HAVE_POSIX_MEMALIGN
+	if (size>=PTP_USB_DATA_ALIGN) {
+		if (posix_memalign(&data, PTP_USB_DATA_ALIGN, size)!=0)
+			data=NULL;
+		return (unsigned char *)data;
+	}
+#endif
+	/* whole buffer is going to be overwritten, no need to clear it */
+	data=malloc(size?size:1);
+	return (unsigned char *)data;
+}
+
+/* size class of a data phase buffer, -1 if too large for the pool */
+static int
+ptp_bufpool_class (unsigned int size)
+{
+	unsigned int len=PTP_BUFPOOL_MIN;
+	int c;
+
+	for (c=0; c<PTP_BUFPOOL_CLASSES; c++, len*=4)
+		if (size<=len)
+			return c;
+	return -1;
+}
+
+/**
+ * ptp_data_alloc:
+ * params:	PTPParams*
+ *		unsigned int size	- data phase length
+ *
+ * Allocates the buffer a data phase is received into. Up to 256KB it is
+ * rounded up to its size class and taken from the session's pool if one
+ * is free there; either way it may simply be free()d by the caller.
+ * Buffers which are only unpacked should go back by ptp_data_release(),
+ * so that listing thousands of objects does not malloc() each ObjectInfo.
+ *
+ * Return values: the buffer or NULL if out of memory.
+ **/
+unsigned char*
+ptp_data_alloc (PTPParams* params, unsigned int size)
+{
+	PTPBufPool *pool=&params->bufpool;
+	int c=ptp_bufpool_class(size);
+
+	if (c>=0 && pool->count[c]>0) {
+		pool->hits++;
+		return pool->buf[c][--pool->count[c]];
+	}
+	pool->misses++;
+	if (c>=0)
+		size=PTP_BUFPOOL_MIN<<(2*c);
+	return ptp_usb_data_alloc(size);
+}
+
+/**
+ * ptp_data_release:
+ * params:	PTPParams*
+ *		void *buf		- buffer from ptp_data_alloc() or NULL
+ *		unsigned int size	- data phase length it was allocated for
+ *
+ * Gives a data phase buffer back to the session's pool, or frees it if its
+ * size class is full already.
+ **/
+void
+ptp_data_release (PTPParams* params, void *buf, unsigned int size)
+{
+	PTPBufPool *pool=&params->bufpool;
+	int c=ptp_bufpool_class(size);
+
+	if (buf==NULL)
+		return;
+	if (c<0 || pool->count[c]==PTP_BUFPOOL_DEPTH) {
+		free(buf);
+		return;
+	}
+	pool->buf[c][pool->count[c]++]=buf;
+}
+
+/**
+ * ptp_bufpool_flush:
+ * params:	PTPParams*
+ *
+ * Frees the buffers kept in the session's pool, e.g. when the session is
+ * closed. The hit and miss counters are left alone.
+ **/
+void
+ptp_bufpool_flush (PTPParams* params)
+{
+	PTPBufPool *pool=&params->bufpool;
+	int c;
+
+	for (c=0; c<PTP_BUFPOOL_CLASSES; c++)
+		while (pool->count[c]>0)
+			free(pool->buf[c][--pool->count[c]]);
+}
+
+/*
+ * reads the first packet of the data phase and checks its header;
+ * *first is set to the number of data bytes that came with it.
+ * A data phase of 4GB or more has 0xffffffff as container length, then
+ * the length expected by the caller in *getlen (if any) is kept.
+ */
+static uint16_t
+ptp_usb_getdata_hdr (PTPParams* params, PTPContainer* ptp,
+		PTPUSBBulkPacket* usbdata, uint64_t *getlen,
+		unsigned int *first)
+{
+	uint16_t ret;
+	unsigned int packet=ptp_usb_packet_len(params);
+
+	ret=ptp_io_read(params, usbdata->raw, packet);
+	if (ret!=PTP_RC_OK) {
+		ret = PTP_ERROR_IO;
+	} else
+	if (dtoh16(usbdata->cnt.type)!=PTP_USB_CONTAINER_DATA
+		&& dtoh16(usbdata->cnt.type)!=PTP_USB_CONTAINER_RESPONSE) {
+		ret = PTP_ERROR_DATA_EXPECTED;
+	} else
+	if (dtoh16(usbdata->cnt.code)!=ptp->Code) {
+		/* a response instead of the data phase */
+		ret = dtoh16(usbdata->cnt.code);
+		if (ret==PTP_RC_OK)
+			ret = PTP_ERROR_DATA_EXPECTED;
+	} else
+	if (dtoh32(usbdata->cnt.length)<PTP_USB_BULK_HDR_LEN) {
+		ret = PTP_ERROR_DATA_EXPECTED;
+	} else {
+		/* evaluate data length */
+		if (dtoh32(usbdata->cnt.length)!=0xffffffff ||
+		    *getlen<0xffffffff-PTP_USB_BULK_HDR_LEN)
+			*getlen=dtoh32(usbdata->cnt.length)-
+				PTP_USB_BULK_HDR_LEN;
+		*first=packet-PTP_USB_BULK_HDR_LEN;
+		if (*getlen<*first) *first=*getlen;
+		/* now we know how long the rest may take */
+		ptp_transaction_deadline(params, ptp->Code, *getlen);
+	}
+	return ret;
+}
+
+/* ptp_cancel() was called and the transport is able to, see below */
+static inline int
+ptp_usb_cancelling (PTPParams* params)
+{
+	return params->cancel && params->cancel_func!=NULL;
+}
+
+/*
+ * stops the data phase of ptp after ptp_cancel(): the transport cancels
+ * the transaction, no response phase follows
+ */
+static uint16_t
+ptp_usb_cancelled (PTPParams* params, PTPContainer* ptp)
+{
+	params->cancel=0;
+	if (params->cancel_func(ptp->Transaction_ID, params->data)!=PTP_RC_OK)
+		ptp_error(params, "PTP: cancelling transaction 0x%08x failed",
+			ptp->Transaction_ID);
+	return PTP_ERROR_CANCEL;
+}
+
+/*
+ * reads and throws away len bytes of the data phase of ptp, in chunks
+ * through one scratch buffer, or through the packet buffer usbdata if
+ * there is no memory for that
+ */
+static uint16_t
+ptp_usb_discard (PTPParams* params, PTPContainer* ptp, uint64_t len,
+		PTPUSBBulkPacket* usbdata)
+{
+	unsigned int size, chunklen=ptp_usb_chunk_len(params);
+	unsigned char *buf=NULL;
+
+	if (len==0)
+		return PTP_RC_OK;
+	if (chunklen>len)
+		chunklen=(unsigned int)len;
+	buf=ptp_usb_data_alloc(chunklen);
+	if (buf==NULL) {
+		buf=usbdata->raw;
+		chunklen=ptp_usb_packet_len(params);
+	}
+	for (; len>0; len-=size) {
+		if (ptp_usb_cancelling(params)) {
+			if (buf!=usbdata->raw)
+				free(buf);
+			return ptp_usb_cancelled(params, ptp);
+		}
+		size=len>chunklen?chunklen:(unsigned int)len;
+		if (ptp_io_read(params, buf, size)!=PTP_RC_OK)
+			break;
+	}
+	if (buf!=usbdata->raw)
+		free(buf);
+	return len>0?PTP_ERROR_IO:PTP_RC_OK;
+}
+
 uint16_t
 ptp_usb_getdata (PTPParams* params, PTPContainer* ptp,  unsigned int *getlen, 
 		unsigned char **data)
 {
-	static uint16_t ret;
-	static PTPUSBBulkContainer usbdata;
+	uint16_t ret;
+	PTPUSBBulkPacket usbdata;
+	unsigned int first, off, size, chunklen, capacity=*getlen;
+	uint64_t len=0;
+	unsigned char *dest=*data;
 
 	PTP_CNT_INIT(usbdata);
-#if 0
-	if (*data!=NULL) return PTP_ERROR_BADPARAM;
-#endif
 	do {
-		/* read first(?) part of data */
-		ret=params->read_func((unsigned char *)&usbdata,
-				sizeof(usbdata), params->data);
-		if (ret!=PTP_RC_OK) {
-			ret = PTP_ERROR_IO;
+		/* read first packet: container header and first part of data */
+		ret=ptp_usb_getdata_hdr(params, ptp, &usbdata, &len, &first);
+		if (ret!=PTP_RC_OK)
 			break;
-		} else
-		if (dtoh16(usbdata.type)!=PTP_USB_CONTAINER_DATA
-			&& dtoh16(usbdata.type)!=PTP_USB_CONTAINER_RESPONSE) {
-			ret = PTP_ERROR_DATA_EXPECTED;
-			break;
-		} else
-		if (dtoh16(usbdata.code)!=ptp->Code) {
-			ret = dtoh16(usbdata.code);
+		*getlen=len;
+		/* too long for the caller's buffer, the caller learns the
+		   length needed; the pipe is kept in step */
+		if (dest!=NULL && capacity>0 && len>capacity) {
+			ret=ptp_usb_discard(params, ptp, len-first, &usbdata);
+			if (ret==PTP_RC_OK)
+				ret = PTP_ERROR_CAPACITY;
 			break;
 		}
-		/* evaluate data length */
-		*getlen=dtoh32(usbdata.length)-PTP_USB_BULK_HDR_LEN;
-		/* allocate memory for data if not allocated already */
-		if (*data==NULL) *data=calloc(1,*getlen);
-		/* copy first part of data to 'data' */
-		memcpy(*data,usbdata.payload.data,
-			PTP_USB_BULK_PAYLOAD_LEN<*getlen?
-			PTP_USB_BULK_PAYLOAD_LEN:*getlen);
+		/* allocate memory for data if not provided by the caller */
+		if (dest==NULL) {
+			dest=ptp_data_alloc(params, *getlen);
+			if (dest==NULL) {
+				ret = PTP_ERROR_IO;
+				break;
+			}
+		}
+		/* the first packet shares the header, copy its data part */
+		memcpy(dest,usbdata.raw+PTP_USB_BULK_HDR_LEN,first);
 		/* is that all of data? */
-		if (*getlen+PTP_USB_BULK_HDR_LEN<=sizeof(usbdata)) break;
-		/* if not finaly read the rest of it */
-		ret=params->read_func(((unsigned char *)(*data))+
-					PTP_USB_BULK_PAYLOAD_LEN,
-					*getlen-PTP_USB_BULK_PAYLOAD_LEN,
-					params->data);
-		if (ret!=PTP_RC_OK) {
-			ret = PTP_ERROR_IO;
-			break;
+		if (*getlen==first) break;
+		/* if not read the rest of it directly into the destination,
+		   in chunks if the transport is able to cancel in between */
+		chunklen=params->cancel_func!=NULL?
+			ptp_usb_chunk_len(params):*getlen;
+		for (off=first; off<*getlen; off+=size) {
+			if (ptp_usb_cancelling(params)) {
+				ret=ptp_usb_cancelled(params, ptp);
+				break;
+			}
+			size=*getlen-off>chunklen?chunklen:*getlen-off;
+			ret=ptp_io_read(params, dest+off, size);
+			if (ret!=PTP_RC_OK) {
+				ret = PTP_ERROR_IO;
+				break;
+			}
 		}
 	} while (0);
+	*data=dest;
 /*
 	if (ret!=PTP_RC_OK) {
 		ptp_error (params,
@@ -216,16 +586,98 @@ ptp_usb_getdata (PTPParams* params, PTPContainer* ptp,  unsigned int *getlen,
 	return ret;
 }
 
+/**
+ * ptp_usb_getdata_sink:
+ * params:	PTPParams*
+ *		PTPContainer* ptp	- request container
+ *		uint64_t *getlen	- data phase length expected or 0,
+ *					  the length received is returned
+ *		PTPDataSinkFunc sink	- data sink
+ *		void *priv		- private data passed to the sink
+ *
+ * Receives the data phase in params->chunk_size (PTP_USB_DATA_CHUNK_LEN
+ * by default) chunks and passes every chunk to the sink as soon as it
+ * arrives, so only one chunk sized buffer is ever allocated regardless of
+ * object size. The buffer comes from params->bufalloc_func if the
+ * transport provides one. Data phases of 4GB or more are received as
+ * long as the caller tells their length in *getlen.
+ * If the sink fails the rest of the data phase is read and thrown away to
+ * keep the pipe in sync and PTP_ERROR_SINK is returned. After ptp_cancel()
+ * the transport's cancel_func stops the data phase before the next chunk
+ * and PTP_ERROR_CANCEL is returned.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_usb_getdata_sink (PTPParams* params, PTPContainer* ptp,
+		uint64_t *getlen, PTPDataSinkFunc sink, void *priv)
+{
+	uint16_t ret, sinkret=PTP_RC_OK;
+	PTPUSBBulkPacket usbdata;
+	unsigned char *chunk=NULL;
+	unsigned int first, size, chunklen=ptp_usb_chunk_len(params);
+	unsigned int chunksize=0;
+	int transportbuf=0;
+	uint64_t offset;
+
+	PTP_CNT_INIT(usbdata);
+	ret=ptp_usb_getdata_hdr(params, ptp, &usbdata, getlen, &first);
+	if (ret!=PTP_RC_OK)
+		return ret;
+	if (first>0)
+		sinkret=sink(priv, usbdata.raw+PTP_USB_BULK_HDR_LEN, first, 0);
+	offset=first;
+	if (offset<*getlen) {
+		size=*getlen-first>chunklen?chunklen:*getlen-first;
+		chunksize=size;
+		/* rather use transport's buffer, if it has one */
+		if (params->bufalloc_func!=NULL)
+			chunk=params->bufalloc_func(size, params->data);
+		if (chunk!=NULL)
+			transportbuf=1;
+		else
+			chunk=ptp_usb_data_alloc(size);
+		/* no memory, go on a packet at a time through the packet
+		   buffer rather than leave the rest in the pipe */
+		if (chunk==NULL) {
+			chunk=usbdata.raw;
+			chunklen=ptp_usb_packet_len(params);
+		}
+	}
+	while (offset<*getlen) {
+		if (ptp_usb_cancelling(params)) {
+			ret=ptp_usb_cancelled(params, ptp);
+			break;
+		}
+		size=*getlen-offset>chunklen?chunklen:*getlen-offset;
+		ret=ptp_io_read(params, chunk, size);
+		if (ret!=PTP_RC_OK) {
+			ret = PTP_ERROR_IO;
+			break;
+		}
+		if (sinkret==PTP_RC_OK)
+			sinkret=sink(priv, chunk, size, offset);
+		offset+=size;
+	}
+	if (transportbuf)
+		params->buffree_func(chunk, chunksize, params->data);
+	else if (chunk!=usbdata.raw)
+		free(chunk);
+	if (ret==PTP_RC_OK && sinkret!=PTP_RC_OK)
+		ret = PTP_ERROR_SINK;
+	return ret;
+}
+
 uint16_t
 ptp_usb_getresp (PTPParams* params, PTPContainer* resp)
 {
-	static uint16_t ret;
-	static PTPUSBBulkContainer usbresp;
+	uint16_t ret;
+	PTPUSBBulkContainer usbresp;
 
 	PTP_CNT_INIT(usbresp);
 	/* read response, it should never be longer than sizeof(usbresp) */
-	ret=params->read_func((unsigned char *)&usbresp,
-				sizeof(usbresp), params->data);
+	ret=ptp_io_read(params, (unsigned char *)&usbresp,
+				sizeof(usbresp));
 
 	if (ret!=PTP_RC_OK) {
 		ret = PTP_ERROR_IO;
@@ -264,6 +716,228 @@ ptp_usb_getresp (PTPParams* params, PTPContainer* resp)
 #define PTP_RQ_PARAM4		0x0400	/* four parameters */
 #define PTP_RQ_PARAM5		0x0500	/* five parameters */
 
+/* transaction deadlines */
+
+static uint64_t
+ptp_now_ms (void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec*1000+tv.tv_usec/1000;
+#endif
+}
+
+/**
+ * ptp_timeout:
+ * params:	PTPParams*
+ *		uint16_t code		- operation code
+ *		uint64_t bytes		- length of the data phase, if known
+ *
+ * Computes how long a transaction may take: the base timeout of the
+ * operation (params->capture_timeout for operations waiting for the
+ * shutter, params->timeout otherwise) plus the time the data phase
+ * takes at PTP_TIMEOUT_MIN_RATE.
+ *
+ * Return values: timeout in ms.
+ **/
+unsigned int
+ptp_timeout (PTPParams* params, uint16_t code, uint64_t bytes)
+{
+	uint64_t timeout;
+
+	switch (code) {
+	case PTP_OC_InitiateCapture:
+	case PTP_OC_InitiateOpenCapture:
+	case PTP_OC_CANON_InitiateCaptureInMemory:
+	case PTP_OC_NIKON_DirectCapture:
+		timeout=params->capture_timeout?
+			params->capture_timeout:PTP_TIMEOUT_CAPTURE;
+		break;
+	default:
+		timeout=params->timeout?params->timeout:PTP_TIMEOUT_DEFAULT;
+		break;
+	}
+	timeout+=bytes/PTP_TIMEOUT_MIN_RATE;	/* KB/s == B/ms */
+	return timeout>0x7fffffff?0x7fffffff:(unsigned int)timeout;
+}
+
+/**
+ * ptp_transaction_deadline:
+ * params:	PTPParams*
+ *		uint16_t code		- operation code
+ *		uint64_t bytes		- length of the data phase, if known
+ *
+ * Sets the deadline of the transaction in progress to ptp_timeout()
+ * from now. ptp_transaction() calls it before the request phase and
+ * again once the length of a received data phase is known.
+ **/
+void
+ptp_transaction_deadline (PTPParams* params, uint16_t code, uint64_t bytes)
+{
+	params->deadline=ptp_now_ms()+ptp_timeout(params, code, bytes);
+}
+
+/**
+ * ptp_timeout_left:
+ * params:	PTPParams*
+ *
+ * To be used by the transport as the timeout of a bulk transfer.
+ *
+ * Return values: ms left until the deadline of the transaction in
+ * progress, at least 1 so that an expired deadline fails fast instead
+ * of meaning "no timeout"; the base timeout outside a transaction.
+ **/
+int
+ptp_timeout_left (PTPParams* params)
+{
+	uint64_t now;
+
+	if (params->deadline==0)
+		return ptp_timeout(params, 0, 0);
+	now=ptp_now_ms();
+	if (now>=params->deadline)
+		return 1;
+	if (params->deadline-now>0x7fffffff)
+		return 0x7fffffff;
+	return (int)(params->deadline-now);
+}
+
+/**
+ * ptp_cancel:
+ * params:	PTPParams*
+ *
+ * Asks the transaction in progress to stop as soon as it can; may be
+ * called from another thread or a signal handler. A data phase sees it
+ * before its next chunk and, if the transport has a cancel_func (for USB
+ * the class Cancel request), is cut short; the transaction fails with
+ * PTP_ERROR_CANCEL and is not retried, the session stays open. Without a
+ * transaction in progress, or if the transport cannot cancel, the next
+ * transaction fails with PTP_ERROR_CANCEL before its request is sent.
+ **/
+void
+ptp_cancel (PTPParams* params)
+{
+	params->cancel=1;
+}
+
+/* takes a cancel asked for before the transaction started */
+static inline int
+ptp_cancel_pending (PTPParams* params)
+{
+	if (!params->cancel)
+		return 0;
+	params->cancel=0;
+	return 1;
+}
+
+/**
+ * ptp_usb_drain:
+ * params:	PTPParams*
+ *		unsigned int ms		- how long the device may stay quiet
+ *
+ * Reads and throws away what the device still sends on the bulk IN pipe
+ * until nothing came for ms, but no longer than the base timeout. For the
+ * transport's cancel_func: what the device queued before it saw the
+ * Cancel request would be taken for the next transaction otherwise.
+ *
+ * Return values: PTP_RC_OK or PTP_ERROR_IO if out of memory.
+ **/
+uint16_t
+ptp_usb_drain (PTPParams* params, unsigned int ms)
+{
+	unsigned int len=ptp_usb_chunk_len(params);
+	uint64_t until=ptp_now_ms()+ptp_timeout(params, 0, 0);
+	unsigned char *buf;
+
+	buf=ptp_usb_data_alloc(len);
+	if (buf==NULL)
+		return PTP_ERROR_IO;
+	do
+		params->deadline=ptp_now_ms()+ms;
+	while (ptp_io_read(params, buf, len)==PTP_RC_OK &&
+	    params->deadline<until);
+	params->deadline=0;
+	free(buf);
+	return PTP_RC_OK;
+}
+
+/* ms an event may be waited for */
+static unsigned int
+ptp_event_wait_timeout (PTPParams* params)
+{
+	return params->capture_timeout?
+		params->capture_timeout:PTP_TIMEOUT_CAPTURE;
+}
+
+/**
+ * ptp_event_timeout:
+ * params:	PTPParams*
+ *
+ * Return values: timeout of a single interrupt endpoint read in ms;
+ * short while the event pump runs, so that it can be stopped.
+ **/
+int
+ptp_event_timeout (PTPParams* params)
+{
+#ifdef PTP_EVENT_PUMP
+	if (params->eventpump!=NULL)
+		return PTP_TIMEOUT_EVENT_PUMP;
+#endif
+	return ptp_event_wait_timeout(params);
+}
+
+/* one go of ptp_transaction() */
+static uint16_t
+ptp_transaction_once (PTPParams* params, PTPContainer* ptp,
+			uint16_t flags, unsigned int sendlen, char** data)
+{
+	if (ptp_cancel_pending(params))
+		return PTP_ERROR_CANCEL;
+	ptp->Transaction_ID=params->transaction_id++;
+	ptp->SessionID=params->session_id;
+	ptp_transaction_deadline(params, ptp->Code,
+		(flags&PTP_DP_DATA_MASK)==PTP_DP_SENDDATA?sendlen:0);
+	TRANSACTION_BEGIN(params, ptp);
+	/* send request */
+	CHECK_PTP_RC(PHASE_END(params, PTP_STATS_REQUEST,
+		params->sendreq_func (params, ptp)));
+	/* is there a dataphase? */
+	switch (flags&PTP_DP_DATA_MASK) {
+		case PTP_DP_SENDDATA:
+			STATS_BYTES(params, sendlen);
+			CHECK_PTP_RC(PHASE_END(params, PTP_STATS_DATA,
+				params->senddata_func(params, ptp,
+				(unsigned char*)*data, sendlen)));
+			break;
+		case PTP_DP_GETDATA:
+			{
+			unsigned int getlen=0;
+			uint16_t ret;
+
+			ret=params->getdata_func(params, ptp,
+				&getlen, (unsigned char**)data);
+			STATS_BYTES(params, getlen);
+			CHECK_PTP_RC(PHASE_END(params, PTP_STATS_DATA, ret));
+			}
+			break;
+		case PTP_DP_NODATA:
+			break;
+		default:
+		return PTP_ERROR_BADPARAM;
+	}
+	/* get response */
+	CHECK_PTP_RC(PHASE_END(params, PTP_STATS_RESPONSE,
+		params->getresp_func(params, ptp)));
+	return PTP_RC_OK;
+}
+
 /**
  * ptp_transaction:
  * params:	PTPParams*
@@ -286,6 +960,12 @@ ptp_usb_getresp (PTPParams* params, PTPContainer* resp)
  * The memory for a pointer should be preserved by the caller, if data are
  * beeing retreived the appropriate amount of memory is beeing allocated
  * (the caller should handle that!).
+ * If *data already points to a buffer (e.g. an mmap()ed file) the received
+ * data are stored there directly, without any intermediate copy; as its
+ * size is unknown here, better use ptp_transaction_buf() for that.
+ *
+ * A failed transaction is recovered and sent again as params->recovery
+ * says, see ptp_recover(). It may be cancelled by ptp_cancel().
  *
  * Return values: Some PTP_RC_* code.
  * Upon success PTPContainer* ptp contains PTP Response Phase container with
@@ -295,36 +975,350 @@ ptp_usb_getresp (PTPParams* params, PTPContainer* resp)
 ptp_transaction (PTPParams* params, PTPContainer* ptp, 
 			uint16_t flags, unsigned int sendlen, char** data)
 {
+	PTPContainer req;
+	char *dest;
+	unsigned int attempt=0;
+	uint16_t ret;
+
 	if ((params==NULL) || (ptp==NULL)) 
 		return PTP_ERROR_BADPARAM;
-	
+
+	req=*ptp;
+	dest=data!=NULL?*data:NULL;
+	while ((ret=ptp_transaction_once(params, ptp, flags, sendlen,
+	    data))!=PTP_RC_OK &&
+	    ptp_recover(params, req.Code, ret, ++attempt, 1)) {
+		/* drop what the failed attempt allocated */
+		if ((flags&PTP_DP_DATA_MASK)==PTP_DP_GETDATA && dest==NULL) {
+			free(*data);
+			*data=NULL;
+		}
+		*ptp=req;
+	}
+	return ret;
+}
+
+/* one go of ptp_transaction_pool() */
+static uint16_t
+ptp_transaction_pool_once (PTPParams* params, PTPContainer* ptp, char** data,
+			unsigned int *getlen)
+{
+	*data=NULL;
+	*getlen=0;
+	if (ptp_cancel_pending(params))
+		return PTP_ERROR_CANCEL;
 	ptp->Transaction_ID=params->transaction_id++;
 	ptp->SessionID=params->session_id;
+	ptp_transaction_deadline(params, ptp->Code, 0);
+	TRANSACTION_BEGIN(params, ptp);
 	/* send request */
-	CHECK_PTP_RC(params->sendreq_func (params, ptp));
-	/* is there a dataphase? */
-	switch (flags&PTP_DP_DATA_MASK) {
-		case PTP_DP_SENDDATA:
-			CHECK_PTP_RC(params->senddata_func(params, ptp,
-				(unsigned char*)*data, sendlen));
-			break;
-		case PTP_DP_GETDATA:
-			{
-			unsigned int getlen;
-			CHECK_PTP_RC(params->getdata_func(params, ptp,
-				    sendlen?(unsigned int *)(((uint64_t)(&getlen)&0xffffffff00000000)|sendlen):
-				    &getlen,
-				(unsigned char**)data));
+	CHECK_PTP_RC(PHASE_END(params, PTP_STATS_REQUEST,
+		params->sendreq_func (params, ptp)));
+	/* receive data phase */
+	CHECK_PTP_RC(PHASE_END(params, PTP_STATS_DATA,
+		params->getdata_func(params, ptp, getlen,
+		(unsigned char**)data)));
+	STATS_BYTES(params, *getlen);
+	/* get response */
+	CHECK_PTP_RC(PHASE_END(params, PTP_STATS_RESPONSE,
+		params->getresp_func(params, ptp)));
+	return PTP_RC_OK;
+}
+
+/*
+ * ptp_transaction() receiving a data phase which the caller only unpacks:
+ * the buffer comes from the session's pool and is given back by
+ * ptp_data_release(params, *data, *getlen), also if this fails
+ */
+static uint16_t
+ptp_transaction_pool (PTPParams* params, PTPContainer* ptp, char** data,
+			unsigned int *getlen)
+{
+	PTPContainer req=*ptp;
+	unsigned int attempt=0;
+	uint16_t ret;
+
+	while ((ret=ptp_transaction_pool_once(params, ptp, data,
+	    getlen))!=PTP_RC_OK &&
+	    ptp_recover(params, req.Code, ret, ++attempt, 1)) {
+		ptp_data_release(params, *data, *getlen);
+		*ptp=req;
+	}
+	return ret;
+}
+
+/* one go of ptp_transaction_buf() */
+static uint16_t
+ptp_transaction_buf_once (PTPParams* params, PTPContainer* ptp,
+			unsigned char *buf, unsigned int capacity,
+			unsigned int *getlen)
+{
+	uint16_t ret;
+
+	if (ptp_cancel_pending(params))
+		return PTP_ERROR_CANCEL;
+	ptp->Transaction_ID=params->transaction_id++;
+	ptp->SessionID=params->session_id;
+	ptp_transaction_deadline(params, ptp->Code, 0);
+	TRANSACTION_BEGIN(params, ptp);
+	/* send request */
+	CHECK_PTP_RC(PHASE_END(params, PTP_STATS_REQUEST,
+		params->sendreq_func (params, ptp)));
+	/* receive data phase */
+	*getlen=capacity;
+	ret=params->getdata_func(params, ptp, getlen, &buf);
+	STATS_BYTES(params, ret==PTP_RC_OK?*getlen:0);
+	ret=PHASE_END(params, PTP_STATS_DATA, ret);
+	if (ret!=PTP_RC_OK && ret!=PTP_ERROR_CAPACITY)
+		return ret;
+	/* get response */
+	CHECK_PTP_RC(PHASE_END(params, PTP_STATS_RESPONSE,
+		params->getresp_func(params, ptp)));
+	return ret;
+}
+
+/**
+ * ptp_transaction_buf:
+ * params:	PTPParams*
+ * 		PTPContainer* ptp	- general ptp container
+ *		unsigned char *buf	- receive buffer
+ *		unsigned int capacity	- its size
+ *		unsigned int *getlen	- data phase length (returned)
+ *
+ * Performs PTP transaction with receiving data phase like ptp_transaction()
+ * does, but into the caller's buffer, so one buffer may serve any number
+ * of transactions without allocating memory. If the data phase does not
+ * fit, it is read and thrown away, *getlen tells the capacity needed and
+ * PTP_ERROR_CAPACITY is returned once the response was received. Failures
+ * are recovered like ptp_transaction() does.
+ *
+ * Return values: Some PTP_RC_* code.
+ * Upon success PTPContainer* ptp contains PTP Response Phase container with
+ * all fields filled in.
+ **/
+uint16_t
+ptp_transaction_buf (PTPParams* params, PTPContainer* ptp,
+			unsigned char *buf, unsigned int capacity,
+			unsigned int *getlen)
+{
+	PTPContainer req;
+	unsigned int attempt=0;
+	uint16_t ret;
+
+	if ((params==NULL) || (ptp==NULL) || (buf==NULL) || (capacity==0))
+		return PTP_ERROR_BADPARAM;
+
+	req=*ptp;
+	while ((ret=ptp_transaction_buf_once(params, ptp, buf, capacity,
+	    getlen))!=PTP_RC_OK &&
+	    ptp_recover(params, req.Code, ret, ++attempt, 1))
+		*ptp=req;
+	return ret;
+}
+
+/* one go of ptp_transaction_sink() */
+static uint16_t
+ptp_transaction_sink_once (PTPParams* params, PTPContainer* ptp,
+			uint64_t size, PTPDataSinkFunc sink, void *priv)
+{
+	uint16_t ret;
+	uint64_t getlen=size;
+
+	if (ptp_cancel_pending(params))
+		return PTP_ERROR_CANCEL;
+	ptp->Transaction_ID=params->transaction_id++;
+	ptp->SessionID=params->session_id;
+	ptp_transaction_deadline(params, ptp->Code, size);
+	TRANSACTION_BEGIN(params, ptp);
+	/* send request */
+	CHECK_PTP_RC(PHASE_END(params, PTP_STATS_REQUEST,
+		params->sendreq_func (params, ptp)));
+	/* receive data phase */
+	if (params->getdatasink_func!=NULL) {
+		ret=params->getdatasink_func(params, ptp, &getlen, sink, priv);
+	} else {
+		unsigned char *data=NULL;
+		unsigned int len=0;
+
+		ret=params->getdata_func(params, ptp, &len, &data);
+		if (ret==PTP_RC_OK && len>0 &&
+		    sink(priv, data, len, 0)!=PTP_RC_OK)
+			ret=PTP_ERROR_SINK;
+		free(data);
+		getlen=len;
+	}
+	STATS_BYTES(params, getlen);
+	ret=PHASE_END(params, PTP_STATS_DATA, ret);
+	if (ret!=PTP_RC_OK && ret!=PTP_ERROR_SINK)
+		return ret;
+	/* get response */
+	CHECK_PTP_RC(PHASE_END(params, PTP_STATS_RESPONSE,
+		params->getresp_func(params, ptp)));
+	return ret;
+}
+
+/**
+ * ptp_transaction_sink:
+ * params:	PTPParams*
+ * 		PTPContainer* ptp	- general ptp container
+ *		uint64_t size		- data phase length expected, 0 if
+ *					  unknown; needed for 4GB or more
+ *		PTPDataSinkFunc sink	- data sink
+ *		void *priv		- private data passed to the sink
+ *
+ * Performs PTP transaction with receiving data phase like ptp_transaction()
+ * does, but instead of returning the data in one buffer passes it to the
+ * sink chunk by chunk, as it is read from the device.
+ * Transports not providing getdatasink_func receive the data phase into a
+ * temporary buffer which is then passed to the sink at once.
+ *
+ * After a failure the transport is recovered as params->recovery says, but
+ * the transaction is not sent again: the sink may have had part of the
+ * data already, the caller knows how to go on.
+ *
+ * Return values: Some PTP_RC_* code, PTP_ERROR_SINK if the sink failed (the
+ * transaction is completed anyway).
+ * Upon success PTPContainer* ptp contains PTP Response Phase container with
+ * all fields filled in.
+ **/
+uint16_t
+ptp_transaction_sink (PTPParams* params, PTPContainer* ptp,
+			uint64_t size, PTPDataSinkFunc sink, void *priv)
+{
+	uint16_t ret, code;
+
+	if ((params==NULL) || (ptp==NULL) || (sink==NULL)) 
+		return PTP_ERROR_BADPARAM;
+
+	code=ptp->Code;
+	ret=ptp_transaction_sink_once(params, ptp, size, sink, priv);
+	if (ret!=PTP_RC_OK)
+		ptp_recover(params, code, ret, 1, 0);
+	return ret;
+}
+
+/*
+ * does a batch stop after an operation returning rc: transport errors
+ * leave the session in an unknown state, so they stop it whatever the
+ * policy
+ */
+static inline int
+ptp_batch_stop (uint16_t rc, int policy)
+{
+	return policy!=PTP_BATCH_CONTINUE || (rc&0xff00)==0x0200;
+}
+
+/* called after each operation of a batch, may take its data phase */
+typedef void (* PTPBatchFunc) (PTPParams* params, PTPBatchOp *op,
+				unsigned int i, void *priv);
+
+/* ptp_batch(), telling each about every operation run */
+static uint16_t
+ptp_batch_run (PTPParams* params, PTPBatchOp *ops, unsigned int n,
+		int policy, unsigned int *done, PTPBatchFunc each, void *priv)
+{
+	PTPBatchOp *op;
+	uint16_t ret=PTP_RC_OK;
+	unsigned int i;
+
+	if (done!=NULL)
+		*done=0;
+	if ((params==NULL) || (ops==NULL && n>0))
+		return PTP_ERROR_BADPARAM;
+
+	for (i=0; i<n; ) {
+		op=&ops[i++];
+		op->data=NULL;
+		op->len=0;
+		if (op->flags==PTP_DP_GETDATA) {
+			op->rc=ptp_transaction_pool(params, &op->req,
+				&op->data, &op->len);
+			if (op->rc!=PTP_RC_OK) {
+				ptp_data_release(params, op->data, op->len);
+				op->data=NULL;
+				op->len=0;
 			}
+		} else if (op->flags==PTP_DP_NODATA)
+			op->rc=ptp_transaction(params, &op->req,
+				PTP_DP_NODATA, 0, NULL);
+		else
+			op->rc=PTP_ERROR_BADPARAM;
+		if (each!=NULL)
+			each(params, op, i-1, priv);
+		if (op->rc==PTP_RC_OK)
+			continue;
+		if (ret==PTP_RC_OK)
+			ret=op->rc;
+		if (ptp_batch_stop(op->rc, policy))
 			break;
-		case PTP_DP_NODATA:
-			break;
-		default:
-		return PTP_ERROR_BADPARAM;
 	}
-	/* get response */
-	CHECK_PTP_RC(params->getresp_func(params, ptp));
-	return PTP_RC_OK;
+	if (done!=NULL)
+		*done=i;
+	return ret;
+}
+
+/*
+ * a batch of n operations code, one for each of the handles given as
+ * Param1; NULL if out of memory
+ */
+static PTPBatchOp *
+ptp_batch_handles (const uint32_t *handles, unsigned int n, uint16_t code,
+		uint8_t nparam, uint16_t flags)
+{
+	PTPBatchOp *ops;
+	unsigned int i;
+
+	ops=calloc(n?n:1, sizeof(PTPBatchOp));
+	if (ops==NULL)
+		return NULL;
+	for (i=0; i<n; i++) {
+		PTP_CNT_INIT(ops[i].req);
+		ops[i].req.Code=code;
+		ops[i].req.Param1=handles[i];
+		ops[i].req.Nparam=nparam;
+		ops[i].flags=flags;
+	}
+	return ops;
+}
+
+/**
+ * ptp_batch:
+ * params:	PTPParams*
+ *		PTPBatchOp *ops		- operations to run, in order
+ *		unsigned int n		- how many
+ *		int policy		- PTP_BATCH_STOP or PTP_BATCH_CONTINUE
+ *		unsigned int *done	- operations run (returned), may be NULL
+ *
+ * Runs the operations back to back, without the debug output of the
+ * single operation functions. ops[i].req is the request and gets the
+ * response container, ops[i].rc the response code. A data phase received
+ * is left in ops[i].data until ptp_batch_release(); the data of a failed
+ * operation is dropped. After a failure the batch stops or goes on as
+ * policy says, but PTP_ERROR_* transport errors always stop it.
+ *
+ * Return values: PTP_RC_OK if all operations run succeeded, the code of the
+ * first one failed otherwise.
+ **/
+uint16_t
+ptp_batch (PTPParams* params, PTPBatchOp *ops, unsigned int n, int policy,
+		unsigned int *done)
+{
+	if (params!=NULL)
+		ptp_debug(params,"PTP: Running a batch of %u operations", n);
+	return ptp_batch_run(params, ops, n, policy, done, NULL, NULL);
+}
+
+/* gives back the data phases received by ptp_batch() */
+void
+ptp_batch_release (PTPParams* params, PTPBatchOp *ops, unsigned int n)
+{
+	unsigned int i;
+
+	for (i=0; i<n; i++) {
+		ptp_data_release(params, ops[i].data, ops[i].len);
+		ops[i].data=NULL;
+		ops[i].len=0;
+	}
 }
 
 /* Enets handling functions */
@@ -353,7 +1347,7 @@ static inline uint16_t
 ptp_usb_event (PTPParams* params, PTPContainer* event, int wait)
 {
 	int result=0, size=0;
-	static PTPUSBEventContainer usbevent;
+	PTPUSBEventContainer usbevent;
 
 	PTP_CNT_INIT(usbevent);
 
@@ -380,14 +1374,241 @@ ptp_usb_event (PTPParams* params, PTPContainer* event, int wait)
 	event->Param1=dtoh32(usbevent.param1);
 	event->Param2=dtoh32(usbevent.param2);
 	event->Param3=dtoh32(usbevent.param3);
+	ptp_trace_mark(params, PTP_TRACE_EVENT, event->Code, event->Param1);
+
+	return PTP_RC_OK;
+}
+
+#ifdef PTP_EVENT_PUMP
+
+/*
+ * Event pump: a thread reading the interrupt endpoint all the time and
+ * queueing events in a single producer/single consumer ring, so that no
+ * event is missed while the caller is busy with bulk transfers.
+ * head is only written by the pump thread, tail by the consumer.
+ * fd is readable whenever the ring is not empty or a read failed.
+ */
+#define PTP_EVENT_RING_LEN	64	/* power of 2 */
+
+struct _PTPEventPump {
+	PTPParams *params;
+	pthread_t thread;
+	int stop;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int dropped;
+	unsigned int errors;	/* failed interrupt reads */
+	PTPContainer ring[PTP_EVENT_RING_LEN];
+	int fd[2];		/* eventfd in fd[0] == fd[1], or a pipe */
+};
+
+static void
+ptp_event_pump_signal (PTPEventPump *pump)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t one=1;
+
+	if (write(pump->fd[1], &one, sizeof(one))<0) {}
+#else
+	if (write(pump->fd[1], "", 1)<0) {}
+#endif
+}
+
+static void
+ptp_event_pump_drain (PTPEventPump *pump)
+{
+	char buf[64];
+
+	while (read(pump->fd[0], buf, sizeof(buf))>0);
+}
+
+static void *
+ptp_event_pump_thread (void *arg)
+{
+	PTPEventPump *pump=(PTPEventPump *)arg;
+	PTPContainer event;
+	unsigned int head;
+	uint64_t start, took, quiet=0;
+
+	while (!__atomic_load_n(&pump->stop, __ATOMIC_ACQUIRE)) {
+		start=ptp_now_ms();
+		if (ptp_usb_event(pump->params, &event,
+			PTP_EVENT_CHECK)!=PTP_RC_OK) {
+			took=ptp_now_ms()-start;
+			/*
+			 * the reads time out every PTP_TIMEOUT_EVENT_PUMP;
+			 * the waiters are told once nothing came for as
+			 * long as a direct read would have waited
+			 */
+			if (took>=PTP_TIMEOUT_EVENT_PUMP) {
+				quiet+=took;
+				if (quiet<ptp_event_wait_timeout(pump->params))
+					continue;
+			}
+			quiet=0;
+			__atomic_add_fetch(&pump->errors, 1, __ATOMIC_RELEASE);
+			ptp_event_pump_signal(pump);
+			/* don't spin if the device is gone */
+			if (took<PTP_TIMEOUT_EVENT_PUMP)
+				poll(NULL, 0, 10);
+			continue;
+		}
+		quiet=0;
+		head=pump->head;
+		if (head-__atomic_load_n(&pump->tail, __ATOMIC_ACQUIRE)==
+			PTP_EVENT_RING_LEN) {
+			pump->dropped++;
+			ptp_error(pump->params,
+				"PTP: event ring full, dropped event 0x%04x",
+				event.Code);
+			continue;
+		}
+		pump->ring[head%PTP_EVENT_RING_LEN]=event;
+		__atomic_store_n(&pump->head, head+1, __ATOMIC_RELEASE);
+		ptp_event_pump_signal(pump);
+	}
+	return NULL;
+}
+
+/* pops one event, returns 0 if the ring is empty */
+static int
+ptp_event_pump_pop (PTPEventPump *pump, PTPContainer* event)
+{
+	unsigned int tail=pump->tail;
+
+	if (tail==__atomic_load_n(&pump->head, __ATOMIC_ACQUIRE))
+		return 0;
+	*event=pump->ring[tail%PTP_EVENT_RING_LEN];
+	__atomic_store_n(&pump->tail, tail+1, __ATOMIC_RELEASE);
+	/* keep fd readable as long as there is something left */
+	ptp_event_pump_drain(pump);
+	if (tail+1!=__atomic_load_n(&pump->head, __ATOMIC_ACQUIRE))
+		ptp_event_pump_signal(pump);
+	return 1;
+}
+
+#endif /* PTP_EVENT_PUMP */
+
+/**
+ * ptp_usb_event_pump_start:
+ * params:	PTPParams*
+ *
+ * Starts a thread reading events from the interrupt endpoint into a
+ * ring buffer. Until ptp_usb_event_pump_stop() is called
+ * ptp_usb_event_check() returns queued events without touching the
+ * device (PTP_ERROR_NOEVENT if there is none) and ptp_usb_event_wait()
+ * sleeps until an event is queued or an interrupt read fails.
+ * check_int_func is then called from the pump thread while the caller
+ * does bulk transfers, which the transport must allow; libusb-0.1 does
+ * not, libusb-1.0 and usbfs do.
+ *
+ * Return values: Some PTP_RC_* code, PTP_ERROR_BADPARAM if the library
+ * was built without thread support.
+ **/
+uint16_t
+ptp_usb_event_pump_start (PTPParams* params)
+{
+#ifdef PTP_EVENT_PUMP
+	PTPEventPump *pump;
 
+	if (params->eventpump!=NULL)
+		return PTP_RC_OK;
+	/* not a USB transport */
+	if (params->check_int_func==NULL)
+		return PTP_ERROR_BADPARAM;
+	pump=calloc(1, sizeof(PTPEventPump));
+	if (pump==NULL)
+		return PTP_ERROR_IO;
+	pump->params=params;
+	/* set before the first read, see ptp_event_timeout() */
+	params->eventpump=pump;
+#ifdef HAVE_SYS_EVENTFD_H
+	pump->fd[0]=pump->fd[1]=eventfd(0, EFD_NONBLOCK);
+	if (pump->fd[0]<0) {
+		params->eventpump=NULL;
+		free(pump);
+		return PTP_ERROR_IO;
+	}
+#else
+	if (pipe(pump->fd)<0) {
+		params->eventpump=NULL;
+		free(pump);
+		return PTP_ERROR_IO;
+	}
+	fcntl(pump->fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(pump->fd[1], F_SETFL, O_NONBLOCK);
+#endif
+	if (pthread_create(&pump->thread, NULL, ptp_event_pump_thread,
+		pump)!=0) {
+		close(pump->fd[0]);
+		if (pump->fd[1]!=pump->fd[0]) close(pump->fd[1]);
+		params->eventpump=NULL;
+		free(pump);
+		return PTP_ERROR_IO;
+	}
 	return PTP_RC_OK;
+#else
+	return PTP_ERROR_BADPARAM;
+#endif
+}
+
+/**
+ * ptp_usb_event_pump_stop:
+ * params:	PTPParams*
+ *
+ * Stops the event pump started by ptp_usb_event_pump_start(), waiting
+ * for the interrupt read in progress to finish, PTP_TIMEOUT_EVENT_PUMP
+ * at most. Queued events are lost.
+ **/
+void
+ptp_usb_event_pump_stop (PTPParams* params)
+{
+#ifdef PTP_EVENT_PUMP
+	PTPEventPump *pump=params->eventpump;
+
+	if (pump==NULL)
+		return;
+	__atomic_store_n(&pump->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(pump->thread, NULL);
+	if (pump->dropped)
+		ptp_debug(params, "PTP: event pump dropped %u events",
+			pump->dropped);
+	close(pump->fd[0]);
+	if (pump->fd[1]!=pump->fd[0]) close(pump->fd[1]);
+	free(pump);
+	params->eventpump=NULL;
+#endif
+}
+
+/**
+ * ptp_usb_event_fd:
+ * params:	PTPParams*
+ *
+ * Returns a file descriptor which polls readable while the event pump
+ * has events queued (or an interrupt read failed), for use with
+ * poll()/select(); -1 if the pump is not running.
+ **/
+int
+ptp_usb_event_fd (PTPParams* params)
+{
+#ifdef PTP_EVENT_PUMP
+	if (params->eventpump!=NULL)
+		return params->eventpump->fd[0];
+#endif
+	return -1;
 }
 
 uint16_t
 ptp_usb_event_check (PTPParams* params, PTPContainer* event) {
 
 	ptp_debug(params,"PTP: Checking for Event");
+#ifdef PTP_EVENT_PUMP
+	if (params->eventpump!=NULL) {
+		if (ptp_event_pump_pop(params->eventpump, event))
+			return PTP_RC_OK;
+		return PTP_ERROR_NOEVENT;
+	}
+#endif
 	return ptp_usb_event (params, event, PTP_EVENT_CHECK_FAST);
 }
 
@@ -395,6 +1616,32 @@ uint16_t
 ptp_usb_event_wait (PTPParams* params, PTPContainer* event) {
 
 	ptp_debug(params,"PTP: Waiting for Event");
+#ifdef PTP_EVENT_PUMP
+	if (params->eventpump!=NULL) {
+		PTPEventPump *pump=params->eventpump;
+		unsigned int errors=__atomic_load_n(&pump->errors,
+			__ATOMIC_ACQUIRE);
+		struct pollfd pfd;
+
+		/*
+		 * like the direct read, fail once a whole interrupt read
+		 * failed while waiting; the first failure may belong to a
+		 * read started before we were called.
+		 */
+		for (;;) {
+			if (ptp_event_pump_pop(pump, event))
+				return PTP_RC_OK;
+			if (__atomic_load_n(&pump->errors, __ATOMIC_ACQUIRE)
+				-errors>=2)
+				return PTP_ERROR_IO;
+			pfd.fd=pump->fd[0];
+			pfd.events=POLLIN;
+			if (poll(&pfd, 1, -1)<0 && errno!=EINTR)
+				return PTP_ERROR_IO;
+			ptp_event_pump_drain(pump);
+		}
+	}
+#endif
 	return ptp_usb_event (params, event, PTP_EVENT_CHECK);
 }
 
@@ -420,15 +1667,16 @@ ptp_getdeviceinfo (PTPParams* params, PTPDeviceInfo* deviceinfo)
 	uint16_t ret;
 	PTPContainer ptp;
 	char* di=NULL;
+	unsigned int len;
 
 	ptp_debug(params,"PTP: Obtaining DeviceInfo");
 
 	PTP_CNT_INIT(ptp);
 	ptp.Code=PTP_OC_GetDeviceInfo;
 	ptp.Nparam=0;
-	ret=ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &di);
+	ret=ptp_transaction_pool(params, &ptp, &di, &len);
 	if (ret == PTP_RC_OK) ptp_unpack_DI(params, di, deviceinfo);
-	free(di);
+	ptp_data_release(params, di, len);
 	return ret;
 }
 
@@ -501,15 +1749,16 @@ ptp_getstorageids (PTPParams* params, PTPStorageIDs* storageids)
 	uint16_t ret;
 	PTPContainer ptp;
 	char* sids=NULL;
+	unsigned int len;
 
 	ptp_debug(params,"PTP: Obtaining StorageIDs");
 
 	PTP_CNT_INIT(ptp);
 	ptp.Code=PTP_OC_GetStorageIDs;
 	ptp.Nparam=0;
-	ret=ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &sids);
+	ret=ptp_transaction_pool(params, &ptp, &sids, &len);
 	if (ret == PTP_RC_OK) ptp_unpack_SIDs(params, sids, storageids);
-	free(sids);
+	ptp_data_release(params, sids, len);
 	return ret;
 }
 
@@ -530,6 +1779,7 @@ ptp_getstorageinfo (PTPParams* params, uint32_t storageid,
 	uint16_t ret;
 	PTPContainer ptp;
 	char* si=NULL;
+	unsigned int len;
 
 	ptp_debug(params,"PTP: Obtaining StorageInfo for storage 0x%08x",
 		storageid);
@@ -538,9 +1788,9 @@ ptp_getstorageinfo (PTPParams* params, uint32_t storageid,
 	ptp.Code=PTP_OC_GetStorageInfo;
 	ptp.Param1=storageid;
 	ptp.Nparam=1;
-	ret=ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &si);
+	ret=ptp_transaction_pool(params, &ptp, &si, &len);
 	if (ret == PTP_RC_OK) ptp_unpack_SI(params, si, storageinfo);
-	free(si);
+	ptp_data_release(params, si, len);
 	return ret;
 }
 
@@ -566,6 +1816,7 @@ ptp_getobjecthandles (PTPParams* params, uint32_t storage,
 	uint16_t ret;
 	PTPContainer ptp;
 	char* oh=NULL;
+	unsigned int len;
 
 	ptp_debug(params,"PTP: Obtaining ObjectHandles");
 
@@ -575,9 +1826,9 @@ ptp_getobjecthandles (PTPParams* params, uint32_t storage,
 	ptp.Param2=objectformatcode;
 	ptp.Param3=associationOH;
 	ptp.Nparam=3;
-	ret=ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &oh);
+	ret=ptp_transaction_pool(params, &ptp, &oh, &len);
 	if (ret == PTP_RC_OK) ptp_unpack_OH(params, oh, objecthandles);
-	free(oh);
+	ptp_data_release(params, oh, len);
 	return ret;
 }
 
@@ -599,6 +1850,7 @@ ptp_getobjectinfo (PTPParams* params, uint32_t handle,
 	uint16_t ret;
 	PTPContainer ptp;
 	char* oi=NULL;
+	unsigned int len;
 
 	ptp_debug(params,"PTP: Obtaining ObjectInfo for object 0x%08x",
 		handle);
@@ -607,9 +1859,67 @@ ptp_getobjectinfo (PTPParams* params, uint32_t handle,
 	ptp.Code=PTP_OC_GetObjectInfo;
 	ptp.Param1=handle;
 	ptp.Nparam=1;
-	ret=ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &oi);
+	ret=ptp_transaction_pool(params, &ptp, &oi, &len);
 	if (ret == PTP_RC_OK) ptp_unpack_OI(params, oi, objectinfo);
-	free(oi);
+	ptp_data_release(params, oi, len);
+	return ret;
+}
+
+/* unpacks an ObjectInfo of ptp_getobjectinfo_batch() as it arrives */
+static void
+ptp_batch_objectinfo (PTPParams* params, PTPBatchOp *op, unsigned int i,
+		void *priv)
+{
+	PTPObjectInfo *objectinfo=(PTPObjectInfo *)priv;
+
+	if (op->rc==PTP_RC_OK)
+		ptp_unpack_OI(params, op->data, &objectinfo[i]);
+	ptp_data_release(params, op->data, op->len);
+	op->data=NULL;
+	op->len=0;
+}
+
+/**
+ * ptp_getobjectinfo_batch:
+ * params:	PTPParams*
+ *		handles			- object handles
+ *		n			- how many
+ *		objectinfo		- ObjectInfo for each handle (returned)
+ *		rc			- PTP_RC_* for each handle (returned),
+ *					  may be NULL
+ *		policy, done		- see ptp_batch()
+ *
+ * Gets the ObjectInfo of n objects back to back. Every data phase is
+ * unpacked as soon as it arrives, so they all share one pooled buffer.
+ * objectinfo[i] is left as it was if getting it failed.
+ *
+ * Return values: PTP_RC_OK if all succeeded, the code of the first one
+ * failed otherwise, PTP_ERROR_IO with *done 0 if out of memory.
+ **/
+uint16_t
+ptp_getobjectinfo_batch (PTPParams *params, const uint32_t *handles,
+			unsigned int n, PTPObjectInfo *objectinfo,
+			uint16_t *rc, int policy, unsigned int *done)
+{
+	PTPBatchOp *ops;
+	uint16_t ret;
+	unsigned int i, run;
+
+	ptp_debug(params,"PTP: Obtaining ObjectInfo for %u objects", n);
+	if (done!=NULL)
+		*done=0;
+	ops=ptp_batch_handles(handles, n, PTP_OC_GetObjectInfo, 1,
+		PTP_DP_GETDATA);
+	if (ops==NULL)
+		return PTP_ERROR_IO;
+	ret=ptp_batch_run(params, ops, n, policy, &run,
+		ptp_batch_objectinfo, objectinfo);
+	if (rc!=NULL)
+		for (i=0; i<run; i++)
+			rc[i]=ops[i].rc;
+	if (done!=NULL)
+		*done=run;
+	free(ops);
 	return ret;
 }
 
@@ -628,6 +1938,264 @@ ptp_getobject (PTPParams* params, uint32_t handle, char** object)
 	return ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, object);
 }
 
+/**
+ * ptp_getobject_buf:
+ * params:	PTPParams*
+ *		handle			- object handle
+ *		buf			- buffer to receive the object
+ *		capacity		- its size
+ *		getlen			- object size (returned)
+ *
+ * Downloads the object straight into the caller's buffer (e.g. an
+ * mmap()ed file), see ptp_transaction_buf().
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_getobject_buf (PTPParams* params, uint32_t handle, unsigned char *buf,
+			unsigned int capacity, unsigned int *getlen)
+{
+	PTPContainer ptp;
+
+	ptp_debug(params,"PTP: Downloading Object 0x%08x", handle);
+
+	PTP_CNT_INIT(ptp);
+	ptp.Code=PTP_OC_GetObject;
+	ptp.Param1=handle;
+	ptp.Nparam=1;
+	return ptp_transaction_buf(params, &ptp, buf, capacity, getlen);
+}
+
+/**
+ * ptp_getobject_sink:
+ * params:	PTPParams*
+ *		handle			- object handle
+ *		size			- object size, see ptp_object_size(),
+ *					  or 0 for objects under 4GB
+ *		sink			- data sink
+ *		priv			- private data passed to the sink
+ *
+ * Downloads the object passing its data to the sink while it is being
+ * received, see ptp_transaction_sink().
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_getobject_sink (PTPParams* params, uint32_t handle, uint64_t size,
+			PTPDataSinkFunc sink, void *priv)
+{
+	PTPContainer ptp;
+
+	ptp_debug(params,"PTP: Downloading Object 0x%08x (streaming)",
+		handle);
+
+	PTP_CNT_INIT(ptp);
+	ptp.Code=PTP_OC_GetObject;
+	ptp.Param1=handle;
+	ptp.Nparam=1;
+	return ptp_transaction_sink(params, &ptp, size, sink, priv);
+}
+
+/**
+ * ptp_object_size:
+ * params:	PTPParams*
+ *		handle			- object handle
+ *		oi			- its ObjectInfo
+ *		size			- returned object size
+ *
+ * ObjectInfo carries the size in 32 bits; objects of 4GB or more show
+ * PTP_OBJECT_SIZE_4GB there. Their real size is asked for as the MTP
+ * ObjectSize property, if the device supports GetObjectPropValue.
+ *
+ * Return values: Some PTP_RC_* code, PTP_RC_OperationNotSupported if the
+ * size of a 4GB or larger object cannot be found out (*size is then
+ * PTP_OBJECT_SIZE_4GB), PTP_ERROR_IO if the value sent is too short.
+ **/
+uint16_t
+ptp_object_size (PTPParams* params, uint32_t handle, PTPObjectInfo *oi,
+			uint64_t *size)
+{
+	uint16_t ret;
+	PTPContainer ptp;
+	char* dpv=NULL;
+	unsigned int len;
+
+	*size=oi->ObjectCompressedSize;
+	if (oi->ObjectCompressedSize!=PTP_OBJECT_SIZE_4GB)
+		return PTP_RC_OK;
+	if (!ptp_operation_issupported(params,
+	    PTP_OC_MTP_GetObjectPropValue))
+		return PTP_RC_OperationNotSupported;
+
+	PTP_CNT_INIT(ptp);
+	ptp.Code=PTP_OC_MTP_GetObjectPropValue;
+	ptp.Param1=handle;
+	ptp.Param2=PTP_OPC_ObjectSize;
+	ptp.Nparam=2;
+	ret=ptp_transaction_pool(params, &ptp, &dpv, &len);
+	/* a UINT64 value */
+	if (ret==PTP_RC_OK && len<8)
+		ret=PTP_ERROR_IO;
+	if (ret==PTP_RC_OK)
+		*size=dtoh64a(dpv);
+	ptp_data_release(params, dpv, len);
+	return ret;
+}
+
+/**
+ * ptp_getpartialobject:
+ * params:	PTPParams*
+ *		handle			- object handle
+ *		offset			- first byte wanted
+ *		maxbytes		- bytes wanted at most, 0xffffffff for
+ *					  the rest of the object
+ *		object			- pointer to the data (returned)
+ *		len			- bytes sent by the device (returned)
+ *
+ * Gets a part of the object.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_getpartialobject (PTPParams* params, uint32_t handle, uint32_t offset,
+			uint32_t maxbytes, char** object, uint32_t *len)
+{
+	uint16_t ret;
+	PTPContainer ptp;
+
+	ptp_debug(params,"PTP: Downloading Object 0x%08x from %u on",
+		handle, offset);
+
+	PTP_CNT_INIT(ptp);
+	ptp.Code=PTP_OC_GetPartialObject;
+	ptp.Param1=handle;
+	ptp.Param2=offset;
+	ptp.Param3=maxbytes;
+	ptp.Nparam=3;
+	ret=ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, object);
+	if (ret==PTP_RC_OK)
+		*len=ptp.Param1;
+	return ret;
+}
+
+/* passes a part of an object on to the sink, at its offset in the object */
+typedef struct {
+	PTPDataSinkFunc sink;
+	void *priv;
+	uint64_t offset;
+	uint32_t len;
+} PTPPartialSink;
+
+static uint16_t
+ptp_partial_sink (void *priv, unsigned char *data, unsigned int size,
+		uint64_t offset)
+{
+	PTPPartialSink *p=(PTPPartialSink *)priv;
+
+	p->len+=size;
+	return p->sink(p->priv, data, size, p->offset+offset);
+}
+
+/**
+ * ptp_getpartialobject_sink:
+ * params:	PTPParams*
+ *		handle			- object handle
+ *		offset			- first byte wanted
+ *		maxbytes		- bytes wanted at most
+ *		sink			- data sink, gets offsets in the object
+ *		priv			- private data passed to the sink
+ *		len			- bytes received (returned)
+ *
+ * Gets a part of the object passing it to the sink while it is being
+ * received. Offsets of 4GB or more take the Android GetPartialObject64
+ * operation.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_getpartialobject_sink (PTPParams* params, uint32_t handle,
+			uint64_t offset, uint32_t maxbytes,
+			PTPDataSinkFunc sink, void *priv, uint32_t *len)
+{
+	uint16_t ret;
+	PTPContainer ptp;
+	PTPPartialSink p;
+
+	ptp_debug(params,"PTP: Downloading Object 0x%08x from %llu on",
+		handle, (unsigned long long)offset);
+
+	p.sink=sink;
+	p.priv=priv;
+	p.offset=offset;
+	p.len=0;
+	PTP_CNT_INIT(ptp);
+	ptp.Param1=handle;
+	if (offset<=0xffffffffULL) {
+		ptp.Code=PTP_OC_GetPartialObject;
+		ptp.Param2=(uint32_t)offset;
+		ptp.Param3=maxbytes;
+		ptp.Nparam=3;
+	} else {
+		ptp.Code=PTP_OC_ANDROID_GetPartialObject64;
+		ptp.Param2=(uint32_t)offset;
+		ptp.Param3=(uint32_t)(offset>>32);
+		ptp.Param4=maxbytes;
+		ptp.Nparam=4;
+	}
+	ret=ptp_transaction_sink(params, &ptp,
+		maxbytes==0xffffffff?0:maxbytes, ptp_partial_sink, &p);
+	*len=p.len;
+	return ret;
+}
+
+/**
+ * ptp_getobject_chunked:
+ * params:	PTPParams*
+ *		handle			- object handle
+ *		size			- object size, see ptp_object_size()
+ *		chunk			- bytes per transaction, 0 for
+ *					  PTP_PARTIAL_CHUNK_LEN
+ *		offset			- first byte still missing, updated
+ *		sink			- data sink
+ *		priv			- private data passed to the sink
+ *
+ * Downloads the object from *offset on by GetPartialObject, chunk bytes
+ * at a time. *offset is advanced after each chunk, so if the link fails
+ * the caller may call again, once ptp_recover() brought it back, to go on
+ * from the last chunk received, instead of getting the whole object anew.
+ * Objects of 4GB or more need GetPartialObject64 as well.
+ *
+ * Return values: Some PTP_RC_* code, PTP_RC_OperationNotSupported if the
+ * device cannot do it.
+ **/
+uint16_t
+ptp_getobject_chunked (PTPParams* params, uint32_t handle, uint64_t size,
+			uint32_t chunk, uint64_t *offset,
+			PTPDataSinkFunc sink, void *priv)
+{
+	uint16_t ret;
+	uint32_t n, len;
+
+	if (!ptp_operation_issupported(params, PTP_OC_GetPartialObject) ||
+	    (size>0xffffffffULL && !ptp_operation_issupported(params,
+	    PTP_OC_ANDROID_GetPartialObject64)))
+		return PTP_RC_OperationNotSupported;
+	if (chunk==0)
+		chunk=PTP_PARTIAL_CHUNK_LEN;
+	while (*offset<size) {
+		n=size-*offset<chunk?(uint32_t)(size-*offset):chunk;
+		ret=ptp_getpartialobject_sink(params, handle, *offset, n,
+			sink, priv, &len);
+		if (ret!=PTP_RC_OK)
+			return ret;
+		/* a device sending nothing would keep us here forever */
+		if (len==0 || len>n)
+			return PTP_ERROR_IO;
+		*offset+=len;
+	}
+	return PTP_RC_OK;
+}
+
 uint16_t
 ptp_getthumb (PTPParams* params, uint32_t handle,  char** object)
 {
@@ -669,6 +2237,47 @@ ptp_deleteobject (PTPParams* params, uint32_t handle,
 	return ptp_transaction(params, &ptp, PTP_DP_NODATA, 0, NULL);
 }
 
+/**
+ * ptp_deleteobject_batch:
+ * params:	PTPParams*
+ *		handles			- object handles
+ *		n			- how many
+ *		rc			- PTP_RC_* for each handle (returned),
+ *					  may be NULL
+ *		policy, done		- see ptp_batch()
+ *
+ * Deletes n objects back to back.
+ *
+ * Return values: PTP_RC_OK if all succeeded, the code of the first one
+ * failed otherwise, PTP_ERROR_IO with *done 0 if out of memory.
+ **/
+uint16_t
+ptp_deleteobject_batch (PTPParams* params, const uint32_t *handles,
+			unsigned int n, uint16_t *rc, int policy,
+			unsigned int *done)
+{
+	PTPBatchOp *ops;
+	uint16_t ret;
+	unsigned int i, run;
+
+	ptp_debug(params,"PTP: Deleting %u objects", n);
+	if (done!=NULL)
+		*done=0;
+	/* Param2, the ObjectFormatCode, is 0 */
+	ops=ptp_batch_handles(handles, n, PTP_OC_DeleteObject, 2,
+		PTP_DP_NODATA);
+	if (ops==NULL)
+		return PTP_ERROR_IO;
+	ret=ptp_batch_run(params, ops, n, policy, &run, NULL, NULL);
+	if (rc!=NULL)
+		for (i=0; i<run; i++)
+			rc[i]=ops[i].rc;
+	if (done!=NULL)
+		*done=run;
+	free(ops);
+	return ret;
+}
+
 /**
  * ptp_sendobjectinfo:
  * params:	PTPParams*
@@ -780,6 +2389,7 @@ ptp_getdevicepropdesc (PTPParams* params, uint16_t propcode,
 	PTPContainer ptp;
 	uint16_t ret;
 	char* dpd=NULL;
+	unsigned int len;
 
 	ptp_debug(params, "PTP: Obtaining Device Property Description for property 0x%04x", propcode);
 
@@ -787,9 +2397,9 @@ ptp_getdevicepropdesc (PTPParams* params, uint16_t propcode,
 	ptp.Code=PTP_OC_GetDevicePropDesc;
 	ptp.Param1=propcode;
 	ptp.Nparam=1;
-	ret=ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &dpd);
+	ret=ptp_transaction_pool(params, &ptp, &dpd, &len);
 	if (ret == PTP_RC_OK) ptp_unpack_DPD(params, dpd, devicepropertydesc);
-	free(dpd);
+	ptp_data_release(params, dpd, len);
 	return ret;
 }
 
@@ -800,17 +2410,30 @@ ptp_getdevicepropvalue (PTPParams* params, uint16_t propcode,
 {
 	PTPContainer ptp;
 	uint16_t ret;
+	unsigned char buf[PTP_DPV_BUF_LEN];
+	unsigned int len;
 	char* dpv=NULL;
 
 	ptp_debug(params, "PTP: Obtaining Device Property Value for property 0x%04x", propcode);
 
+	/* values are small, polling them needs no malloc() */
 	PTP_CNT_INIT(ptp);
 	ptp.Code=PTP_OC_GetDevicePropValue;
 	ptp.Param1=propcode;
 	ptp.Nparam=1;
-	ret=ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &dpv);
+	ret=ptp_transaction_buf(params, &ptp, buf, sizeof(buf), &len);
+	if (ret == PTP_RC_OK) ptp_unpack_DPV(params, (char *)buf, value,
+		datatype);
+	if (ret != PTP_ERROR_CAPACITY)
+		return ret;
+	/* a long array, ask again */
+	PTP_CNT_INIT(ptp);
+	ptp.Code=PTP_OC_GetDevicePropValue;
+	ptp.Param1=propcode;
+	ptp.Nparam=1;
+	ret=ptp_transaction_pool(params, &ptp, &dpv, &len);
 	if (ret == PTP_RC_OK) ptp_unpack_DPV(params, dpv, value, datatype);
-	free(dpv);
+	ptp_data_release(params, dpv, len);
 	return ret;
 }
 
@@ -835,16 +2458,35 @@ ptp_setdevicepropvalue (PTPParams* params, uint16_t propcode,
 	return ret;
 }
 
+/**
+ * ptp_sendgenericrequest:
+ * params:	PTPParams*
+ *		reqcode			- operation code
+ *		reqparams		- its 5 parameters, trailing 0s not sent
+ *		data			- data to send or received (returned)
+ *		direction		- PTP_DP_*
+ *		sendlen			- length of the data sent
+ *		getlen			- length of the data received
+ *					  (returned), may be NULL
+ *
+ * Sends any operation. Received data are in a buffer of at least *getlen
+ * bytes, to be free()d by the caller.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
 uint16_t
 ptp_sendgenericrequest (PTPParams* params, uint16_t reqcode,
-						uint32_t* reqparams, char** data, uint32_t direction, long sendlen)
+						uint32_t* reqparams, char** data, uint32_t direction, long sendlen,
+						unsigned int *getlen)
 {
 	PTPContainer ptp;
 	uint16_t ret=0;
-	char *dpv=NULL;
+	unsigned int len=0;
 	
 	if (direction == PTP_DP_GETDATA)
 		*data = NULL;
+	if (getlen!=NULL)
+		*getlen=0;
 
 	ptp_debug(params, "PTP: Sending generic Request 0x%04x", reqcode);
 
@@ -864,7 +2506,15 @@ ptp_sendgenericrequest (PTPParams* params, uint16_t reqcode,
 	if((ptp.Param5=reqparams[4]) != 0)
 		ptp.Nparam = 5;
 
-	ret=ptp_transaction(params, &ptp, direction, sendlen, data);
+	if (direction != PTP_DP_GETDATA)
+		return ptp_transaction(params, &ptp, direction, sendlen, data);
+	/* the pooled buffer is larger than the data, tell how long they are */
+	ret=ptp_transaction_pool(params, &ptp, data, &len);
+	if (ret!=PTP_RC_OK) {
+		ptp_data_release(params, *data, len);
+		*data=NULL;
+	} else if (getlen!=NULL)
+		*getlen=len;
 	return ret;
 }
 
@@ -1118,19 +2768,17 @@ ptp_canon_checkevent (PTPParams* params, PTPUSBEventContainer* event, int* iseve
 {
 	uint16_t ret;
 	PTPContainer ptp;
-	char *evdata = NULL;
+	unsigned char evdata[PTP_USB_BULK_HS_MAX_PACKET_LEN];
+	unsigned int len;
 	
 	*isevent=0;
 	PTP_CNT_INIT(ptp);
 	ptp.Code=PTP_OC_CANON_CheckEvent;
 	ptp.Nparam=0;
-	ret=ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &evdata);
-	if (evdata!=NULL) {
-		if (ret == PTP_RC_OK) {
-        		ptp_unpack_EC(params, evdata, event);
-    			*isevent=1;
-        	}
-		free(evdata);
+	ret=ptp_transaction_buf(params, &ptp, evdata, sizeof(evdata), &len);
+	if (ret == PTP_RC_OK && len>0) {
+		ptp_unpack_EC(params, (char *)evdata, event);
+		*isevent=1;
 	}
 	return ret;
 }
@@ -1306,14 +2954,15 @@ ptp_canon_getchanges (PTPParams* params, uint16_t** props, uint32_t* propnum)
 	uint16_t ret;
 	PTPContainer ptp;
 	char* data=NULL;
+	unsigned int len;
 	
 	PTP_CNT_INIT(ptp);
 	ptp.Code=PTP_OC_CANON_GetChanges;
 	ptp.Nparam=0;
-	ret=ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &data);
+	ret=ptp_transaction_pool(params, &ptp, &data, &len);
 	if (ret == PTP_RC_OK)
         	*propnum=ptp_unpack_uint16_t_array(params,data,0,props);
-	free(data);
+	ptp_data_release(params, data, len);
 	return ret;
 }
 
@@ -1348,6 +2997,7 @@ ptp_canon_getfolderentries (PTPParams* params, uint32_t store, uint32_t p2,
 	uint16_t ret;
 	PTPContainer ptp;
 	char *data = NULL;
+	unsigned int len;
 	
 	PTP_CNT_INIT(ptp);
 	ptp.Code=PTP_OC_CANON_GetFolderEntries;
@@ -1356,7 +3006,7 @@ ptp_canon_getfolderentries (PTPParams* params, uint32_t store, uint32_t p2,
 	ptp.Param3=parent;
 	ptp.Param4=handle;
 	ptp.Nparam=4;
-	ret=ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &data);
+	ret=ptp_transaction_pool(params, &ptp, &data, &len);
 	if (ret == PTP_RC_OK) {
 		int i;
 		*entnum=ptp.Param1;
@@ -1370,7 +3020,7 @@ ptp_canon_getfolderentries (PTPParams* params, uint32_t store, uint32_t p2,
 			ret=PTP_ERROR_IO; /* Cannot allocate memory */
 		}
 	}
-	free(data);
+	ptp_data_release(params, data, len);
 	return ret;
 }
 
@@ -1407,14 +3057,15 @@ ptp_nikon_checkevent (PTPParams* params, PTPUSBEventContainer** event, uint16_t*
 	uint16_t ret;
 	PTPContainer ptp;
 	char *evdata = NULL;
+	unsigned int len;
 	
 	PTP_CNT_INIT(ptp);
 	ptp.Code=PTP_OC_NIKON_CheckEvent;
 	ptp.Nparam=0;
 
-	ret = ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &evdata);
+	ret = ptp_transaction_pool(params, &ptp, &evdata, &len);
 	if (ret == PTP_RC_OK) ptp_nikon_unpack_EC(params, evdata, event, evnum);
-	free (evdata);
+	ptp_data_release(params, evdata, len);
 	return ret;
 }
 
@@ -1523,6 +3174,10 @@ ptp_perror(PTPParams* params, uint16_t error) {
 	{PTP_ERROR_BADPARAM,	  N_("PTP: Error: bad parameter")},
 	{PTP_ERROR_DATA_EXPECTED, N_("PTP: Protocol error: data expected")},
 	{PTP_ERROR_RESP_EXPECTED, N_("PTP: Protocol error: response expected")},
+	{PTP_ERROR_SINK,	  N_("PTP: Error: data sink failed")},
+	{PTP_ERROR_NOEVENT,	  N_("PTP: No event pending")},
+	{PTP_ERROR_CAPACITY,	  N_("PTP: Error: data phase exceeds buffer")},
+	{PTP_ERROR_CANCEL,	  N_("PTP: Error: transaction cancelled")},
 	{0, NULL}
 	};
 	static struct {
@@ -52,9 +52,103 @@ typedef struct _PTPContainer PTPContainer;
 /* PTP USB Bulk-Pipe container */
 /* USB bulk max max packet length for high speed endpoints */
 #define PTP_USB_BULK_HS_MAX_PACKET_LEN	512
+/* and for SuperSpeed ones */
+#define PTP_USB_BULK_SS_MAX_PACKET_LEN	1024
 #define PTP_USB_BULK_HDR_LEN		(2*sizeof(uint32_t)+2*sizeof(uint16_t))
 #define PTP_USB_BULK_PAYLOAD_LEN	(PTP_USB_BULK_HS_MAX_PACKET_LEN-PTP_USB_BULK_HDR_LEN)
 #define PTP_USB_BULK_REQ_LEN	(PTP_USB_BULK_HDR_LEN+5*sizeof(uint32_t))
+/* default chunk size used when streaming data phase to a sink (2MB) */
+#define PTP_USB_DATA_CHUNK_LEN	2097152
+/* default chunk size of ptp_getobject_chunked() (8MB) */
+#define PTP_PARTIAL_CHUNK_LEN	8388608
+
+/* receive buffer of ptp_getdevicepropvalue(), fits any string value */
+#define PTP_DPV_BUF_LEN		512
+
+/* data phase buffer pool: size classes of 256B, 1KB, ... 256KB and the
+   number of free buffers kept in each, see ptp_data_alloc() */
+#define PTP_BUFPOOL_MIN		256
+#define PTP_BUFPOOL_CLASSES	6
+#define PTP_BUFPOOL_DEPTH	4
+
+/* PTP/IP (CIPA DC-005) */
+#define PTPIP_PORT			15740
+#define PTPIP_VERSION			0x00010000
+#define PTPIP_HDR_LEN			(2*sizeof(uint32_t))
+/* the longest request, response or event packet */
+#define PTPIP_REQ_LEN			(PTPIP_HDR_LEN+10+5*sizeof(uint32_t))
+/* socket buffers of the command/data connection */
+#define PTPIP_SOCKBUF			(4*1024*1024)
+
+/* PTP/IP packet types */
+#define PTPIP_INIT_COMMAND_REQUEST	1
+#define PTPIP_INIT_COMMAND_ACK		2
+#define PTPIP_INIT_EVENT_REQUEST	3
+#define PTPIP_INIT_EVENT_ACK		4
+#define PTPIP_INIT_FAIL			5
+#define PTPIP_OPERATION_REQUEST		6
+#define PTPIP_OPERATION_RESPONSE	7
+#define PTPIP_EVENT			8
+#define PTPIP_START_DATA		9
+#define PTPIP_DATA			10
+#define PTPIP_CANCEL_TRANSACTION	11
+#define PTPIP_END_DATA			12
+#define PTPIP_PROBE_REQUEST		13
+#define PTPIP_PROBE_RESPONSE		14
+
+/* data phase field of an operation request */
+#define PTPIP_DATAPHASE_NONE		1	/* no data or data in */
+#define PTPIP_DATAPHASE_OUT		2
+
+/* virtual camera store used when no PTPVCamConfig is given */
+#define PTP_VCAM_OBJECTS		16
+#define PTP_VCAM_OBJECT_SIZE		(4*1024*1024)
+
+/* transaction deadlines, see ptp_transaction_deadline() */
+#define PTP_TIMEOUT_DEFAULT	5000	/* ms, commands and small data */
+#define PTP_TIMEOUT_CAPTURE	20000	/* ms, captures and event waits */
+#define PTP_TIMEOUT_MIN_RATE	1024	/* KB/s, slowest data phase allowed */
+#define PTP_TIMEOUT_EVENT_PUMP	250	/* ms, interrupt reads of the pump */
+
+/* transaction statistics, see ptp_stats_enable(): phases timed, latency
+   histogram buckets and operation codes kept apart */
+#define PTP_STATS_REQUEST	0
+#define PTP_STATS_DATA		1
+#define PTP_STATS_RESPONSE	2
+#define PTP_STATS_TOTAL		3
+#define PTP_STATS_PHASES	4
+#define PTP_STATS_BUCKETS	128
+#define PTP_STATS_OPCODES	64
+
+/* session tracing, see ptp_trace_start(): records kept by default and
+   record types */
+#define PTP_TRACE_RECORDS	65536
+#define PTP_TRACE_BEGIN		1	/* transaction, arg: transaction ID */
+#define PTP_TRACE_PHASE		2	/* code: PTP_STATS_* phase ended */
+#define PTP_TRACE_READ		3	/* read_func, arg: bytes */
+#define PTP_TRACE_WRITE		4	/* write_func or writev_func */
+#define PTP_TRACE_EVENT		5	/* code: event, arg: its Param1 */
+#define PTP_TRACE_RETRY		6	/* code: operation, arg: bytes */
+
+/* what a batch does after a failed operation, see ptp_batch() */
+#define PTP_BATCH_STOP		0	/* stops */
+#define PTP_BATCH_CONTINUE	1	/* goes on with the next one */
+
+/* error classes, see ptp_error_class() */
+#define PTP_ERRCLASS_NONE	0	/* PTP_RC_OK */
+#define PTP_ERRCLASS_FATAL	1	/* trying again will not help */
+#define PTP_ERRCLASS_BUSY	2	/* the device asks to try later */
+#define PTP_ERRCLASS_TRANSPORT	3	/* the transfer failed or got out
+					   of step */
+#define PTP_ERRCLASS_SESSION	4	/* session or transaction ID lost */
+
+/* recovery actions, see ptp_recover() */
+#define PTP_RECOVER_CLEAR_HALT	0x0001	/* clear halted pipes */
+#define PTP_RECOVER_RESYNC	0x0002	/* reopen the session */
+#define PTP_RECOVER_RESET	0x0004	/* class Device Reset, from the
+					   second attempt on */
+#define PTP_RECOVER_ANY_OP	0x0100	/* retry all operations, not only
+					   those safe to repeat */
 
 struct _PTPUSBBulkContainer {
 	uint32_t length;
@@ -177,6 +271,8 @@ typedef struct _PTPUSBEventContainer PTPUSBEventContainer;
 #define	PTP_OC_MTP_GetObjectReferences		0x9810
 #define	PTP_OC_MTP_SetObjectReferences		0x9811
 #define	PTP_OC_MTP_UpdateDeviceFirmware		0x9812
+/* Android MTP extension Operation Codes */
+#define PTP_OC_ANDROID_GetPartialObject64	0x95C1
 #define	PTP_OC_MTP_Skip			0x9820
 /* Nikon extensiion Operation Codes */
 #define PTP_OC_NIKON_DirectCapture	0x90C0
@@ -240,6 +336,10 @@ typedef struct _PTPUSBEventContainer PTPUSBEventContainer;
 #define PTP_ERROR_DATA_EXPECTED		0x02FE
 #define PTP_ERROR_RESP_EXPECTED		0x02FD
 #define PTP_ERROR_BADPARAM		0x02FC
+#define PTP_ERROR_SINK			0x02FB
+#define PTP_ERROR_NOEVENT		0x02FA
+#define PTP_ERROR_CAPACITY		0x02F9
+#define PTP_ERROR_CANCEL		0x02F8
 
 /* PTP Event Codes */
 
@@ -324,6 +424,9 @@ typedef struct _PTPObjectHandles PTPObjectHandles;
 #define PTP_HANDLER_SPECIAL	0xffffffff
 #define PTP_HANDLER_ROOT	0x00000000
 
+/* ObjectCompressedSize of objects of 4GB or more */
+#define PTP_OBJECT_SIZE_4GB	0xffffffff
+
 
 /* PTP objectinfo structure (returned by GetObjectInfo) */
 
@@ -331,7 +434,8 @@ struct _PTPObjectInfo {
 	uint32_t StorageID;
 	uint16_t ObjectFormat;
 	uint16_t ProtectionStatus;
-	uint32_t ObjectCompressedSize;
+	uint32_t ObjectCompressedSize;	/* PTP_OBJECT_SIZE_4GB: see
+					   ptp_object_size() */
 	uint16_t ThumbFormat;
 	uint32_t ThumbCompressedSize;
 	uint32_t ThumbPixWidth;
@@ -709,6 +813,9 @@ typedef struct _PTPCANONFolderEntry PTPCANONFolderEntry;
 #define	PTP_DPC_MTP_PlaybackObject		0xD411
 #define	PTP_DPC_MTP_PlaybackContainerIndex	0xD412
 
+/* MTP extension object property codes */
+#define PTP_OPC_ObjectSize			0xDC04
+
 /* Device Property Form Flag */
 
 #define PTP_DPFF_None			0x00
@@ -722,12 +829,78 @@ typedef struct _PTPCANONFolderEntry PTPCANONFolderEntry;
 /* Glue stuff starts here */
 
 typedef struct _PTPParams PTPParams;
+typedef struct _PTPEventPump PTPEventPump;
+typedef struct _PTPIPConnection PTPIPConnection;
+typedef struct _PTPVCam PTPVCam;
+typedef struct _PTPWireLog PTPWireLog;
+typedef struct _PTPStats PTPStats;
+typedef struct _PTPTrace PTPTrace;
+
+/* statistics of an operation code, see ptp_stats_get() */
+typedef struct _PTPOpStats PTPOpStats;
+struct _PTPOpStats {
+	uint16_t code;
+	unsigned long count;		/* transactions */
+	unsigned long errors;		/* not ending with PTP_RC_OK */
+	uint64_t bytes;			/* data phase bytes */
+	/* latency in us per phase, see ptp_stats_percentile() */
+	uint32_t hist[PTP_STATS_PHASES][PTP_STATS_BUCKETS];
+};
+
+/* free data phase buffers of a session, see ptp_data_alloc() */
+typedef struct _PTPBufPool PTPBufPool;
+struct _PTPBufPool {
+	unsigned char *buf[PTP_BUFPOOL_CLASSES][PTP_BUFPOOL_DEPTH];
+	unsigned int count[PTP_BUFPOOL_CLASSES];
+	unsigned long hits;		/* served from the pool */
+	unsigned long misses;		/* allocated */
+};
+
+/* an operation of a batch, see ptp_batch() */
+typedef struct _PTPBatchOp PTPBatchOp;
+struct _PTPBatchOp {
+	PTPContainer req;		/* request; the response on return */
+	uint16_t flags;			/* PTP_DP_NODATA or PTP_DP_GETDATA */
+	uint16_t rc;			/* PTP_RC_* of the operation */
+	char *data;			/* data phase received, NULL if none */
+	unsigned int len;
+};
+
+/* virtual camera, see ptp_vcam_open() */
+typedef struct _PTPVCamConfig PTPVCamConfig;
+struct _PTPVCamConfig {
+	unsigned int objects;		/* objects in the store */
+	uint64_t object_size;		/* bytes each */
+	uint16_t object_format;		/* PTP_OFC_*, 0 for EXIF/JPEG */
+	unsigned int latency;		/* us added to every transaction */
+	unsigned int bandwidth;		/* KB/s, 0 for unlimited */
+	unsigned int errors;		/* every that many bulk IN transfer
+					   fails, 0 for none */
+};
 
 /* raw write functions */
 typedef short (* PTPIOReadFunc)	(unsigned char *bytes, unsigned int size,
 				 void *data);
 typedef short (* PTPIOWriteFunc)(unsigned char *bytes, unsigned int size,
 				 void *data);
+/*
+ * Vectored write: sends all iovcnt buffers, in order, as one bulk
+ * transfer (no short packet in between, ZLP terminated if required).
+ */
+typedef struct _PTPIOVec PTPIOVec;
+struct _PTPIOVec {
+	unsigned char *base;
+	unsigned int len;
+};
+typedef short (* PTPIOWriteVFunc)(PTPIOVec *iov, int iovcnt, void *data);
+/*
+ * Transport provided data phase buffers (e.g. DMA-able memory the device
+ * may fill without an intermediate copy). Alloc returns NULL if it has
+ * nothing suitable and the library uses malloc()ed memory instead.
+ */
+typedef unsigned char* (* PTPIOBufAlloc)(unsigned int size, void *data);
+typedef void (* PTPIOBufFree)(unsigned char *buf, unsigned int size,
+				void *data);
 /*
  * This functions take PTP oriented arguments and send them over an
  * appropriate data layer doing byteorder conversion accordingly.
@@ -736,12 +909,61 @@ typedef uint16_t (* PTPIOSendReq)	(PTPParams* params, PTPContainer* req);
 typedef uint16_t (* PTPIOSendData)	(PTPParams* params, PTPContainer* ptp,
 					unsigned char *data, unsigned int size);
 typedef uint16_t (* PTPIOGetResp)	(PTPParams* params, PTPContainer* resp);
+/*
+ * Receives the data phase into *data, allocating it if NULL. If the
+ * caller provides the buffer, *getlen holds its capacity (0: unchecked);
+ * a longer data phase is read and dropped and PTP_ERROR_CAPACITY
+ * returned. The data phase length is returned in *getlen.
+ */
 typedef uint16_t (* PTPIOGetData)	(PTPParams* params, PTPContainer* ptp,
 					uint32_t *getlen,
 					unsigned char **data);
+/*
+ * Data sink receiving data phase chunk by chunk; offset is the position of
+ * the chunk within the data phase. Any return value other than PTP_RC_OK
+ * aborts passing data to the sink.
+ * The data phase length is returned in *getlen. On entry it holds the
+ * length the caller expects, or 0; that is used when the container cannot
+ * tell, i.e. for objects of 4GB or more.
+ */
+typedef uint16_t (* PTPDataSinkFunc)	(void *priv, unsigned char *data,
+					unsigned int size, uint64_t offset);
+typedef uint16_t (* PTPIOGetDataSink)	(PTPParams* params, PTPContainer* ptp,
+					uint64_t *getlen,
+					PTPDataSinkFunc sink, void *priv);
 /* debug functions */
 typedef void (* PTPErrorFunc) (void *data, const char *format, va_list args);
 typedef void (* PTPDebugFunc) (void *data, const char *format, va_list args);
+/* transport recovery functions: PTP_RC_OK or PTP_ERROR_IO */
+typedef short (* PTPIOControlFunc) (void *data);
+/* cancels the transaction in progress, see ptp_cancel() */
+typedef short (* PTPIOCancelFunc) (uint32_t transaction_id, void *data);
+
+/* a recovery attempt of a failed transaction, see ptp_recover() */
+typedef struct _PTPRecoverAttempt PTPRecoverAttempt;
+struct _PTPRecoverAttempt {
+	uint16_t code;			/* operation code */
+	uint16_t rc;			/* what it failed with */
+	int errclass;			/* PTP_ERRCLASS_* of rc */
+	unsigned int attempt;		/* 1 for the first recovery */
+	unsigned int actions;		/* PTP_RECOVER_* taken */
+	uint16_t action_rc;		/* how the last action taken ended,
+					   PTP_RC_OK if none was */
+	int retry;			/* the operation is repeated */
+	unsigned int delay;		/* ms waited before that */
+};
+typedef void (* PTPRecoverFunc) (void *priv, const PTPRecoverAttempt *attempt);
+
+/* error recovery policy of a session, see ptp_recover() */
+typedef struct _PTPRecovery PTPRecovery;
+struct _PTPRecovery {
+	unsigned int retries;		/* per transaction */
+	unsigned int backoff;		/* ms before the first retry */
+	unsigned int backoff_max;	/* ms, the doubling stops there */
+	unsigned int actions;		/* PTP_RECOVER_* allowed */
+	PTPRecoverFunc report;		/* told about every attempt, optional */
+	void *priv;			/* passed to report */
+};
 
 struct _PTPParams {
 	/* data layer byteorder */
@@ -777,6 +999,56 @@ struct _PTPParams {
 	PTPObjectHandles handles;
 	PTPObjectInfo * objectinfo;
 	PTPDeviceInfo deviceinfo;
+
+	/* members added since libptp2 1.2.0 follow, keep the ones above
+	   where they are */
+
+	/* Data layer packet and chunk sizes: bulk wMaxPacketSize and the
+	   size of a single read_func call when streaming data phase.
+	   0 selects PTP_USB_BULK_HS_MAX_PACKET_LEN and PTP_USB_DATA_CHUNK_LEN */
+	unsigned int	maxpacket;
+	unsigned int	chunk_size;
+
+	/* Transaction deadlines in ms: base timeout of a transaction, of
+	   a capture or an event wait (0 selects PTP_TIMEOUT_DEFAULT and
+	   PTP_TIMEOUT_CAPTURE) and the deadline of the transaction in
+	   progress, see ptp_timeout_left() */
+	unsigned int	timeout;
+	unsigned int	capture_timeout;
+	uint64_t	deadline;
+	/* set by ptp_cancel(), from any thread or a signal handler */
+	volatile int	cancel;
+
+	/* Data layer IO functions, optional */
+	PTPIOWriteVFunc	writev_func;
+	PTPIOBufAlloc	bufalloc_func;
+	PTPIOBufFree	buffree_func;
+	/* Data layer recovery functions, optional: clear halted pipes and
+	   send the class Device Reset request, see ptp_recover(); cancel
+	   the transaction in progress, see ptp_cancel() */
+	PTPIOControlFunc clearhalt_func;
+	PTPIOControlFunc reset_func;
+	PTPIOCancelFunc	cancel_func;
+
+	/* Custom IO functions, optional */
+	PTPIOGetDataSink getdatasink_func;
+
+	/* background event reader, see ptp_usb_event_pump_start() */
+	PTPEventPump * eventpump;
+	/* PTP/IP connection, see ptp_ptpip_connect() */
+	PTPIPConnection * ptpip;
+	/* virtual camera, see ptp_vcam_open() */
+	PTPVCam * vcam;
+	/* transfer log, see ptp_record_open() and ptp_replay_open() */
+	PTPWireLog * wirelog;
+	/* data phase buffers, see ptp_data_alloc() */
+	PTPBufPool bufpool;
+	/* transaction statistics, see ptp_stats_enable() */
+	PTPStats * stats;
+	/* session trace, see ptp_trace_start() */
+	PTPTrace * trace;
+	/* error recovery policy, see ptp_recover() */
+	PTPRecovery recovery;
 };
 
 /* last, but not least - ptp functions */
@@ -786,8 +1058,101 @@ uint16_t ptp_usb_senddata	(PTPParams* params, PTPContainer* ptp,
 uint16_t ptp_usb_getresp	(PTPParams* params, PTPContainer* resp);
 uint16_t ptp_usb_getdata	(PTPParams* params, PTPContainer* ptp,  
 				unsigned int *getlen, unsigned char **data);
+uint16_t ptp_usb_getdata_sink	(PTPParams* params, PTPContainer* ptp,
+				uint64_t *getlen,
+				PTPDataSinkFunc sink, void *priv);
+uint16_t ptp_usb_drain		(PTPParams* params, unsigned int ms);
 uint16_t ptp_usb_event_check	(PTPParams* params, PTPContainer* event);
 uint16_t ptp_usb_event_wait		(PTPParams* params, PTPContainer* event);
+uint16_t ptp_usb_event_pump_start	(PTPParams* params);
+void ptp_usb_event_pump_stop	(PTPParams* params);
+int ptp_usb_event_fd		(PTPParams* params);
+
+/* PTP/IP transport, ptpip.c */
+uint16_t ptp_ptpip_connect	(PTPParams* params, const char *host,
+				unsigned short port, const char *name);
+void ptp_ptpip_disconnect	(PTPParams* params);
+uint16_t ptp_ptpip_sendreq	(PTPParams* params, PTPContainer* req);
+uint16_t ptp_ptpip_senddata	(PTPParams* params, PTPContainer* ptp,
+				unsigned char *data, unsigned int size);
+uint16_t ptp_ptpip_getresp	(PTPParams* params, PTPContainer* resp);
+uint16_t ptp_ptpip_getdata	(PTPParams* params, PTPContainer* ptp,
+				unsigned int *getlen,
+				unsigned char **data);
+uint16_t ptp_ptpip_getdata_sink	(PTPParams* params, PTPContainer* ptp,
+				uint64_t *getlen,
+				PTPDataSinkFunc sink, void *priv);
+uint16_t ptp_ptpip_event_check	(PTPParams* params, PTPContainer* event);
+uint16_t ptp_ptpip_event_wait	(PTPParams* params, PTPContainer* event);
+
+/* virtual camera, vcam.c */
+uint16_t ptp_vcam_open		(PTPParams* params,
+				const PTPVCamConfig* config);
+void ptp_vcam_close		(PTPParams* params);
+
+/* wire level record and replay, wirelog.c */
+uint16_t ptp_record_open	(PTPParams* params, const char *filename);
+uint16_t ptp_replay_open	(PTPParams* params, const char *filename,
+				int realtime);
+uint16_t ptp_wirelog_close	(PTPParams* params);
+
+/* transaction statistics, stats.c */
+uint16_t ptp_stats_enable	(PTPParams* params);
+void ptp_stats_disable		(PTPParams* params);
+const PTPOpStats *ptp_stats_get	(PTPParams* params, unsigned int *n);
+uint32_t ptp_stats_percentile	(const PTPOpStats *stats, int phase,
+				unsigned int percent);
+void ptp_stats_begin		(PTPParams* params, uint16_t code);
+void ptp_stats_bytes		(PTPParams* params, uint64_t bytes);
+uint16_t ptp_stats_phase	(PTPParams* params, int phase, uint16_t rc);
+
+/* session tracing, trace.c */
+uint16_t ptp_trace_start	(PTPParams* params, unsigned int records);
+void ptp_trace_stop		(PTPParams* params);
+uint16_t ptp_trace_dump		(PTPParams* params, const char *filename);
+void ptp_trace_mark		(PTPParams* params, int type, uint16_t code,
+				uint32_t arg);
+uint64_t ptp_trace_now		(PTPParams* params);
+void ptp_trace_put		(PTPParams* params, int type, uint16_t code,
+				uint16_t rc, uint32_t arg, uint64_t ts,
+				uint32_t dur);
+
+/* error recovery, recover.c */
+int ptp_error_class		(uint16_t rc);
+int ptp_recover_retryable	(uint16_t code);
+unsigned int ptp_recover_delay	(const PTPRecovery *recovery,
+				unsigned int attempt);
+int ptp_recover			(PTPParams* params, uint16_t code,
+				uint16_t rc, unsigned int attempt,
+				int retry);
+
+unsigned int ptp_timeout	(PTPParams* params, uint16_t code,
+				uint64_t bytes);
+void ptp_transaction_deadline	(PTPParams* params, uint16_t code,
+				uint64_t bytes);
+int ptp_timeout_left		(PTPParams* params);
+void ptp_cancel			(PTPParams* params);
+int ptp_event_timeout		(PTPParams* params);
+
+unsigned char *ptp_data_alloc	(PTPParams* params, unsigned int size);
+void ptp_data_release		(PTPParams* params, void *buf,
+				unsigned int size);
+void ptp_bufpool_flush		(PTPParams* params);
+
+uint16_t ptp_transaction	(PTPParams* params, PTPContainer* ptp,
+				uint16_t flags, unsigned int sendlen,
+				char** data);
+uint16_t ptp_transaction_buf	(PTPParams* params, PTPContainer* ptp,
+				unsigned char *buf, unsigned int capacity,
+				unsigned int *getlen);
+uint16_t ptp_transaction_sink	(PTPParams* params, PTPContainer* ptp,
+				uint64_t size,
+				PTPDataSinkFunc sink, void *priv);
+uint16_t ptp_batch		(PTPParams* params, PTPBatchOp *ops,
+				unsigned int n, int policy,
+				unsigned int *done);
+void ptp_batch_release		(PTPParams* params, PTPBatchOp *ops,
+				unsigned int n);
 
 uint16_t ptp_getdeviceinfo	(PTPParams* params, PTPDeviceInfo* deviceinfo);
 
@@ -805,14 +1170,40 @@ uint16_t ptp_getobjecthandles 	(PTPParams* params, uint32_t storage,
 
 uint16_t ptp_getobjectinfo	(PTPParams *params, uint32_t handle,
 				PTPObjectInfo* objectinfo);
+uint16_t ptp_getobjectinfo_batch (PTPParams *params,
+				const uint32_t *handles, unsigned int n,
+				PTPObjectInfo *objectinfo, uint16_t *rc,
+				int policy, unsigned int *done);
 
 uint16_t ptp_getobject		(PTPParams *params, uint32_t handle,
 				char** object);
+uint16_t ptp_getobject_buf	(PTPParams *params, uint32_t handle,
+				unsigned char *buf, unsigned int capacity,
+				unsigned int *getlen);
+uint16_t ptp_getobject_sink	(PTPParams *params, uint32_t handle,
+				uint64_t size,
+				PTPDataSinkFunc sink, void *priv);
+uint16_t ptp_object_size	(PTPParams *params, uint32_t handle,
+				PTPObjectInfo *oi, uint64_t *size);
+uint16_t ptp_getpartialobject	(PTPParams *params, uint32_t handle,
+				uint32_t offset, uint32_t maxbytes,
+				char** object, uint32_t *len);
+uint16_t ptp_getpartialobject_sink (PTPParams *params, uint32_t handle,
+				uint64_t offset, uint32_t maxbytes,
+				PTPDataSinkFunc sink, void *priv,
+				uint32_t *len);
+uint16_t ptp_getobject_chunked	(PTPParams *params, uint32_t handle,
+				uint64_t size, uint32_t chunk,
+				uint64_t *offset,
+				PTPDataSinkFunc sink, void *priv);
 uint16_t ptp_getthumb		(PTPParams *params, uint32_t handle,
 				char** object);
 
 uint16_t ptp_deleteobject	(PTPParams* params, uint32_t handle,
 				uint32_t ofc);
+uint16_t ptp_deleteobject_batch	(PTPParams* params,
+				const uint32_t *handles, unsigned int n,
+				uint16_t *rc, int policy, unsigned int *done);
 
 uint16_t ptp_sendobjectinfo	(PTPParams* params, uint32_t* store,
 				uint32_t* parenthandle, uint32_t* handle,
@@ -833,7 +1224,8 @@ uint16_t ptp_setdevicepropvalue (PTPParams* params, uint16_t propcode,
 
 uint16_t ptp_sendgenericrequest (PTPParams* params, uint16_t reqcode,
 				uint32_t* reqparams, char** data,
-				uint32_t direction, long sendlen);
+				uint32_t direction, long sendlen,
+				unsigned int *getlen);
 
 
 uint16_t ptp_ek_sendfileobjectinfo (PTPParams* params, uint32_t* store,
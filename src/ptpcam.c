@@ -27,11 +27,16 @@
 #include <unistd.h>
 #include <signal.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <utime.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <usb.h>
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>
+#endif
+#include <limits.h>
 
 #ifdef ENABLE_NLS
 #  include <libintl.h>
@@ -56,11 +61,6 @@
 
 /* some defines comes here */
 
-/* USB interface class */
-#ifndef USB_CLASS_PTP
-#define USB_CLASS_PTP		6
-#endif
-
 /* USB control message data phase direction */
 #ifndef USB_DP_HTD
 #define USB_DP_HTD		(0x00 << 7)	/* host to device */
@@ -70,6 +70,9 @@
 #endif
 
 /* PTP class specific requests */
+#ifndef USB_REQ_CANCEL
+#define USB_REQ_CANCEL			0x64
+#endif
 #ifndef USB_REQ_DEVICE_RESET
 #define USB_REQ_DEVICE_RESET		0x66
 #endif
@@ -82,19 +85,49 @@
 #define USB_FEATURE_HALT	0x00
 #endif
 
-/* OUR APPLICATION USB URB (2MB) ;) */
-#define PTPCAM_USB_URB		2097152
-
-#define USB_TIMEOUT		5000
-#define USB_CAPTURE_TIMEOUT	20000
-
 /* one global variable (yes, I know it sucks) */
 short verbose=0;
-/* the other one, it sucks definitely ;) */
-int ptpcam_usb_timeout = USB_TIMEOUT;
+/* base transaction timeout in ms selected by --timeout, 0: default */
+unsigned int ptpcam_timeout = 0;
+/* USB transport selected by --transport */
+int ptpcam_transport = PTPCAM_TRANSPORT_LIBUSB;
+int ptpcam_usb_queue = PTPCAM_USB_QUEUE;
+/* PTP/IP responder selected by --ptpip, HOST[:PORT] */
+char *ptpcam_ptpip_host = NULL;
+/* virtual camera selected by --vcam */
+PTPVCamConfig ptpcam_vcam = {PTP_VCAM_OBJECTS, PTP_VCAM_OBJECT_SIZE, 0, 0, 0, 0};
+/* transfer logs selected by --record and --replay */
+char *ptpcam_record = NULL;
+char *ptpcam_replay = NULL;
+int ptpcam_replay_realtime = 0;
+/* bulk transfer size selected by --chunk-size */
+unsigned int ptpcam_usb_urb = PTPCAM_USB_URB;
+/* GetPartialObject chunk selected by --partial, 0: whole objects */
+uint32_t ptpcam_partial = 0;
+/* --get-all-cameras: writer threads and virtual cameras (--vcam=cameras=N) */
+int ptpcam_writers = PTPCAM_WRITERS;
+int ptpcam_vcam_cameras = 1;
+/* transaction statistics printed by close_camera(), see --stats */
+int ptpcam_stats = 0;
+/* session trace written by close_camera(), see --trace */
+char *ptpcam_trace = NULL;
+/* error recovery, see --retries and --reset-on-error */
+unsigned int ptpcam_retries = PTPCAM_RETRIES;
+int ptpcam_reset_on_error = 0;
+/* device selected by --serial or --id instead of --bus/--dev */
+char *ptpcam_serial = NULL;
+uint16_t ptpcam_id_vendor = 0;
+uint16_t ptpcam_id_product = 0;
 
 /* we need it for a proper signal handling :/ */
 PTPParams* globalparams;
+PTP_USB* globalptp_usb;
+/* set by the first SIGINT, loops over objects stop there */
+volatile sig_atomic_t ptpcam_interrupted = 0;
+/* --get-all-cameras: the sessions downloading at once, all of them are
+   cancelled by SIGINT */
+static PTPParams **ptpcam_sessions = NULL;
+static volatile sig_atomic_t ptpcam_nsessions = 0;
 
 
 void
@@ -110,8 +143,11 @@ help()
 	printf("Options:\n"
 	"  --bus=BUS-NUMBER             USB bus number\n"
 	"  --dev=DEV-NUMBER             USB assigned device number\n"
+	"  --serial=SERIAL              Camera with this USB serial number\n"
+	"  --id=VID:PID                 Camera with this USB vendor/product ID (hex)\n"
 	"  -r, --reset                  Reset the device\n"
 	"  -l, --list-devices           List all PTP devices\n"
+	"  --monitor                    Print USB devices as they come and go\n"
 	"                               \n"
 	"  -i, --info                   Show device info\n"
 	"  -o, --list-operations        List all supported operations\n"
@@ -131,6 +167,9 @@ help()
 	"  -L, --list-files             List all files\n"
 	"  -g, --get-file=HANDLE        Get file by given handler\n"
 	"  -G, --get-all-files          Get all files\n"
+	"  --get-all-cameras            Get all files of every camera at once, each\n"
+	"                               into a directory named by its bus-dev\n"
+	"  --writers=N                  Threads writing files for --get-all-cameras\n"
 	"                               \n"
 	"  -d, --delete-object=HANDLE   Delete object (file) by given handle\n"
 	"  -D, --delete-all-files       Delete all files form camera\n"
@@ -160,6 +199,36 @@ help()
 	"  --overwrite                  Force file overwrite while saving"
 					"to disk\n"
 	"  -f, --force                  Talk to non PTP devices\n"
+	"  --transport=NAME             USB transport: libusb (default), libusb1\n"
+	"                               or usbfs (Linux only)\n"
+	"  --queue-depth=N              Bulk transfers kept in flight by libusb1\n"
+	"                               and usbfs\n"
+	"  --chunk-size=N               USB bulk transfer size in bytes (default 2MB)\n"
+	"  --probe-chunk                Find the fastest --chunk-size for the camera\n"
+	"  --partial[=SIZE]             Download objects SIZE bytes at a time (default\n"
+	"                               8MB), going on after errors\n"
+	"  --ptpip=HOST[:PORT]          Talk to a PTP/IP camera instead of USB\n"
+	"  --vcam[=KEY=VAL,...]         Talk to a virtual camera instead of USB;\n"
+	"                               keys: objects, size, format, latency (us),\n"
+	"                               bandwidth (KB/s), errors (every Nth\n"
+	"                               transfer fails) and cameras (for\n"
+	"                               --get-all-cameras)\n"
+	"  --record=FILE                Log all USB transfers to FILE\n"
+	"  --replay=FILE                Play a --record log back instead of USB\n"
+	"  --replay-realtime            Keep the recorded timing while replaying\n"
+	"  --timeout=MS                 Base timeout of a transaction (default 5000),\n"
+	"                               data phases get more time per byte\n"
+	"  --stats                      Print per operation latency statistics\n"
+	"                               (libptp2 configured with --enable-stats)\n"
+	"  --trace=FILE                 Write a timeline of the session to FILE\n"
+	"                               (Chrome trace JSON, see ui.perfetto.dev)\n"
+	"  --retries=N                  Retry failed transactions N times (default\n"
+	"                               3), 0 for no error recovery at all\n"
+	"  --reset-on-error             Reset the camera if retrying does not help\n"
+	"  --daemon=SOCKET              Keep the session open, serving the commands\n"
+	"                               of ptpcam --socket=SOCKET until killed\n"
+	"  --socket=SOCKET              Have the ptpcam --daemon on SOCKET run the\n"
+	"                               command (also PTPCAM_SOCKET)\n"
 	"  -v, --verbose                Be verbose (print more debug)\n"
 	"  -h, --help                   Print this help message\n"
 	"\n");
@@ -196,17 +265,32 @@ display_hexdump(char *data, size_t size)
 void
 ptpcam_siginthandler(int signum)
 {
-    PTP_USB* ptp_usb=(PTP_USB *)globalparams->data;
-    struct usb_device *dev=usb_device(ptp_usb->handle);
+    PTP_USB* ptp_usb=globalptp_usb;
+    struct usb_device *dev=NULL;
 
-    if (signum==SIGINT)
-    {
-	/* hey it's not that easy though... but at least we can try! */
-	printf("Got SIGINT, trying to clean up and close...\n");
-	usleep(5000);
-	close_camera (ptp_usb, globalparams, dev);
-	exit (-1);
+    if (signum!=SIGINT)
+	return;
+    /* the first one cancels the transfer, the session is closed as usual */
+    if (!ptpcam_interrupted && globalparams!=NULL) {
+	int i;
+
+	ptpcam_interrupted=1;
+	for (i=0; i<ptpcam_nsessions; i++)
+	    ptp_cancel(ptpcam_sessions[i]);
+	ptp_cancel(globalparams);
+	return;
     }
+    /* no camera open, e.g. while list_devices probes */
+    if (ptp_usb==NULL || globalparams==NULL)
+	exit (-1);
+    if (ptp_usb->handle!=NULL)
+	dev=usb_device(ptp_usb->handle);
+
+    /* hey it's not that easy though... but at least we can try! */
+    printf("Got SIGINT, trying to clean up and close...\n");
+    usleep(5000);
+    close_camera (ptp_usb, globalparams, dev);
+    exit (-1);
 }
 
 static short
@@ -219,17 +303,20 @@ ptp_read_func (unsigned char *bytes, unsigned int size, void *data)
 
 	do {
 		bytes+=toread;
-		if (rbytes>PTPCAM_USB_URB) 
-			toread = PTPCAM_USB_URB;
+		if (rbytes>ptp_usb->urb) 
+			toread = ptp_usb->urb;
 		else
 			toread = rbytes;
-		result=USB_BULK_READ(ptp_usb->handle, ptp_usb->inep,(char *)bytes, toread,ptpcam_usb_timeout);
+		result=USB_BULK_READ(ptp_usb->handle, ptp_usb->inep,(char *)bytes, toread,ptp_timeout_left(ptp_usb->params));
 		/* sometimes retry might help */
-		if (result==0)
-			result=USB_BULK_READ(ptp_usb->handle, ptp_usb->inep,(char *)bytes, toread,ptpcam_usb_timeout);
+		if (result==0) {
+			ptp_trace_mark(ptp_usb->params, PTP_TRACE_RETRY, 0,
+				toread);
+			result=USB_BULK_READ(ptp_usb->handle, ptp_usb->inep,(char *)bytes, toread,ptp_timeout_left(ptp_usb->params));
+		}
 		if (result < 0)
 			break;
-		rbytes-=PTPCAM_USB_URB;
+		rbytes-=ptp_usb->urb;
 	} while (rbytes>0);
 
 	if (result >= 0) {
@@ -248,7 +335,7 @@ ptp_write_func (unsigned char *bytes, unsigned int size, void *data)
 	int result;
 	PTP_USB *ptp_usb=(PTP_USB *)data;
 
-	result=USB_BULK_WRITE(ptp_usb->handle,ptp_usb->outep,(char *)bytes,size,ptpcam_usb_timeout);
+	result=USB_BULK_WRITE(ptp_usb->handle,ptp_usb->outep,(char *)bytes,size,ptp_timeout_left(ptp_usb->params));
 	if (result >= 0)
 		return (PTP_RC_OK);
 	else 
@@ -265,9 +352,9 @@ ptp_check_int (unsigned char *bytes, unsigned int size, void *data)
 	int result;
 	PTP_USB *ptp_usb=(PTP_USB *)data;
 
-	result=USB_BULK_READ(ptp_usb->handle, ptp_usb->intep,(char *)bytes,size,ptpcam_usb_timeout);
+	result=USB_BULK_READ(ptp_usb->handle, ptp_usb->intep,(char *)bytes,size,ptp_event_timeout(ptp_usb->params));
 	if (result==0)
-	    result=USB_BULK_READ(ptp_usb->handle, ptp_usb->intep,(char *)bytes,size,ptpcam_usb_timeout);
+	    result=USB_BULK_READ(ptp_usb->handle, ptp_usb->intep,(char *)bytes,size,ptp_event_timeout(ptp_usb->params));
 	if (verbose>2) fprintf (stderr, "USB_BULK_READ returned %i, size=%i\n", result, size);
 
 	if (result >= 0) {
@@ -302,11 +389,159 @@ ptpcam_error (void *data, const char *format, va_list args)
 
 
 
+/*
+ * Sets the bulk transfer size (rounded down to whole packets) and the
+ * library chunk size; the asynchronous transports get a chunk big enough
+ * to keep all of their queue busy.
+ */
 void
-init_ptp_usb (PTPParams* params, PTP_USB* ptp_usb, struct usb_device* dev)
+set_chunk_size (PTPParams* params, PTP_USB* ptp_usb, unsigned int urb)
+{
+	unsigned int packet=ptp_usb->maxpacket>0?
+		ptp_usb->maxpacket:PTP_USB_BULK_HS_MAX_PACKET_LEN;
+
+	urb-=urb%packet;
+	if (urb==0) urb=packet;
+	ptp_usb->urb=urb;
+	params->chunk_size=urb;
+	if (ptpcam_transport!=PTPCAM_TRANSPORT_LIBUSB)
+		params->chunk_size=urb*ptpcam_usb_queue;
+}
+
+/* --stats and --trace: starts watching the session set up in params */
+static void
+start_instrument (PTPParams *params)
+{
+	if (ptpcam_stats)
+		ptp_stats_enable(params);
+	if (ptpcam_trace!=NULL && ptp_trace_start(params, 0)!=PTP_RC_OK)
+		fprintf(stderr,"ERROR: Could not start tracing!\n");
+}
+
+/* the --retries policy; a backoff of it also paces retries outside it */
+static void
+recovery_policy (PTPRecovery *r)
+{
+	memset(r, 0, sizeof(PTPRecovery));
+	if (ptpcam_retries==0)
+		return;
+	r->retries=ptpcam_retries;
+	r->backoff=PTPCAM_BACKOFF;
+	r->backoff_max=PTPCAM_BACKOFF_MAX;
+	r->actions=PTP_RECOVER_CLEAR_HALT|PTP_RECOVER_RESYNC;
+	if (ptpcam_reset_on_error)
+		r->actions|=PTP_RECOVER_RESET;
+}
+
+/* waits before retry attempt of something the library does not retry */
+static void
+recovery_backoff (unsigned int attempt)
+{
+	PTPRecovery r;
+
+	recovery_policy(&r);
+	usleep(ptp_recover_delay(&r, attempt)*1000);
+}
+
+/* tells about every recovery attempt of the library */
+static void
+recovery_report (void *priv, const PTPRecoverAttempt *a)
+{
+	PTPParams *params=(PTPParams *)priv;
+	const char *name=ptp_get_operation_name(params, a->code);
+
+	if (name!=NULL)
+		fprintf(stderr, "PTP: %s failed (0x%04x)", name, a->rc);
+	else
+		fprintf(stderr, "PTP: operation 0x%04x failed (0x%04x)",
+			a->code, a->rc);
+	if (a->actions&PTP_RECOVER_CLEAR_HALT)
+		fprintf(stderr, ", pipes cleared");
+	if (a->actions&PTP_RECOVER_RESET)
+		fprintf(stderr, ", device reset");
+	if (a->actions&PTP_RECOVER_RESYNC)
+		fprintf(stderr, ", session reopened");
+	if (a->action_rc!=PTP_RC_OK)
+		fprintf(stderr, " (failed: 0x%04x)", a->action_rc);
+	if (a->retry)
+		fprintf(stderr, ", retry %u in %ums", a->attempt, a->delay);
+	fprintf(stderr, "\n");
+}
+
+/* recovery functions of the USB transports, see ptp_recover() */
+static short
+recovery_clear_halt (void *data)
+{
+	clear_stall((PTP_USB *)data);
+	return PTP_RC_OK;
+}
+
+static short
+recovery_reset (void *data)
+{
+	return usb_ptp_device_reset((PTP_USB *)data)<0?
+		PTP_ERROR_IO:PTP_RC_OK;
+}
+
+/*
+ * the class Cancel request, see ptp_cancel(): what the device sent before
+ * it saw the request is drained, then it is waited for to be ready
+ */
+static short
+usb_cancel (uint32_t transaction_id, void *data)
+{
+	PTP_USB *ptp_usb=(PTP_USB *)data;
+	unsigned char req[6];
+	uint16_t devstatus[2];
+	int i;
+
+	htole16a(req, PTP_EC_CancelTransaction);
+	htole32a(req+2, transaction_id);
+	if (usb_ptp_cancel(ptp_usb, req)<0)
+		return PTP_ERROR_IO;
+	ptp_usb_drain(ptp_usb->params, PTPCAM_CANCEL_DRAIN);
+	clear_stall(ptp_usb);
+	for (i=0; i<PTPCAM_CANCEL_POLLS; i++) {
+		devstatus[0]=devstatus[1]=0;
+		if (usb_ptp_get_device_status(ptp_usb, devstatus)<0)
+			return PTP_ERROR_IO;
+		if (devstatus[1]==PTP_RC_OK)
+			return PTP_RC_OK;
+		usleep(PTPCAM_CANCEL_POLL_MS*1000);
+	}
+	return PTP_RC_DeviceBusy;
+}
+
+/*
+ * the event pump, unless the transport is libusb-0.1, which must not
+ * read the interrupt pipe while another thread does bulk transfers
+ */
+static void
+start_event_pump (PTPParams *params)
+{
+	if (ptpcam_transport!=PTPCAM_TRANSPORT_LIBUSB)
+		ptp_usb_event_pump_start(params);
+}
+
+/* --retries: sets up error recovery of the session set up in params */
+static void
+start_recovery (PTPParams *params)
+{
+	recovery_policy(&params->recovery);
+	params->recovery.report=recovery_report;
+	params->recovery.priv=params;
+}
+
+/*
+ * sets up params to talk to dev through the transport selected; it keeps
+ * to params and ptp_usb, so that probe threads may call it at once
+ */
+static void
+init_usb_transport (PTPParams* params, PTP_USB* ptp_usb, struct usb_device* dev)
 {
 	usb_dev_handle *device_handle;
 
+	memset(params, 0, sizeof(PTPParams));
 	params->write_func=ptp_write_func;
 	params->read_func=ptp_read_func;
 	params->check_int_func=ptp_check_int;
@@ -317,9 +552,57 @@ init_ptp_usb (PTPParams* params, PTP_USB* ptp_usb, struct usb_device* dev)
 	params->senddata_func=ptp_usb_senddata;
 	params->getresp_func=ptp_usb_getresp;
 	params->getdata_func=ptp_usb_getdata;
+	params->getdatasink_func=ptp_usb_getdata_sink;
+	params->event_check=ptp_usb_event_check;
+	params->event_wait=ptp_usb_event_wait;
 	params->data=ptp_usb;
 	params->transaction_id=0;
 	params->byteorder = PTP_DL_LE;
+	params->maxpacket=ptp_usb->maxpacket;
+	set_chunk_size(params, ptp_usb, ptpcam_usb_urb);
+	params->timeout=ptpcam_timeout;
+	params->clearhalt_func=recovery_clear_halt;
+	params->reset_func=recovery_reset;
+	params->cancel_func=usb_cancel;
+	ptp_usb->params=params;
+	ptp_usb->handle=NULL;
+	ptp_usb->usb1=NULL;
+	ptp_usb->usbfs=NULL;
+
+#ifdef HAVE_USBFS
+	if (ptpcam_transport==PTPCAM_TRANSPORT_USBFS) {
+		int ret;
+
+		params->write_func=myusb_write_func;
+		params->writev_func=myusb_writev_func;
+		params->read_func=myusb_read_func;
+		params->check_int_func=myusb_check_int;
+		params->check_int_fast_func=myusb_check_int;
+		params->bufalloc_func=myusb_bufalloc;
+		params->buffree_func=myusb_buffree;
+		if ((ret=myusb_open(ptp_usb, dev, ptpcam_usb_queue,
+			params->chunk_size))<0)
+			fprintf(stderr, "ERROR: usbfs open failed: %s\n",
+				strerror(-ret));
+		return;
+	}
+#endif
+
+#ifdef HAVE_LIBUSB1
+	if (ptpcam_transport==PTPCAM_TRANSPORT_LIBUSB1) {
+		int ret;
+
+		params->write_func=ptp_usb1_write_func;
+		params->writev_func=ptp_usb1_writev_func;
+		params->read_func=ptp_usb1_read_func;
+		params->check_int_func=ptp_usb1_check_int;
+		params->check_int_fast_func=ptp_usb1_check_int;
+		if ((ret=ptp_usb1_open(ptp_usb, dev, ptpcam_usb_queue))<0)
+			fprintf(stderr, "ERROR: libusb-1.0 open failed: %s\n",
+				ptp_usb1_strerror(ret));
+		return;
+	}
+#endif
 
 	if ((device_handle=usb_open(dev))){
 		if (!device_handle) {
@@ -331,7 +614,38 @@ init_ptp_usb (PTPParams* params, PTP_USB* ptp_usb, struct usb_device* dev)
 		usb_claim_interface(device_handle,
 			dev->config->interface->altsetting->bInterfaceNumber);
 	}
+}
+
+void
+init_ptp_usb (PTPParams* params, PTP_USB* ptp_usb, struct usb_device* dev)
+{
+	init_usb_transport(params, ptp_usb, dev);
+	start_instrument(params);
+	start_recovery(params);
 	globalparams=params;
+	globalptp_usb=ptp_usb;
+}
+
+/* wraps the transport set up in params into the --record log */
+static int
+start_record (PTPParams *params)
+{
+	if (ptpcam_record==NULL)
+		return 0;
+	if (ptp_record_open(params, ptpcam_record)!=PTP_RC_OK) {
+		fprintf(stderr,"ERROR: Could not record to %s!\n",
+			ptpcam_record);
+		return -1;
+	}
+	return 0;
+}
+
+/* ends --record or --replay */
+static void
+stop_record (PTPParams *params)
+{
+	if (ptp_wirelog_close(params)!=PTP_RC_OK && ptpcam_record!=NULL)
+		fprintf(stderr,"ERROR: %s is incomplete!\n", ptpcam_record);
 }
 
 void
@@ -340,6 +654,11 @@ clear_stall(PTP_USB* ptp_usb)
 	uint16_t status=0;
 	int ret;
 
+	/* no pipes to reset */
+	if (ptpcam_transport==PTPCAM_TRANSPORT_PTPIP ||
+	    ptpcam_transport==PTPCAM_TRANSPORT_VCAM ||
+	    ptpcam_transport==PTPCAM_TRANSPORT_REPLAY)
+		return;
 	/* check the inep status */
 	ret=usb_get_endpoint_status(ptp_usb,ptp_usb->inep,&status);
 	if (ret<0) perror ("inep: usb_get_endpoint_status()");
@@ -370,69 +689,105 @@ void
 close_usb(PTP_USB* ptp_usb, struct usb_device* dev)
 {
 	//clear_stall(ptp_usb);
+	if (ptp_usb->params!=NULL && ptp_usb->params->wirelog!=NULL)
+		stop_record(ptp_usb->params);
+	if (ptpcam_transport==PTPCAM_TRANSPORT_REPLAY)
+		return;
+	if (ptp_usb->params!=NULL && ptp_usb->params->ptpip!=NULL) {
+		ptp_ptpip_disconnect(ptp_usb->params);
+		return;
+	}
+	if (ptp_usb->params!=NULL && ptp_usb->params->vcam!=NULL) {
+		ptp_vcam_close(ptp_usb->params);
+		return;
+	}
+#ifdef HAVE_LIBUSB1
+	if (ptp_usb->usb1!=NULL) {
+		ptp_usb1_close(ptp_usb, 1);
+		return;
+	}
+#endif
+#ifdef HAVE_USBFS
+	if (ptp_usb->usbfs!=NULL) {
+		myusb_close(ptp_usb, 1);
+		return;
+	}
+#endif
         usb_release_interface(ptp_usb->handle,
                 dev->config->interface->altsetting->bInterfaceNumber);
 	usb_reset(ptp_usb->handle);
         usb_close(ptp_usb->handle);
 }
 
-
-struct usb_bus*
-init_usb()
+/* give the interface back without resetting the device */
+void
+release_usb(PTP_USB* ptp_usb, struct usb_device* dev)
 {
-	usb_init();
-	usb_find_busses();
-	usb_find_devices();
-	return (usb_get_busses());
+	if (ptp_usb->params!=NULL && ptp_usb->params->wirelog!=NULL)
+		stop_record(ptp_usb->params);
+	if (ptpcam_transport==PTPCAM_TRANSPORT_REPLAY)
+		return;
+	if (ptp_usb->params!=NULL && ptp_usb->params->ptpip!=NULL) {
+		ptp_ptpip_disconnect(ptp_usb->params);
+		return;
+	}
+	if (ptp_usb->params!=NULL && ptp_usb->params->vcam!=NULL) {
+		ptp_vcam_close(ptp_usb->params);
+		return;
+	}
+#ifdef HAVE_LIBUSB1
+	if (ptp_usb->usb1!=NULL) {
+		ptp_usb1_close(ptp_usb, 0);
+		return;
+	}
+#endif
+#ifdef HAVE_USBFS
+	if (ptp_usb->usbfs!=NULL) {
+		myusb_close(ptp_usb, 0);
+		return;
+	}
+#endif
+	usb_release_interface(ptp_usb->handle,
+		dev->config->interface->altsetting->bInterfaceNumber);
 }
 
+
 /*
    find_device() returns the pointer to a usb_device structure matching
    given busn, devicen numbers. If any or both of arguments are 0 then the
-   first matching PTP device structure is returned. 
+   first matching PTP device structure is returned. --serial and --id
+   select the device by its USB serial number or vendor/product ID instead.
+   The lookup is answered from the device registry, see devreg.c.
 */
 struct usb_device*
 find_device (int busn, int devicen, short force);
 struct usb_device*
 find_device (int busn, int devn, short force)
 {
-	struct usb_bus *bus;
-	struct usb_device *dev;
-
-	bus=init_usb();
-	for (; bus; bus = bus->next)
-	for (dev = bus->devices; dev; dev = dev->next)
-	if (dev->config)
-	if ((dev->config->interface->altsetting->bInterfaceClass==
-		USB_CLASS_PTP)||force)
-	if (dev->descriptor.bDeviceClass!=USB_CLASS_HUB)
-	{
-		int curbusn, curdevn;
+	PTPDevice *d;
 
-		curbusn=strtol(bus->dirname,NULL,10);
-		curdevn=strtol(dev->filename,NULL,10);
-
-		if (devn==0) {
-			if (busn==0) return dev;
-			if (curbusn==busn) return dev;
-		} else {
-			if ((busn==0)&&(curdevn==devn)) return dev;
-			if ((curbusn==busn)&&(curdevn==devn)) return dev;
-		}
-	}
-	return NULL;
+	if (ptpcam_serial!=NULL)
+		d=devreg_find_serial(ptpcam_serial, force);
+	else if (ptpcam_id_vendor!=0)
+		d=devreg_find_id(ptpcam_id_vendor, ptpcam_id_product, force);
+	else
+		d=devreg_find(busn, devn, force);
+	return d!=NULL?d->dev:NULL;
 }
 
 void
-find_endpoints(struct usb_device *dev, int* inep, int* outep, int* intep);
+find_endpoints(struct usb_device *dev, int* inep, int* outep, int* intep,
+	int* maxpacket);
 void
-find_endpoints(struct usb_device *dev, int* inep, int* outep, int* intep)
+find_endpoints(struct usb_device *dev, int* inep, int* outep, int* intep,
+	int* maxpacket)
 {
 	int i,n;
 	struct usb_endpoint_descriptor *ep;
 
 	ep = dev->config->interface->altsetting->endpoint;
 	n=dev->config->interface->altsetting->bNumEndpoints;
+	*maxpacket=0;
 
 	for (i=0;i<n;i++) {
 	if (ep[i].bmAttributes==USB_ENDPOINT_TYPE_BULK)	{
@@ -440,8 +795,10 @@ find_endpoints(struct usb_device *dev, int* inep, int* outep, int* intep)
 			USB_ENDPOINT_DIR_MASK)
 		{
 			*inep=ep[i].bEndpointAddress;
+			*maxpacket=ep[i].wMaxPacketSize&0x7ff;
 			if (verbose>1)
-				fprintf(stderr, "Found inep: 0x%02x\n",*inep);
+				fprintf(stderr, "Found inep: 0x%02x, "
+					"wMaxPacketSize %i\n",*inep,*maxpacket);
 		}
 		if ((ep[i].bEndpointAddress&USB_ENDPOINT_DIR_MASK)==0)
 		{
@@ -460,12 +817,180 @@ find_endpoints(struct usb_device *dev, int* inep, int* outep, int* intep)
 	}
 }
 
+/* connects to the PTP/IP camera given by --ptpip, *dev is NULL then */
+static int
+open_ptpip (PTP_USB *ptp_usb, PTPParams *params, struct usb_device **dev)
+{
+	char host[256], *port;
+	unsigned short portn=0;
+
+	*dev=NULL;
+	memset(ptp_usb, 0, sizeof(PTP_USB));
+	memset(params, 0, sizeof(PTPParams));
+	params->error_func=ptpcam_error;
+	params->debug_func=ptpcam_debug;
+	params->data=ptp_usb;
+	params->chunk_size=ptpcam_usb_urb;
+	params->timeout=ptpcam_timeout;
+	start_instrument(params);
+	start_recovery(params);
+	ptp_usb->params=params;
+	globalparams=params;
+	globalptp_usb=ptp_usb;
+
+	strncpy(host, ptpcam_ptpip_host, sizeof(host)-1);
+	host[sizeof(host)-1]='\0';
+	/* HOST:PORT, but not a bare IPv6 address */
+	port=strrchr(host, ':');
+	if (port!=NULL && strchr(host, ':')==port) {
+		*port++='\0';
+		portn=strtol(port, NULL, 10);
+	}
+	if (ptp_ptpip_connect(params, host, portn, "ptpcam")!=PTP_RC_OK) {
+		fprintf(stderr,"ERROR: Could not connect to %s!\n",
+			ptpcam_ptpip_host);
+		return -1;
+	}
+	if (ptp_opensession(params,1)!=PTP_RC_OK) {
+		fprintf(stderr,"ERROR: Could not open session!\n");
+		ptp_ptpip_disconnect(params);
+		return -1;
+	}
+	if (ptp_getdeviceinfo(params,&params->deviceinfo)!=PTP_RC_OK) {
+		fprintf(stderr,"ERROR: Could not get device info!\n");
+		ptp_ptpip_disconnect(params);
+		return -1;
+	}
+	return 0;
+}
+
+/* sets up the virtual camera given by --vcam, *dev is NULL then */
+static int
+open_vcam (PTP_USB *ptp_usb, PTPParams *params, struct usb_device **dev)
+{
+	*dev=NULL;
+	memset(ptp_usb, 0, sizeof(PTP_USB));
+	memset(params, 0, sizeof(PTPParams));
+	params->error_func=ptpcam_error;
+	params->debug_func=ptpcam_debug;
+	params->chunk_size=ptpcam_usb_urb;
+	params->timeout=ptpcam_timeout;
+	start_instrument(params);
+	start_recovery(params);
+	ptp_usb->params=params;
+	globalparams=params;
+	globalptp_usb=ptp_usb;
+
+	if (ptp_vcam_open(params, &ptpcam_vcam)!=PTP_RC_OK) {
+		fprintf(stderr,"ERROR: Could not set up the virtual camera!\n");
+		return -1;
+	}
+	if (start_record(params)<0) {
+		ptp_vcam_close(params);
+		return -1;
+	}
+	if (ptp_opensession(params,1)!=PTP_RC_OK) {
+		fprintf(stderr,"ERROR: Could not open session!\n");
+		ptp_vcam_close(params);
+		return -1;
+	}
+	if (ptp_getdeviceinfo(params,&params->deviceinfo)!=PTP_RC_OK) {
+		fprintf(stderr,"ERROR: Could not get device info!\n");
+		ptp_vcam_close(params);
+		return -1;
+	}
+	return 0;
+}
+
+/* plays the --replay log back, *dev is NULL then */
+static int
+open_replay (PTP_USB *ptp_usb, PTPParams *params, struct usb_device **dev)
+{
+	*dev=NULL;
+	memset(ptp_usb, 0, sizeof(PTP_USB));
+	memset(params, 0, sizeof(PTPParams));
+	params->error_func=ptpcam_error;
+	params->debug_func=ptpcam_debug;
+	params->timeout=ptpcam_timeout;
+	start_instrument(params);
+	/* the retries recorded are played back by retrying alike */
+	start_recovery(params);
+	ptp_usb->params=params;
+	globalparams=params;
+	globalptp_usb=ptp_usb;
+
+	if (ptp_replay_open(params, ptpcam_replay,
+	    ptpcam_replay_realtime)!=PTP_RC_OK) {
+		fprintf(stderr,"ERROR: Could not replay %s!\n",
+			ptpcam_replay);
+		return -1;
+	}
+	if (ptp_opensession(params,1)!=PTP_RC_OK) {
+		fprintf(stderr,"ERROR: Could not open session!\n");
+		ptp_wirelog_close(params);
+		return -1;
+	}
+	if (ptp_getdeviceinfo(params,&params->deviceinfo)!=PTP_RC_OK) {
+		fprintf(stderr,"ERROR: Could not get device info!\n");
+		ptp_wirelog_close(params);
+		return -1;
+	}
+	return 0;
+}
+
+/* parses --vcam=objects=N,size=S,format=F,latency=US,bandwidth=KBPS,errors=N,
+   cameras=N */
+static int
+parse_vcam (char *arg)
+{
+	char *opt, *val;
+
+	for (opt=strtok(arg, ","); opt!=NULL; opt=strtok(NULL, ",")) {
+		val=strchr(opt, '=');
+		if (val==NULL) {
+			fprintf(stderr,"ERROR: --vcam option '%s' needs a value\n",
+				opt);
+			return -1;
+		}
+		*val++='\0';
+		if (!strcmp(opt, "objects"))
+			ptpcam_vcam.objects=strtoul(val,NULL,0);
+		else if (!strcmp(opt, "size"))
+			ptpcam_vcam.object_size=strtoull(val,NULL,0);
+		else if (!strcmp(opt, "format"))
+			ptpcam_vcam.object_format=strtoul(val,NULL,0);
+		else if (!strcmp(opt, "latency"))
+			ptpcam_vcam.latency=strtoul(val,NULL,0);
+		else if (!strcmp(opt, "bandwidth"))
+			ptpcam_vcam.bandwidth=strtoul(val,NULL,0);
+		else if (!strcmp(opt, "errors"))
+			ptpcam_vcam.errors=strtoul(val,NULL,0);
+		else if (!strcmp(opt, "cameras"))
+			ptpcam_vcam_cameras=strtol(val,NULL,0);
+		else {
+			fprintf(stderr,"ERROR: unknown --vcam option '%s'\n",
+				opt);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 int
 open_camera (int busn, int devn, short force, PTP_USB *ptp_usb, PTPParams *params, struct usb_device **dev)
 {
 #ifdef DEBUG
 	printf("dev %i\tbus %i\n",devn,busn);
 #endif
+	/* the session is open already, see ptpcamd.c */
+	if (ptpcamd_serving())
+		return ptpcamd_lend(ptp_usb, params, dev);
+	if (ptpcam_transport==PTPCAM_TRANSPORT_PTPIP)
+		return open_ptpip(ptp_usb, params, dev);
+	if (ptpcam_transport==PTPCAM_TRANSPORT_VCAM)
+		return open_vcam(ptp_usb, params, dev);
+	if (ptpcam_transport==PTPCAM_TRANSPORT_REPLAY)
+		return open_replay(ptp_usb, params, dev);
 	
 	*dev=find_device(busn,devn,force);
 	if (*dev==NULL) {
@@ -473,9 +998,14 @@ open_camera (int busn, int devn, short force, PTP_USB *ptp_usb, PTPParams *param
 		"bus/dev numbers\n");
 		exit(-1);
 	}
-	find_endpoints(*dev,&ptp_usb->inep,&ptp_usb->outep,&ptp_usb->intep);
+	find_endpoints(*dev,&ptp_usb->inep,&ptp_usb->outep,&ptp_usb->intep,
+		&ptp_usb->maxpacket);
 
 	init_ptp_usb(params, ptp_usb, *dev);
+	if (start_record(params)<0) {
+		close_usb(ptp_usb, *dev);
+		return -1;
+	}
 	if (ptp_opensession(params,1)!=PTP_RC_OK) {
 		fprintf(stderr,"ERROR: Could not open session!\n");
 		close_usb(ptp_usb, *dev);
@@ -498,9 +1028,14 @@ theta_open_camera (int busn, int devn, short force, PTP_USB *ptp_usb, PTPParams
 		"bus/dev numbers\n");
 		exit(-1);
 	}
-	find_endpoints(*dev,&ptp_usb->inep,&ptp_usb->outep,&ptp_usb->intep);
+	find_endpoints(*dev,&ptp_usb->inep,&ptp_usb->outep,&ptp_usb->intep,
+		&ptp_usb->maxpacket);
 
 	init_ptp_usb(params, ptp_usb, *dev);
+	if (start_record(params)<0) {
+		close_usb(ptp_usb, *dev);
+		return -1;
+	}
 	if (ptp_opensession(params, 1)!=PTP_RC_OK) {
 		fprintf(stderr,"ERROR: Could not open session!\n");
 		close_usb(ptp_usb, *dev);
@@ -522,64 +1057,259 @@ theta_open_camera (int busn, int devn, short force, PTP_USB *ptp_usb, PTPParams
 	return 0;
 }
 
+/* --stats: per operation counts, bytes and latency percentiles */
+static void
+print_stats (PTPParams *params)
+{
+	const PTPOpStats *st;
+	const char *name;
+	unsigned int i, n, b;
+	char lat[24];
+	int p;
+
+	st=ptp_stats_get(params, &n);
+	if (st==NULL)
+		return;
+	printf("\nTransaction statistics, latency p50/p99 in us:\n");
+	printf("Operation                      Count Errors        Bytes"
+		"       Request          Data      Response         Total\n");
+	for (i=0; i<n; i++) {
+		name=ptp_get_operation_name(params, st[i].code);
+		printf("0x%04x %-20.20s %8lu %6lu %12llu", st[i].code,
+			name!=NULL?name:"UNKNOWN", st[i].count,
+			st[i].errors, (unsigned long long)st[i].bytes);
+		for (p=0; p<PTP_STATS_PHASES; p++) {
+			for (b=0; b<PTP_STATS_BUCKETS; b++)
+				if (st[i].hist[p][b]!=0)
+					break;
+			if (b==PTP_STATS_BUCKETS)
+				/* no data phase */
+				strcpy(lat, "-");
+			else
+				snprintf(lat, sizeof(lat), "%lu/%lu",
+					(unsigned long)ptp_stats_percentile(
+					&st[i], p, 50),
+					(unsigned long)ptp_stats_percentile(
+					&st[i], p, 99));
+			printf(" %13s", lat);
+		}
+		printf("\n");
+	}
+}
+
 void
 close_camera (PTP_USB *ptp_usb, PTPParams *params, struct usb_device *dev)
 {
+	ptp_usb_event_pump_stop(params);
+	if (ptpcamd_serving()) {
+		ptpcamd_return(params);
+		return;
+	}
+	/* a cancel nothing took any more must not fail CloseSession */
+	params->cancel=0;
 	if (ptp_closesession(params)!=PTP_RC_OK)
 		fprintf(stderr,"ERROR: Could not close session!\n");
+	if (verbose)
+		printf("Buffer pool: %lu hits, %lu misses\n",
+			params->bufpool.hits, params->bufpool.misses);
+	if (ptpcam_stats)
+		print_stats(params);
+	ptp_stats_disable(params);
+	if (params->trace!=NULL &&
+	    ptp_trace_dump(params, ptpcam_trace)!=PTP_RC_OK)
+		fprintf(stderr,"ERROR: Could not write %s!\n", ptpcam_trace);
+	ptp_trace_stop(params);
+	ptp_bufpool_flush(params);
 	close_usb(ptp_usb, dev);
 }
 
 
+/* a device list_devices talks to */
+typedef struct {
+	PTPDevice *d;
+	PTPDeviceInfo deviceinfo;
+	int gotinfo;
+	const char *error;	/* NULL if all went fine */
+} DeviceProbe;
+
+static void
+probe_device (DeviceProbe *p)
+{
+	PTPParams params;
+	PTP_USB ptp_usb;
+	struct usb_device *dev=p->d->dev;
+
+	find_endpoints(dev,&ptp_usb.inep,&ptp_usb.outep,
+		&ptp_usb.intep,&ptp_usb.maxpacket);
+	/* no globals, instrumentation or recovery for a probe */
+	init_usb_transport(&params, &ptp_usb, dev);
+	/* a dead camera shall not hold the listing up for long */
+	if (ptpcam_timeout==0)
+		params.timeout=PTPCAM_PROBE_TIMEOUT;
+
+	if (ptp_opensession(&params,1)!=PTP_RC_OK) {
+		p->error="Could not open session!\n"
+			"Try to reset the camera.\n";
+		ptp_bufpool_flush(&params);
+		release_usb(&ptp_usb, dev);
+		return;
+	}
+	if (ptp_getdeviceinfo(&params, &p->deviceinfo)!=PTP_RC_OK) {
+		p->error="Could not get device info!\n";
+		ptp_bufpool_flush(&params);
+		release_usb(&ptp_usb, dev);
+		return;
+	}
+	p->gotinfo=1;
+	if (ptp_closesession(&params)!=PTP_RC_OK) {
+		p->error="Could not close session!\n";
+		ptp_bufpool_flush(&params);
+		release_usb(&ptp_usb, dev);
+		return;
+	}
+	ptp_bufpool_flush(&params);
+	close_usb(&ptp_usb, dev);
+}
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+/* the devices to probe, taken by the probe threads one by one */
+typedef struct {
+	DeviceProbe *probes;
+	int n;
+	int next;
+	pthread_mutex_t lock;
+} ProbeQueue;
+
+static void *
+probe_thread (void *arg)
+{
+	ProbeQueue *q=(ProbeQueue *)arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		i=q->next++;
+		pthread_mutex_unlock(&q->lock);
+		if (i>=q->n)
+			return NULL;
+		probe_device(&q->probes[i]);
+	}
+}
+
+/* probes up to PTPCAM_PROBE_THREADS devices at once */
+static void
+probe_devices (DeviceProbe *probes, int n)
+{
+	pthread_t threads[PTPCAM_PROBE_THREADS-1];
+	ProbeQueue q;
+	int i, nthreads=0;
+
+	q.probes=probes;
+	q.n=n;
+	q.next=0;
+	pthread_mutex_init(&q.lock, NULL);
+	/* this thread is one of the probers */
+	while (nthreads<PTPCAM_PROBE_THREADS-1 && nthreads<n-1) {
+		if (pthread_create(&threads[nthreads], NULL, probe_thread,
+		    &q)!=0)
+			break;
+		nthreads++;
+	}
+	probe_thread(&q);
+	for (i=0; i<nthreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&q.lock);
+}
+#else
+static void
+probe_devices (DeviceProbe *probes, int n)
+{
+	int i;
+
+	for (i=0; i<n; i++)
+		probe_device(&probes[i]);
+}
+#endif
+
+/*
+   list_devices() probes all PTP devices at once, then lists them in bus
+   order
+*/
 void
 list_devices(short force)
 {
-	struct usb_bus *bus;
-	struct usb_device *dev;
-	int found=0;
+	DeviceProbe *probes;
+	PTPDevice *d;
+	int i, n, nprobes=0;
 
 
-	bus=init_usb();
-  	for (; bus; bus = bus->next)
-    	for (dev = bus->devices; dev; dev = dev->next) {
+	n=devreg_count();
+	probes=calloc(n>0?n:1, sizeof(DeviceProbe));
+	if (probes==NULL) {
+		perror("calloc");
+		return;
+	}
+	for (i=0; i<n; i++) {
+		d=devreg_device(i);
 		/* if it's a PTP device try to talk to it */
-		if (dev->config)
-		if ((dev->config->interface->altsetting->bInterfaceClass==
-			USB_CLASS_PTP)||force)
-		if (dev->descriptor.bDeviceClass!=USB_CLASS_HUB)
-		{
-			PTPParams params;
-			PTP_USB ptp_usb;
-			PTPDeviceInfo deviceinfo;
-
-			if (!found){
-				printf("\nListing devices...\n");
-				printf("bus/dev\tvendorID/prodID\tdevice model\n");
-				found=1;
-			}
-
-			find_endpoints(dev,&ptp_usb.inep,&ptp_usb.outep,
-				&ptp_usb.intep);
-			init_ptp_usb(&params, &ptp_usb, dev);
-
-			CC(ptp_opensession (&params,1),
-				"Could not open session!\n"
-				"Try to reset the camera.\n");
-			CC(ptp_getdeviceinfo (&params, &deviceinfo),
-				"Could not get device info!\n");
+		if (d->ptp||force)
+			probes[nprobes++].d=d;
+	}
+	probe_devices(probes, nprobes);
 
+	if (nprobes) {
+		printf("\nListing devices...\n");
+		printf("bus/dev\tvendorID/prodID\tdevice model\n");
+	}
+	for (i=0; i<nprobes; i++) {
+		d=probes[i].d;
+		if (probes[i].gotinfo)
       			printf("%s/%s\t0x%04X/0x%04X\t%s\n",
-				bus->dirname, dev->filename,
-				dev->descriptor.idVendor,
-				dev->descriptor.idProduct, deviceinfo.Model);
-
-			CC(ptp_closesession(&params),
-				"Could not close session!\n");
-			close_usb(&ptp_usb, dev);
-		}
+				d->bus->dirname, d->dev->filename,
+				d->vendor, d->product,
+				probes[i].deviceinfo.Model);
+		if (probes[i].error!=NULL)
+			fprintf(stderr,"ERROR: %s",probes[i].error);
 	}
-	if (!found) printf("\nFound no PTP devices\n");
+	if (!nprobes) printf("\nFound no PTP devices\n");
 	printf("\n");
+	free(probes);
+}
+
+static short monitor_force;
+
+static void
+print_device (PTPDevice *d, int arrived)
+{
+	if (!d->ptp && !monitor_force)
+		return;
+	/* the usb_device of one gone may be freed already */
+	printf("%s\t%03d/%03d\t0x%04X/0x%04X\t%s\n",
+		arrived?"added":"removed", d->busn, d->devn,
+		d->vendor, d->product, arrived?devreg_serial(d):d->serial);
+	fflush(stdout);
+}
+
+/*
+   monitor_devices() lists the cameras connected, then prints the ones
+   plugged in or out until interrupted
+*/
+void
+monitor_devices (short force)
+{
+	int i, n;
+
+	monitor_force=force;
+	/* no camera open, nothing for the handler to clean up */
+	signal(SIGINT, SIG_DFL);
+	printf("event\tbus/dev\tvendorID/prodID\tserial\n");
+	n=devreg_count();
+	for (i=0; i<n; i++)
+		print_device(devreg_device(i), 1);
+	while (devreg_poll(-1, print_device)>=0)
+		;
+	perror("poll");
+	devreg_close();
 }
 
 void
@@ -636,12 +1366,17 @@ capture_image (int busn, int devn, short force)
 	    if (ret==PTP_RC_OK) ExposureTime=(*(int32_t*)(dpd.CurrentValue))/10;
 	}
 
-	/* adjust USB timeout */
-	if (ExposureTime>USB_TIMEOUT) ptpcam_usb_timeout=ExposureTime;
+	/* the camera reports the capture after the exposure */
+	if (ExposureTime>0)
+		params.capture_timeout=PTP_TIMEOUT_CAPTURE+ExposureTime;
+
+	/* read events in the background, so none is lost; if there is
+	   no thread support they are read inline below */
+	start_event_pump(&params);
 
 	CR(ptp_initiatecapture (&params, 0x0, 0), "Could not capture.\n");
 	
-	ret=ptp_usb_event_wait(&params,&event);
+	ret=params.event_wait(&params,&event);
 	if (ret!=PTP_RC_OK) goto err;
 	if (verbose) printf ("Event received %08x, ret=%x\n", event.Code, ret);
 	if (event.Code==PTP_EC_CaptureComplete) {
@@ -651,7 +1386,7 @@ capture_image (int busn, int devn, short force)
 		
 	while (event.Code==PTP_EC_ObjectAdded) {
 		printf ("Object added 0x%08lx\n", (long unsigned) event.Param1);
-		if (ptp_usb_event_wait(&params, &event)!=PTP_RC_OK)
+		if (params.event_wait(&params, &event)!=PTP_RC_OK)
 			goto err;
 		if (verbose) printf ("Event received %08x, ret=%x\n", event.Code, ret);
 		if (event.Code==PTP_EC_CaptureComplete) {
@@ -664,7 +1399,6 @@ err:
 	printf("Events receiving error. Capture status unknown.\n");
 out:
 
-	ptpcam_usb_timeout=USB_TIMEOUT;
 	close_camera(&ptp_usb, &params, dev);
 }
 
@@ -672,6 +1406,96 @@ static void sig_alrm(int signo)
 {
 }
 
+/* sink writing the data into the file descriptor priv points to */
+static uint16_t
+file_sink (void *priv, unsigned char *data, unsigned int size, uint64_t offset)
+{
+	int file=*(int *)priv;
+	ssize_t n;
+
+	while (size>0) {
+		n=pwrite(file, data, size, offset);
+		if (n==-1 && errno==EINTR)
+			continue;
+		if (n<=0) {
+			perror("write");
+			return PTP_ERROR_IO;
+		}
+		data+=n;
+		size-=n;
+		offset+=n;
+	}
+	return PTP_RC_OK;
+}
+
+/*
+ * --partial: downloads the object by GetPartialObject; after an I/O error
+ * the pipes are reset and it goes on from the last chunk received
+ */
+static uint16_t
+download_partial (PTPParams *params, uint32_t handle, uint64_t size,
+	PTPDataSinkFunc sink, void *priv)
+{
+	uint64_t offset=0, last=0;
+	int retries=0;
+	uint16_t ret;
+
+	while ((ret=ptp_getobject_chunked(params, handle, size,
+	    ptpcam_partial, &offset, sink, priv))==PTP_ERROR_IO) {
+		if (offset>last)
+			retries=0;
+		if (++retries>PTPCAM_RESUME_RETRIES)
+			break;
+		last=offset;
+		ptp_trace_mark(params, PTP_TRACE_RETRY,
+			PTP_OC_GetPartialObject, ptpcam_partial);
+		if (verbose)
+			printf("\nI/O error, going on at byte %llu ",
+				(unsigned long long)offset);
+		/* the transport is recovered already, see ptp_recover() */
+		recovery_backoff(retries);
+	}
+	return ret;
+}
+
+/*
+ * downloads the object of size bytes (see ptp_object_size()) into file:
+ * straight into the mmap()ed file or, for objects of 4GB or more,
+ * streamed chunk by chunk; with --partial by GetPartialObject if the
+ * camera can; returns -1 if the file could not be prepared (reported
+ * already), a PTP_RC_* code otherwise
+ */
+static int
+download_object (PTPParams *params, uint32_t handle, uint64_t size,
+	int file)
+{
+	char *image;
+	unsigned int len;
+	uint16_t ret;
+
+	if (ptpcam_partial>0) {
+		ret=download_partial(params, handle, size, file_sink, &file);
+		if (ret!=PTP_RC_OperationNotSupported)
+			return ret;
+	}
+	if (size==0 || size>0xffffffffULL-PTP_USB_BULK_HDR_LEN ||
+	    size>(size_t)-1)
+		return ptp_getobject_sink(params, handle, size, file_sink,
+			&file);
+	if (lseek(file,size-1,SEEK_SET)==-1 || write(file,"",1)==-1) {
+		perror("write");
+		return -1;
+	}
+	image=mmap(0,size,PROT_READ|PROT_WRITE,MAP_SHARED,file,0);
+	if (image==MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	ret=ptp_getobject_buf(params,handle,(unsigned char *)image,size,&len);
+	munmap(image,size);
+	return ret;
+}
+
 void
 loop_capture (int busn, int devn, short force, int n, int interval, int overwrite)
 {
@@ -682,7 +1506,7 @@ loop_capture (int busn, int devn, short force, int n, int interval, int overwrit
 	int file;
 	PTPObjectInfo oi;
 	uint32_t handle=0;
-	char *image;
+	uint64_t size;
 	int ret;
 	char *filename;
 	time_t start_time;
@@ -694,20 +1518,20 @@ loop_capture (int busn, int devn, short force, int n, int interval, int overwrit
 	if (open_camera(busn, devn, force, &ptp_usb, &params, &dev)<0)
 		return;
 
-	/* capture timeout should be longer */
-	ptpcam_usb_timeout=USB_CAPTURE_TIMEOUT;
-
 	printf("Camera: %s\n",params.deviceinfo.Model);
 
+	/* queue ObjectAdded events arriving while we download */
+	start_event_pump(&params);
+
 	/* local loop */
-	while (n>0) {
+	while (n>0 && !ptpcam_interrupted) {
 		/* capture */
 		time(&start_time);
 		printf("\nInitiating captue...\n");
 		CR(ptp_initiatecapture (&params, 0x0, 0),"Could not capture\n");
 		n--;
 
-		ret=ptp_usb_event_wait(&params,&event);
+		ret=params.event_wait(&params,&event);
 		if (verbose) printf ("Event received %08x, ret=%x\n", event.Code, ret);
 		if (ret!=PTP_RC_OK) goto err;
 		if (event.Code==PTP_EC_CaptureComplete) {
@@ -718,7 +1542,7 @@ loop_capture (int busn, int devn, short force, int n, int interval, int overwrit
 		while (event.Code==PTP_EC_ObjectAdded) {
 			printf ("Object added 0x%08lx\n",(long unsigned) event.Param1);
 			handle=event.Param1;
-			if (ptp_usb_event_wait(&params, &event)!=PTP_RC_OK)
+			if (params.event_wait(&params, &event)!=PTP_RC_OK)
 				goto err;
 			if (verbose) printf ("Event received %08x, ret=%x\n", event.Code, ret);
 			if (event.Code==PTP_EC_CaptureComplete)
@@ -731,13 +1555,18 @@ download:
 		if ((ret=ptp_getobjectinfo(&params,handle, &oi))!=PTP_RC_OK){
 			fprintf(stderr,"ERROR: Could not get object info\n");
 			ptp_perror(&params,ret);
-			if (ret==PTP_ERROR_IO) clear_stall(&ptp_usb);
 			continue;
 		}
 	
 		if (oi.ObjectFormat == PTP_OFC_Association)
 				goto out;
 		filename=(oi.Filename);
+		/* known before the file is made, or a failure leaves it empty */
+		if ((ret=ptp_object_size(&params,handle,&oi,&size))!=PTP_RC_OK){
+			fprintf(stderr,"ERROR: Could not get object size\n");
+			ptp_perror(&params,ret);
+			goto out;
+		}
 		file=open(filename, (overwrite==OVERWRITE_EXISTING?0:O_EXCL)|O_RDWR|O_CREAT|O_TRUNC,S_IRWXU|S_IRGRP);
 		if (file==-1) {
 			if (errno==EEXIST) {
@@ -747,28 +1576,15 @@ download:
 			perror("open");
 			goto out;
 		}
-		lseek(file,oi.ObjectCompressedSize-1,SEEK_SET);
-		ret=write(file,"",1);
-		if (ret==-1) {
-			perror("write");
-			goto out;
-		}
-		image=mmap(0,oi.ObjectCompressedSize,PROT_READ|PROT_WRITE,MAP_SHARED,
-			file,0);
-		if (image==MAP_FAILED) {
-			perror("mmap");
-			close(file);
-			goto out;
-		}
 		printf ("Saving file: \"%s\" ",filename);
 		fflush(NULL);
-		ret=ptp_getobject(&params,handle,&image);
-		munmap(image,oi.ObjectCompressedSize);
+		ret=download_object(&params,handle,size,file);
 		close(file);
+		if (ret==-1)
+			goto out;
 		if (ret!=PTP_RC_OK) {
 			printf ("error!\n");
 			ptp_perror(&params,ret);
-			if (ret==PTP_ERROR_IO) clear_stall(&ptp_usb);
 		} else {
 			/* and delete from camera! */
 			printf("is done...\nDeleting from camera.\n");
@@ -787,7 +1603,6 @@ out:
 	}
 err:
 
-	ptpcam_usb_timeout=USB_TIMEOUT;
 	close_camera(&ptp_usb, &params, dev);
 }
 
@@ -959,7 +1774,6 @@ nikon_direct_capture (int busn, int devn, short force, char* filename,int overwr
 	}
 
 out:	
-	ptpcam_usb_timeout=USB_TIMEOUT;
 	close_camera(&ptp_usb, &params, dev);
 }
 
@@ -979,7 +1793,8 @@ nikon_direct_capture2 (int busn, int devn, short force, char* filename, int over
 		"bus/dev numbers\n");
 		exit(-1);
 	}
-	find_endpoints(dev,&ptp_usb.inep,&ptp_usb.outep,&ptp_usb.intep);
+	find_endpoints(dev,&ptp_usb.inep,&ptp_usb.outep,&ptp_usb.intep,
+		&ptp_usb.maxpacket);
 
 	init_ptp_usb(&params, &ptp_usb, dev);
 
@@ -1125,7 +1940,6 @@ loop:
 	}
 
 out:	
-	ptpcam_usb_timeout=USB_TIMEOUT;
 	close_camera(&ptp_usb, &params, dev);
 #endif
 }
@@ -1133,15 +1947,50 @@ out:
 
 
 
+/*
+   get_all_objectinfo() gets the ObjectInfo of all params->handles in
+   batches, going on past the objects failing; (*rc)[i] tells which did.
+   Returns -1 if out of memory.
+*/
+static int
+get_all_objectinfo (PTPParams *params, PTPObjectInfo **ois, uint16_t **rc)
+{
+	unsigned int i, n=params->handles.n, done;
+	uint16_t ret;
+
+	*ois=calloc(n>0?n:1, sizeof(PTPObjectInfo));
+	*rc=calloc(n>0?n:1, sizeof(uint16_t));
+	if (*ois==NULL || *rc==NULL) {
+		perror("calloc");
+		free(*ois);
+		free(*rc);
+		return -1;
+	}
+	/* a batch stops at transport errors only */
+	for (i=0; i<n; i+=done) {
+		ret=ptp_getobjectinfo_batch(params, params->handles.Handler+i,
+			n-i, *ois+i, *rc+i, PTP_BATCH_CONTINUE, &done);
+		/* none run at all, the rest fail the same */
+		if (done==0) {
+			for (; i<n; i++)
+				(*rc)[i]=ret;
+			break;
+		}
+	}
+	return 0;
+}
+
 void
 list_files (int busn, int devn, short force)
 {
 	PTPParams params;
 	PTP_USB ptp_usb;
 	struct usb_device *dev;
-	int i;
-	PTPObjectInfo oi;
+	unsigned int i, done;
+	PTPObjectInfo *ois, *oi;
 	struct tm *tm;
+	uint64_t size;
+	uint16_t ret;
 
 	printf("\nListing files...\n");
 	if (open_camera(busn, devn, force, &ptp_usb, &params, &dev)<0)
@@ -1149,20 +1998,34 @@ list_files (int busn, int devn, short force)
 	printf("Camera: %s\n",params.deviceinfo.Model);
 	CR(ptp_getobjecthandles (&params,0xffffffff, 0x000000, 0x000000,
 		&params.handles),"Could not get object handles\n");
+	ois=calloc(params.handles.n>0?params.handles.n:1,
+		sizeof(PTPObjectInfo));
+	if (ois==NULL) {
+		perror("calloc");
+		close_camera(&ptp_usb, &params, dev);
+		return;
+	}
+	ret=ptp_getobjectinfo_batch(&params, params.handles.Handler,
+		params.handles.n, ois, NULL, PTP_BATCH_STOP, &done);
+	/* the one failed is the last done, if any was */
+	if (ret!=PTP_RC_OK && done>0)
+		done--;
 	printf("Handler:           Size: \tCaptured:      \tname:\n");
-	for (i = 0; i < params.handles.n; i++) {
-		CR(ptp_getobjectinfo(&params,params.handles.Handler[i],
-			&oi),"Could not get object info\n");
-		if (oi.ObjectFormat == PTP_OFC_Association)
+	for (i = 0; i < done; i++) {
+		oi=&ois[i];
+		if (oi->ObjectFormat == PTP_OFC_Association)
 			continue;
-		tm=gmtime(&oi.CaptureDate);
-		printf("0x%08lx: %12u\t%4i-%02i-%02i %02i:%02i\t%s\n",
+		ptp_object_size(&params,params.handles.Handler[i],oi,&size);
+		tm=gmtime(&oi->CaptureDate);
+		printf("0x%08lx: %12llu\t%4i-%02i-%02i %02i:%02i\t%s\n",
 			(long unsigned)params.handles.Handler[i],
-			(unsigned) oi.ObjectCompressedSize, 
+			(unsigned long long) size,
 			tm->tm_year+1900, tm->tm_mon+1,tm->tm_mday,
 			tm->tm_hour, tm->tm_min,
-			oi.Filename);
+			oi->Filename);
 	}
+	free(ois);
+	CR(ret,"Could not get object info\n");
 	printf("\n");
 	close_camera(&ptp_usb, &params, dev);
 }
@@ -1190,10 +2053,11 @@ delete_all_files (int busn, int devn, short force)
 	PTPParams params;
 	PTP_USB ptp_usb;
 	struct usb_device *dev;
-	PTPObjectInfo oi;
-	uint32_t handle;
-	int i;
-	int ret;
+	PTPObjectInfo *ois;
+	uint16_t *rc;
+	uint32_t handle, *handles;
+	unsigned int i, n=0, done;
+	uint16_t ret;
 
 	if (open_camera(busn, devn, force, &ptp_usb, &params, &dev)<0)
 		return;
@@ -1201,21 +2065,36 @@ delete_all_files (int busn, int devn, short force)
 	CR(ptp_getobjecthandles (&params,0xffffffff, 0x000000, 0x000000,
 		&params.handles),"Could not get object handles\n");
 
+	if (get_all_objectinfo(&params, &ois, &rc)<0) {
+		close_camera(&ptp_usb, &params, dev);
+		return;
+	}
+	/* the objects to delete replace the handles list */
+	handles=params.handles.Handler;
 	for (i=0; i<params.handles.n; i++) {
 		handle=params.handles.Handler[i];
-		if ((ret=ptp_getobjectinfo(&params,handle, &oi))!=PTP_RC_OK){
+		if (rc[i]!=PTP_RC_OK){
 			fprintf(stderr,"Handle: 0x%08lx\n",(long unsigned) handle);
 			fprintf(stderr,"ERROR: Could not get object info\n");
-			ptp_perror(&params,ret);
-			if (ret==PTP_ERROR_IO) clear_stall(&ptp_usb);
+			ptp_perror(&params,rc[i]);
 			continue;
 		}
-		if (oi.ObjectFormat == PTP_OFC_Association)
+		if (ois[i].ObjectFormat == PTP_OFC_Association)
 			continue;
-		CR(ptp_deleteobject(&params, handle,0),
-				"Could not delete object\n");
-		printf("Object 0x%08lx (%s) deleted.\n",(long unsigned) handle, oi.Filename);
+		ois[n]=ois[i];
+		handles[n++]=handle;
 	}
+	params.handles.n=n;
+	ret=ptp_deleteobject_batch(&params, handles, n, NULL,
+		PTP_BATCH_STOP, &done);
+	if (ret!=PTP_RC_OK && done>0)
+		done--;
+	for (i=0; i<done; i++)
+		printf("Object 0x%08lx (%s) deleted.\n",
+			(long unsigned) handles[i], ois[i].Filename);
+	free(ois);
+	free(rc);
+	CR(ret,"Could not delete object\n");
 	close_camera(&ptp_usb, &params, dev);
 }
 
@@ -1223,46 +2102,47 @@ void
 save_object(PTPParams *params, uint32_t handle, char* filename, PTPObjectInfo oi, int overwrite)
 {
 	int file;
-	char *image;
 	int ret;
+	uint64_t size;
 	struct utimbuf timebuf;
 
+	/* known before the file is made, or a failure leaves it empty */
+	ret=ptp_object_size(params, handle, &oi, &size);
+	if (ret!=PTP_RC_OK) {
+		fprintf(stderr,"ERROR: Could not get the size of \"%s\"\n",
+			filename);
+		ptp_perror(params,ret);
+		goto out;
+	}
 	file=open(filename, (overwrite==OVERWRITE_EXISTING?0:O_EXCL)|O_RDWR|O_CREAT|O_TRUNC,S_IRWXU|S_IRGRP);
 	if (file==-1) {
 		if (errno==EEXIST) {
 			printf("Skipping file: \"%s\", file exists!\n",filename);
-			goto out;
-		}
-		perror("open");
-		goto out;
-	}
-	lseek(file,oi.ObjectCompressedSize-1,SEEK_SET);
-	ret=write(file,"",1);
-	if (ret==-1) {
-	    perror("write");
-	    goto out;
-	}
-	image=mmap(0,oi.ObjectCompressedSize,PROT_READ|PROT_WRITE,MAP_SHARED,
-		file,0);
-	if (image==MAP_FAILED) {
-		perror("mmap");
-		close(file);
+			goto out;
+		}
+		perror("open");
 		goto out;
 	}
 	printf ("Saving file: \"%s\" ",filename);
 	fflush(NULL);
-	ret=ptp_getobject(params,handle,&image);
-	munmap(image,oi.ObjectCompressedSize);
+	ret=download_object(params,handle,size,file);
 	if (close(file)==-1) {
 	    perror("close");
 	}
+	if (ret==-1)
+		goto out;
+	if (ret==PTP_ERROR_CANCEL) {
+		/* or it would be skipped as existing next time */
+		unlink(filename);
+		printf("cancelled.\n");
+		goto out;
+	}
 	timebuf.actime=oi.ModificationDate;
 	timebuf.modtime=oi.CaptureDate;
 	utime(filename,&timebuf);
 	if (ret!=PTP_RC_OK) {
 		printf ("error!\n");
 		ptp_perror(params,ret);
-		if (ret==PTP_ERROR_IO) clear_stall((PTP_USB *)(params->data));
 	} else {
 		printf("is done.\n");
 	}
@@ -1283,7 +2163,6 @@ get_save_object (PTPParams *params, uint32_t handle, char* filename, int overwri
 	if ((ret=ptp_getobjectinfo(params,handle, &oi))!=PTP_RC_OK) {
 	    fprintf(stderr, "Could not get object info\n");
 	    ptp_perror(params,ret);
-	    if (ret==PTP_ERROR_IO) clear_stall((PTP_USB *)(params->data));
 	    goto out;
 	}
 	if (oi.ObjectFormat == PTP_OFC_Association)
@@ -1320,7 +2199,10 @@ get_all_files (int busn, int devn, short force, int overwrite)
 	PTPParams params;
 	PTP_USB ptp_usb;
 	struct usb_device *dev;
-	int i;
+	PTPObjectInfo *ois;
+	uint16_t *rc;
+	uint32_t handle;
+	unsigned int i;
 
 	if (open_camera(busn, devn, force, &ptp_usb, &params, &dev)<0)
 		return;
@@ -1329,10 +2211,596 @@ get_all_files (int busn, int devn, short force, int overwrite)
 	CR(ptp_getobjecthandles (&params,0xffffffff, 0x000000, 0x000000,
 		&params.handles),"Could not get object handles\n");
 
+	if (get_all_objectinfo(&params, &ois, &rc)<0) {
+		close_camera(&ptp_usb, &params, dev);
+		return;
+	}
+	for (i=0; i<params.handles.n; i++) {
+		handle=params.handles.Handler[i];
+		if (verbose)
+			printf ("Handle: 0x%08lx\n",(long unsigned) handle);
+		if (rc[i]!=PTP_RC_OK) {
+			fprintf(stderr, "Could not get object info\n");
+			ptp_perror(&params,rc[i]);
+			continue;
+		}
+		if (ois[i].ObjectFormat == PTP_OFC_Association)
+			continue;
+		save_object(&params, handle, ois[i].Filename, ois[i],
+			overwrite);
+		if (ptpcam_interrupted)
+			break;
+	}
+	free(ois);
+	free(rc);
+	close_camera(&ptp_usb, &params, dev);
+}
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+/*
+ * --get-all-cameras: every camera gets a download thread of its own. The
+ * data received is copied into a bounded set of buffers which a pool of
+ * writer threads, shared by all cameras, takes to disk; a slow disk holds
+ * the cameras back instead of filling the memory.
+ */
+typedef struct _WriterPool WriterPool;
+
+/* a file being written by the pool */
+typedef struct {
+	WriterPool *pool;
+	int file;
+	unsigned int pending;		/* chunks queued or being written */
+	int error;			/* errno of a failed write */
+} WriterFile;
+
+typedef struct {
+	WriterFile *file;
+	unsigned char *data;
+	unsigned int size;
+	uint64_t offset;
+} WriterJob;
+
+struct _WriterPool {
+	pthread_mutex_t lock;
+	pthread_cond_t more;		/* a job was queued or stop is set */
+	pthread_cond_t done;		/* a job is done, its buffer free */
+	WriterJob *jobs;		/* ring, one job per buffer at most */
+	unsigned int head, count;
+	unsigned char **bufs;		/* free buffers */
+	unsigned int nfree, nbufs, buflen;
+	pthread_t *threads;
+	int nthreads;
+	int stop;
+};
+
+static void *
+writer_thread (void *arg)
+{
+	WriterPool *pool=(WriterPool *)arg;
+	WriterJob job;
+	unsigned char *data;
+	ssize_t n;
+	int error;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->count==0 && !pool->stop)
+			pthread_cond_wait(&pool->more, &pool->lock);
+		if (pool->count==0)
+			break;
+		job=pool->jobs[pool->head];
+		pool->head=(pool->head+1)%pool->nbufs;
+		pool->count--;
+		pthread_mutex_unlock(&pool->lock);
+
+		error=0;
+		data=job.data;
+		while (job.size>0) {
+			n=pwrite(job.file->file, data, job.size, job.offset);
+			if (n==-1 && errno==EINTR)
+				continue;
+			if (n<=0) {
+				error=n==-1?errno:EIO;
+				break;
+			}
+			data+=n;
+			job.size-=n;
+			job.offset+=n;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		if (error && !job.file->error)
+			job.file->error=error;
+		pool->bufs[pool->nfree++]=job.data;
+		job.file->pending--;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void writer_pool_stop (WriterPool *pool);
+
+/* starts nthreads writers with PTPCAM_WRITER_BUFS buffers of buflen each */
+static int
+writer_pool_start (WriterPool *pool, int nthreads, unsigned int buflen)
+{
+	unsigned int i;
+
+	memset(pool, 0, sizeof(WriterPool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->more, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	if (nthreads<1) nthreads=1;
+	pool->buflen=buflen;
+	pool->nbufs=nthreads*PTPCAM_WRITER_BUFS;
+	pool->jobs=calloc(pool->nbufs, sizeof(WriterJob));
+	pool->bufs=calloc(pool->nbufs, sizeof(unsigned char *));
+	pool->threads=calloc(nthreads, sizeof(pthread_t));
+	if (pool->jobs==NULL || pool->bufs==NULL || pool->threads==NULL)
+		goto err;
+	for (i=0; i<pool->nbufs; i++) {
+		pool->bufs[i]=malloc(buflen);
+		if (pool->bufs[i]==NULL)
+			goto err;
+		pool->nfree++;
+	}
+	for (; pool->nthreads<nthreads; pool->nthreads++)
+		if (pthread_create(&pool->threads[pool->nthreads], NULL,
+		    writer_thread, pool)!=0)
+			goto err;
+	return 0;
+err:
+	perror("writer pool");
+	writer_pool_stop(pool);
+	return -1;
+}
+
+/* writes what is queued yet and ends the writers */
+static void
+writer_pool_stop (WriterPool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop=1;
+	pthread_cond_broadcast(&pool->more);
+	pthread_mutex_unlock(&pool->lock);
+	for (i=0; i<pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	while (pool->nfree>0)
+		free(pool->bufs[--pool->nfree]);
+	free(pool->bufs);
+	free(pool->jobs);
+	free(pool->threads);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->more);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+/* sink queueing the data to the writers, priv is a WriterFile */
+static uint16_t
+writer_sink (void *priv, unsigned char *data, unsigned int size,
+	uint64_t offset)
+{
+	WriterFile *f=(WriterFile *)priv;
+	WriterPool *pool=f->pool;
+	WriterJob *job;
+	unsigned char *buf;
+	unsigned int n;
+	int error=0;
+
+	while (size>0 && !error) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->nfree==0)
+			pthread_cond_wait(&pool->done, &pool->lock);
+		buf=pool->bufs[--pool->nfree];
+		pthread_mutex_unlock(&pool->lock);
+
+		n=size<pool->buflen?size:pool->buflen;
+		memcpy(buf, data, n);
+
+		pthread_mutex_lock(&pool->lock);
+		job=&pool->jobs[(pool->head+pool->count)%pool->nbufs];
+		job->file=f;
+		job->data=buf;
+		job->size=n;
+		job->offset=offset;
+		pool->count++;
+		f->pending++;
+		error=f->error;
+		pthread_cond_signal(&pool->more);
+		pthread_mutex_unlock(&pool->lock);
+		data+=n;
+		size-=n;
+		offset+=n;
+	}
+	return error?PTP_ERROR_IO:PTP_RC_OK;
+}
+
+/* waits for the data of f to be written, returns errno of a failure */
+static int
+writer_file_wait (WriterFile *f)
+{
+	WriterPool *pool=f->pool;
+	int error;
+
+	pthread_mutex_lock(&pool->lock);
+	while (f->pending>0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	error=f->error;
+	pthread_mutex_unlock(&pool->lock);
+	return error;
+}
+
+/* a camera of --get-all-cameras and its download thread */
+typedef struct {
+	PTPParams params;
+	PTP_USB ptp_usb;
+	struct usb_device *dev;
+	char dir[64];			/* files go there */
+	WriterPool *pool;
+	int overwrite;
+	pthread_t thread;
+	int started;			/* thread is running */
+	unsigned int files, failed;
+	uint64_t bytes;
+	double seconds;
+} CameraWorker;
+
+static double
+ptpcam_now (void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+/* downloads one object into the camera's directory, -1 if skipped
+   or cancelled */
+static int
+camera_download (CameraWorker *c, uint32_t handle)
+{
+	PTPParams *params=&c->params;
+	PTPObjectInfo oi;
+	WriterFile f;
+	struct utimbuf timebuf;
+	char path[PATH_MAX];
+	uint64_t size=0;
+	int ret;
+	int error=0;
+
+	memset(&oi, 0, sizeof(PTPObjectInfo));
+	ret=ptp_getobjectinfo(params, handle, &oi);
+	if (ret!=PTP_RC_OK) {
+		fprintf(stderr, "%s: Could not get object info of "
+			"0x%08lx\n", c->dir, (long unsigned)handle);
+		ptp_perror(params, ret);
+		return ret;
+	}
+	if (oi.ObjectFormat==PTP_OFC_Association || oi.Filename==NULL) {
+		ret=-1;
+		goto out;
+	}
+	snprintf(path, sizeof(path), "%s/%s", c->dir, oi.Filename);
+	/* known before the file is made, or a failure leaves it empty */
+	ret=ptp_object_size(params, handle, &oi, &size);
+	if (ret!=PTP_RC_OK) {
+		fprintf(stderr, "%s: Could not get the object size\n", path);
+		ptp_perror(params, ret);
+		goto out;
+	}
+	memset(&f, 0, sizeof(WriterFile));
+	f.pool=c->pool;
+	f.file=open(path, (c->overwrite==OVERWRITE_EXISTING?0:O_EXCL)|
+		O_RDWR|O_CREAT|O_TRUNC, S_IRWXU|S_IRGRP);
+	if (f.file==-1) {
+		if (errno==EEXIST)
+			printf("Skipping file: \"%s\", file exists!\n", path);
+		else
+			perror(path);
+		ret=-1;
+		goto out;
+	}
+	if (ptpcam_partial>0) {
+		ret=download_partial(params, handle, size, writer_sink, &f);
+		/* the camera cannot, get it whole */
+		if (ret==PTP_RC_OperationNotSupported)
+			ret=ptp_getobject_sink(params, handle, size,
+				writer_sink, &f);
+	} else
+		ret=ptp_getobject_sink(params, handle, size, writer_sink, &f);
+	error=writer_file_wait(&f);
+	close(f.file);
+	if (ret==PTP_ERROR_CANCEL) {
+		/* or it would be skipped as existing next time */
+		unlink(path);
+		printf("Saving file: \"%s\" cancelled.\n", path);
+		ret=-1;
+		goto out;
+	}
+	timebuf.actime=oi.ModificationDate;
+	timebuf.modtime=oi.CaptureDate;
+	utime(path, &timebuf);
+	if (error!=0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(error));
+		if (ret==PTP_RC_OK || ret==PTP_ERROR_SINK)
+			ret=PTP_ERROR_IO;
+	} else if (ret!=PTP_RC_OK) {
+		fprintf(stderr, "%s: error!\n", path);
+		ptp_perror(params, ret);
+	} else {
+		if (verbose)
+			printf("Saving file: \"%s\" is done.\n", path);
+		c->bytes+=size;
+	}
+out:
+	free(oi.Filename);
+	free(oi.Keywords);
+	return ret;
+}
+
+static void *
+camera_worker (void *arg)
+{
+	CameraWorker *c=(CameraWorker *)arg;
+	PTPParams *params=&c->params;
+	double start=ptpcam_now();
+	uint16_t ret;
+	int i, r;
+
+	if (mkdir(c->dir, 0755)==-1 && errno!=EEXIST) {
+		perror(c->dir);
+		c->failed++;
+		return NULL;
+	}
+	ret=ptp_getobjecthandles(params, 0xffffffff, 0x000000, 0x000000,
+		&params->handles);
+	if (ret!=PTP_RC_OK) {
+		fprintf(stderr, "%s: Could not get object handles\n", c->dir);
+		ptp_perror(params, ret);
+		c->failed++;
+		return NULL;
+	}
+	for (i=0; i<params->handles.n && !ptpcam_interrupted; i++) {
+		r=camera_download(c, params->handles.Handler[i]);
+		if (r==PTP_RC_OK)
+			c->files++;
+		else if (r!=-1)
+			c->failed++;
+	}
+	c->seconds=ptpcam_now()-start;
+	return NULL;
+}
+
+/* opens every camera, returns how many */
+static int
+open_all_cameras (short force, CameraWorker **cams)
+{
+	PTPDevice *d;
+	struct usb_device *dev;
+	CameraWorker *c;
+	int i, n=0, max=0, ndevs=0, usb=0;
+
+	if (ptpcam_transport==PTPCAM_TRANSPORT_VCAM)
+		max=ptpcam_vcam_cameras;
+	else if (ptpcam_transport==PTPCAM_TRANSPORT_PTPIP ||
+	    ptpcam_transport==PTPCAM_TRANSPORT_REPLAY)
+		max=1;
+	else {
+		usb=1;
+		ndevs=devreg_count();
+		for (i=0; i<ndevs; i++)
+			if (devreg_device(i)->ptp || force)
+				max++;
+	}
+	if (max==0)
+		return 0;
+	*cams=calloc(max, sizeof(CameraWorker));
+	if (*cams==NULL) {
+		perror("calloc");
+		return 0;
+	}
+	if (!usb) {
+		/* transports with no bus to scan */
+		for (; n<max; n++) {
+			c=&(*cams)[n];
+			if (open_camera(0, 0, force, &c->ptp_usb, &c->params,
+			    &c->dev)<0)
+				break;
+			snprintf(c->dir, sizeof(c->dir), "camera%d", n);
+		}
+		return n;
+	}
+	for (i=0; i<ndevs && n<max; i++) {
+		d=devreg_device(i);
+		if (!d->ptp && !force)
+			continue;
+		dev=d->dev;
+		c=&(*cams)[n];
+		c->dev=dev;
+		find_endpoints(dev, &c->ptp_usb.inep, &c->ptp_usb.outep,
+			&c->ptp_usb.intep, &c->ptp_usb.maxpacket);
+		init_ptp_usb(&c->params, &c->ptp_usb, dev);
+		if (ptp_opensession(&c->params, 1)!=PTP_RC_OK) {
+			fprintf(stderr, "ERROR: %s/%s: Could not open "
+				"session!\n", d->bus->dirname, dev->filename);
+			release_usb(&c->ptp_usb, dev);
+			continue;
+		}
+		if (ptp_getdeviceinfo(&c->params, &c->params.deviceinfo)
+		    !=PTP_RC_OK) {
+			fprintf(stderr, "ERROR: %s/%s: Could not get device "
+				"info!\n", d->bus->dirname, dev->filename);
+			close_camera(&c->ptp_usb, &c->params, dev);
+			continue;
+		}
+		snprintf(c->dir, sizeof(c->dir), "%.24s-%.24s",
+			d->bus->dirname, dev->filename);
+		n++;
+	}
+	return n;
+}
+
+void
+get_all_cameras (short force, int overwrite)
+{
+	CameraWorker *cams=NULL, *c;
+	WriterPool pool;
+	unsigned int files=0, failed=0;
+	uint64_t bytes=0;
+	double start, seconds;
+	int i, n;
+
+	if (ptpcam_record!=NULL || ptpcam_trace!=NULL) {
+		fprintf(stderr, "ERROR: --record and --trace take one camera "
+			"only\n");
+		return;
+	}
+	n=open_all_cameras(force, &cams);
+	if (n==0) {
+		printf("\nFound no PTP devices\n");
+		free(cams);
+		return;
+	}
+	if (writer_pool_start(&pool, ptpcam_writers, ptpcam_usb_urb)<0)
+		goto out;
+	ptpcam_sessions=calloc(n, sizeof(PTPParams *));
+	if (ptpcam_sessions!=NULL) {
+		for (i=0; i<n; i++)
+			ptpcam_sessions[i]=&cams[i].params;
+		ptpcam_nsessions=n;
+	}
+
+	start=ptpcam_now();
+	for (i=0; i<n; i++) {
+		c=&cams[i];
+		c->pool=&pool;
+		c->overwrite=overwrite;
+		printf("%s: %s, serial number '%s'\n", c->dir,
+			c->params.deviceinfo.Model,
+			c->params.deviceinfo.SerialNumber);
+		if (pthread_create(&c->thread, NULL, camera_worker, c)==0)
+			c->started=1;
+		else {
+			perror("pthread_create");
+			camera_worker(c);
+		}
+	}
+	for (i=0; i<n; i++)
+		if (cams[i].started)
+			pthread_join(cams[i].thread, NULL);
+	writer_pool_stop(&pool);
+	seconds=ptpcam_now()-start;
+	ptpcam_nsessions=0;
+	free(ptpcam_sessions);
+	ptpcam_sessions=NULL;
+
+	for (i=0; i<n; i++) {
+		c=&cams[i];
+		printf("%s: %u files, %llu bytes, %.1f MB/s%s\n", c->dir,
+			c->files, (unsigned long long)c->bytes,
+			c->seconds>0?c->bytes/c->seconds/1048576:0.0,
+			c->failed?", some failed":"");
+		files+=c->files;
+		failed+=c->failed;
+		bytes+=c->bytes;
+	}
+	printf("Total: %u files, %llu bytes from %d cameras in %.2f s, "
+		"%.1f MB/s\n", files, (unsigned long long)bytes, n, seconds,
+		seconds>0?bytes/seconds/1048576:0.0);
+	if (failed)
+		printf("%u downloads failed\n", failed);
+out:
+	for (i=0; i<n; i++)
+		close_camera(&cams[i].ptp_usb, &cams[i].params, cams[i].dev);
+	free(cams);
+}
+#else
+void
+get_all_cameras (short force, int overwrite)
+{
+	fprintf(stderr, "ERROR: ptpcam was built without threads\n");
+}
+#endif
+
+static uint16_t
+probe_sink (void *priv, unsigned char *data, unsigned int size, uint64_t offset)
+{
+	return PTP_RC_OK;
+}
+
+/*
+ * Downloads one object (the biggest one up to PROBE_MAX_OBJECT bytes)
+ * with each of the chunk sizes below and reports the fastest of them.
+ */
+#define PROBE_MIN_OBJECT	1048576
+#define PROBE_MAX_OBJECT	67108864
+
+void
+probe_chunk_size (int busn, int devn, short force)
+{
+	static const unsigned int sizes[]={
+		65536, 262144, 1048576, 2097152, 4194304, 8388608 };
+	PTPParams params;
+	PTP_USB ptp_usb;
+	struct usb_device *dev;
+	PTPObjectInfo oi;
+	uint32_t handle=0, size=0;
+	unsigned int best=0;
+	double bestrate=0;
+	int i;
+
+	if (open_camera(busn, devn, force, &ptp_usb, &params, &dev)<0)
+		return;
+	printf("Camera: %s\n",params.deviceinfo.Model);
+
+	CR(ptp_getobjecthandles (&params,0xffffffff, 0x000000, 0x000000,
+		&params.handles),"Could not get object handles\n");
 	for (i=0; i<params.handles.n; i++) {
-	    get_save_object (&params, params.handles.Handler[i], NULL,
-		    overwrite);
+		memset(&oi, 0, sizeof(PTPObjectInfo));
+		if (ptp_getobjectinfo(&params,params.handles.Handler[i],
+			&oi)!=PTP_RC_OK)
+			continue;
+		if (oi.ObjectFormat!=PTP_OFC_Association &&
+		    oi.ObjectCompressedSize>size &&
+		    oi.ObjectCompressedSize<=PROBE_MAX_OBJECT) {
+			handle=params.handles.Handler[i];
+			size=oi.ObjectCompressedSize;
+		}
+		free(oi.Filename);
+		free(oi.Keywords);
+	}
+	if (size<PROBE_MIN_OBJECT) {
+		fprintf(stderr,"ERROR: no object between %i and %i bytes "
+			"to probe with\n", PROBE_MIN_OBJECT, PROBE_MAX_OBJECT);
+		close_camera(&ptp_usb, &params, dev);
+		return;
+	}
+	printf("Probing with object 0x%08lx, %lu bytes\n",
+		(long unsigned) handle, (long unsigned) size);
+
+	for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		struct timeval start, end;
+		double rate, secs;
+
+		set_chunk_size(&params, &ptp_usb, sizes[i]);
+		gettimeofday(&start, NULL);
+		CR(ptp_getobject_sink(&params, handle, 0, probe_sink, NULL),
+			"Could not get object\n");
+		gettimeofday(&end, NULL);
+		secs=(end.tv_sec-start.tv_sec)+
+			(end.tv_usec-start.tv_usec)/1000000.0;
+		rate=secs>0?size/secs/1048576.0:0;
+		printf("chunk %8u: %8.2f MB/s\n", ptp_usb.urb, rate);
+		if (rate>bestrate) {
+			bestrate=rate;
+			best=ptp_usb.urb;
+		}
 	}
+	printf("Fastest chunk size: %u (use --chunk-size=%u)\n", best, best);
+
 	close_camera(&ptp_usb, &params, dev);
 }
 
@@ -1397,14 +2865,15 @@ send_generic_request (int busn, int devn, uint16_t reqCode, uint32_t *reqParams,
 
 	printf("Sending generic request: reqCode=0x%04x, params=[0x%08x,0x%08x,0x%08x,0x%08x,0x%08x]\n",
 			(uint)reqCode, reqParams[0], reqParams[1], reqParams[2], reqParams[3], reqParams[4]);
-	uint16_t result=ptp_sendgenericrequest (&params, reqCode, reqParams, &data, direction, fsize);
+	unsigned int getlen=0;
+	uint16_t result=ptp_sendgenericrequest (&params, reqCode, reqParams, &data, direction, fsize, &getlen);
 	if((result)!=PTP_RC_OK) {
 		ptp_perror(&params,result);
 		if (result > 0x2000)
 			fprintf(stderr,"PTP: ERROR: response 0x%04x\n", result);
 	} else {
 	    if (data != NULL && direction == PTP_DP_GETDATA) {
-		    display_hexdump(data, malloc_usable_size ((void*)data));
+		    display_hexdump(data, getlen);
 			free(data);
 		}
 		printf("PTP: response OK\n");
@@ -1579,16 +3048,17 @@ theta_sleep (int busn,int devn,uint16_t property,char* value, short force)
 	while (timeout-- > 0 && open_camera(busn, devn, force, &ptp_usb, &params, &dev) < 0)
 		fprintf(stderr, "fail to open camera, %d time\n", TIMEOUT - timeout);
 
-	// get property "sleep mode"
+	// get property "sleep mode", retried by the library while busy
 	memset(&dpd,0,sizeof(dpd));
 	result = ptp_getdevicepropdesc(&params, SleepMode, &dpd);
 	uint8_t is_sleep = 0;
-	
-	while (result!=PTP_RC_OK) 
+
+	if (result!=PTP_RC_OK)
 	{
-		// fprintf(stderr,"ERROR: can not got SleepMode status, retry\n");
-		result = ptp_getdevicepropdesc(&params, SleepMode, &dpd);
-		if (result==PTP_RC_OK || dpd.DataType != 0) break;
+		ptp_perror(&params,result);
+		fprintf(stderr,"ERROR: can not get SleepMode status!\n");
+		close_camera(&ptp_usb, &params, dev);
+		return;
 	}
 
 	if (dpd.DataType != PTP_DTC_UNDEF)
@@ -1649,16 +3119,17 @@ theta_shut_up_test (int busn,int devn,uint16_t property,char* value, short force
 		}
 	}
 
-	// get property "sleep mode"
+	// get property "sleep mode", retried by the library while busy
 	memset(&dpd,0,sizeof(dpd));
 	result = ptp_getdevicepropdesc(&params, SleepMode, &dpd);
 	uint8_t is_sleep = 0;
-	
-	while (result!=PTP_RC_OK) 
+
+	if (result!=PTP_RC_OK)
 	{
-		// fprintf(stderr,"ERROR: can not got SleepMode status, retry\n");
-		result = ptp_getdevicepropdesc(&params, SleepMode, &dpd);
-		if (result==PTP_RC_OK || dpd.DataType != 0) break;
+		ptp_perror(&params,result);
+		fprintf(stderr,"ERROR: can not get SleepMode status!\n");
+		close_camera(&ptp_usb, &params, dev);
+		return;
 	}
 
 	if (dpd.DataType != PTP_DTC_UNDEF)
@@ -1764,45 +3235,30 @@ theta_init (int busn,int devn, uint16_t property, char* value, short force)
 	PTPParams params;
 	PTP_USB ptp_usb;
 	struct usb_device *dev;
-	int timeout = TIMEOUT;
-	uint16_t result;
+	unsigned int attempt;
 
-	// 1. open camera
-	while (timeout-- > 0 && theta_open_camera(busn, devn, force, &ptp_usb, &params, &dev) < 0)
-	{
-		fprintf(stderr, "fail to open camera, %d time\n", TIMEOUT - timeout);
-		usleep(5000*100);
-	}
-		
-	if (timeout < 0) 
+	// 1. open camera, backing off like the library does (see --retries)
+	for (attempt = 1; theta_open_camera(busn, devn, force, &ptp_usb, &params, &dev) < 0; attempt++)
 	{
-		fprintf (stderr, "Error: cannot open camera!");
-		return 1;
+		fprintf(stderr, "fail to open camera, %u time\n", attempt);
+		if (attempt > ptpcam_retries)
+		{
+			fprintf (stderr, "Error: cannot open camera!");
+			return 1;
+		}
+		recovery_backoff(attempt);
 	}
 
-	timeout = TIMEOUT;
+	// the transactions below are retried by the library
 	// get property "SleepMode" if it does not equals 0, set to 0
-	while (timeout-- > 0 && theta_get_and_change(&params, SleepMode, "0x00") != PTP_RC_OK)
-	{
-		fprintf(stderr, "fail to change sleepmode, %d time\n", TIMEOUT - timeout);
-		usleep(5000*100);
-	}
-
-	if (timeout < 0) 
+	if (theta_get_and_change(&params, SleepMode, "0x00") != PTP_RC_OK)
 	{
 		fprintf (stderr, "Error: cannot change sleepmode!");
 		return 1;
 	}
 
 	// get property "StillCaptureMode" if it equals 0x8005, set to 0x8005
-	timeout = TIMEOUT;
-	while (timeout-- > 0 && theta_get_and_change(&params, StillCaptureMode, "0x8005") != PTP_RC_OK)
-	{
-		fprintf(stderr, "fail to change capture mode, %d time\n", TIMEOUT - timeout);
-		usleep(5000*100);
-	}
-
-	if (timeout < 0) 
+	if (theta_get_and_change(&params, StillCaptureMode, "0x8005") != PTP_RC_OK)
 	{
 		fprintf(stderr,"ERROR: fail on querying StillCaptureMode!\n");
 		return 1;
@@ -1972,6 +3428,7 @@ getset_propertybyname (int busn,int devn,char* property,char* value,short force)
 
 	if (property==NULL) {
 		fprintf(stderr,"ERROR: no such property\n");
+		close_camera(&ptp_usb, &params, dev);
 		return;
 	}
 		
@@ -2157,10 +3614,29 @@ show_all_properties (int busn,int devn,short force, int unknown)
 	close_camera(&ptp_usb, &params, dev);
 }
 
+/* route class and standard requests to the transport in use */
+static int
+ptpcam_control_msg(PTP_USB* ptp_usb, int requesttype, int request, int value,
+	int index, char *bytes, int size, int timeout)
+{
+#ifdef HAVE_LIBUSB1
+	if (ptp_usb->usb1!=NULL)
+		return ptp_usb1_control_msg(ptp_usb, requesttype, request,
+			value, index, bytes, size, timeout);
+#endif
+#ifdef HAVE_USBFS
+	if (ptp_usb->usbfs!=NULL)
+		return myusb_control_msg(ptp_usb, requesttype, request,
+			value, index, bytes, size, timeout);
+#endif
+	return usb_control_msg(ptp_usb->handle, requesttype, request,
+		value, index, bytes, size, timeout);
+}
+
 int
 usb_get_endpoint_status(PTP_USB* ptp_usb, int ep, uint16_t* status)
 {
-	 return (usb_control_msg(ptp_usb->handle,
+	 return (ptpcam_control_msg(ptp_usb,
 		USB_DP_DTH|USB_RECIP_ENDPOINT, USB_REQ_GET_STATUS,
 		USB_FEATURE_HALT, ep, (char *)status, 2, 3000));
 }
@@ -2169,7 +3645,7 @@ int
 usb_clear_stall_feature(PTP_USB* ptp_usb, int ep)
 {
 
-	return (usb_control_msg(ptp_usb->handle,
+	return (ptpcam_control_msg(ptp_usb,
 		USB_RECIP_ENDPOINT, USB_REQ_CLEAR_FEATURE, USB_FEATURE_HALT,
 		ep, NULL, 0, 3000));
 }
@@ -2179,22 +3655,29 @@ usb_ptp_get_device_status(PTP_USB* ptp_usb, uint16_t* devstatus);
 int
 usb_ptp_get_device_status(PTP_USB* ptp_usb, uint16_t* devstatus)
 {
-	return (usb_control_msg(ptp_usb->handle,
+	return (ptpcam_control_msg(ptp_usb,
 		USB_DP_DTH|USB_TYPE_CLASS|USB_RECIP_INTERFACE,
 		USB_REQ_GET_DEVICE_STATUS, 0, 0,
 		(char *)devstatus, 4, 3000));
 }
 
-int
-usb_ptp_device_reset(PTP_USB* ptp_usb);
 int
 usb_ptp_device_reset(PTP_USB* ptp_usb)
 {
-	return (usb_control_msg(ptp_usb->handle,
+	return (ptpcam_control_msg(ptp_usb,
 		USB_TYPE_CLASS|USB_RECIP_INTERFACE,
 		USB_REQ_DEVICE_RESET, 0, 0, NULL, 0, 3000));
 }
 
+/* req: CancelTransaction event code and transaction ID, 6 bytes */
+int
+usb_ptp_cancel(PTP_USB* ptp_usb, unsigned char* req)
+{
+	return (ptpcam_control_msg(ptp_usb,
+		USB_TYPE_CLASS|USB_RECIP_INTERFACE,
+		USB_REQ_CANCEL, 0, 0, (char *)req, 6, 3000));
+}
+
 void
 reset_device (int busn, int devn, short force);
 void
@@ -2216,7 +3699,8 @@ reset_device (int busn, int devn, short force)
 		"bus/dev numbers\n");
 		exit(-1);
 	}
-	find_endpoints(dev,&ptp_usb.inep,&ptp_usb.outep,&ptp_usb.intep);
+	find_endpoints(dev,&ptp_usb.inep,&ptp_usb.outep,&ptp_usb.intep,
+		&ptp_usb.maxpacket);
 
 	init_ptp_usb(&params, &ptp_usb, dev);
 	
@@ -2283,12 +3767,13 @@ ptp_transaction_nodata (PTPParams* params, PTPContainer* ptp)
 	return (ptp_transaction(params, ptp, PTP_DP_NODATA, 0, 0));
 }
 
+/* *getlen: capacity of *data on entry, data phase length on return */
 uint16_t
 ptp_transaction_getdata (PTPParams* params, PTPContainer* ptp, unsigned int *getlen, char** data);
 uint16_t
 ptp_transaction_getdata (PTPParams* params, PTPContainer* ptp, unsigned int *getlen, char** data)
 {
-	return (ptp_transaction(params, ptp, PTP_DP_GETDATA, (unsigned int) getlen, data));
+	return (ptp_transaction_buf(params, ptp, (unsigned char *)*data, *getlen, getlen));
 }
 
 uint16_t
@@ -2337,8 +3822,8 @@ void ptphack()
 
 /* main program  */
 
-int
-main(int argc, char ** argv)
+static int
+ptpcam_main(int argc, char ** argv)
 {
 	int busn=0,devn=0;
 	int action=0;
@@ -2355,6 +3840,7 @@ main(int argc, char ** argv)
 	uint32_t reqParams[5];
 	uint32_t direction=PTP_DP_GETDATA;
 	char data_file[256];
+	char *sockpath=NULL;
 	/* parse options */
 	int option_index = 0,opt;
 	static struct option loptions[] = {
@@ -2364,6 +3850,9 @@ main(int argc, char ** argv)
 		{"help",0,0,'h'},
 		{"bus",1,0,0},
 		{"dev",1,0,0},
+		{"serial",1,0,0},
+		{"id",1,0,0},
+		{"monitor",0,0,0},
 		{"reset",0,0,'r'},
 		{"list-devices",0,0,'l'},
 		{"list-files",0,0,'L'},
@@ -2376,6 +3865,8 @@ main(int argc, char ** argv)
 		{"set",1,0,0},
 		{"get-file",1,0,'g'},
 		{"get-all-files",0,0,'G'},
+		{"get-all-cameras",0,0,0},
+		{"writers",1,0,0},
 		{"capture",0,0,'c'},
 		{"nikon-dc",0,0,0},
 		{"ndc",0,0,0},
@@ -2393,16 +3884,37 @@ main(int argc, char ** argv)
 		{"overwrite",0,0,0},
 		{"force",0,0,'f'},
 		{"verbose",2,0,'v'},
+		{"transport",1,0,0},
+		{"queue-depth",1,0,0},
+		{"chunk-size",1,0,0},
+		{"probe-chunk",0,0,0},
+		{"partial",2,0,0},
+		{"timeout",1,0,0},
+		{"ptpip",1,0,0},
+		{"vcam",2,0,0},
+		{"record",1,0,0},
+		{"replay",1,0,0},
+		{"replay-realtime",0,0,0},
+		{"stats",0,0,0},
+		{"trace",1,0,0},
+		{"retries",1,0,0},
+		{"reset-on-error",0,0,0},
+		{"daemon",1,0,0},
+		/* taken by ptpcamd_socket() */
+		{"socket",1,0,0},
 		{0,0,0,0}
 	};
 
-	/* register signal handlers */
-	signal(SIGINT, ptpcam_siginthandler);
-	
 	while(1) {
 		opt = getopt_long (argc, argv, "LhlcipfroGg:Dd:s:v::R:", loptions, &option_index);
 		if (opt==-1) break;
 	
+		if (ptpcamd_serving() && (opt=='S' || opt=='T' || opt=='t')) {
+			fprintf(stderr,"ERROR: --%s is not served by ptpcamd\n",
+				loptions[option_index].name);
+			return -1;
+		}
+	
 		switch (opt) {
 		/* set parameters */
 		case 'S':
@@ -2424,6 +3936,23 @@ main(int argc, char ** argv)
 				busn=strtol(optarg,NULL,10);
 			if (!(strcmp("dev",loptions[option_index].name)))
 				devn=strtol(optarg,NULL,10);
+			if (!(strcmp("serial",loptions[option_index].name)))
+				ptpcam_serial=optarg;
+			if (!(strcmp("id",loptions[option_index].name)))
+			{
+				unsigned int vid, pid;
+
+				if (sscanf(optarg,"%x:%x",&vid,&pid)!=2 ||
+				    vid==0 || vid>0xffff || pid>0xffff) {
+					fprintf(stderr,"ERROR: bad --id '%s', "
+						"VID:PID expected\n",optarg);
+					return -1;
+				}
+				ptpcam_id_vendor=vid;
+				ptpcam_id_product=pid;
+			}
+			if (!(strcmp("monitor",loptions[option_index].name)))
+				action=ACT_MONITOR;
 			if (!(strcmp("loop-capture",loptions[option_index].name)))
 			{
 				action=ACT_LOOP_CAPTURE;
@@ -2440,6 +3969,78 @@ main(int argc, char ** argv)
 			}
 			if (!(strcmp("interval",loptions[option_index].name)))
 				interval=strtol(optarg,NULL,10);
+			if (!(strcmp("transport",loptions[option_index].name)))
+			{
+				if (!strcmp(optarg,"libusb"))
+					ptpcam_transport=PTPCAM_TRANSPORT_LIBUSB;
+#ifdef HAVE_LIBUSB1
+				else if (!strcmp(optarg,"libusb1"))
+					ptpcam_transport=PTPCAM_TRANSPORT_LIBUSB1;
+#endif
+#ifdef HAVE_USBFS
+				else if (!strcmp(optarg,"usbfs"))
+					ptpcam_transport=PTPCAM_TRANSPORT_USBFS;
+#endif
+				else {
+					fprintf(stderr,"ERROR: unsupported "
+						"transport '%s'\n",optarg);
+					return -1;
+				}
+			}
+			if (!(strcmp("queue-depth",loptions[option_index].name)))
+				ptpcam_usb_queue=strtol(optarg,NULL,10);
+			if (!(strcmp("chunk-size",loptions[option_index].name)))
+				ptpcam_usb_urb=strtoul(optarg,NULL,10);
+			if (!(strcmp("probe-chunk",loptions[option_index].name)))
+				action=ACT_PROBE_CHUNK;
+			if (!(strcmp("get-all-cameras",loptions[option_index].name)))
+				action=ACT_GET_ALL_CAMERAS;
+			if (!(strcmp("writers",loptions[option_index].name)))
+				ptpcam_writers=strtol(optarg,NULL,10);
+			if (!(strcmp("partial",loptions[option_index].name)))
+				ptpcam_partial=optarg!=NULL?
+					strtoul(optarg,NULL,0):
+					PTP_PARTIAL_CHUNK_LEN;
+			if (!(strcmp("trace",loptions[option_index].name)))
+				ptpcam_trace=optarg;
+			if (!(strcmp("retries",loptions[option_index].name)))
+				ptpcam_retries=strtoul(optarg,NULL,10);
+			if (!(strcmp("reset-on-error",loptions[option_index].name)))
+				ptpcam_reset_on_error=1;
+			if (!(strcmp("daemon",loptions[option_index].name)))
+			{
+				action=ACT_DAEMON;
+				sockpath=optarg;
+			}
+			if (!(strcmp("stats",loptions[option_index].name)))
+			{
+#ifdef PTP_STATS
+				ptpcam_stats=1;
+#else
+				fprintf(stderr,"ERROR: --stats needs libptp2 "
+					"configured with --enable-stats\n");
+				return -1;
+#endif
+			}
+			if (!(strcmp("timeout",loptions[option_index].name)))
+				ptpcam_timeout=strtoul(optarg,NULL,10);
+			if (!(strcmp("ptpip",loptions[option_index].name))) {
+				ptpcam_transport=PTPCAM_TRANSPORT_PTPIP;
+				ptpcam_ptpip_host=optarg;
+			}
+			if (!(strcmp("vcam",loptions[option_index].name))) {
+				ptpcam_transport=PTPCAM_TRANSPORT_VCAM;
+				if (optarg!=NULL && parse_vcam(optarg)<0)
+					return -1;
+			}
+			if (!(strcmp("record",loptions[option_index].name)))
+				ptpcam_record=optarg;
+			if (!(strcmp("replay",loptions[option_index].name))) {
+				ptpcam_transport=PTPCAM_TRANSPORT_REPLAY;
+				ptpcam_replay=optarg;
+			}
+			if (!(strcmp("replay-realtime",loptions[option_index].name)))
+				ptpcam_replay_realtime=1;
 			if (!strcmp("nikon-dc", loptions[option_index].name) ||
 			    !strcmp("ndc", loptions[option_index].name))
 			{
@@ -2536,6 +4137,15 @@ main(int argc, char ** argv)
 		usage();
 		return 0;
 	}
+	/* these need the bus or a session of their own */
+	if (ptpcamd_serving() && (action==ACT_DEVICE_RESET ||
+	    action==ACT_LIST_DEVICES || action==ACT_MONITOR ||
+	    action==ACT_GET_ALL_CAMERAS || action==ACT_PROBE_CHUNK ||
+	    action==ACT_NIKON_DC2 || action==ACT_DAEMON)) {
+		fprintf(stderr,"ERROR: this action is not served by "
+			"ptpcamd\n");
+		return -1;
+	}
 	switch (action) {
 		case ACT_DEVICE_RESET:
 			reset_device(busn,devn,force);
@@ -2568,6 +4178,15 @@ main(int argc, char ** argv)
 		case ACT_GET_ALL_FILES:
 			get_all_files(busn,devn,force,overwrite);
 			break;
+		case ACT_PROBE_CHUNK:
+			probe_chunk_size(busn,devn,force);
+			break;
+		case ACT_GET_ALL_CAMERAS:
+			get_all_cameras(force,overwrite);
+			break;
+		case ACT_MONITOR:
+			monitor_devices(force);
+			break;
 		case ACT_CAPTURE:
 			capture_image(busn,devn,force);
 			break;
@@ -2597,7 +4216,80 @@ main(int argc, char ** argv)
 			break;
 		case ACT_NIKON_DC2:
 			nikon_direct_capture2(busn,devn,force,filename,overwrite);
+			break;
+		case ACT_DAEMON:
+			return ptpcamd(busn,devn,force,sockpath)<0?-1:0;
 	}
 
 	return 0;
 }
+
+/*
+ * runs a command line in the daemon as main() would; the options are
+ * put back afterwards, so the next command starts from the daemon's
+ */
+int
+ptpcam_command(int argc, char ** argv)
+{
+	short saved_verbose=verbose;
+	unsigned int saved_timeout=ptpcam_timeout;
+	int saved_transport=ptpcam_transport;
+	int saved_queue=ptpcam_usb_queue;
+	char *saved_ptpip_host=ptpcam_ptpip_host;
+	PTPVCamConfig saved_vcam=ptpcam_vcam;
+	char *saved_record=ptpcam_record;
+	char *saved_replay=ptpcam_replay;
+	int saved_replay_realtime=ptpcam_replay_realtime;
+	unsigned int saved_urb=ptpcam_usb_urb;
+	uint32_t saved_partial=ptpcam_partial;
+	int saved_writers=ptpcam_writers;
+	int saved_vcam_cameras=ptpcam_vcam_cameras;
+	int saved_stats=ptpcam_stats;
+	char *saved_trace=ptpcam_trace;
+	unsigned int saved_retries=ptpcam_retries;
+	int saved_reset_on_error=ptpcam_reset_on_error;
+	char *saved_serial=ptpcam_serial;
+	uint16_t saved_id_vendor=ptpcam_id_vendor;
+	uint16_t saved_id_product=ptpcam_id_product;
+	int ret;
+
+	/* getopt starts over */
+	optind=0;
+	ret=ptpcam_main(argc, argv);
+	verbose=saved_verbose;
+	ptpcam_timeout=saved_timeout;
+	ptpcam_transport=saved_transport;
+	ptpcam_usb_queue=saved_queue;
+	ptpcam_ptpip_host=saved_ptpip_host;
+	ptpcam_vcam=saved_vcam;
+	ptpcam_record=saved_record;
+	ptpcam_replay=saved_replay;
+	ptpcam_replay_realtime=saved_replay_realtime;
+	ptpcam_usb_urb=saved_urb;
+	ptpcam_partial=saved_partial;
+	ptpcam_writers=saved_writers;
+	ptpcam_vcam_cameras=saved_vcam_cameras;
+	ptpcam_stats=saved_stats;
+	ptpcam_trace=saved_trace;
+	ptpcam_retries=saved_retries;
+	ptpcam_reset_on_error=saved_reset_on_error;
+	ptpcam_serial=saved_serial;
+	ptpcam_id_vendor=saved_id_vendor;
+	ptpcam_id_product=saved_id_product;
+	return ret;
+}
+
+int
+main(int argc, char ** argv)
+{
+	const char *sockpath;
+
+	/* a command for ptpcamd, see ptpcamd.c */
+	if ((sockpath=ptpcamd_socket(argc, argv))!=NULL)
+		return ptpcamd_request(sockpath, argc, argv);
+
+	/* register signal handlers */
+	signal(SIGINT, ptpcam_siginthandler);
+
+	return ptpcam_main(argc, argv);
+}
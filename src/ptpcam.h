@@ -19,18 +19,10 @@
 #ifndef __PTPCAM_H__
 #define __PTPCAM_H__
 
-#if 0	/* This is no longer needed at all */
-//#ifdef LINUX_OS
-#define USB_BULK_READ myusb_bulk_read
-#define USB_BULK_WRITE myusb_bulk_write
-int myusb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size,
-	int timeout);
-int myusb_bulk_write(usb_dev_handle *dev, int ep, char *bytes, int length,
-	int timeout);
-#else
+#include <signal.h>
+
 #define USB_BULK_READ usb_bulk_read
 #define USB_BULK_WRITE usb_bulk_write
-#endif
 
 /*
  * macros
@@ -51,8 +43,7 @@ int myusb_bulk_write(usb_dev_handle *dev, int ep, char *bytes, int length,
 #define CC(result,error) {						\
 			if((result)!=PTP_RC_OK) {			\
 				fprintf(stderr,"ERROR: "error);		\
-				usb_release_interface(ptp_usb.handle,	\
-		dev->config->interface->altsetting->bInterfaceNumber);	\
+				release_usb(&ptp_usb, dev);		\
 				continue;					\
 			}						\
 }
@@ -94,6 +85,10 @@ int myusb_bulk_write(usb_dev_handle *dev, int ep, char *bytes, int length,
 #define ACT_SHOW_UNKNOWN_PROPERTIES	0xF
 #define ACT_SET_PROPBYNAME	0x10
 #define ACT_GENERIC_REQ     0x11
+#define ACT_PROBE_CHUNK		0x12
+#define ACT_GET_ALL_CAMERAS	0x13
+#define ACT_MONITOR		0x14
+#define ACT_DAEMON		0x15
 
 #define ACT_NIKON_DC		0x101
 #define ACT_NIKON_DC2		0x102
@@ -103,6 +98,60 @@ int myusb_bulk_write(usb_dev_handle *dev, int ep, char *bytes, int length,
 #define PTPCAM_PRINT_HEX	00
 #define PTPCAM_PRINT_DEC	01
 
+/* OUR APPLICATION USB URB (2MB) ;), the default for --chunk-size */
+#define PTPCAM_USB_URB		2097152
+
+/* USB transports */
+#define PTPCAM_TRANSPORT_LIBUSB		0	/* libusb-0.1, synchronous */
+#define PTPCAM_TRANSPORT_LIBUSB1	1	/* libusb-1.0, asynchronous */
+#define PTPCAM_TRANSPORT_USBFS		2	/* Linux usbfs, asynchronous */
+#define PTPCAM_TRANSPORT_PTPIP		3	/* PTP/IP, see --ptpip */
+#define PTPCAM_TRANSPORT_VCAM		4	/* virtual camera, see --vcam */
+#define PTPCAM_TRANSPORT_REPLAY		5	/* transfer log, see --replay */
+
+/* bulk transfers queued by the asynchronous transports */
+#define PTPCAM_USB_QUEUE	4
+#define PTPCAM_USB_MAX_QUEUE	32
+
+/* --partial: tries to go on with a download without getting further */
+#define PTPCAM_RESUME_RETRIES	5
+
+/* error recovery, see --retries: retries per transaction by default and
+   the backoff in ms, doubling from the first to the last */
+#define PTPCAM_RETRIES		3
+#define PTPCAM_BACKOFF		100
+#define PTPCAM_BACKOFF_MAX	2000
+
+/* cancelling a transfer, see ptp_cancel(): ms the bulk IN pipe must stay
+   quiet to be drained, then how often and every how many ms the device
+   status is asked until it is ready again */
+#define PTPCAM_CANCEL_DRAIN	100
+#define PTPCAM_CANCEL_POLLS	50
+#define PTPCAM_CANCEL_POLL_MS	20
+
+/* --get-all-cameras: writer threads by default and buffers per writer */
+#define PTPCAM_WRITERS		4
+#define PTPCAM_WRITER_BUFS	4
+
+/* USB device class of still image cameras */
+#ifndef USB_CLASS_PTP
+#define USB_CLASS_PTP		6
+#endif
+
+/* list_devices: devices probed at once, timeout (ms) unless --timeout */
+#define PTPCAM_PROBE_THREADS	8
+#define PTPCAM_PROBE_TIMEOUT	2000
+
+/* device registry: serial number length, rescan period (ms) if no inotify */
+#define PTPCAM_SERIAL_LEN	64
+#define PTPCAM_DEVREG_POLL	1000
+
+/* ptpcamd: descriptors a client hands over (cwd, stdout, stderr), bytes
+   of arguments taken, clients waiting for the one served */
+#define PTPCAMD_FDS		3
+#define PTPCAMD_MAX_ARGS_LEN	65536
+#define PTPCAMD_BACKLOG		8
+
 /* filename overwrite */
 #define OVERWRITE_EXISTING	1
 #define	SKIP_IF_EXISTS		0
@@ -112,20 +161,49 @@ int myusb_bulk_write(usb_dev_handle *dev, int ep, char *bytes, int length,
  * structures
  */
 
+typedef struct _PTP_USB1 PTP_USB1;
+typedef struct _PTP_USBFS PTP_USBFS;
+
 typedef struct _PTP_USB PTP_USB;
 struct _PTP_USB {
 	usb_dev_handle* handle;
 	int inep;
 	int outep;
 	int intep;
+	int maxpacket;		/* bulk IN wMaxPacketSize */
+	unsigned int urb;	/* bulk transfer size */
+	PTPParams* params;	/* for the transaction deadline */
+	PTP_USB1* usb1;		/* libusb-1.0 transport, NULL if not used */
+	PTP_USBFS* usbfs;	/* usbfs transport, NULL if not used */
 };
 
+/* a USB device in the registry, see devreg.c */
+typedef struct _PTPDevice PTPDevice;
+struct _PTPDevice {
+	struct usb_bus *bus;
+	struct usb_device *dev;
+	int busn;
+	int devn;
+	uint16_t vendor;
+	uint16_t product;
+	int ptp;		/* has a still image interface */
+	int serial_read;	/* serial looked up already */
+	char serial[PTPCAM_SERIAL_LEN];
+};
+
+/* told about a device arrived (1) or gone (0) */
+typedef void (*PTPDeviceFunc)(PTPDevice *d, int arrived);
+
 /*
  * variables
  */
 
 /* one global variable */
 extern short verbose;
+extern unsigned int ptpcam_timeout;
+extern PTPParams* globalparams;
+extern PTP_USB* globalptp_usb;
+extern volatile sig_atomic_t ptpcam_interrupted;
 
 
 /*
@@ -142,6 +220,8 @@ void show_info (int busn, int devn, short force);
 void list_files (int busn, int devn, short force);
 void get_file (int busn, int devn, short force, uint32_t handle, char* filename, int overwrite);
 void get_all_files (int busn, int devn, short force, int overwrite);
+void get_all_cameras (short force, int overwrite);
+void monitor_devices (short force);
 void capture_image (int busn, int devn, short force);
 void nikon_direct_capture (int busn, int devn, short force, char* filename, int overwrite);
 void nikon_direct_capture2 (int busn, int devn, short force, char* filename, int overwrite);
@@ -153,17 +233,70 @@ void list_properties (int dev, int bus, short force);
 void loop_capture (int busn, int devn, short force, int n, int interval, int overwrite);
 void save_object(PTPParams *params, uint32_t handle, char* filename, PTPObjectInfo oi, int overwrite);
 void get_save_object (PTPParams *params, uint32_t handle, char* filename, int overwrite);
+void probe_chunk_size (int busn, int devn, short force);
 void send_generic_request (int busn, int devn, uint16_t reqCode, uint32_t *params, uint32_t direction, char *data_file);
 
 
-struct usb_bus* init_usb(void);
 void close_usb(PTP_USB* ptp_usb, struct usb_device* dev);
+void release_usb(PTP_USB* ptp_usb, struct usb_device* dev);
 void init_ptp_usb (PTPParams*, PTP_USB*, struct usb_device*);
+void set_chunk_size (PTPParams* params, PTP_USB* ptp_usb, unsigned int urb);
 void clear_stall(PTP_USB* ptp_usb);
 
 int usb_get_endpoint_status(PTP_USB* ptp_usb, int ep, uint16_t* status);
 int usb_clear_stall_feature(PTP_USB* ptp_usb, int ep);
+int usb_ptp_device_reset(PTP_USB* ptp_usb);
+int usb_ptp_get_device_status(PTP_USB* ptp_usb, uint16_t* devstatus);
+int usb_ptp_cancel(PTP_USB* ptp_usb, unsigned char* req);
 int open_camera (int busn, int devn, short force, PTP_USB *ptp_usb, PTPParams *params, struct usb_device **dev);
 void close_camera (PTP_USB *ptp_usb, PTPParams *params, struct usb_device *dev);
+int ptpcam_command (int argc, char **argv);
+
+/* ptpcamd.c */
+int ptpcamd_serving (void);
+int ptpcamd_lend (PTP_USB *ptp_usb, PTPParams *params, struct usb_device **dev);
+void ptpcamd_return (PTPParams *params);
+int ptpcamd (int busn, int devn, short force, const char *path);
+const char *ptpcamd_socket (int argc, char **argv);
+int ptpcamd_request (const char *path, int argc, char **argv);
+
+/* devreg.c */
+int devreg_poll (int timeout, PTPDeviceFunc changed);
+int devreg_count (void);
+PTPDevice *devreg_device (int i);
+PTPDevice *devreg_find (int busn, int devn, short force);
+PTPDevice *devreg_find_serial (const char *serial, short force);
+PTPDevice *devreg_find_id (uint16_t vendor, uint16_t product, short force);
+const char *devreg_serial (PTPDevice *d);
+void devreg_close (void);
+
+#ifdef HAVE_LIBUSB1
+/* libusb1.c */
+int ptp_usb1_open (PTP_USB *ptp_usb, struct usb_device *dev, int queue);
+void ptp_usb1_close (PTP_USB *ptp_usb, int reset);
+short ptp_usb1_read_func (unsigned char *bytes, unsigned int size, void *data);
+short ptp_usb1_write_func (unsigned char *bytes, unsigned int size, void *data);
+short ptp_usb1_writev_func (PTPIOVec *iov, int iovcnt, void *data);
+short ptp_usb1_check_int (unsigned char *bytes, unsigned int size, void *data);
+int ptp_usb1_control_msg (PTP_USB *ptp_usb, int requesttype, int request,
+	int value, int index, char *bytes, int size, int timeout);
+const char *ptp_usb1_strerror (int error);
+#endif
+
+#if defined(LINUX_OS) && defined(HAVE_LINUX_USBDEVICE_FS_H)
+/* myusb.c */
+#define HAVE_USBFS
+int myusb_open (PTP_USB *ptp_usb, struct usb_device *dev, int queue,
+	size_t dmalen);
+void myusb_close (PTP_USB *ptp_usb, int reset);
+short myusb_read_func (unsigned char *bytes, unsigned int size, void *data);
+short myusb_write_func (unsigned char *bytes, unsigned int size, void *data);
+short myusb_writev_func (PTPIOVec *iov, int iovcnt, void *data);
+short myusb_check_int (unsigned char *bytes, unsigned int size, void *data);
+int myusb_control_msg (PTP_USB *ptp_usb, int requesttype, int request,
+	int value, int index, char *bytes, int size, int timeout);
+unsigned char *myusb_bufalloc (unsigned int size, void *data);
+void myusb_buffree (unsigned char *buf, unsigned int size, void *data);
+#endif
 
 #endif /* __PTPCAM_H__ */
@@ -0,0 +1,501 @@
+/* ptpcamd.c
+ *
+ * ptpcamd: ptpcam keeping the session open for other ptpcam commands.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * ptpcam --daemon=SOCKET opens the camera once and listens on a Unix
+ * socket. ptpcam --socket=SOCKET (or with PTPCAM_SOCKET set) does not
+ * touch the bus but hands its command line over: the daemon sends its
+ * pid, the client sends the length of its arguments with its working
+ * directory, stdout and stderr attached as SCM_RIGHTS, then the arguments
+ * one after another, each NUL terminated. The daemon runs the command
+ * as ptpcam would, in the client's directory and printing to the client's
+ * terminal, and answers with its exit status. Commands are served one at
+ * a time; open_camera() lends them the open session and close_camera()
+ * takes it back instead of closing it. Ctrl-C in the client becomes
+ * SIGUSR1 to the daemon, which cancels the transfer in progress.
+ */
+
+#include <config.h>
+#include "ptp.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <usb.h>
+
+#include "ptpcam.h"
+
+/* the session served, see ptpcamd_lend() */
+static PTPParams *ptpcamd_params=NULL;
+static PTP_USB *ptpcamd_usb=NULL;
+static struct usb_device *ptpcamd_dev=NULL;
+static int ptpcamd_lent=0;
+
+static volatile sig_atomic_t ptpcamd_busy=0;	/* a command is running */
+static volatile sig_atomic_t ptpcamd_quit=0;
+
+/* the daemon's pid, for the client's SIGINT handler */
+static volatile pid_t ptpcamd_pid=0;
+
+/* true in the daemon once the camera is open */
+int
+ptpcamd_serving (void)
+{
+	return ptpcamd_params!=NULL;
+}
+
+/*
+ * open_camera() of a command served: the command gets a copy of the
+ * session, with the transport pointed at it for the transaction deadlines
+ */
+int
+ptpcamd_lend (PTP_USB *ptp_usb, PTPParams *params, struct usb_device **dev)
+{
+	if (ptpcamd_lent) {
+		fprintf(stderr,"ERROR: the session is in use already!\n");
+		return -1;
+	}
+	*params=*ptpcamd_params;
+	*ptp_usb=*ptpcamd_usb;
+	ptp_usb->params=params;
+	ptpcamd_usb->params=params;
+	*dev=ptpcamd_dev;
+	globalparams=params;
+	globalptp_usb=ptpcamd_usb;
+	ptpcamd_lent=1;
+	return 0;
+}
+
+/* close_camera() of a command served: the session is taken back */
+void
+ptpcamd_return (PTPParams *params)
+{
+	/* the handles listed are the command's */
+	free(params->handles.Handler);
+	memset(&params->handles, 0, sizeof(PTPObjectHandles));
+	params->cancel=0;
+	*ptpcamd_params=*params;
+	ptpcamd_usb->params=ptpcamd_params;
+	globalparams=ptpcamd_params;
+	globalptp_usb=ptpcamd_usb;
+	ptpcamd_lent=0;
+}
+
+/* SIGINT and SIGTERM end the daemon, SIGUSR1 only the command running */
+static void
+ptpcamd_signal (int signum)
+{
+	if (signum!=SIGUSR1)
+		ptpcamd_quit=1;
+	if (ptpcamd_busy) {
+		ptpcam_interrupted=1;
+		ptp_cancel(globalparams);
+	}
+}
+
+static int
+read_all (int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len>0) {
+		n=read(fd, buf, len);
+		if (n<0 && errno==EINTR)
+			continue;
+		if (n<=0)
+			return -1;
+		buf=(char *)buf+n;
+		len-=n;
+	}
+	return 0;
+}
+
+static int
+write_all (int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len>0) {
+		n=write(fd, buf, len);
+		if (n<0 && errno==EINTR)
+			continue;
+		if (n<0)
+			return -1;
+		buf=(const char *)buf+n;
+		len-=n;
+	}
+	return 0;
+}
+
+static int
+socket_address (struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family=AF_UNIX;
+	if (strlen(path)>=sizeof(addr->sun_path)) {
+		fprintf(stderr,"ERROR: socket path %s is too long\n", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/*
+ * receives a command: its arguments as argv (argv[0] is "ptpcam", the
+ * strings are in *args) and the client's working directory, stdout and
+ * stderr in fds; NULL if there is none, as from a ptpcamd starting and
+ * seeing whether the socket is in use
+ */
+static char **
+receive_command (int c, int *argc, char **args, int *fds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(PTPCAMD_FDS*sizeof(int))];
+	} ctl;
+	uint32_t len, i;
+	char *p, **argv;
+	int n;
+	ssize_t r;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base=&len;
+	iov.iov_len=sizeof(len);
+	msg.msg_iov=&iov;
+	msg.msg_iovlen=1;
+	msg.msg_control=ctl.buf;
+	msg.msg_controllen=sizeof(ctl.buf);
+	do
+		r=recvmsg(c, &msg, 0);
+	while (r<0 && errno==EINTR);
+	if (r<=0)
+		return NULL;
+	cmsg=CMSG_FIRSTHDR(&msg);
+	if (r!=sizeof(len) || cmsg==NULL || cmsg->cmsg_level!=SOL_SOCKET ||
+	    cmsg->cmsg_type!=SCM_RIGHTS ||
+	    cmsg->cmsg_len!=CMSG_LEN(PTPCAMD_FDS*sizeof(int))) {
+		fprintf(stderr,"ptpcamd: bad request\n");
+		return NULL;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), PTPCAMD_FDS*sizeof(int));
+	if (len>PTPCAMD_MAX_ARGS_LEN) {
+		fprintf(stderr,"ptpcamd: bad request\n");
+		goto fail;
+	}
+	*args=malloc(len+1);
+	if (*args==NULL)
+		goto fail;
+	(*args)[len]='\0';
+	if (read_all(c, *args, len)<0) {
+		free(*args);
+		goto fail;
+	}
+	for (n=1, i=0; i<len; i++)
+		if ((*args)[i]=='\0')
+			n++;
+	/* "ptpcam", up to n arguments (the last may lack its NUL), NULL */
+	argv=calloc(n+2, sizeof(char *));
+	if (argv==NULL) {
+		free(*args);
+		goto fail;
+	}
+	argv[0]="ptpcam";
+	for (*argc=1, p=*args; p<*args+len; p+=strlen(p)+1)
+		argv[(*argc)++]=p;
+	return argv;
+fail:
+	for (n=0; n<PTPCAMD_FDS; n++)
+		close(fds[n]);
+	return NULL;
+}
+
+/* runs a command of the client connected to c */
+static void
+serve_client (int c)
+{
+	int fds[PTPCAMD_FDS], saved[PTPCAMD_FDS];
+	int argc, i;
+	int32_t status=-1;
+	char **argv, *args;
+	pid_t pid=getpid();
+
+	if (write_all(c, &pid, sizeof(pid))<0)
+		return;
+	argv=receive_command(c, &argc, &args, fds);
+	if (argv==NULL)
+		return;
+	fflush(NULL);
+	saved[0]=open(".", O_RDONLY);
+	saved[1]=dup(STDOUT_FILENO);
+	saved[2]=dup(STDERR_FILENO);
+	if (fchdir(fds[0])==0 && dup2(fds[1], STDOUT_FILENO)>=0 &&
+	    dup2(fds[2], STDERR_FILENO)>=0) {
+		ptpcam_interrupted=0;
+		ptpcamd_busy=1;
+		status=ptpcam_command(argc, argv);
+		ptpcamd_busy=0;
+		fflush(NULL);
+		if (ptpcamd_lent) {
+			/* the transaction ID may be behind now, a
+			   failure reopens the session */
+			fprintf(stderr,"ptpcamd: the command kept the "
+				"session, going on without its changes\n");
+			memset(&ptpcamd_params->bufpool, 0,
+				sizeof(PTPBufPool));
+			ptpcamd_usb->params=ptpcamd_params;
+			globalparams=ptpcamd_params;
+			ptpcamd_lent=0;
+		}
+	}
+	dup2(saved[1], STDOUT_FILENO);
+	dup2(saved[2], STDERR_FILENO);
+	if (fchdir(saved[0])<0)
+		perror("ptpcamd: fchdir");
+	for (i=0; i<PTPCAMD_FDS; i++) {
+		close(saved[i]);
+		close(fds[i]);
+	}
+	free(args);
+	free(argv);
+	write_all(c, &status, sizeof(status));
+}
+
+/*
+ * --daemon: opens the camera and serves the commands of ptpcam
+ * --socket=path until SIGINT or SIGTERM, then closes the camera; -1 if
+ * the camera or the socket could not be set up
+ */
+int
+ptpcamd (int busn, int devn, short force, const char *path)
+{
+	static PTPParams params;
+	static PTP_USB ptp_usb;
+	struct usb_device *dev;
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct pollfd pfd;
+	int s, c;
+
+	if (socket_address(&addr, path)<0)
+		return -1;
+	s=socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s<0) {
+		perror("socket");
+		return -1;
+	}
+	/* a socket left behind by a daemon gone */
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr))==0) {
+		fprintf(stderr,"ERROR: ptpcamd is running on %s already\n",
+			path);
+		close(s);
+		return -1;
+	}
+	unlink(path);
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr))<0 ||
+	    listen(s, PTPCAMD_BACKLOG)<0) {
+		perror(path);
+		close(s);
+		return -1;
+	}
+	if (open_camera(busn, devn, force, &ptp_usb, &params, &dev)<0) {
+		close(s);
+		unlink(path);
+		return -1;
+	}
+	printf("Camera: %s, serving %s\n", params.deviceinfo.Model, path);
+	fflush(stdout);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler=ptpcamd_signal;
+	sa.sa_flags=SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	/* a client gone while its command prints */
+	signal(SIGPIPE, SIG_IGN);
+
+	ptpcamd_params=&params;
+	ptpcamd_usb=&ptp_usb;
+	ptpcamd_dev=dev;
+	pfd.fd=s;
+	pfd.events=POLLIN;
+	while (!ptpcamd_quit) {
+		/* poll() is not restarted, a signal ends it */
+		if (poll(&pfd, 1, -1)<0) {
+			if (errno==EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		c=accept(s, NULL, NULL);
+		if (c<0) {
+			if (errno==EINTR)
+				continue;
+			perror("accept");
+			break;
+		}
+		serve_client(c);
+		close(c);
+	}
+	ptpcamd_params=NULL;
+	close(s);
+	unlink(path);
+	close_camera(&ptp_usb, &params, dev);
+	return 0;
+}
+
+/*
+ * the socket of the daemon to hand the command to, given by --socket or
+ * PTPCAM_SOCKET; NULL if ptpcam is to do it itself, always with --daemon
+ */
+const char *
+ptpcamd_socket (int argc, char **argv)
+{
+	const char *path=getenv("PTPCAM_SOCKET");
+	int i;
+
+	for (i=1; i<argc; i++) {
+		if (!strncmp(argv[i], "--daemon", 8))
+			return NULL;
+		if (!strncmp(argv[i], "--socket=", 9))
+			path=argv[i]+9;
+		else if (!strcmp(argv[i], "--socket") && i+1<argc)
+			path=argv[++i];
+	}
+	if (path!=NULL && *path=='\0')
+		return NULL;
+	return path;
+}
+
+/* the client's SIGINT: the daemon cancels the transfer */
+static void
+client_signal (int signum)
+{
+	if (ptpcamd_pid>0)
+		kill(ptpcamd_pid, SIGUSR1);
+}
+
+/*
+ * has the daemon on path run the command, see ptpcamd(); returns its exit
+ * status, -1 if the daemon could not be asked
+ */
+int
+ptpcamd_request (const char *path, int argc, char **argv)
+{
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(PTPCAMD_FDS*sizeof(int))];
+	} ctl;
+	int fds[PTPCAMD_FDS];
+	uint32_t len=0;
+	int32_t status;
+	pid_t pid;
+	char *args, *p;
+	int s, i;
+
+	if (socket_address(&addr, path)<0)
+		return -1;
+	s=socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s<0) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr))<0) {
+		fprintf(stderr,"ERROR: Could not connect to ptpcamd on %s: "
+			"%s\n", path, strerror(errno));
+		close(s);
+		return -1;
+	}
+	/* the arguments but --socket */
+	for (i=1; i<argc; i++)
+		len+=strlen(argv[i])+1;
+	args=malloc(len?len:1);
+	if (args==NULL) {
+		close(s);
+		return -1;
+	}
+	for (p=args, i=1; i<argc; i++) {
+		if (!strncmp(argv[i], "--socket=", 9))
+			continue;
+		if (!strcmp(argv[i], "--socket")) {
+			i++;
+			continue;
+		}
+		strcpy(p, argv[i]);
+		p+=strlen(p)+1;
+	}
+	len=p-args;
+
+	fds[0]=open(".", O_RDONLY);
+	fds[1]=STDOUT_FILENO;
+	fds[2]=STDERR_FILENO;
+	memset(&msg, 0, sizeof(msg));
+	memset(&ctl, 0, sizeof(ctl));
+	iov.iov_base=&len;
+	iov.iov_len=sizeof(len);
+	msg.msg_iov=&iov;
+	msg.msg_iovlen=1;
+	msg.msg_control=ctl.buf;
+	msg.msg_controllen=sizeof(ctl.buf);
+	cmsg=CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level=SOL_SOCKET;
+	cmsg->cmsg_type=SCM_RIGHTS;
+	cmsg->cmsg_len=CMSG_LEN(PTPCAMD_FDS*sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, PTPCAMD_FDS*sizeof(int));
+
+	status=-1;
+	if (fds[0]<0) {
+		perror("open");
+	} else if (read_all(s, &pid, sizeof(pid))<0 ||
+	    sendmsg(s, &msg, 0)!=sizeof(len) ||
+	    write_all(s, args, len)<0) {
+		fprintf(stderr,"ERROR: ptpcamd on %s did not take the "
+			"command\n", path);
+	} else {
+		ptpcamd_pid=pid;
+		signal(SIGINT, client_signal);
+		if (read_all(s, &status, sizeof(status))<0) {
+			fprintf(stderr,"ERROR: ptpcamd on %s went away\n",
+				path);
+			status=-1;
+		}
+		signal(SIGINT, SIG_DFL);
+	}
+	if (fds[0]>=0)
+		close(fds[0]);
+	free(args);
+	close(s);
+	return status;
+}
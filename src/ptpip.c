@@ -0,0 +1,730 @@
+/* ptpip.c
+ *
+ * PTP/IP (PTP over TCP/IP, CIPA DC-005) transport.
+ *
+ *  This file is part of libptp2.
+ *
+ *  libptp2 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  libptp2 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libptp2; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+#include "ptp.h"
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define CHECK_PTP_RC(result)	{uint16_t r=(result); if (r!=PTP_RC_OK) return r;}
+
+/*
+ * The command/data connection carries requests, data phases and
+ * responses, the event connection carries events only. The operation
+ * request is held back until we know whether a data phase follows, so
+ * that its data phase field is right.
+ */
+struct _PTPIPConnection {
+	int cmdfd;
+	int evtfd;
+	uint32_t number;		/* connection number from the responder */
+	int pending;			/* request not sent yet */
+	unsigned char req[PTPIP_REQ_LEN];
+};
+
+static void
+ptpip_error (PTPParams *params, const char *format, ...)
+{
+	va_list args;
+
+	va_start (args, format);
+	if (params->error_func!=NULL)
+		params->error_func (params->data, format, args);
+	else {
+		vfprintf (stderr, format, args);
+		fprintf (stderr,"\n");
+	}
+	va_end (args);
+}
+
+static inline uint16_t
+ptpip_get16 (const unsigned char *a)
+{
+	return (uint16_t)a[0]|((uint16_t)a[1]<<8);
+}
+
+static inline uint32_t
+ptpip_get32 (const unsigned char *a)
+{
+	return (uint32_t)a[0]|((uint32_t)a[1]<<8)|
+		((uint32_t)a[2]<<16)|((uint32_t)a[3]<<24);
+}
+
+static inline uint64_t
+ptpip_get64 (const unsigned char *a)
+{
+	return (uint64_t)ptpip_get32(a)|((uint64_t)ptpip_get32(a+4)<<32);
+}
+
+/* waits until fd is ready, timeout in ms, -1 waits forever */
+static uint16_t
+ptpip_poll (int fd, short events, int timeout)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd=fd;
+	pfd.events=events;
+	do {
+		ret=poll(&pfd, 1, timeout);
+	} while (ret<0 && errno==EINTR);
+	if (ret==0)
+		return PTP_ERROR_NOEVENT;
+	if (ret<0 || (pfd.revents&(POLLERR|POLLNVAL)))
+		return PTP_ERROR_IO;
+	return PTP_RC_OK;
+}
+
+/* sends all of iov, the transaction deadline applies */
+static uint16_t
+ptpip_sendv (PTPParams* params, int fd, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	while (iovcnt>0) {
+		if (ptpip_poll(fd, POLLOUT, ptp_timeout_left(params))
+			!=PTP_RC_OK)
+			return PTP_ERROR_IO;
+		msg.msg_iov=iov;
+		msg.msg_iovlen=iovcnt;
+		n=sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (n<0) {
+			if (errno==EINTR || errno==EAGAIN)
+				continue;
+			return PTP_ERROR_IO;
+		}
+		while (iovcnt>0 && (size_t)n>=iov->iov_len) {
+			n-=iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt>0) {
+			iov->iov_base=(char *)iov->iov_base+n;
+			iov->iov_len-=n;
+		}
+	}
+	return PTP_RC_OK;
+}
+
+static uint16_t
+ptpip_send (PTPParams* params, int fd, unsigned char *buf, size_t len)
+{
+	struct iovec iov;
+
+	iov.iov_base=buf;
+	iov.iov_len=len;
+	return ptpip_sendv(params, fd, &iov, 1);
+}
+
+/*
+ * receives exactly len bytes, straight into buf; every recv() waits for
+ * what is there, so that the poll() bounds it
+ */
+static uint16_t
+ptpip_recv (PTPParams* params, int fd, unsigned char *buf, size_t len,
+	int timeout)
+{
+	ssize_t n;
+	uint16_t ret;
+
+	while (len>0) {
+		ret=ptpip_poll(fd, POLLIN, timeout<0?ptp_timeout_left(params):
+			timeout);
+		if (ret!=PTP_RC_OK)
+			return ret==PTP_ERROR_NOEVENT?PTP_ERROR_IO:ret;
+		n=recv(fd, buf, len, 0);
+		if (n<0) {
+			if (errno==EINTR || errno==EAGAIN)
+				continue;
+			return PTP_ERROR_IO;
+		}
+		if (n==0)	/* connection closed */
+			return PTP_ERROR_IO;
+		buf+=n;
+		len-=n;
+	}
+	return PTP_RC_OK;
+}
+
+/* reads the length and type of the next packet */
+static uint16_t
+ptpip_recv_hdr (PTPParams* params, int fd, uint32_t *len, uint32_t *type,
+	int timeout)
+{
+	unsigned char hdr[PTPIP_HDR_LEN];
+
+	CHECK_PTP_RC(ptpip_recv(params, fd, hdr, sizeof(hdr), timeout));
+	*len=ptpip_get32(hdr);
+	*type=ptpip_get32(hdr+4);
+	if (*len<PTPIP_HDR_LEN) {
+		ptpip_error(params, "PTP/IP: bad packet length %u", *len);
+		return PTP_ERROR_IO;
+	}
+	*len-=PTPIP_HDR_LEN;
+	return PTP_RC_OK;
+}
+
+/* throws away len bytes of a packet we are not interested in */
+static uint16_t
+ptpip_skip (PTPParams* params, int fd, uint32_t len)
+{
+	unsigned char buf[256];
+	uint32_t n;
+
+	while (len>0) {
+		n=len>sizeof(buf)?sizeof(buf):len;
+		CHECK_PTP_RC(ptpip_recv(params, fd, buf, n, -1));
+		len-=n;
+	}
+	return PTP_RC_OK;
+}
+
+/* sends the held back operation request */
+static uint16_t
+ptpip_flush_req (PTPParams* params, uint32_t dataphase)
+{
+	PTPIPConnection *c=params->ptpip;
+
+	if (!c->pending)
+		return PTP_RC_OK;
+	c->pending=0;
+	htole32a(c->req+PTPIP_HDR_LEN, dataphase);
+	return ptpip_send(params, c->cmdfd, c->req, ptpip_get32(c->req));
+}
+
+uint16_t
+ptp_ptpip_sendreq (PTPParams* params, PTPContainer* req)
+{
+	PTPIPConnection *c=params->ptpip;
+	unsigned char *p;
+	uint32_t len=PTPIP_HDR_LEN+10+4*req->Nparam;
+
+	if (c==NULL || req->Nparam>5)
+		return PTP_ERROR_BADPARAM;
+	p=c->req;
+	htole32a(p, len);
+	htole32a(p+4, PTPIP_OPERATION_REQUEST);
+	/* data phase is filled in by ptpip_flush_req() */
+	htole16a(p+12, req->Code);
+	htole32a(p+14, req->Transaction_ID);
+	htole32a(p+18, req->Param1);
+	htole32a(p+22, req->Param2);
+	htole32a(p+26, req->Param3);
+	htole32a(p+30, req->Param4);
+	htole32a(p+34, req->Param5);
+	c->pending=1;
+	return PTP_RC_OK;
+}
+
+uint16_t
+ptp_ptpip_senddata (PTPParams* params, PTPContainer* ptp,
+			unsigned char *data, unsigned int size)
+{
+	PTPIPConnection *c=params->ptpip;
+	unsigned char start[PTPIP_HDR_LEN+12];
+	unsigned char end[PTPIP_HDR_LEN+4];
+	struct iovec iov[3];
+
+	CHECK_PTP_RC(ptpip_flush_req(params, PTPIP_DATAPHASE_OUT));
+	htole32a(start, sizeof(start));
+	htole32a(start+4, PTPIP_START_DATA);
+	htole32a(start+8, ptp->Transaction_ID);
+	htole64a(start+12, (uint64_t)size);
+	/* whole data phase in one EndData packet */
+	htole32a(end, sizeof(end)+size);
+	htole32a(end+4, PTPIP_END_DATA);
+	htole32a(end+8, ptp->Transaction_ID);
+	iov[0].iov_base=start;
+	iov[0].iov_len=sizeof(start);
+	iov[1].iov_base=end;
+	iov[1].iov_len=sizeof(end);
+	iov[2].iov_base=data;
+	iov[2].iov_len=size;
+	return ptpip_sendv(params, c->cmdfd, iov, size?3:2);
+}
+
+uint16_t
+ptp_ptpip_getresp (PTPParams* params, PTPContainer* resp)
+{
+	PTPIPConnection *c=params->ptpip;
+	unsigned char buf[PTPIP_REQ_LEN];
+	uint32_t len, type;
+	uint16_t ret;
+
+	CHECK_PTP_RC(ptpip_flush_req(params, PTPIP_DATAPHASE_NONE));
+	CHECK_PTP_RC(ptpip_recv_hdr(params, c->cmdfd, &len, &type, -1));
+	if (type!=PTPIP_OPERATION_RESPONSE || len<6 ||
+	    len>sizeof(buf)-PTPIP_HDR_LEN) {
+		ptpip_skip(params, c->cmdfd, len);
+		return PTP_ERROR_RESP_EXPECTED;
+	}
+	memset(buf, 0, sizeof(buf));
+	CHECK_PTP_RC(ptpip_recv(params, c->cmdfd, buf, len, -1));
+	ret=ptpip_get16(buf);
+	if (ret!=PTP_RC_OK)
+		return ret;
+	resp->Code=ret;
+	resp->SessionID=params->session_id;
+	resp->Transaction_ID=ptpip_get32(buf+2);
+	resp->Param1=ptpip_get32(buf+6);
+	resp->Param2=ptpip_get32(buf+10);
+	resp->Param3=ptpip_get32(buf+14);
+	resp->Param4=ptpip_get32(buf+18);
+	resp->Param5=ptpip_get32(buf+22);
+	resp->Nparam=(len-6)/4;
+	return ret;
+}
+
+/* the sink of a data phase too long for the caller's buffer */
+static uint16_t
+ptpip_discard (void *priv, unsigned char *data, unsigned int size,
+	uint64_t offset)
+{
+	return PTP_RC_OK;
+}
+
+/*
+ * ptp_cancel() during a data phase: the responder is told on the event
+ * connection and what it sends up to the response is thrown away, so
+ * that the command connection stays in step
+ */
+static uint16_t
+ptpip_cancelled (PTPParams* params, PTPContainer* ptp)
+{
+	PTPIPConnection *c=params->ptpip;
+	unsigned char buf[PTPIP_HDR_LEN+4];
+	uint32_t len, type;
+
+	params->cancel=0;
+	htole32a(buf, sizeof(buf));
+	htole32a(buf+4, PTPIP_CANCEL_TRANSACTION);
+	htole32a(buf+8, ptp->Transaction_ID);
+	if (ptpip_send(params, c->evtfd, buf, sizeof(buf))!=PTP_RC_OK)
+		ptpip_error(params, "PTP/IP: cancelling transaction 0x%08x "
+			"failed", ptp->Transaction_ID);
+	do {
+		CHECK_PTP_RC(ptpip_recv_hdr(params, c->cmdfd, &len, &type, -1));
+		CHECK_PTP_RC(ptpip_skip(params, c->cmdfd, len));
+	} while (type!=PTPIP_OPERATION_RESPONSE);
+	return PTP_ERROR_CANCEL;
+}
+
+/*
+ * Receives a data phase: StartData, any number of Data packets and
+ * EndData. The payload is received straight into *data (allocated if
+ * NULL; *getlen is its capacity otherwise, 0 if unchecked) or, if sink
+ * is given, in chunk_size pieces passed to the sink. ptp_cancel() is
+ * seen between the packets.
+ */
+static uint16_t
+ptpip_getdata (PTPParams* params, PTPContainer* ptp, uint64_t *getlen,
+	unsigned char **data, PTPDataSinkFunc sink, void *priv)
+{
+	PTPIPConnection *c=params->ptpip;
+	unsigned char buf[PTPIP_REQ_LEN];
+	unsigned char *chunk=NULL;
+	uint32_t len, type;
+	uint64_t total, offset=0, capacity=*getlen;
+	unsigned int chunklen=0, fill=0, n;
+	uint16_t ret, sinkret=PTP_RC_OK;
+	int overflow=0;
+
+	CHECK_PTP_RC(ptpip_flush_req(params, PTPIP_DATAPHASE_NONE));
+	CHECK_PTP_RC(ptpip_recv_hdr(params, c->cmdfd, &len, &type, -1));
+	if (type==PTPIP_OPERATION_RESPONSE && len>=6 &&
+	    len<=sizeof(buf)-PTPIP_HDR_LEN) {
+		/* no data phase, return the response code like USB does */
+		CHECK_PTP_RC(ptpip_recv(params, c->cmdfd, buf, len, -1));
+		ret=ptpip_get16(buf);
+		return ret==PTP_RC_OK?PTP_ERROR_DATA_EXPECTED:ret;
+	}
+	if (type!=PTPIP_START_DATA || len<12) {
+		ptpip_skip(params, c->cmdfd, len);
+		return PTP_ERROR_DATA_EXPECTED;
+	}
+	/* transaction ID and total length, anything past them is skipped */
+	CHECK_PTP_RC(ptpip_recv(params, c->cmdfd, buf, 12, -1));
+	if (len>12)
+		CHECK_PTP_RC(ptpip_skip(params, c->cmdfd, len-12));
+	total=ptpip_get64(buf+4);
+	/* only a sink takes 4GB or more */
+	if (sink==NULL && total>0xffffffffULL) {
+		ptpip_error(params, "PTP/IP: data phase of %llu bytes too "
+			"long", (unsigned long long)total);
+		return PTP_ERROR_IO;
+	}
+	ptp_transaction_deadline(params, ptp->Code, total);
+	/* too long for the caller's buffer, received in chunks and thrown
+	   away, the caller learns the length needed */
+	if (sink==NULL && *data!=NULL && capacity>0 && total>capacity) {
+		sink=ptpip_discard;
+		overflow=1;
+	}
+	if (sink!=NULL) {
+		chunklen=params->chunk_size?params->chunk_size:
+			PTP_USB_DATA_CHUNK_LEN;
+		if (chunklen>total) chunklen=(unsigned int)total;
+		chunk=malloc(chunklen?chunklen:1);
+		if (chunk==NULL)
+			return PTP_ERROR_IO;
+	} else
+	if (*data==NULL) {
+		*data=ptp_data_alloc(params, (unsigned int)total);
+		if (*data==NULL)
+			return PTP_ERROR_IO;
+	}
+	do {
+		if (params->cancel) {
+			ret=ptpip_cancelled(params, ptp);
+			break;
+		}
+		ret=ptpip_recv_hdr(params, c->cmdfd, &len, &type, -1);
+		if (ret!=PTP_RC_OK)
+			break;
+		if ((type!=PTPIP_DATA && type!=PTPIP_END_DATA) || len<4) {
+			ret=PTP_ERROR_DATA_EXPECTED;
+			break;
+		}
+		ret=ptpip_recv(params, c->cmdfd, buf, 4, -1);
+		if (ret!=PTP_RC_OK)
+			break;
+		len-=4;
+		if (offset+len>total) {
+			ptpip_error(params, "PTP/IP: data phase longer than "
+				"announced");
+			ret=PTP_ERROR_IO;
+			break;
+		}
+		while (len>0) {
+			if (sink==NULL) {
+				n=len;
+				ret=ptpip_recv(params, c->cmdfd,
+					*data+offset, n, -1);
+			} else {
+				n=chunklen-fill;
+				if (n>len) n=len;
+				ret=ptpip_recv(params, c->cmdfd,
+					chunk+fill, n, -1);
+				fill+=n;
+				if (ret==PTP_RC_OK && fill==chunklen) {
+					if (sinkret==PTP_RC_OK)
+						sinkret=sink(priv, chunk, fill,
+							offset+n-fill);
+					fill=0;
+				}
+			}
+			if (ret!=PTP_RC_OK)
+				break;
+			offset+=n;
+			len-=n;
+		}
+	} while (ret==PTP_RC_OK && type!=PTPIP_END_DATA);
+	if (ret==PTP_RC_OK && sink!=NULL && fill>0 && sinkret==PTP_RC_OK)
+		sinkret=sink(priv, chunk, fill, offset-fill);
+	free(chunk);
+	*getlen=offset;
+	if (ret==PTP_RC_OK && sinkret!=PTP_RC_OK)
+		ret=PTP_ERROR_SINK;
+	if (overflow) {
+		*getlen=total;
+		if (ret==PTP_RC_OK)
+			ret=PTP_ERROR_CAPACITY;
+	}
+	return ret;
+}
+
+uint16_t
+ptp_ptpip_getdata (PTPParams* params, PTPContainer* ptp,
+		unsigned int *getlen, unsigned char **data)
+{
+	uint64_t len=*getlen;
+	uint16_t ret;
+
+	ret=ptpip_getdata(params, ptp, &len, data, NULL, NULL);
+	*getlen=len;
+	return ret;
+}
+
+uint16_t
+ptp_ptpip_getdata_sink (PTPParams* params, PTPContainer* ptp,
+		uint64_t *getlen, PTPDataSinkFunc sink, void *priv)
+{
+	return ptpip_getdata(params, ptp, getlen, NULL, sink, priv);
+}
+
+static uint16_t
+ptpip_event (PTPParams* params, PTPContainer* event, int timeout)
+{
+	PTPIPConnection *c=params->ptpip;
+	unsigned char buf[PTPIP_REQ_LEN];
+	uint32_t len, type;
+	uint16_t ret;
+
+	for (;;) {
+		ret=ptpip_poll(c->evtfd, POLLIN, timeout);
+		if (ret!=PTP_RC_OK)
+			return ret;
+		CHECK_PTP_RC(ptpip_recv_hdr(params, c->evtfd, &len, &type,
+			ptp_event_timeout(params)));
+		if (type==PTPIP_PROBE_REQUEST) {
+			/* keepalive, answer it */
+			unsigned char probe[PTPIP_HDR_LEN];
+
+			CHECK_PTP_RC(ptpip_skip(params, c->evtfd, len));
+			htole32a(probe, sizeof(probe));
+			htole32a(probe+4, PTPIP_PROBE_RESPONSE);
+			CHECK_PTP_RC(ptpip_send(params, c->evtfd, probe,
+				sizeof(probe)));
+			continue;
+		}
+		if (type!=PTPIP_EVENT || len<6 ||
+		    len>sizeof(buf)-PTPIP_HDR_LEN) {
+			CHECK_PTP_RC(ptpip_skip(params, c->evtfd, len));
+			continue;
+		}
+		memset(buf, 0, sizeof(buf));
+		CHECK_PTP_RC(ptpip_recv(params, c->evtfd, buf, len,
+			ptp_event_timeout(params)));
+		event->Code=ptpip_get16(buf);
+		event->SessionID=params->session_id;
+		event->Transaction_ID=ptpip_get32(buf+2);
+		event->Param1=ptpip_get32(buf+6);
+		event->Param2=ptpip_get32(buf+10);
+		event->Param3=ptpip_get32(buf+14);
+		event->Nparam=(len-6)/4;
+		return PTP_RC_OK;
+	}
+}
+
+uint16_t
+ptp_ptpip_event_check (PTPParams* params, PTPContainer* event)
+{
+	return ptpip_event(params, event, 0);
+}
+
+uint16_t
+ptp_ptpip_event_wait (PTPParams* params, PTPContainer* event)
+{
+	uint16_t ret=ptpip_event(params, event, ptp_event_timeout(params));
+
+	return ret==PTP_ERROR_NOEVENT?PTP_ERROR_IO:ret;
+}
+
+static int
+ptpip_socket (PTPParams* params, const char *host, unsigned short port,
+	int cmd)
+{
+	struct addrinfo hints, *res, *ai;
+	char service[8];
+	int fd=-1, one=1, bufsize=PTPIP_SOCKBUF, err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_socktype=SOCK_STREAM;
+	snprintf(service, sizeof(service), "%u", port);
+	err=getaddrinfo(host, service, &hints, &res);
+	if (err!=0) {
+		ptpip_error(params, "PTP/IP: %s: %s", host, gai_strerror(err));
+		return -1;
+	}
+	for (ai=res; ai!=NULL; ai=ai->ai_next) {
+		fd=socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd<0)
+			continue;
+		if (cmd) {
+			/* object data: big buffers, set before connect()
+			   so the window scale is negotiated accordingly */
+			setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize,
+				sizeof(bufsize));
+			setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize,
+				sizeof(bufsize));
+		}
+		/* requests and responses are small, don't delay them */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen)==0)
+			break;
+		close(fd);
+		fd=-1;
+	}
+	freeaddrinfo(res);
+	if (fd<0)
+		ptpip_error(params, "PTP/IP: could not connect to %s:%u: %s",
+			host, port, strerror(errno));
+	return fd;
+}
+
+/* packs an ASCII string as a null terminated UTF-16LE one */
+static unsigned int
+ptpip_pack_name (unsigned char *p, const char *name, unsigned int max)
+{
+	unsigned int i;
+
+	for (i=0; name[i]!='\0' && 2*i+2<max; i++)
+		htole16a(p+2*i, (uint16_t)(unsigned char)name[i]);
+	htole16a(p+2*i, 0);
+	return 2*i+2;
+}
+
+/**
+ * ptp_ptpip_connect:
+ * params:	PTPParams*
+ *		const char *host	- responder's host name or address
+ *		unsigned short port	- TCP port, 0 for PTPIP_PORT
+ *		const char *name	- our friendly name
+ *
+ * Opens the command/data and the event connections to a PTP/IP
+ * responder and sets up params to do transactions over them.
+ * Only the I/O functions, byte order and params->ptpip are set, the
+ * caller's error/debug functions, data and timeouts are kept.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_ptpip_connect (PTPParams* params, const char *host, unsigned short port,
+	const char *name)
+{
+	PTPIPConnection *c;
+	unsigned char buf[PTPIP_HDR_LEN+16+2*64+4];
+	unsigned char *p;
+	uint32_t len, type, i, seed;
+	uint16_t ret;
+
+	if (params==NULL || host==NULL)
+		return PTP_ERROR_BADPARAM;
+	if (port==0) port=PTPIP_PORT;
+	c=calloc(1, sizeof(PTPIPConnection));
+	if (c==NULL)
+		return PTP_ERROR_IO;
+	c->evtfd=-1;
+	params->ptpip=c;
+	params->byteorder=PTP_DL_LE;
+	params->sendreq_func=ptp_ptpip_sendreq;
+	params->senddata_func=ptp_ptpip_senddata;
+	params->getresp_func=ptp_ptpip_getresp;
+	params->getdata_func=ptp_ptpip_getdata;
+	params->getdatasink_func=ptp_ptpip_getdata_sink;
+	params->event_check=ptp_ptpip_event_check;
+	params->event_wait=ptp_ptpip_event_wait;
+	ptp_transaction_deadline(params, 0, 0);
+
+	c->cmdfd=ptpip_socket(params, host, port, 1);
+	if (c->cmdfd<0) {
+		ret=PTP_ERROR_IO;
+		goto fail;
+	}
+	/* Init Command Request: GUID, friendly name, protocol version */
+	p=buf+PTPIP_HDR_LEN;
+	seed=(uint32_t)getpid()^(uint32_t)(unsigned long)params;
+	for (i=0; i<16; i++) {
+		seed=seed*1103515245+12345;
+		p[i]=(unsigned char)(seed>>16);
+	}
+	p+=16;
+	p+=ptpip_pack_name(p, name?name:"libptp2", 2*64);
+	htole32a(p, PTPIP_VERSION);
+	p+=4;
+	htole32a(buf, p-buf);
+	htole32a(buf+4, PTPIP_INIT_COMMAND_REQUEST);
+	ret=ptpip_send(params, c->cmdfd, buf, p-buf);
+	if (ret!=PTP_RC_OK)
+		goto fail;
+	ret=ptpip_recv_hdr(params, c->cmdfd, &len, &type, -1);
+	if (ret!=PTP_RC_OK)
+		goto fail;
+	if (type!=PTPIP_INIT_COMMAND_ACK || len<4) {
+		if (type==PTPIP_INIT_FAIL && len>=4 &&
+		    ptpip_recv(params, c->cmdfd, buf, 4, -1)==PTP_RC_OK)
+			ptpip_error(params, "PTP/IP: connection refused, "
+				"reason %u", ptpip_get32(buf));
+		ret=PTP_ERROR_IO;
+		goto fail;
+	}
+	ret=ptpip_recv(params, c->cmdfd, buf, 4, -1);
+	if (ret!=PTP_RC_OK)
+		goto fail;
+	c->number=ptpip_get32(buf);
+	/* responder's GUID, name and version are of no use to us */
+	ret=ptpip_skip(params, c->cmdfd, len-4);
+	if (ret!=PTP_RC_OK)
+		goto fail;
+
+	/* Init Event Request on the second connection */
+	c->evtfd=ptpip_socket(params, host, port, 0);
+	if (c->evtfd<0) {
+		ret=PTP_ERROR_IO;
+		goto fail;
+	}
+	htole32a(buf, PTPIP_HDR_LEN+4);
+	htole32a(buf+4, PTPIP_INIT_EVENT_REQUEST);
+	htole32a(buf+8, c->number);
+	ret=ptpip_send(params, c->evtfd, buf, PTPIP_HDR_LEN+4);
+	if (ret!=PTP_RC_OK)
+		goto fail;
+	ret=ptpip_recv_hdr(params, c->evtfd, &len, &type, -1);
+	if (ret!=PTP_RC_OK)
+		goto fail;
+	if (type!=PTPIP_INIT_EVENT_ACK) {
+		ptpip_error(params, "PTP/IP: event connection refused");
+		ret=PTP_ERROR_IO;
+		goto fail;
+	}
+	ret=ptpip_skip(params, c->evtfd, len);
+	if (ret!=PTP_RC_OK)
+		goto fail;
+	params->deadline=0;
+	return PTP_RC_OK;
+fail:
+	ptp_ptpip_disconnect(params);
+	return ret;
+}
+
+/**
+ * ptp_ptpip_disconnect:
+ * params:	PTPParams*
+ *
+ * Closes both connections opened by ptp_ptpip_connect().
+ **/
+void
+ptp_ptpip_disconnect (PTPParams* params)
+{
+	PTPIPConnection *c=params->ptpip;
+
+	if (c==NULL)
+		return;
+	if (c->evtfd>=0) close(c->evtfd);
+	if (c->cmdfd>=0) close(c->cmdfd);
+	free(c);
+	params->ptpip=NULL;
+}
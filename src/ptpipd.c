@@ -0,0 +1,596 @@
+/* ptpipd.c
+ *
+ * A stand-in PTP/IP responder: serves a fake camera with a configurable
+ * number of JPEG objects, so the PTP/IP transport can be exercised and
+ * benchmarked over loopback without a network camera.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+#include "ptp.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define PTPIPD_STORAGE		0x00010001
+#define PTPIPD_MAX_OBJECTS	65536
+/* Data packet payload */
+#define PTPIPD_DATA_LEN		(1024*1024)
+
+static short verbose=0;
+
+/* the object store */
+static unsigned int nobjects=16;
+static uint32_t objsize=4*1024*1024;
+static unsigned char *deleted;
+static int session;
+
+/* growable packet buffer */
+typedef struct {
+	unsigned char *p;
+	size_t len, size;
+} Buf;
+
+static void
+buf_put (Buf *b, const void *data, size_t len)
+{
+	if (b->len+len>b->size) {
+		b->size=(b->len+len)*2;
+		b->p=realloc(b->p, b->size);
+		if (b->p==NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(b->p+b->len, data, len);
+	b->len+=len;
+}
+
+static void
+put16 (Buf *b, uint16_t v)
+{
+	unsigned char a[2];
+
+	htole16a(a, v);
+	buf_put(b, a, 2);
+}
+
+static void
+put32 (Buf *b, uint32_t v)
+{
+	unsigned char a[4];
+
+	htole32a(a, v);
+	buf_put(b, a, 4);
+}
+
+static void
+put64 (Buf *b, uint64_t v)
+{
+	unsigned char a[8];
+
+	htole64a(a, v);
+	buf_put(b, a, 8);
+}
+
+/* PTP string: number of UCS-2 characters including the terminator */
+static void
+putstr (Buf *b, const char *s)
+{
+	size_t i, n=strlen(s);
+	unsigned char len;
+
+	if (n==0) {
+		buf_put(b, "", 1);
+		return;
+	}
+	if (n>254) n=254;
+	len=n+1;
+	buf_put(b, &len, 1);
+	for (i=0; i<=n; i++)
+		put16(b, i<n?(unsigned char)s[i]:0);
+}
+
+static void
+putarr16 (Buf *b, const uint16_t *v, unsigned int n)
+{
+	unsigned int i;
+
+	put32(b, n);
+	for (i=0; i<n; i++)
+		put16(b, v[i]);
+}
+
+static uint32_t
+get32 (const unsigned char *a)
+{
+	return (uint32_t)a[0]|((uint32_t)a[1]<<8)|
+		((uint32_t)a[2]<<16)|((uint32_t)a[3]<<24);
+}
+
+static int
+sendall (int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+
+	while (iovcnt>0) {
+		n=writev(fd, iov, iovcnt);
+		if (n<0) {
+			if (errno==EINTR) continue;
+			return -1;
+		}
+		while (iovcnt>0 && (size_t)n>=iov->iov_len) {
+			n-=iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt>0) {
+			iov->iov_base=(char *)iov->iov_base+n;
+			iov->iov_len-=n;
+		}
+	}
+	return 0;
+}
+
+static int
+recvall (int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len>0) {
+		n=recv(fd, buf, len, MSG_WAITALL);
+		if (n<0 && errno==EINTR) continue;
+		if (n<=0) return -1;
+		buf=(char *)buf+n;
+		len-=n;
+	}
+	return 0;
+}
+
+/* sends a packet of given type, body and optional payload */
+static int
+send_packet (int fd, uint32_t type, Buf *body, const void *payload,
+	size_t len)
+{
+	unsigned char hdr[PTPIP_HDR_LEN];
+	struct iovec iov[3];
+
+	htole32a(hdr, PTPIP_HDR_LEN+body->len+len);
+	htole32a(hdr+4, type);
+	iov[0].iov_base=hdr;
+	iov[0].iov_len=sizeof(hdr);
+	iov[1].iov_base=body->p;
+	iov[1].iov_len=body->len;
+	iov[2].iov_base=(void *)payload;
+	iov[2].iov_len=len;
+	return sendall(fd, iov, len?3:2);
+}
+
+/* reads the next packet, the body goes to b */
+static int
+recv_packet (int fd, uint32_t *type, Buf *b)
+{
+	unsigned char hdr[PTPIP_HDR_LEN];
+	uint32_t len;
+
+	if (recvall(fd, hdr, sizeof(hdr))<0)
+		return -1;
+	len=get32(hdr);
+	*type=get32(hdr+4);
+	if (len<PTPIP_HDR_LEN)
+		return -1;
+	len-=PTPIP_HDR_LEN;
+	b->len=0;
+	if (len>b->size) {
+		b->size=len;
+		b->p=realloc(b->p, len);
+		if (b->p==NULL)
+			return -1;
+	}
+	if (recvall(fd, b->p, len)<0)
+		return -1;
+	b->len=len;
+	return 0;
+}
+
+static int
+send_response (int fd, uint16_t code, uint32_t tid, int nparam,
+	uint32_t param1)
+{
+	Buf b={NULL, 0, 0};
+	int ret;
+
+	put16(&b, code);
+	put32(&b, tid);
+	if (nparam>0) put32(&b, param1);
+	ret=send_packet(fd, PTPIP_OPERATION_RESPONSE, &b, NULL, 0);
+	free(b.p);
+	return ret;
+}
+
+static int
+send_event (int fd, uint16_t code, uint32_t tid, uint32_t param1)
+{
+	Buf b={NULL, 0, 0};
+	int ret;
+
+	put16(&b, code);
+	put32(&b, tid);
+	put32(&b, param1);
+	ret=send_packet(fd, PTPIP_EVENT, &b, NULL, 0);
+	free(b.p);
+	return ret;
+}
+
+/*
+ * sends a data phase of len bytes; data is repeated as needed if it is
+ * shorter (object contents are a pattern)
+ */
+static int
+send_data (int fd, uint32_t tid, const unsigned char *data, size_t datalen,
+	uint64_t len)
+{
+	Buf b={NULL, 0, 0};
+	uint64_t sent=0;
+	size_t n;
+	int ret;
+
+	put32(&b, tid);
+	put64(&b, len);
+	ret=send_packet(fd, PTPIP_START_DATA, &b, NULL, 0);
+	b.len=0;
+	put32(&b, tid);
+	while (ret==0) {
+		n=len-sent>datalen?datalen:len-sent;
+		if (sent+n==len) {
+			ret=send_packet(fd, PTPIP_END_DATA, &b, data, n);
+			break;
+		}
+		ret=send_packet(fd, PTPIP_DATA, &b, data, n);
+		sent+=n;
+	}
+	free(b.p);
+	return ret;
+}
+
+/* reads and throws away a data phase sent to us */
+static int
+skip_data (int fd, Buf *b)
+{
+	uint32_t type;
+
+	do {
+		if (recv_packet(fd, &type, b)<0)
+			return -1;
+	} while (type!=PTPIP_END_DATA && type!=PTPIP_CANCEL_TRANSACTION);
+	return 0;
+}
+
+static int
+valid_handle (uint32_t handle)
+{
+	return handle>=1 && handle<=nobjects && !deleted[handle-1];
+}
+
+static void
+pack_deviceinfo (Buf *b)
+{
+	static const uint16_t ops[]={
+		PTP_OC_GetDeviceInfo, PTP_OC_OpenSession,
+		PTP_OC_CloseSession, PTP_OC_GetStorageIDs,
+		PTP_OC_GetStorageInfo, PTP_OC_GetNumObjects,
+		PTP_OC_GetObjectHandles, PTP_OC_GetObjectInfo,
+		PTP_OC_GetObject, PTP_OC_DeleteObject, PTP_OC_InitiateCapture
+	};
+	static const uint16_t events[]={
+		PTP_EC_ObjectAdded, PTP_EC_CaptureComplete
+	};
+	static const uint16_t formats[]={PTP_OFC_EXIF_JPEG};
+
+	put16(b, 100);			/* StandardVersion */
+	put32(b, 0);			/* VendorExtensionID */
+	put16(b, 0);			/* VendorExtensionVersion */
+	putstr(b, "");			/* VendorExtensionDesc */
+	put16(b, 0);			/* FunctionalMode */
+	putarr16(b, ops, sizeof(ops)/sizeof(ops[0]));
+	putarr16(b, events, sizeof(events)/sizeof(events[0]));
+	putarr16(b, NULL, 0);		/* DevicePropertiesSupported */
+	putarr16(b, formats, 1);	/* CaptureFormats */
+	putarr16(b, formats, 1);	/* ImageFormats */
+	putstr(b, "libptp2");
+	putstr(b, "ptpipd");
+	putstr(b, VERSION);
+	putstr(b, "0000000001");
+}
+
+static void
+pack_storageinfo (Buf *b)
+{
+	put16(b, PTP_ST_FixedRAM);
+	put16(b, PTP_FST_GenericHierarchical);
+	put16(b, PTP_AC_ReadWrite);
+	put64(b, (uint64_t)nobjects*objsize);	/* MaxCapability */
+	put64(b, 0);				/* FreeSpaceInBytes */
+	put32(b, 0);				/* FreeSpaceInImages */
+	putstr(b, "ptpipd");
+	putstr(b, "");
+}
+
+static void
+pack_objectinfo (Buf *b, uint32_t handle)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "IMG_%04u.JPG", handle%10000);
+	put32(b, PTPIPD_STORAGE);
+	put16(b, PTP_OFC_EXIF_JPEG);
+	put16(b, 0);			/* ProtectionStatus */
+	put32(b, objsize);		/* ObjectCompressedSize */
+	put16(b, 0);			/* ThumbFormat */
+	put32(b, 0);			/* ThumbCompressedSize */
+	put32(b, 0);			/* ThumbPixWidth */
+	put32(b, 0);			/* ThumbPixHeight */
+	put32(b, 4000);			/* ImagePixWidth */
+	put32(b, 3000);			/* ImagePixHeight */
+	put32(b, 24);			/* ImageBitDepth */
+	put32(b, 0);			/* ParentObject */
+	put16(b, 0);			/* AssociationType */
+	put32(b, 0);			/* AssociationDesc */
+	put32(b, handle);		/* SequenceNumber */
+	putstr(b, name);
+	putstr(b, "20060101T120000");	/* CaptureDate */
+	putstr(b, "20060101T120000");	/* ModificationDate */
+	putstr(b, "");			/* Keywords */
+}
+
+/* serves one session, returns when the initiator disconnects */
+static void
+serve (int cmdfd, int evtfd)
+{
+	static unsigned char pattern[PTPIPD_DATA_LEN];
+	Buf req={NULL, 0, 0}, data={NULL, 0, 0};
+	uint32_t type, phase, tid, param1, i, n;
+	uint16_t code, rc;
+
+	for (i=0; i<sizeof(pattern); i++)
+		pattern[i]=(unsigned char)(i*7);
+	session=0;
+	while (recv_packet(cmdfd, &type, &req)==0) {
+		if (type!=PTPIP_OPERATION_REQUEST || req.len<10)
+			continue;
+		phase=get32(req.p);
+		code=req.p[4]|(req.p[5]<<8);
+		tid=get32(req.p+6);
+		param1=req.len>=14?get32(req.p+10):0;
+		if (verbose)
+			fprintf(stderr, "request 0x%04x tid %u param1 0x%08x\n",
+				code, tid, param1);
+		if (phase==PTPIP_DATAPHASE_OUT && skip_data(cmdfd, &data)<0)
+			break;
+		data.len=0;
+		rc=PTP_RC_OK;
+		if (!session && code!=PTP_OC_GetDeviceInfo &&
+		    code!=PTP_OC_OpenSession) {
+			send_response(cmdfd, PTP_RC_SessionNotOpen, tid, 0, 0);
+			continue;
+		}
+		switch (code) {
+		case PTP_OC_GetDeviceInfo:
+			pack_deviceinfo(&data);
+			break;
+		case PTP_OC_OpenSession:
+			if (session) rc=PTP_RC_SessionAlreadyOpened;
+			session=1;
+			break;
+		case PTP_OC_CloseSession:
+			session=0;
+			break;
+		case PTP_OC_GetStorageIDs:
+			put32(&data, 1);
+			put32(&data, PTPIPD_STORAGE);
+			break;
+		case PTP_OC_GetStorageInfo:
+			if (param1!=PTPIPD_STORAGE)
+				rc=PTP_RC_InvalidStorageId;
+			else
+				pack_storageinfo(&data);
+			break;
+		case PTP_OC_GetNumObjects:
+		case PTP_OC_GetObjectHandles:
+			for (i=0, n=0; i<nobjects; i++)
+				if (!deleted[i]) n++;
+			if (code==PTP_OC_GetNumObjects) {
+				send_response(cmdfd, rc, tid, 1, n);
+				continue;
+			}
+			put32(&data, n);
+			for (i=0; i<nobjects; i++)
+				if (!deleted[i]) put32(&data, i+1);
+			break;
+		case PTP_OC_GetObjectInfo:
+			if (!valid_handle(param1))
+				rc=PTP_RC_InvalidObjectHandle;
+			else
+				pack_objectinfo(&data, param1);
+			break;
+		case PTP_OC_GetObject:
+			if (!valid_handle(param1)) {
+				rc=PTP_RC_InvalidObjectHandle;
+				break;
+			}
+			if (send_data(cmdfd, tid, pattern, sizeof(pattern),
+				objsize)<0)
+				goto out;
+			break;
+		case PTP_OC_DeleteObject:
+			if (param1==0xffffffff)
+				memset(deleted, 1, nobjects);
+			else if (!valid_handle(param1))
+				rc=PTP_RC_InvalidObjectHandle;
+			else
+				deleted[param1-1]=1;
+			break;
+		case PTP_OC_InitiateCapture:
+			if (nobjects==PTPIPD_MAX_OBJECTS) {
+				rc=PTP_RC_StoreFull;
+				break;
+			}
+			deleted[nobjects++]=0;
+			send_response(cmdfd, rc, tid, 0, 0);
+			send_event(evtfd, PTP_EC_ObjectAdded, tid, nobjects);
+			send_event(evtfd, PTP_EC_CaptureComplete, tid, 0);
+			continue;
+		default:
+			rc=PTP_RC_OperationNotSupported;
+			break;
+		}
+		if (data.len>0 && rc==PTP_RC_OK &&
+		    send_data(cmdfd, tid, data.p, data.len, data.len)<0)
+			break;
+		if (send_response(cmdfd, rc, tid, 0, 0)<0)
+			break;
+	}
+out:
+	free(req.p);
+	free(data.p);
+}
+
+/* accepts a connection and reads its init request */
+static int
+accept_init (int sock, uint32_t want, Buf *b)
+{
+	uint32_t type;
+	int fd, one=1;
+
+	fd=accept(sock, NULL, NULL);
+	if (fd<0) {
+		perror("accept");
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (recv_packet(fd, &type, b)<0 || type!=want) {
+		fprintf(stderr, "ptpipd: unexpected packet type %u\n", type);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+usage (void)
+{
+	printf("USAGE: ptpipd [-a ADDRESS] [-p PORT] [-n OBJECTS] "
+		"[-s OBJECT_SIZE] [-v]\n"
+		"Serves a fake PTP/IP camera (default 127.0.0.1:%u, "
+		"16 objects of 4MB)\n", PTPIP_PORT);
+}
+
+int
+main (int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	Buf b={NULL, 0, 0};
+	int sock, cmdfd, evtfd, opt, one=1, bufsize=PTPIP_SOCKBUF;
+	unsigned char guid[16];
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(PTPIP_PORT);
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	while ((opt=getopt(argc, argv, "a:p:n:s:vh"))!=-1) {
+		switch (opt) {
+		case 'a':
+			if (inet_pton(AF_INET, optarg, &addr.sin_addr)!=1) {
+				fprintf(stderr, "bad address %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			addr.sin_port=htons(strtol(optarg, NULL, 10));
+			break;
+		case 'n':
+			nobjects=strtoul(optarg, NULL, 10);
+			if (nobjects>=PTPIPD_MAX_OBJECTS)
+				nobjects=PTPIPD_MAX_OBJECTS-1;
+			break;
+		case 's':
+			objsize=strtoul(optarg, NULL, 10);
+			break;
+		case 'v':
+			verbose++;
+			break;
+		default:
+			usage();
+			return opt=='h'?0:1;
+		}
+	}
+	deleted=calloc(PTPIPD_MAX_OBJECTS, 1);
+	signal(SIGPIPE, SIG_IGN);
+
+	sock=socket(AF_INET, SOCK_STREAM, 0);
+	if (sock<0) {
+		perror("socket");
+		return 1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	/* inherited by the accepted connections */
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))<0 ||
+	    listen(sock, 2)<0) {
+		perror("bind");
+		return 1;
+	}
+	memset(guid, 0x5a, sizeof(guid));
+	for (;;) {
+		cmdfd=accept_init(sock, PTPIP_INIT_COMMAND_REQUEST, &b);
+		if (cmdfd<0)
+			continue;
+		/* Init Command Ack: connection number, GUID, name, version */
+		b.len=0;
+		put32(&b, 1);
+		buf_put(&b, guid, sizeof(guid));
+		put16(&b, 'p'); put16(&b, 't'); put16(&b, 'p');
+		put16(&b, 'i'); put16(&b, 'p'); put16(&b, 'd'); put16(&b, 0);
+		put32(&b, PTPIP_VERSION);
+		send_packet(cmdfd, PTPIP_INIT_COMMAND_ACK, &b, NULL, 0);
+
+		evtfd=accept_init(sock, PTPIP_INIT_EVENT_REQUEST, &b);
+		if (evtfd<0) {
+			close(cmdfd);
+			continue;
+		}
+		b.len=0;
+		send_packet(evtfd, PTPIP_INIT_EVENT_ACK, &b, NULL, 0);
+		if (verbose)
+			fprintf(stderr, "ptpipd: initiator connected\n");
+		serve(cmdfd, evtfd);
+		close(evtfd);
+		close(cmdfd);
+		if (verbose)
+			fprintf(stderr, "ptpipd: initiator disconnected\n");
+	}
+	return 0;
+}
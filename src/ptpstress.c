@@ -0,0 +1,304 @@
+/* ptpstress.c
+ *
+ * Drives many virtual cameras from one process at once, one thread and one
+ * PTPParams each, and checks every object read back, so the transaction
+ * path can be tested for sessions running side by side.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+#include "ptp.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>
+#define PTPSTRESS_THREADS
+#endif
+
+#define PTPSTRESS_MAX_THREADS	64
+/* the payload of a virtual camera object repeats every that many bytes,
+   byte i being i*7, see ptp_vcam_open() */
+#define PTPSTRESS_PATTERN_LEN	65536
+
+static short verbose=0;
+static unsigned int nthreads=16;
+static unsigned int rounds=4;
+static PTPVCamConfig config={8, 1024*1024, 0, 0, 0, 0};
+
+/* a camera and its thread */
+typedef struct {
+#ifdef PTPSTRESS_THREADS
+	pthread_t thread;
+#endif
+	unsigned int id;
+	PTPParams params;
+	unsigned long objects;
+	unsigned long failures;
+	uint64_t bytes;
+} Camera;
+
+/* an object being read, see check_sink() */
+typedef struct {
+	Camera *c;
+	uint32_t handle;
+	uint64_t next;
+	int bad;
+} Check;
+
+static void
+stress_error (void *data, const char *format, va_list args)
+{
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+}
+
+static void
+stress_debug (void *data, const char *format, va_list args)
+{
+	if (verbose<2)
+		return;
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+}
+
+static void
+failure (Camera *c, const char *what, uint32_t handle, uint16_t rc)
+{
+	fprintf(stderr, "camera %u: %s 0x%08lx failed (0x%04x)\n", c->id,
+		what, (unsigned long)handle, rc);
+	c->failures++;
+}
+
+/* takes the data phase of GetObject, comparing it with the pattern */
+static uint16_t
+check_sink (void *priv, unsigned char *data, unsigned int size,
+		uint64_t offset)
+{
+	Check *k=(Check *)priv;
+	unsigned int i;
+
+	if (offset!=k->next) {
+		fprintf(stderr, "camera %u: object 0x%08lx: got offset %llu, "
+			"expected %llu\n", k->c->id, (unsigned long)k->handle,
+			(unsigned long long)offset,
+			(unsigned long long)k->next);
+		k->bad=1;
+		return PTP_ERROR_IO;
+	}
+	for (i=0; i<size; i++)
+		if (data[i]!=(unsigned char)
+		    (((offset+i)%PTPSTRESS_PATTERN_LEN)*7)) {
+			fprintf(stderr, "camera %u: object 0x%08lx: bad byte "
+				"at %llu\n", k->c->id,
+				(unsigned long)k->handle,
+				(unsigned long long)(offset+i));
+			k->bad=1;
+			return PTP_ERROR_IO;
+		}
+	k->next+=size;
+	return PTP_RC_OK;
+}
+
+/* reads back every object of the camera once */
+static void
+get_all (Camera *c)
+{
+	PTPParams *params=&c->params;
+	PTPObjectHandles handles;
+	PTPObjectInfo oi;
+	Check k;
+	uint64_t size;
+	uint16_t rc;
+	unsigned int i;
+
+	rc=ptp_getobjecthandles(params, 0xffffffff, 0, 0, &handles);
+	if (rc!=PTP_RC_OK) {
+		failure(c, "GetObjectHandles", 0, rc);
+		return;
+	}
+	if (handles.n!=config.objects) {
+		fprintf(stderr, "camera %u: %lu objects, expected %u\n",
+			c->id, (unsigned long)handles.n, config.objects);
+		c->failures++;
+	}
+	for (i=0; i<handles.n; i++) {
+		memset(&oi, 0, sizeof(oi));
+		rc=ptp_getobjectinfo(params, handles.Handler[i], &oi);
+		if (rc!=PTP_RC_OK) {
+			failure(c, "GetObjectInfo", handles.Handler[i], rc);
+			continue;
+		}
+		rc=ptp_object_size(params, handles.Handler[i], &oi, &size);
+		free(oi.Filename);
+		free(oi.Keywords);
+		if (rc!=PTP_RC_OK) {
+			failure(c, "ObjectSize", handles.Handler[i], rc);
+			continue;
+		}
+		if (size!=config.object_size) {
+			fprintf(stderr, "camera %u: object 0x%08lx has %llu "
+				"bytes, expected %llu\n", c->id,
+				(unsigned long)handles.Handler[i],
+				(unsigned long long)size,
+				(unsigned long long)config.object_size);
+			c->failures++;
+			continue;
+		}
+		k.c=c;
+		k.handle=handles.Handler[i];
+		k.next=0;
+		k.bad=0;
+		rc=ptp_getobject_sink(params, handles.Handler[i], size,
+			check_sink, &k);
+		if (k.bad)
+			c->failures++;
+		else if (rc!=PTP_RC_OK)
+			failure(c, "GetObject", handles.Handler[i], rc);
+		else if (k.next!=size) {
+			fprintf(stderr, "camera %u: object 0x%08lx: got %llu "
+				"bytes\n", c->id,
+				(unsigned long)handles.Handler[i],
+				(unsigned long long)k.next);
+			c->failures++;
+		}
+		c->objects++;
+		c->bytes+=k.next;
+	}
+	free(handles.Handler);
+}
+
+static void *
+camera_thread (void *arg)
+{
+	Camera *c=(Camera *)arg;
+	PTPParams *params=&c->params;
+	unsigned int r;
+	uint16_t rc;
+
+	memset(params, 0, sizeof(PTPParams));
+	params->error_func=stress_error;
+	params->debug_func=stress_debug;
+	rc=ptp_vcam_open(params, &config);
+	if (rc!=PTP_RC_OK) {
+		failure(c, "opening camera", 0, rc);
+		return NULL;
+	}
+	rc=ptp_opensession(params, c->id+1);
+	if (rc!=PTP_RC_OK)
+		failure(c, "OpenSession", 0, rc);
+	else {
+		for (r=0; r<rounds; r++)
+			get_all(c);
+		rc=ptp_closesession(params);
+		if (rc!=PTP_RC_OK)
+			failure(c, "CloseSession", 0, rc);
+	}
+	ptp_vcam_close(params);
+	ptp_bufpool_flush(params);
+	if (verbose)
+		printf("camera %u: %lu objects, %llu bytes, %lu failures\n",
+			c->id, c->objects, (unsigned long long)c->bytes,
+			c->failures);
+	return NULL;
+}
+
+static void
+usage (void)
+{
+	printf("USAGE: ptpstress [-t THREADS] [-r ROUNDS] [-n OBJECTS] "
+		"[-s OBJECT_SIZE] [-v]\n"
+		"Reads every object of THREADS virtual cameras ROUNDS times "
+		"at once\n(default 16 cameras, 4 rounds, 8 objects of 1MB) "
+		"and checks the data\n");
+}
+
+int
+main (int argc, char **argv)
+{
+	Camera *cams;
+	struct timeval start, end;
+	unsigned long objects=0, failures=0;
+	uint64_t bytes=0;
+	double secs;
+	unsigned int i;
+	int opt;
+
+	while ((opt=getopt(argc, argv, "t:r:n:s:vh"))!=-1) {
+		switch (opt) {
+		case 't':
+			nthreads=strtoul(optarg, NULL, 10);
+			if (nthreads<1)
+				nthreads=1;
+			if (nthreads>PTPSTRESS_MAX_THREADS)
+				nthreads=PTPSTRESS_MAX_THREADS;
+			break;
+		case 'r':
+			rounds=strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			config.objects=strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			config.object_size=strtoull(optarg, NULL, 10);
+			break;
+		case 'v':
+			verbose++;
+			break;
+		default:
+			usage();
+			return opt=='h'?0:1;
+		}
+	}
+	cams=calloc(nthreads, sizeof(Camera));
+	if (cams==NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i=0; i<nthreads; i++) {
+		cams[i].id=i;
+#ifdef PTPSTRESS_THREADS
+		if (pthread_create(&cams[i].thread, NULL, camera_thread,
+		    &cams[i])!=0) {
+			perror("pthread_create");
+			return 1;
+		}
+#else
+		camera_thread(&cams[i]);
+#endif
+	}
+	for (i=0; i<nthreads; i++) {
+#ifdef PTPSTRESS_THREADS
+		pthread_join(cams[i].thread, NULL);
+#endif
+		objects+=cams[i].objects;
+		bytes+=cams[i].bytes;
+		failures+=cams[i].failures;
+	}
+	gettimeofday(&end, NULL);
+	secs=(end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec)/1e6;
+
+	printf("%u cameras: %lu objects, %.1f MB in %.2fs (%.1f MB/s), "
+		"%lu failures\n", nthreads, objects, bytes/1048576.0, secs,
+		secs>0?bytes/1048576.0/secs:0, failures);
+	free(cams);
+	return failures?1:0;
+}
@@ -0,0 +1,216 @@
+/* recover.c
+ *
+ * Error recovery of the transaction layer: failed transactions are
+ * classified, the transport is brought back in step (halted pipes
+ * cleared, the class Device Reset sent, the session reopened) and those
+ * safe to repeat are tried again after a backoff doubling up to a limit.
+ *
+ *  This file is part of libptp2.
+ *
+ *  libptp2 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  libptp2 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libptp2; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+#include "ptp.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+static void
+recover_sleep_ms (unsigned int ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec=ms/1000;
+	ts.tv_nsec=(ms%1000)*1000000;
+	while (nanosleep(&ts, &ts)==-1 && errno==EINTR);
+}
+
+/**
+ * ptp_error_class:
+ * rc:		uint16_t		- PTP_RC_* or PTP_ERROR_* code
+ *
+ * Return values: the PTP_ERRCLASS_* of rc, i.e. what may help after it.
+ **/
+int
+ptp_error_class (uint16_t rc)
+{
+	switch (rc) {
+	case PTP_RC_OK:
+		return PTP_ERRCLASS_NONE;
+	case PTP_RC_DeviceBusy:
+		return PTP_ERRCLASS_BUSY;
+	case PTP_ERROR_IO:
+	case PTP_ERROR_DATA_EXPECTED:
+	case PTP_ERROR_RESP_EXPECTED:
+	case PTP_RC_IncompleteTransfer:
+		return PTP_ERRCLASS_TRANSPORT;
+	case PTP_RC_SessionNotOpen:
+	case PTP_RC_InvalidTransactionID:
+		return PTP_ERRCLASS_SESSION;
+	default:
+		return PTP_ERRCLASS_FATAL;
+	}
+}
+
+/**
+ * ptp_recover_retryable:
+ * code:	uint16_t		- operation code
+ *
+ * Return values: true if the operation may be sent again after it failed
+ * somewhere on the way, i.e. it has no effect on the device or the same
+ * one each time.
+ **/
+int
+ptp_recover_retryable (uint16_t code)
+{
+	switch (code) {
+	case PTP_OC_GetDeviceInfo:
+	case PTP_OC_GetStorageIDs:
+	case PTP_OC_GetStorageInfo:
+	case PTP_OC_GetNumObjects:
+	case PTP_OC_GetObjectHandles:
+	case PTP_OC_GetObjectInfo:
+	case PTP_OC_GetObject:
+	case PTP_OC_GetThumb:
+	case PTP_OC_GetDevicePropDesc:
+	case PTP_OC_GetDevicePropValue:
+	case PTP_OC_SetDevicePropValue:
+	case PTP_OC_ResetDevicePropValue:
+	case PTP_OC_GetPartialObject:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * ptp_recover_delay:
+ * recovery:	const PTPRecovery*
+ *		unsigned int attempt	- 1 for the first retry
+ *
+ * Return values: ms to wait before the retry, recovery->backoff doubled
+ * with every attempt up to recovery->backoff_max.
+ **/
+unsigned int
+ptp_recover_delay (const PTPRecovery *recovery, unsigned int attempt)
+{
+	unsigned int delay=recovery->backoff;
+
+	while (--attempt>0 && delay<recovery->backoff_max)
+		delay*=2;
+	if (recovery->backoff_max>0 && delay>recovery->backoff_max)
+		delay=recovery->backoff_max;
+	return delay;
+}
+
+/*
+ * reopens the session after the device lost it; OpenSession goes without
+ * recovery, so that a failure here does not recurse
+ */
+static uint16_t
+recover_session (PTPParams* params)
+{
+	PTPRecovery recovery=params->recovery;
+	uint32_t session=params->session_id;
+	uint16_t ret;
+
+	if (session==0)
+		return PTP_RC_OK;
+	memset(&params->recovery, 0, sizeof(PTPRecovery));
+	ret=ptp_opensession(params, session);
+	params->recovery=recovery;
+	if (ret==PTP_RC_SessionAlreadyOpened)
+		ret=PTP_RC_OK;
+	return ret;
+}
+
+/**
+ * ptp_recover:
+ * params:	PTPParams*
+ *		uint16_t code		- operation code of the transaction
+ *		uint16_t rc		- what it failed with
+ *		unsigned int attempt	- 1 after the first failure
+ *		int retry		- may the caller repeat it at all
+ *
+ * Called by the transaction functions after a transaction failed, as
+ * params->recovery says; does nothing if that has neither retries nor
+ * actions, or if rc is PTP_ERRCLASS_FATAL. Transport errors clear halted
+ * pipes and, from the second attempt on, reset the device and reopen the
+ * session; a lost session is reopened; a busy device is just waited for.
+ * Every attempt is told to recovery.report. Operations not
+ * ptp_recover_retryable() are brought back in step but not repeated,
+ * unless PTP_RECOVER_ANY_OP.
+ *
+ * Return values: true if the caller is to send the transaction again,
+ * which it may after the backoff waited here.
+ **/
+int
+ptp_recover (PTPParams* params, uint16_t code, uint16_t rc,
+		unsigned int attempt, int retry)
+{
+	PTPRecovery *r=&params->recovery;
+	PTPRecoverAttempt a;
+
+	if (r->retries==0 && r->actions==0)
+		return 0;
+	memset(&a, 0, sizeof(a));
+	a.code=code;
+	a.rc=rc;
+	a.errclass=ptp_error_class(rc);
+	a.attempt=attempt;
+	a.action_rc=PTP_RC_OK;
+	if (a.errclass==PTP_ERRCLASS_NONE || a.errclass==PTP_ERRCLASS_FATAL)
+		return 0;
+	a.retry=retry && attempt<=r->retries &&
+		((r->actions&PTP_RECOVER_ANY_OP) ||
+		ptp_recover_retryable(code));
+
+	switch (a.errclass) {
+	case PTP_ERRCLASS_TRANSPORT:
+		if ((r->actions&PTP_RECOVER_CLEAR_HALT) &&
+		    params->clearhalt_func!=NULL) {
+			a.actions|=PTP_RECOVER_CLEAR_HALT;
+			a.action_rc=params->clearhalt_func(params->data);
+		}
+		if (attempt<2 || !(r->actions&PTP_RECOVER_RESET) ||
+		    params->reset_func==NULL)
+			break;
+		a.actions|=PTP_RECOVER_RESET;
+		a.action_rc=params->reset_func(params->data);
+		if (a.action_rc!=PTP_RC_OK)
+			break;
+		/* the reset closed the session */
+		if (r->actions&PTP_RECOVER_RESYNC) {
+			a.actions|=PTP_RECOVER_RESYNC;
+			a.action_rc=recover_session(params);
+		}
+		break;
+	case PTP_ERRCLASS_SESSION:
+		if (r->actions&PTP_RECOVER_RESYNC) {
+			a.actions|=PTP_RECOVER_RESYNC;
+			a.action_rc=recover_session(params);
+		}
+		break;
+	}
+	if (a.retry)
+		a.delay=ptp_recover_delay(r, attempt);
+	if (r->report!=NULL)
+		r->report(r->priv, &a);
+	if (a.delay>0)
+		recover_sleep_ms(a.delay);
+	return a.retry;
+}
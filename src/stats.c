@@ -0,0 +1,248 @@
+/* stats.c
+ *
+ * Per operation code transaction statistics: how many, how many failed,
+ * bytes moved and latency histograms of the request, data and response
+ * phases. Built in by configure --enable-stats only; the hooks in
+ * ptp.c cost nothing otherwise.
+ *
+ *  This file is part of libptp2.
+ *
+ *  libptp2 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  libptp2 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libptp2; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+#include "ptp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef HAVE_CLOCK_GETTIME
+#include <sys/time.h>
+#endif
+
+#ifdef PTP_STATS
+
+struct _PTPStats {
+	PTPOpStats op[PTP_STATS_OPCODES];
+	unsigned int nops;
+	/* the transaction in progress, cur is NULL if none */
+	PTPOpStats *cur;
+	uint64_t start;
+	uint64_t mark;			/* end of the last phase */
+	uint64_t bytes;
+};
+
+static uint64_t
+stats_now_us (void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec*1000000+tv.tv_usec;
+#endif
+}
+
+/*
+ * histogram bucket of us: 0-3 have a bucket each, above that every
+ * power of two is split into 4 buckets
+ */
+static unsigned int
+stats_bucket (uint64_t us)
+{
+	unsigned int o, b;
+
+	if (us<4)
+		return us;
+#ifdef __GNUC__
+	o=63-__builtin_clzll(us);
+#else
+	for (o=2; (us>>(o+1))!=0; o++)
+		;
+#endif
+	b=4*(o-1)+((us>>(o-2))&3);
+	return b<PTP_STATS_BUCKETS?b:PTP_STATS_BUCKETS-1;
+}
+
+/* the largest us falling into bucket b */
+static uint32_t
+stats_bucket_max (unsigned int b)
+{
+	unsigned int o=b/4+1;
+	uint64_t max;
+
+	if (b<4)
+		return b;
+	max=((uint64_t)(5+b%4)<<(o-2))-1;
+	return max>0xffffffff?0xffffffff:max;
+}
+
+static void
+stats_record (PTPStats *s, int phase, uint64_t now)
+{
+	s->cur->hist[phase][stats_bucket(now-s->mark)]++;
+	s->mark=now;
+}
+
+/* hook: a transaction of code starts */
+void
+ptp_stats_begin (PTPParams* params, uint16_t code)
+{
+	PTPStats *s=params->stats;
+	unsigned int i;
+
+	s->cur=NULL;
+	for (i=0; i<s->nops; i++)
+		if (s->op[i].code==code) {
+			s->cur=&s->op[i];
+			break;
+		}
+	if (s->cur==NULL) {
+		if (s->nops==PTP_STATS_OPCODES)
+			return;
+		s->cur=&s->op[s->nops++];
+		s->cur->code=code;
+	}
+	s->bytes=0;
+	s->start=s->mark=stats_now_us();
+}
+
+/* hook: bytes were moved by the data phase */
+void
+ptp_stats_bytes (PTPParams* params, uint64_t bytes)
+{
+	params->stats->bytes+=bytes;
+}
+
+/*
+ * hook: a phase of the transaction ended with rc, which is returned; the
+ * response phase or an error ends the transaction
+ */
+uint16_t
+ptp_stats_phase (PTPParams* params, int phase, uint16_t rc)
+{
+	PTPStats *s=params->stats;
+	uint64_t now;
+
+	if (s->cur==NULL)
+		return rc;
+	now=stats_now_us();
+	stats_record(s, phase, now);
+	/* the data phase may fail and the transaction go on */
+	if (phase!=PTP_STATS_RESPONSE && (rc==PTP_RC_OK ||
+	    rc==PTP_ERROR_SINK || rc==PTP_ERROR_CAPACITY))
+		return rc;
+	s->cur->hist[PTP_STATS_TOTAL][stats_bucket(now-s->start)]++;
+	s->cur->count++;
+	if (rc!=PTP_RC_OK)
+		s->cur->errors++;
+	s->cur->bytes+=s->bytes;
+	s->cur=NULL;
+	return rc;
+}
+
+#endif /* PTP_STATS */
+
+/**
+ * ptp_stats_enable:
+ * params:	PTPParams*
+ *
+ * Starts collecting statistics of the transactions of params.
+ *
+ * Return values: PTP_RC_OK, PTP_RC_OperationNotSupported if the library was
+ * built without --enable-stats, PTP_ERROR_IO if out of memory.
+ **/
+uint16_t
+ptp_stats_enable (PTPParams* params)
+{
+#ifdef PTP_STATS
+	if (params->stats!=NULL)
+		return PTP_RC_OK;
+	params->stats=calloc(1, sizeof(PTPStats));
+	if (params->stats==NULL)
+		return PTP_ERROR_IO;
+	return PTP_RC_OK;
+#else
+	return PTP_RC_OperationNotSupported;
+#endif
+}
+
+/* stops collecting statistics and frees them */
+void
+ptp_stats_disable (PTPParams* params)
+{
+	free(params->stats);
+	params->stats=NULL;
+}
+
+/**
+ * ptp_stats_get:
+ * params:	PTPParams*
+ *		unsigned int *n		- operation codes seen (returned)
+ *
+ * Return values: the statistics of each operation code, in the order they
+ * were first used, NULL if none are collected. Valid until
+ * ptp_stats_disable().
+ **/
+const PTPOpStats *
+ptp_stats_get (PTPParams* params, unsigned int *n)
+{
+	*n=0;
+#ifdef PTP_STATS
+	if (params->stats!=NULL) {
+		*n=params->stats->nops;
+		return params->stats->op;
+	}
+#endif
+	return NULL;
+}
+
+/**
+ * ptp_stats_percentile:
+ * stats:	const PTPOpStats*
+ *		int phase		- PTP_STATS_REQUEST ... PTP_STATS_TOTAL
+ *		unsigned int percent	- 1 to 100
+ *
+ * Return values: the latency in us that percent of the phases took at
+ * most, rounded up to the histogram bucket; 0 if there are none.
+ **/
+uint32_t
+ptp_stats_percentile (const PTPOpStats *stats, int phase,
+			unsigned int percent)
+{
+#ifdef PTP_STATS
+	uint64_t total=0, want, sum=0;
+	unsigned int b;
+
+	for (b=0; b<PTP_STATS_BUCKETS; b++)
+		total+=stats->hist[phase][b];
+	if (total==0)
+		return 0;
+	want=(total*percent+99)/100;
+	if (want==0)
+		want=1;
+	for (b=0; b<PTP_STATS_BUCKETS; b++) {
+		sum+=stats->hist[phase][b];
+		if (sum>=want)
+			return stats_bucket_max(b);
+	}
+#endif
+	return 0;
+}
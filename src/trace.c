@@ -0,0 +1,313 @@
+/* trace.c
+ *
+ * Session tracing: fixed size binary records of transaction begins,
+ * phase ends, bulk transfers, events and retries go into a ring kept in
+ * memory, to be written out as Chrome trace JSON (chrome://tracing,
+ * ui.perfetto.dev) when the session is over.
+ *
+ *  This file is part of libptp2.
+ *
+ *  libptp2 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  libptp2 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libptp2; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+#include "ptp.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifndef HAVE_CLOCK_GETTIME
+#include <sys/time.h>
+#endif
+
+/* Chrome trace threads the records are shown in */
+#define TRACE_TID_TRANSACTIONS	1
+#define TRACE_TID_BUS		2
+#define TRACE_TID_EVENTS	3
+
+typedef struct {
+	uint64_t ts;			/* us since ptp_trace_start() */
+	uint32_t dur;			/* us, transfers only */
+	uint32_t arg;			/* see PTP_TRACE_* */
+	uint16_t code;
+	uint16_t rc;
+	uint8_t type;
+} TraceRec;
+
+struct _PTPTrace {
+	TraceRec *ring;
+	unsigned int size;		/* power of 2 */
+	unsigned long head;		/* records ever put */
+	uint64_t start;
+};
+
+static uint64_t
+trace_clock_us (void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec*1000000+tv.tv_usec;
+#endif
+}
+
+/**
+ * ptp_trace_start:
+ * params:	PTPParams*
+ *		unsigned int records	- ring size, 0 for PTP_TRACE_RECORDS;
+ *					  rounded up to a power of 2
+ *
+ * Starts tracing the session. Once the ring is full the oldest records
+ * are overwritten.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_trace_start (PTPParams* params, unsigned int records)
+{
+	PTPTrace *t;
+	unsigned int size=1;
+
+	if (params->trace!=NULL)
+		return PTP_ERROR_BADPARAM;
+	if (records==0)
+		records=PTP_TRACE_RECORDS;
+	while (size<records && size<0x80000000)
+		size<<=1;
+	t=calloc(1, sizeof(PTPTrace));
+	if (t==NULL)
+		return PTP_ERROR_IO;
+	t->ring=malloc(size*sizeof(TraceRec));
+	if (t->ring==NULL) {
+		free(t);
+		return PTP_ERROR_IO;
+	}
+	t->size=size;
+	t->start=trace_clock_us();
+	params->trace=t;
+	return PTP_RC_OK;
+}
+
+/* stops tracing and frees the records */
+void
+ptp_trace_stop (PTPParams* params)
+{
+	if (params->trace==NULL)
+		return;
+	free(params->trace->ring);
+	free(params->trace);
+	params->trace=NULL;
+}
+
+/* hook: us since the trace started, the ts of ptp_trace_put() */
+uint64_t
+ptp_trace_now (PTPParams* params)
+{
+	return trace_clock_us()-params->trace->start;
+}
+
+/*
+ * hook: puts a record; the event pump thread puts records too, so the
+ * slot is taken atomically
+ */
+void
+ptp_trace_put (PTPParams* params, int type, uint16_t code, uint16_t rc,
+		uint32_t arg, uint64_t ts, uint32_t dur)
+{
+	PTPTrace *t=params->trace;
+	TraceRec *r;
+
+#ifdef __GNUC__
+	r=&t->ring[__sync_fetch_and_add(&t->head, 1)&(t->size-1)];
+#else
+	r=&t->ring[t->head++&(t->size-1)];
+#endif
+	r->ts=ts;
+	r->dur=dur;
+	r->arg=arg;
+	r->code=code;
+	r->rc=rc;
+	r->type=type;
+}
+
+/**
+ * ptp_trace_mark:
+ * params:	PTPParams*
+ *		int type		- PTP_TRACE_EVENT or PTP_TRACE_RETRY
+ *		uint16_t code		- event or operation code
+ *		uint32_t arg		- event Param1 or bytes retried
+ *
+ * Puts a record of something happening now into the trace, if the
+ * session is traced.
+ **/
+void
+ptp_trace_mark (PTPParams* params, int type, uint16_t code, uint32_t arg)
+{
+	if (params==NULL || params->trace==NULL)
+		return;
+	ptp_trace_put(params, type, code, PTP_RC_OK, arg,
+		ptp_trace_now(params), 0);
+}
+
+static const char *
+trace_phase_name (int phase)
+{
+	switch (phase) {
+	case PTP_STATS_REQUEST:
+		return "request";
+	case PTP_STATS_DATA:
+		return "data";
+	default:
+		return "response";
+	}
+}
+
+/* writes a Chrome trace complete (ph "X") event */
+static void
+trace_json_x (FILE *f, int *first, const char *name, int tid,
+		uint64_t ts, uint64_t dur, const char *args)
+{
+	fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+		"\"ts\":%llu,\"dur\":%llu,\"args\":{%s}}", *first?"":",",
+		name, tid, (unsigned long long)ts, (unsigned long long)dur,
+		args);
+	*first=0;
+}
+
+/* writes a Chrome trace instant (ph "i") event */
+static void
+trace_json_i (FILE *f, int *first, const char *name, int tid, uint64_t ts,
+		const char *args)
+{
+	fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,"
+		"\"tid\":%d,\"ts\":%llu,\"args\":{%s}}", *first?"":",",
+		name, tid, (unsigned long long)ts, args);
+	*first=0;
+}
+
+/**
+ * ptp_trace_dump:
+ * params:	PTPParams*
+ *		const char *filename	- JSON file to write
+ *
+ * Writes the records in the ring as Chrome trace JSON: transactions and
+ * their phases, bulk transfers and events each on a timeline of their
+ * own, so that idle bus time and host stalls show as gaps. Transactions
+ * whose begin was overwritten already are left out.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_trace_dump (PTPParams* params, const char *filename)
+{
+	PTPTrace *t=params->trace;
+	TraceRec *r;
+	FILE *f;
+	unsigned long i, from;
+	uint64_t start=0, mark=0;
+	uint16_t code=0;
+	uint32_t id=0;
+	int first=1, intxn=0;
+	const char *name;
+	char args[96], opname[24];
+
+	if (t==NULL)
+		return PTP_ERROR_BADPARAM;
+	f=fopen(filename, "w");
+	if (f==NULL)
+		return PTP_ERROR_IO;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	fprintf(f, "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"tid\":%d,\"args\":{\"name\":\"transactions\"}},",
+		TRACE_TID_TRANSACTIONS);
+	fprintf(f, "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"tid\":%d,\"args\":{\"name\":\"bus\"}},", TRACE_TID_BUS);
+	fprintf(f, "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"tid\":%d,\"args\":{\"name\":\"events\"}}", TRACE_TID_EVENTS);
+	first=0;
+
+	from=t->head>t->size?t->head-t->size:0;
+	for (i=from; i<t->head; i++) {
+		r=&t->ring[i&(t->size-1)];
+		switch (r->type) {
+		case PTP_TRACE_BEGIN:
+			intxn=1;
+			start=mark=r->ts;
+			code=r->code;
+			id=r->arg;
+			break;
+		case PTP_TRACE_PHASE:
+			if (!intxn)
+				break;
+			snprintf(args, sizeof(args), "\"rc\":\"0x%04x\"",
+				r->rc);
+			trace_json_x(f, &first, trace_phase_name(r->code),
+				TRACE_TID_TRANSACTIONS, mark, r->ts-mark, args);
+			mark=r->ts;
+			/* the same rule as ptp_stats_phase() */
+			if (r->code!=PTP_STATS_RESPONSE &&
+			    (r->rc==PTP_RC_OK || r->rc==PTP_ERROR_SINK ||
+			    r->rc==PTP_ERROR_CAPACITY))
+				break;
+			name=ptp_get_operation_name(params, code);
+			if (name==NULL) {
+				snprintf(opname, sizeof(opname), "0x%04x",
+					code);
+				name=opname;
+			}
+			snprintf(args, sizeof(args), "\"code\":\"0x%04x\","
+				"\"transaction\":%lu,\"rc\":\"0x%04x\"", code,
+				(unsigned long)id, r->rc);
+			trace_json_x(f, &first, name, TRACE_TID_TRANSACTIONS,
+				start, r->ts-start, args);
+			intxn=0;
+			break;
+		case PTP_TRACE_READ:
+		case PTP_TRACE_WRITE:
+			snprintf(args, sizeof(args), "\"bytes\":%lu,"
+				"\"rc\":\"0x%04x\"", (unsigned long)r->arg,
+				r->rc);
+			trace_json_x(f, &first,
+				r->type==PTP_TRACE_READ?"read":"write",
+				TRACE_TID_BUS, r->ts, r->dur, args);
+			break;
+		case PTP_TRACE_EVENT:
+			snprintf(args, sizeof(args), "\"code\":\"0x%04x\","
+				"\"param1\":%lu", r->code,
+				(unsigned long)r->arg);
+			trace_json_i(f, &first, "event", TRACE_TID_EVENTS,
+				r->ts, args);
+			break;
+		case PTP_TRACE_RETRY:
+			snprintf(args, sizeof(args), "\"code\":\"0x%04x\","
+				"\"bytes\":%lu", r->code,
+				(unsigned long)r->arg);
+			trace_json_i(f, &first, "retry",
+				TRACE_TID_TRANSACTIONS, r->ts, args);
+			break;
+		}
+	}
+	fprintf(f, "\n]}\n");
+	if (fclose(f)!=0)
+		return PTP_ERROR_IO;
+	return PTP_RC_OK;
+}
@@ -0,0 +1,920 @@
+/* vcam.c
+ *
+ * Virtual camera: an in-process PTP responder behind read_func,
+ * write_func and check_int_func. It speaks the USB bulk container
+ * protocol, so ptp_transaction(), the container and pack/unpack code
+ * and ptpcam workflows run unchanged without a camera, with a tunable
+ * per transaction latency and bandwidth.
+ *
+ *  This file is part of libptp2.
+ *
+ *  libptp2 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  libptp2 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libptp2; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+#include "ptp.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifndef HAVE_CLOCK_GETTIME
+#include <sys/time.h>
+#endif
+
+#define VCAM_STORAGE		0x00010001
+#define VCAM_MAX_OBJECTS	65536
+#define VCAM_PATTERN_LEN	65536
+#define VCAM_OUT_LEN		4	/* bulk IN transfers queued */
+#define VCAM_EVENT_RING_LEN	16	/* power of 2 */
+#define VCAM_NPROPS		5
+#define VCAM_DATA_LEN		64	/* data phase kept from the initiator */
+
+typedef struct {
+	uint16_t code;
+	uint16_t type;		/* PTP_DTC_UINT8/16/32 */
+	uint8_t getset;
+	uint8_t form;		/* PTP_DPFF_Range or PTP_DPFF_Enumeration */
+	uint32_t def, cur;
+	uint32_t min, max, step;
+	unsigned int nenum;
+	uint32_t en[8];
+} VCamProp;
+
+/* one bulk IN transfer: len bytes of buf followed by patlen pattern bytes
+   starting at patoff */
+typedef struct {
+	unsigned char *buf;
+	size_t len;
+	uint64_t patlen, patoff;
+	uint64_t pos;
+} VCamOut;
+
+/* growable buffer */
+typedef struct {
+	unsigned char *p;
+	size_t len, size;
+} VCamBuf;
+
+struct _PTPVCam {
+	PTPParams *params;
+	PTPVCamConfig config;
+	unsigned int nobjects;
+	unsigned char *deleted;
+	int session;
+	VCamProp props[VCAM_NPROPS];
+
+	/* bulk OUT: container being received */
+	unsigned char cnt[PTP_USB_BULK_REQ_LEN];
+	unsigned int cntlen;		/* bytes of cnt received */
+	uint32_t datalen, datapos;	/* data container payload */
+	unsigned char data[VCAM_DATA_LEN];
+	PTPContainer req;		/* request waiting for its data */
+	int want_data;
+
+	/* bulk IN */
+	VCamOut out[VCAM_OUT_LEN];
+	unsigned int outhead, outcnt;
+	unsigned long reads;		/* bulk IN transfers, see errors */
+
+	/* interrupt IN; filled by the request handler and drained by
+	   check_int, maybe in the event pump thread */
+	unsigned char events[VCAM_EVENT_RING_LEN][sizeof(PTPUSBEventContainer)];
+	unsigned int evhead, evtail, evpos;
+
+	uint64_t busy;			/* us, "bus" busy until */
+	unsigned char pattern[VCAM_PATTERN_LEN];
+};
+
+static uint64_t
+vcam_now_us (void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec*1000000+tv.tv_usec;
+#endif
+}
+
+static void
+vcam_sleep_us (uint64_t us)
+{
+	struct timespec ts;
+
+	ts.tv_sec=us/1000000;
+	ts.tv_nsec=(us%1000000)*1000;
+	while (nanosleep(&ts, &ts)!=0);
+}
+
+/* holds the caller back as long as the transfer would take on the bus */
+static void
+vcam_pace (PTPVCam *v, uint64_t bytes)
+{
+	uint64_t now;
+
+	if (v->config.bandwidth==0)
+		return;
+	now=vcam_now_us();
+	if (v->busy<now)
+		v->busy=now;
+	v->busy+=bytes*1000000/((uint64_t)v->config.bandwidth*1024);
+	if (v->busy>now)
+		vcam_sleep_us(v->busy-now);
+}
+
+static void
+vcam_put (VCamBuf *b, const void *data, size_t len)
+{
+	if (b->len+len>b->size) {
+		b->size=(b->len+len)*2;
+		b->p=realloc(b->p, b->size);
+		if (b->p==NULL) {
+			b->len=b->size=0;
+			return;
+		}
+	}
+	memcpy(b->p+b->len, data, len);
+	b->len+=len;
+}
+
+static void
+vcam_put16 (VCamBuf *b, uint16_t v)
+{
+	unsigned char a[2];
+
+	htole16a(a, v);
+	vcam_put(b, a, 2);
+}
+
+static void
+vcam_put32 (VCamBuf *b, uint32_t v)
+{
+	unsigned char a[4];
+
+	htole32a(a, v);
+	vcam_put(b, a, 4);
+}
+
+static void
+vcam_put64 (VCamBuf *b, uint64_t v)
+{
+	unsigned char a[8];
+
+	htole64a(a, v);
+	vcam_put(b, a, 8);
+}
+
+/* value of a property data type */
+static void
+vcam_putval (VCamBuf *b, uint16_t type, uint32_t v)
+{
+	unsigned char a=(unsigned char)v;
+
+	switch (type) {
+	case PTP_DTC_UINT8:	vcam_put(b, &a, 1);	break;
+	case PTP_DTC_UINT16:	vcam_put16(b, v);	break;
+	default:		vcam_put32(b, v);	break;
+	}
+}
+
+/* PTP string: number of UCS-2 characters including the terminator */
+static void
+vcam_putstr (VCamBuf *b, const char *s)
+{
+	size_t i, n=strlen(s);
+	unsigned char len;
+
+	if (n>254) n=254;
+	len=n?n+1:0;
+	vcam_put(b, &len, 1);
+	for (i=0; n && i<=n; i++)
+		vcam_put16(b, i<n?(unsigned char)s[i]:0);
+}
+
+static void
+vcam_putarr16 (VCamBuf *b, const uint16_t *v, unsigned int n)
+{
+	unsigned int i;
+
+	vcam_put32(b, n);
+	for (i=0; i<n; i++)
+		vcam_put16(b, v[i]);
+}
+
+static uint32_t
+vcam_get32 (const unsigned char *a)
+{
+	return (uint32_t)a[0]|((uint32_t)a[1]<<8)|
+		((uint32_t)a[2]<<16)|((uint32_t)a[3]<<24);
+}
+
+/* queues a bulk IN container: header, payload and patlen pattern bytes
+   from object offset patoff on */
+static uint16_t
+vcam_queue (PTPVCam *v, uint16_t type, uint16_t code, uint32_t tid,
+	VCamBuf *payload, uint64_t patlen, uint64_t patoff)
+{
+	VCamOut *o;
+	unsigned char *buf;
+	size_t len=PTP_USB_BULK_HDR_LEN+(payload?payload->len:0);
+
+	if (v->outcnt==VCAM_OUT_LEN)
+		return PTP_ERROR_IO;
+	buf=malloc(len);
+	if (buf==NULL)
+		return PTP_ERROR_IO;
+	htole32a(buf, len+patlen>0xffffffffULL?0xffffffff:
+		(uint32_t)(len+patlen));
+	htole16a(buf+4, type);
+	htole16a(buf+6, code);
+	htole32a(buf+8, tid);
+	if (payload!=NULL && payload->len>0)
+		memcpy(buf+PTP_USB_BULK_HDR_LEN, payload->p, payload->len);
+	o=&v->out[(v->outhead+v->outcnt)%VCAM_OUT_LEN];
+	o->buf=buf;
+	o->len=len;
+	o->patlen=patlen;
+	o->patoff=patoff;
+	o->pos=0;
+	v->outcnt++;
+	return PTP_RC_OK;
+}
+
+/* drops the bulk IN transfers queued */
+static void
+vcam_flush (PTPVCam *v)
+{
+	while (v->outcnt>0) {
+		free(v->out[v->outhead].buf);
+		v->outhead=(v->outhead+1)%VCAM_OUT_LEN;
+		v->outcnt--;
+	}
+}
+
+static void
+vcam_response (PTPVCam *v, uint16_t rc, uint32_t tid, int nparam,
+	uint32_t param1)
+{
+	VCamBuf b={NULL, 0, 0};
+
+	if (nparam>0)
+		vcam_put32(&b, param1);
+	vcam_queue(v, PTP_USB_CONTAINER_RESPONSE, rc, tid, &b, 0, 0);
+	free(b.p);
+}
+
+static void
+vcam_event (PTPVCam *v, uint16_t code, uint32_t tid, uint32_t param1)
+{
+	unsigned int head=v->evhead;
+	unsigned char *e;
+
+	if (head-__atomic_load_n(&v->evtail, __ATOMIC_ACQUIRE)==
+		VCAM_EVENT_RING_LEN)
+		return;		/* dropped, like a camera would */
+	e=v->events[head%VCAM_EVENT_RING_LEN];
+	htole32a(e, PTP_USB_BULK_HDR_LEN+4);
+	htole16a(e+4, PTP_USB_CONTAINER_EVENT);
+	htole16a(e+6, code);
+	htole32a(e+8, tid);
+	htole32a(e+12, param1);
+	__atomic_store_n(&v->evhead, head+1, __ATOMIC_RELEASE);
+}
+
+static VCamProp *
+vcam_prop (PTPVCam *v, uint32_t code)
+{
+	int i;
+
+	for (i=0; i<VCAM_NPROPS; i++)
+		if (v->props[i].code==code)
+			return &v->props[i];
+	return NULL;
+}
+
+static int
+vcam_valid_handle (PTPVCam *v, uint32_t handle)
+{
+	return handle>=1 && handle<=v->nobjects && !v->deleted[handle-1];
+}
+
+static const char *
+vcam_extension (uint16_t format)
+{
+	switch (format) {
+	case PTP_OFC_EXIF_JPEG:	return "JPG";
+	case PTP_OFC_TIFF:	return "TIF";
+	case PTP_OFC_Text:	return "TXT";
+	case PTP_OFC_WAV:	return "WAV";
+	case PTP_OFC_AVI:	return "AVI";
+	default:		return "DAT";
+	}
+}
+
+static void
+vcam_deviceinfo (PTPVCam *v, VCamBuf *b)
+{
+	static const uint16_t ops[]={
+		PTP_OC_GetDeviceInfo, PTP_OC_OpenSession,
+		PTP_OC_CloseSession, PTP_OC_GetStorageIDs,
+		PTP_OC_GetStorageInfo, PTP_OC_GetNumObjects,
+		PTP_OC_GetObjectHandles, PTP_OC_GetObjectInfo,
+		PTP_OC_GetObject, PTP_OC_DeleteObject,
+		PTP_OC_InitiateCapture, PTP_OC_GetDevicePropDesc,
+		PTP_OC_GetDevicePropValue, PTP_OC_SetDevicePropValue,
+		PTP_OC_GetPartialObject, PTP_OC_MTP_GetObjectPropValue,
+		PTP_OC_ANDROID_GetPartialObject64
+	};
+	static const uint16_t events[]={
+		PTP_EC_ObjectAdded, PTP_EC_CaptureComplete,
+		PTP_EC_DevicePropChanged
+	};
+	uint16_t props[VCAM_NPROPS];
+	int i;
+
+	for (i=0; i<VCAM_NPROPS; i++)
+		props[i]=v->props[i].code;
+	vcam_put16(b, 100);		/* StandardVersion */
+	vcam_put32(b, 0);		/* VendorExtensionID */
+	vcam_put16(b, 0);		/* VendorExtensionVersion */
+	vcam_putstr(b, "");		/* VendorExtensionDesc */
+	vcam_put16(b, 0);		/* FunctionalMode */
+	vcam_putarr16(b, ops, sizeof(ops)/sizeof(ops[0]));
+	vcam_putarr16(b, events, sizeof(events)/sizeof(events[0]));
+	vcam_putarr16(b, props, VCAM_NPROPS);
+	vcam_putarr16(b, &v->config.object_format, 1);	/* CaptureFormats */
+	vcam_putarr16(b, &v->config.object_format, 1);	/* ImageFormats */
+	vcam_putstr(b, "libptp2");
+	vcam_putstr(b, "Virtual Camera");
+	vcam_putstr(b, VERSION);
+	vcam_putstr(b, "vcam0001");
+}
+
+static void
+vcam_storageinfo (PTPVCam *v, VCamBuf *b)
+{
+	vcam_put16(b, PTP_ST_FixedRAM);
+	vcam_put16(b, PTP_FST_GenericHierarchical);
+	vcam_put16(b, PTP_AC_ReadWrite);
+	vcam_put64(b, (uint64_t)VCAM_MAX_OBJECTS*v->config.object_size);
+	vcam_put64(b, (uint64_t)(VCAM_MAX_OBJECTS-v->nobjects)*
+		v->config.object_size);
+	vcam_put32(b, VCAM_MAX_OBJECTS-v->nobjects);
+	vcam_putstr(b, "Virtual Camera");
+	vcam_putstr(b, "");
+}
+
+static void
+vcam_objectinfo (PTPVCam *v, VCamBuf *b, uint32_t handle)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "IMG_%04u.%s", handle%10000,
+		vcam_extension(v->config.object_format));
+	vcam_put32(b, VCAM_STORAGE);
+	vcam_put16(b, v->config.object_format);
+	vcam_put16(b, 0);		/* ProtectionStatus */
+	vcam_put32(b, v->config.object_size<PTP_OBJECT_SIZE_4GB?
+		v->config.object_size:PTP_OBJECT_SIZE_4GB);
+	vcam_put16(b, 0);		/* ThumbFormat */
+	vcam_put32(b, 0);		/* ThumbCompressedSize */
+	vcam_put32(b, 0);		/* ThumbPixWidth */
+	vcam_put32(b, 0);		/* ThumbPixHeight */
+	vcam_put32(b, 4000);		/* ImagePixWidth */
+	vcam_put32(b, 3000);		/* ImagePixHeight */
+	vcam_put32(b, 24);		/* ImageBitDepth */
+	vcam_put32(b, 0);		/* ParentObject */
+	vcam_put16(b, 0);		/* AssociationType */
+	vcam_put32(b, 0);		/* AssociationDesc */
+	vcam_put32(b, handle);		/* SequenceNumber */
+	vcam_putstr(b, name);
+	vcam_putstr(b, "20060101T120000");	/* CaptureDate */
+	vcam_putstr(b, "20060101T120000");	/* ModificationDate */
+	vcam_putstr(b, "");			/* Keywords */
+}
+
+static void
+vcam_propdesc (VCamBuf *b, VCamProp *p)
+{
+	unsigned int i;
+
+	vcam_put16(b, p->code);
+	vcam_put16(b, p->type);
+	vcam_put(b, &p->getset, 1);
+	vcam_putval(b, p->type, p->def);
+	vcam_putval(b, p->type, p->cur);
+	vcam_put(b, &p->form, 1);
+	if (p->form==PTP_DPFF_Range) {
+		vcam_putval(b, p->type, p->min);
+		vcam_putval(b, p->type, p->max);
+		vcam_putval(b, p->type, p->step);
+	} else {
+		vcam_put16(b, p->nenum);
+		for (i=0; i<p->nenum; i++)
+			vcam_putval(b, p->type, p->en[i]);
+	}
+}
+
+static uint16_t
+vcam_setprop (PTPVCam *v, VCamProp *p, const unsigned char *data,
+	uint32_t len)
+{
+	uint32_t val;
+	unsigned int i;
+
+	switch (p->type) {
+	case PTP_DTC_UINT8:
+		if (len<1) return PTP_RC_InvalidDevicePropValue;
+		val=data[0];
+		break;
+	case PTP_DTC_UINT16:
+		if (len<2) return PTP_RC_InvalidDevicePropValue;
+		val=data[0]|(data[1]<<8);
+		break;
+	default:
+		if (len<4) return PTP_RC_InvalidDevicePropValue;
+		val=vcam_get32(data);
+		break;
+	}
+	if (p->getset!=PTP_DPGS_GetSet)
+		return PTP_RC_AccessDenied;
+	if (p->form==PTP_DPFF_Range) {
+		if (val<p->min || val>p->max)
+			return PTP_RC_InvalidDevicePropValue;
+	} else {
+		for (i=0; i<p->nenum && p->en[i]!=val; i++);
+		if (i==p->nenum)
+			return PTP_RC_InvalidDevicePropValue;
+	}
+	if (p->cur!=val) {
+		p->cur=val;
+		vcam_event(v, PTP_EC_DevicePropChanged, 0, p->code);
+	}
+	return PTP_RC_OK;
+}
+
+/* answers a request, data is the data phase sent along, if any */
+static void
+vcam_request (PTPVCam *v, PTPContainer *req, const unsigned char *data,
+	uint32_t datalen)
+{
+	VCamBuf b={NULL, 0, 0};
+	uint64_t patlen=0, patoff=0;
+	int dataphase=0;
+	uint16_t rc=PTP_RC_OK;
+	uint32_t i, n;
+	VCamProp *p;
+
+	if (!v->session && req->Code!=PTP_OC_GetDeviceInfo &&
+	    req->Code!=PTP_OC_OpenSession) {
+		vcam_response(v, PTP_RC_SessionNotOpen, req->Transaction_ID,
+			0, 0);
+		return;
+	}
+	switch (req->Code) {
+	case PTP_OC_GetDeviceInfo:
+		vcam_deviceinfo(v, &b);
+		break;
+	case PTP_OC_OpenSession:
+		if (v->session) rc=PTP_RC_SessionAlreadyOpened;
+		v->session=1;
+		break;
+	case PTP_OC_CloseSession:
+		v->session=0;
+		break;
+	case PTP_OC_GetStorageIDs:
+		vcam_put32(&b, 1);
+		vcam_put32(&b, VCAM_STORAGE);
+		break;
+	case PTP_OC_GetStorageInfo:
+		if (req->Param1!=VCAM_STORAGE)
+			rc=PTP_RC_InvalidStorageId;
+		else
+			vcam_storageinfo(v, &b);
+		break;
+	case PTP_OC_GetNumObjects:
+	case PTP_OC_GetObjectHandles:
+		for (i=0, n=0; i<v->nobjects; i++)
+			if (!v->deleted[i]) n++;
+		if (req->Code==PTP_OC_GetNumObjects) {
+			vcam_response(v, rc, req->Transaction_ID, 1, n);
+			return;
+		}
+		vcam_put32(&b, n);
+		for (i=0; i<v->nobjects; i++)
+			if (!v->deleted[i]) vcam_put32(&b, i+1);
+		break;
+	case PTP_OC_GetObjectInfo:
+		if (!vcam_valid_handle(v, req->Param1))
+			rc=PTP_RC_InvalidObjectHandle;
+		else
+			vcam_objectinfo(v, &b, req->Param1);
+		break;
+	case PTP_OC_GetObject:
+		if (!vcam_valid_handle(v, req->Param1))
+			rc=PTP_RC_InvalidObjectHandle;
+		else {
+			patlen=v->config.object_size;
+			dataphase=1;
+		}
+		break;
+	case PTP_OC_GetPartialObject:
+	case PTP_OC_ANDROID_GetPartialObject64:
+		if (req->Code==PTP_OC_GetPartialObject) {
+			patoff=req->Param2;
+			n=req->Param3;
+		} else {
+			patoff=req->Param2|(uint64_t)req->Param3<<32;
+			n=req->Param4;
+		}
+		if (!vcam_valid_handle(v, req->Param1))
+			rc=PTP_RC_InvalidObjectHandle;
+		else if (patoff>v->config.object_size)
+			rc=PTP_RC_InvalidParameter;
+		else {
+			patlen=v->config.object_size-patoff;
+			if (patlen>n) patlen=n;
+			vcam_queue(v, PTP_USB_CONTAINER_DATA, req->Code,
+				req->Transaction_ID, &b, patlen, patoff);
+			vcam_response(v, rc, req->Transaction_ID, 1,
+				(uint32_t)patlen);
+			return;
+		}
+		break;
+	case PTP_OC_MTP_GetObjectPropValue:
+		if (!vcam_valid_handle(v, req->Param1))
+			rc=PTP_RC_InvalidObjectHandle;
+		else if (req->Param2!=PTP_OPC_ObjectSize)
+			rc=PTP_RC_DevicePropNotSupported;
+		else
+			vcam_put64(&b, v->config.object_size);
+		break;
+	case PTP_OC_DeleteObject:
+		if (req->Param1==0xffffffff)
+			memset(v->deleted, 1, v->nobjects);
+		else if (!vcam_valid_handle(v, req->Param1))
+			rc=PTP_RC_InvalidObjectHandle;
+		else
+			v->deleted[req->Param1-1]=1;
+		break;
+	case PTP_OC_InitiateCapture:
+		if (v->nobjects==VCAM_MAX_OBJECTS) {
+			rc=PTP_RC_StoreFull;
+			break;
+		}
+		v->deleted[v->nobjects++]=0;
+		vcam_response(v, rc, req->Transaction_ID, 0, 0);
+		vcam_event(v, PTP_EC_ObjectAdded, req->Transaction_ID,
+			v->nobjects);
+		vcam_event(v, PTP_EC_CaptureComplete, req->Transaction_ID, 0);
+		return;
+	case PTP_OC_GetDevicePropDesc:
+	case PTP_OC_GetDevicePropValue:
+		p=vcam_prop(v, req->Param1);
+		if (p==NULL)
+			rc=PTP_RC_DevicePropNotSupported;
+		else if (req->Code==PTP_OC_GetDevicePropDesc)
+			vcam_propdesc(&b, p);
+		else
+			vcam_putval(&b, p->type, p->cur);
+		break;
+	case PTP_OC_SetDevicePropValue:
+		p=vcam_prop(v, req->Param1);
+		if (p==NULL)
+			rc=PTP_RC_DevicePropNotSupported;
+		else
+			rc=vcam_setprop(v, p, data, datalen);
+		break;
+	default:
+		rc=PTP_RC_OperationNotSupported;
+		break;
+	}
+	if (rc==PTP_RC_OK && (b.len>0 || dataphase))
+		vcam_queue(v, PTP_USB_CONTAINER_DATA, req->Code,
+			req->Transaction_ID, &b, patlen, 0);
+	vcam_response(v, rc, req->Transaction_ID, 0, 0);
+	free(b.p);
+}
+
+/* a whole command container is in v->cnt */
+static void
+vcam_command (PTPVCam *v)
+{
+	PTPContainer *req=&v->req;
+	uint32_t len=vcam_get32(v->cnt);
+
+	memset(req, 0, sizeof(PTPContainer));
+	req->Code=v->cnt[6]|(v->cnt[7]<<8);
+	req->Transaction_ID=vcam_get32(v->cnt+8);
+	req->Nparam=(len-PTP_USB_BULK_HDR_LEN)/4;
+	req->Param1=vcam_get32(v->cnt+12);
+	req->Param2=vcam_get32(v->cnt+16);
+	req->Param3=vcam_get32(v->cnt+20);
+	req->Param4=vcam_get32(v->cnt+24);
+	req->Param5=vcam_get32(v->cnt+28);
+	if (v->config.latency)
+		vcam_sleep_us(v->config.latency);
+	switch (req->Code) {
+	case PTP_OC_SetDevicePropValue:
+	case PTP_OC_SendObjectInfo:
+	case PTP_OC_SendObject:
+		v->want_data=1;
+		break;
+	default:
+		vcam_request(v, req, NULL, 0);
+		break;
+	}
+}
+
+static short
+vcam_write_func (unsigned char *bytes, unsigned int size, void *data)
+{
+	PTPVCam *v=(PTPVCam *)data;
+	uint32_t len, n;
+
+	vcam_pace(v, size);
+	while (size>0) {
+		/* data container payload */
+		if (v->datapos<v->datalen) {
+			n=v->datalen-v->datapos;
+			if (n>size) n=size;
+			if (v->datapos<VCAM_DATA_LEN)
+				memcpy(v->data+v->datapos, bytes,
+					v->datapos+n>VCAM_DATA_LEN?
+					VCAM_DATA_LEN-v->datapos:n);
+			v->datapos+=n;
+			bytes+=n;
+			size-=n;
+			if (v->datapos==v->datalen && v->want_data) {
+				v->want_data=0;
+				vcam_request(v, &v->req, v->data,
+					v->datalen<VCAM_DATA_LEN?
+					v->datalen:VCAM_DATA_LEN);
+			}
+			continue;
+		}
+		/* container header, whole command */
+		n=(v->cntlen<PTP_USB_BULK_HDR_LEN?PTP_USB_BULK_HDR_LEN:
+			vcam_get32(v->cnt))-v->cntlen;
+		if (n>size) n=size;
+		memcpy(v->cnt+v->cntlen, bytes, n);
+		v->cntlen+=n;
+		bytes+=n;
+		size-=n;
+		if (v->cntlen<PTP_USB_BULK_HDR_LEN)
+			continue;
+		len=vcam_get32(v->cnt);
+		switch (v->cnt[4]|(v->cnt[5]<<8)) {
+		case PTP_USB_CONTAINER_COMMAND:
+			if (len<PTP_USB_BULK_HDR_LEN ||
+			    len>sizeof(v->cnt))
+				return PTP_ERROR_IO;
+			if (v->cntlen<len)
+				continue;
+			memset(v->cnt+len, 0, sizeof(v->cnt)-len);
+			v->cntlen=0;
+			vcam_command(v);
+			break;
+		case PTP_USB_CONTAINER_DATA:
+			if (len<PTP_USB_BULK_HDR_LEN)
+				return PTP_ERROR_IO;
+			v->cntlen=0;
+			v->datalen=len-PTP_USB_BULK_HDR_LEN;
+			v->datapos=0;
+			if (v->datalen==0 && v->want_data) {
+				v->want_data=0;
+				vcam_request(v, &v->req, v->data, 0);
+			}
+			break;
+		default:
+			v->cntlen=0;
+			return PTP_ERROR_IO;
+		}
+	}
+	return PTP_RC_OK;
+}
+
+/* like a bulk read: never returns more than the container at hand */
+static short
+vcam_read_func (unsigned char *bytes, unsigned int size, void *data)
+{
+	PTPVCam *v=(PTPVCam *)data;
+	VCamOut *o;
+	uint64_t total, n, m, off;
+
+	if (v->outcnt==0)
+		return PTP_ERROR_IO;	/* the device would time out */
+	if (v->config.errors>0 && ++v->reads%v->config.errors==0) {
+		/* flaky link: the transaction is lost */
+		vcam_flush(v);
+		return PTP_ERROR_IO;
+	}
+	o=&v->out[v->outhead];
+	total=o->len+o->patlen;
+	n=total-o->pos;
+	if (n>size) n=size;
+	vcam_pace(v, n);
+	for (off=0; off<n; off+=m) {
+		if (o->pos<o->len) {
+			m=o->len-o->pos;
+			if (m>n-off) m=n-off;
+			memcpy(bytes+off, o->buf+o->pos, m);
+		} else {
+			uint64_t pat=(o->patoff+o->pos-o->len)%
+				VCAM_PATTERN_LEN;
+
+			m=VCAM_PATTERN_LEN-pat;
+			if (m>n-off) m=n-off;
+			memcpy(bytes+off, v->pattern+pat, m);
+		}
+		o->pos+=m;
+	}
+	if (o->pos==total) {
+		free(o->buf);
+		v->outhead=(v->outhead+1)%VCAM_OUT_LEN;
+		v->outcnt--;
+	}
+	return PTP_RC_OK;
+}
+
+/* the class Cancel request: the transaction's bulk IN transfers are dropped */
+static short
+vcam_cancel (uint32_t transaction_id, void *data)
+{
+	vcam_flush((PTPVCam *)data);
+	return PTP_RC_OK;
+}
+
+static short
+vcam_interrupt (PTPVCam *v, unsigned char *bytes, unsigned int size,
+	int wait)
+{
+	uint64_t deadline=vcam_now_us()+
+		(uint64_t)ptp_event_timeout(v->params)*1000;
+	unsigned int tail=v->evtail;
+	unsigned char *e;
+	uint32_t len;
+
+	while (tail==__atomic_load_n(&v->evhead, __ATOMIC_ACQUIRE)) {
+		if (!wait || vcam_now_us()>=deadline)
+			return -1;
+		vcam_sleep_us(1000);
+	}
+	e=v->events[tail%VCAM_EVENT_RING_LEN];
+	len=vcam_get32(e)-v->evpos;
+	if (len>size) len=size;
+	memcpy(bytes, e+v->evpos, len);
+	v->evpos+=len;
+	if (v->evpos==vcam_get32(e)) {
+		v->evpos=0;
+		__atomic_store_n(&v->evtail, tail+1, __ATOMIC_RELEASE);
+	}
+	return len;
+}
+
+static short
+vcam_check_int (unsigned char *bytes, unsigned int size, void *data)
+{
+	return vcam_interrupt((PTPVCam *)data, bytes, size, 1);
+}
+
+static short
+vcam_check_int_fast (unsigned char *bytes, unsigned int size, void *data)
+{
+	return vcam_interrupt((PTPVCam *)data, bytes, size, 0);
+}
+
+static void
+vcam_props (PTPVCam *v)
+{
+	static const VCamProp props[VCAM_NPROPS]={
+		{PTP_DPC_BatteryLevel, PTP_DTC_UINT8, PTP_DPGS_Get,
+			PTP_DPFF_Range, 100, 75, 0, 100, 1, 0, {0}},
+		{PTP_DPC_WhiteBalance, PTP_DTC_UINT16, PTP_DPGS_GetSet,
+			PTP_DPFF_Enumeration, 2, 2, 0, 0, 0, 4,
+			{1, 2, 4, 6}},
+		{PTP_DPC_FNumber, PTP_DTC_UINT16, PTP_DPGS_GetSet,
+			PTP_DPFF_Enumeration, 560, 560, 0, 0, 0, 5,
+			{280, 400, 560, 800, 1100}},
+		{PTP_DPC_ExposureTime, PTP_DTC_UINT32, PTP_DPGS_GetSet,
+			PTP_DPFF_Range, 40, 40, 1, 300000, 1, 0, {0}},
+		{PTP_DPC_ExposureIndex, PTP_DTC_UINT16, PTP_DPGS_GetSet,
+			PTP_DPFF_Enumeration, 100, 100, 0, 0, 0, 5,
+			{100, 200, 400, 800, 1600}}
+	};
+
+	memcpy(v->props, props, sizeof(props));
+}
+
+/**
+ * ptp_vcam_open:
+ * params:	PTPParams*
+ *		const PTPVCamConfig *config	- object store and timing,
+ *						  NULL for the defaults
+ *
+ * Plugs a virtual camera into params: its read, write and interrupt
+ * functions answer the USB container protocol spoken by ptp_usb_*, which
+ * are installed as well. The camera offers a store of config->objects
+ * objects of config->object_size bytes in config->object_format,
+ * a handful of device properties, captures (InitiateCapture adds an
+ * object and sends ObjectAdded and CaptureComplete) and DevicePropChanged
+ * events. Objects may be read in parts by GetPartialObject and Android's
+ * GetPartialObject64. Every transaction takes config->latency us more and
+ * data moves at config->bandwidth KB/s at most. With config->errors every
+ * that many bulk IN transfer fails and the transaction in progress is lost,
+ * like on a flaky hub. ptp_cancel() drops the rest of the data phase.
+ * params->data is set to the camera; the caller's error and debug
+ * functions and timeouts are kept.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_vcam_open (PTPParams* params, const PTPVCamConfig* config)
+{
+	PTPVCam *v;
+	unsigned int i;
+
+	if (params==NULL)
+		return PTP_ERROR_BADPARAM;
+	v=calloc(1, sizeof(PTPVCam));
+	if (v==NULL)
+		return PTP_ERROR_IO;
+	v->deleted=calloc(VCAM_MAX_OBJECTS, 1);
+	if (v->deleted==NULL) {
+		free(v);
+		return PTP_ERROR_IO;
+	}
+	v->params=params;
+	if (config!=NULL)
+		v->config=*config;
+	else {
+		v->config.objects=PTP_VCAM_OBJECTS;
+		v->config.object_size=PTP_VCAM_OBJECT_SIZE;
+	}
+	if (v->config.object_format==0)
+		v->config.object_format=PTP_OFC_EXIF_JPEG;
+	v->nobjects=v->config.objects<VCAM_MAX_OBJECTS?
+		v->config.objects:VCAM_MAX_OBJECTS;
+	for (i=0; i<VCAM_PATTERN_LEN; i++)
+		v->pattern[i]=(unsigned char)(i*7);
+	vcam_props(v);
+
+	params->vcam=v;
+	params->data=v;
+	params->byteorder=PTP_DL_LE;
+	params->maxpacket=PTP_USB_BULK_HS_MAX_PACKET_LEN;
+	params->read_func=vcam_read_func;
+	params->write_func=vcam_write_func;
+	params->writev_func=NULL;
+	params->bufalloc_func=NULL;
+	params->buffree_func=NULL;
+	params->check_int_func=vcam_check_int;
+	params->check_int_fast_func=vcam_check_int_fast;
+	params->cancel_func=vcam_cancel;
+	params->sendreq_func=ptp_usb_sendreq;
+	params->senddata_func=ptp_usb_senddata;
+	params->getresp_func=ptp_usb_getresp;
+	params->getdata_func=ptp_usb_getdata;
+	params->getdatasink_func=ptp_usb_getdata_sink;
+	params->event_check=ptp_usb_event_check;
+	params->event_wait=ptp_usb_event_wait;
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_vcam_close:
+ * params:	PTPParams*
+ *
+ * Frees the virtual camera set up by ptp_vcam_open().
+ **/
+void
+ptp_vcam_close (PTPParams* params)
+{
+	PTPVCam *v=params->vcam;
+
+	if (v==NULL)
+		return;
+	vcam_flush(v);
+	free(v->deleted);
+	free(v);
+	params->vcam=NULL;
+	params->data=NULL;
+}
@@ -0,0 +1,563 @@
+/* wirelog.c
+ *
+ * Wire level record and replay: a shim around read_func, write_func
+ * and check_int_func logging every bulk and interrupt transfer with
+ * a timestamp, and a transport playing such a log back, at the
+ * original pace or as fast as possible.
+ *
+ *  This file is part of libptp2.
+ *
+ *  libptp2 is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  libptp2 is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with libptp2; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+#include "ptp.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifndef HAVE_CLOCK_GETTIME
+#include <sys/time.h>
+#endif
+
+/*
+ * Log layout, all numbers little endian:
+ *
+ *   file header:	"PTPWIRE1", uint32 maxpacket, uint32 chunk_size
+ *   record:		uint8 type, int16 rc, uint32 length,
+ *			uint64 us since the recording started,
+ *			length bytes transferred
+ *
+ * rc is what the IO function returned; for interrupt reads that is the
+ * byte count or a negative value on timeout.
+ */
+#define WIRELOG_MAGIC		"PTPWIRE1"
+#define WIRELOG_HDR_LEN		16
+#define WIRELOG_REC_LEN		15
+
+#define WIRELOG_READ		'R'
+#define WIRELOG_WRITE		'W'
+#define WIRELOG_INT		'I'
+
+/* record being replayed */
+typedef struct {
+	uint8_t type;
+	short rc;
+	uint32_t len;
+	uint32_t pos;
+	uint64_t ts;
+	int valid;
+} WireRec;
+
+struct _PTPWireLog {
+	PTPParams *params;
+	int replay;
+	int realtime;
+	int error;
+	uint64_t start;
+	/* record: the log; replay: bulk records */
+	FILE *f;
+	/* replay: interrupt records, read on their own as the event
+	   pump may run in another thread */
+	FILE *fint;
+	WireRec bulk, intr;
+	/* the transport being recorded */
+	PTPIOReadFunc read_func;
+	PTPIOWriteFunc write_func;
+	PTPIOWriteVFunc writev_func;
+	PTPIOBufAlloc bufalloc_func;
+	PTPIOBufFree buffree_func;
+	PTPIOReadFunc check_int_func;
+	PTPIOReadFunc check_int_fast_func;
+	PTPIOControlFunc clearhalt_func;
+	PTPIOControlFunc reset_func;
+	PTPIOCancelFunc cancel_func;
+	void *data;
+};
+
+static uint64_t
+wirelog_now_us (void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec*1000000+tv.tv_usec;
+#endif
+}
+
+static void
+wirelog_sleep_us (uint64_t us)
+{
+	struct timespec ts;
+
+	ts.tv_sec=us/1000000;
+	ts.tv_nsec=(us%1000000)*1000;
+	while (nanosleep(&ts, &ts)!=0);
+}
+
+static uint32_t
+wirelog_get32 (const unsigned char *a)
+{
+	return (uint32_t)a[0]|((uint32_t)a[1]<<8)|
+		((uint32_t)a[2]<<16)|((uint32_t)a[3]<<24);
+}
+
+/* recording */
+
+/* one record; records of the event pump thread are kept whole */
+static void
+wirelog_put (PTPWireLog *w, uint8_t type, short rc, PTPIOVec *iov,
+	int iovcnt)
+{
+	unsigned char hdr[WIRELOG_REC_LEN];
+	uint64_t ts=wirelog_now_us()-w->start;
+	uint32_t len=0;
+	int i;
+
+	for (i=0; i<iovcnt; i++)
+		len+=iov[i].len;
+	hdr[0]=type;
+	htole16a(hdr+1, (uint16_t)rc);
+	htole32a(hdr+3, len);
+	htole64a(hdr+7, ts);
+	flockfile(w->f);
+	if (fwrite(hdr, WIRELOG_REC_LEN, 1, w->f)!=1)
+		w->error=1;
+	for (i=0; i<iovcnt; i++)
+		if (iov[i].len>0 &&
+		    fwrite(iov[i].base, iov[i].len, 1, w->f)!=1)
+			w->error=1;
+	funlockfile(w->f);
+}
+
+static short
+wirelog_read_func (unsigned char *bytes, unsigned int size, void *data)
+{
+	PTPWireLog *w=(PTPWireLog *)data;
+	PTPIOVec iov;
+	short ret;
+
+	ret=w->read_func(bytes, size, w->data);
+	iov.base=bytes;
+	iov.len=ret==PTP_RC_OK?size:0;
+	wirelog_put(w, WIRELOG_READ, ret, &iov, 1);
+	return ret;
+}
+
+static short
+wirelog_write_func (unsigned char *bytes, unsigned int size, void *data)
+{
+	PTPWireLog *w=(PTPWireLog *)data;
+	PTPIOVec iov;
+	short ret;
+
+	ret=w->write_func(bytes, size, w->data);
+	iov.base=bytes;
+	iov.len=size;
+	wirelog_put(w, WIRELOG_WRITE, ret, &iov, 1);
+	return ret;
+}
+
+static short
+wirelog_writev_func (PTPIOVec *iov, int iovcnt, void *data)
+{
+	PTPWireLog *w=(PTPWireLog *)data;
+	short ret;
+
+	ret=w->writev_func(iov, iovcnt, w->data);
+	wirelog_put(w, WIRELOG_WRITE, ret, iov, iovcnt);
+	return ret;
+}
+
+static unsigned char *
+wirelog_bufalloc (unsigned int size, void *data)
+{
+	PTPWireLog *w=(PTPWireLog *)data;
+
+	return w->bufalloc_func(size, w->data);
+}
+
+static void
+wirelog_buffree (unsigned char *buf, unsigned int size, void *data)
+{
+	PTPWireLog *w=(PTPWireLog *)data;
+
+	w->buffree_func(buf, size, w->data);
+}
+
+static short
+wirelog_int (PTPWireLog *w, PTPIOReadFunc func, unsigned char *bytes,
+	unsigned int size)
+{
+	PTPIOVec iov;
+	short ret;
+
+	ret=func(bytes, size, w->data);
+	iov.base=bytes;
+	iov.len=ret>0?ret:0;
+	wirelog_put(w, WIRELOG_INT, ret, &iov, 1);
+	return ret;
+}
+
+static short
+wirelog_check_int (unsigned char *bytes, unsigned int size, void *data)
+{
+	PTPWireLog *w=(PTPWireLog *)data;
+
+	return wirelog_int(w, w->check_int_func, bytes, size);
+}
+
+static short
+wirelog_check_int_fast (unsigned char *bytes, unsigned int size, void *data)
+{
+	PTPWireLog *w=(PTPWireLog *)data;
+
+	return wirelog_int(w, w->check_int_fast_func, bytes, size);
+}
+
+/*
+ * the recovery and cancel functions of the transport get its data, not
+ * the log
+ */
+static short
+wirelog_clearhalt (void *data)
+{
+	PTPWireLog *w=(PTPWireLog *)data;
+
+	return w->clearhalt_func(w->data);
+}
+
+static short
+wirelog_reset (void *data)
+{
+	PTPWireLog *w=(PTPWireLog *)data;
+
+	return w->reset_func(w->data);
+}
+
+static short
+wirelog_cancel (uint32_t transaction_id, void *data)
+{
+	PTPWireLog *w=(PTPWireLog *)data;
+
+	return w->cancel_func(transaction_id, w->data);
+}
+
+/**
+ * ptp_record_open:
+ * params:	PTPParams*
+ *		const char *filename	- log to write
+ *
+ * Starts logging every transfer done through params->read_func,
+ * write_func, writev_func and the interrupt functions to filename,
+ * wrapping the transport set up in params (params->data then points at
+ * the log). Call it before ptp_opensession() to get a log
+ * ptp_replay_open() can play back; ptp_wirelog_close() stops it.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_record_open (PTPParams* params, const char *filename)
+{
+	PTPWireLog *w;
+	unsigned char hdr[WIRELOG_HDR_LEN];
+
+	if (params->wirelog!=NULL || params->read_func==NULL ||
+	    params->write_func==NULL)
+		return PTP_ERROR_BADPARAM;
+	w=calloc(1, sizeof(PTPWireLog));
+	if (w==NULL)
+		return PTP_ERROR_IO;
+	w->f=fopen(filename, "wb");
+	if (w->f==NULL) {
+		free(w);
+		return PTP_ERROR_IO;
+	}
+	memcpy(hdr, WIRELOG_MAGIC, 8);
+	htole32a(hdr+8, params->maxpacket);
+	htole32a(hdr+12, params->chunk_size);
+	if (fwrite(hdr, WIRELOG_HDR_LEN, 1, w->f)!=1) {
+		fclose(w->f);
+		free(w);
+		return PTP_ERROR_IO;
+	}
+	w->start=wirelog_now_us();
+	w->params=params;
+
+	w->read_func=params->read_func;
+	w->write_func=params->write_func;
+	w->writev_func=params->writev_func;
+	w->bufalloc_func=params->bufalloc_func;
+	w->buffree_func=params->buffree_func;
+	w->check_int_func=params->check_int_func;
+	w->check_int_fast_func=params->check_int_fast_func;
+	w->clearhalt_func=params->clearhalt_func;
+	w->reset_func=params->reset_func;
+	w->cancel_func=params->cancel_func;
+	w->data=params->data;
+	params->read_func=wirelog_read_func;
+	params->write_func=wirelog_write_func;
+	if (w->writev_func!=NULL)
+		params->writev_func=wirelog_writev_func;
+	if (w->bufalloc_func!=NULL) {
+		params->bufalloc_func=wirelog_bufalloc;
+		params->buffree_func=wirelog_buffree;
+	}
+	if (w->check_int_func!=NULL)
+		params->check_int_func=wirelog_check_int;
+	if (w->check_int_fast_func!=NULL)
+		params->check_int_fast_func=wirelog_check_int_fast;
+	if (w->clearhalt_func!=NULL)
+		params->clearhalt_func=wirelog_clearhalt;
+	if (w->reset_func!=NULL)
+		params->reset_func=wirelog_reset;
+	if (w->cancel_func!=NULL)
+		params->cancel_func=wirelog_cancel;
+	params->data=w;
+	params->wirelog=w;
+	return PTP_RC_OK;
+}
+
+/* replay */
+
+/* next record of one of the types, skipping the others */
+static int
+wirelog_next (FILE *f, WireRec *rec, uint8_t type1, uint8_t type2)
+{
+	unsigned char hdr[WIRELOG_REC_LEN];
+
+	if (rec->valid && rec->pos<rec->len &&
+	    fseeko(f, rec->len-rec->pos, SEEK_CUR)!=0)
+		return 0;
+	rec->valid=0;
+	while (fread(hdr, WIRELOG_REC_LEN, 1, f)==1) {
+		rec->type=hdr[0];
+		rec->rc=(short)(hdr[1]|(hdr[2]<<8));
+		rec->len=wirelog_get32(hdr+3);
+		rec->ts=wirelog_get32(hdr+7)|
+			((uint64_t)wirelog_get32(hdr+11)<<32);
+		rec->pos=0;
+		if (rec->type==type1 || rec->type==type2) {
+			rec->valid=1;
+			return 1;
+		}
+		if (rec->len>0 && fseeko(f, rec->len, SEEK_CUR)!=0)
+			return 0;
+	}
+	return 0;
+}
+
+/* holds a record back until its time, when replaying in real time */
+static void
+wirelog_wait (PTPWireLog *w, WireRec *rec)
+{
+	uint64_t now;
+
+	if (!w->realtime)
+		return;
+	now=wirelog_now_us();
+	if (w->start+rec->ts>now)
+		wirelog_sleep_us(w->start+rec->ts-now);
+}
+
+/* serves a bulk transfer from the recorded one, which may take several
+   calls if the transfer is split differently now */
+static short
+wirelog_bulk (PTPWireLog *w, uint8_t type, unsigned char *bytes,
+	unsigned int size)
+{
+	WireRec *rec=&w->bulk;
+	unsigned int n;
+
+	if (!rec->valid || rec->pos==rec->len || rec->type!=type) {
+		if (!wirelog_next(w->f, rec, WIRELOG_READ, WIRELOG_WRITE))
+			return PTP_ERROR_IO;
+		/* the initiator strayed from the recorded session */
+		if (rec->type!=type)
+			return PTP_ERROR_IO;
+		wirelog_wait(w, rec);
+		if (rec->rc!=PTP_RC_OK) {
+			if (rec->len>0 && fseeko(w->f, rec->len, SEEK_CUR)!=0)
+				return PTP_ERROR_IO;
+			rec->pos=rec->len;
+			return rec->rc;
+		}
+	}
+	n=rec->len-rec->pos;
+	if (n>size) n=size;
+	if (type==WIRELOG_READ) {
+		if (n>0 && fread(bytes, 1, n, w->f)!=n)
+			return PTP_ERROR_IO;
+	} else if (n>0 && fseeko(w->f, n, SEEK_CUR)!=0)
+		return PTP_ERROR_IO;
+	rec->pos+=n;
+	return PTP_RC_OK;
+}
+
+static short
+wirelog_replay_read (unsigned char *bytes, unsigned int size, void *data)
+{
+	return wirelog_bulk((PTPWireLog *)data, WIRELOG_READ, bytes, size);
+}
+
+static short
+wirelog_replay_write (unsigned char *bytes, unsigned int size, void *data)
+{
+	return wirelog_bulk((PTPWireLog *)data, WIRELOG_WRITE, bytes, size);
+}
+
+static short
+wirelog_replay_int (unsigned char *bytes, unsigned int size, void *data)
+{
+	PTPWireLog *w=(PTPWireLog *)data;
+	WireRec *rec=&w->intr;
+	unsigned int n;
+
+	if (!rec->valid || rec->pos==rec->len) {
+		if (!wirelog_next(w->fint, rec, WIRELOG_INT, WIRELOG_INT)) {
+			/* nothing more happened, the camera timed out */
+			if (w->realtime)
+				wirelog_sleep_us(
+					(uint64_t)ptp_event_timeout(w->params)*1000);
+			return -1;
+		}
+		wirelog_wait(w, rec);
+		if (rec->len==0)
+			return rec->rc;
+	}
+	n=rec->len-rec->pos;
+	if (n>size) n=size;
+	if (fread(bytes, 1, n, w->fint)!=n)
+		return -1;
+	rec->pos+=n;
+	return n;
+}
+
+/**
+ * ptp_replay_open:
+ * params:	PTPParams*
+ *		const char *filename	- log written by ptp_record_open()
+ *		int realtime		- 1: keep the recorded timing,
+ *					  0: play back as fast as possible
+ *
+ * Sets params up to play the log back: the reads, writes and interrupt
+ * reads the initiator does are answered from the recorded transfers
+ * through the USB container code, so the transaction and parsing layers
+ * run against real camera traffic. The initiator has to repeat the
+ * recorded session; if it strays, the transfers fail with PTP_ERROR_IO.
+ * maxpacket and chunk_size are taken from the log. The caller's error
+ * and debug functions and timeouts are kept; ptp_wirelog_close() ends
+ * the replay.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_replay_open (PTPParams* params, const char *filename, int realtime)
+{
+	PTPWireLog *w;
+	unsigned char hdr[WIRELOG_HDR_LEN];
+
+	if (params->wirelog!=NULL)
+		return PTP_ERROR_BADPARAM;
+	w=calloc(1, sizeof(PTPWireLog));
+	if (w==NULL)
+		return PTP_ERROR_IO;
+	w->f=fopen(filename, "rb");
+	if (w->f!=NULL)
+		w->fint=fopen(filename, "rb");
+	if (w->fint==NULL ||
+	    fread(hdr, WIRELOG_HDR_LEN, 1, w->f)!=1 ||
+	    memcmp(hdr, WIRELOG_MAGIC, 8)!=0 ||
+	    fseeko(w->fint, WIRELOG_HDR_LEN, SEEK_SET)!=0) {
+		if (w->fint!=NULL) fclose(w->fint);
+		if (w->f!=NULL) fclose(w->f);
+		free(w);
+		return PTP_ERROR_IO;
+	}
+	w->replay=1;
+	w->realtime=realtime;
+	w->params=params;
+
+	params->byteorder=PTP_DL_LE;
+	params->maxpacket=wirelog_get32(hdr+8);
+	params->chunk_size=wirelog_get32(hdr+12);
+	params->read_func=wirelog_replay_read;
+	params->write_func=wirelog_replay_write;
+	params->writev_func=NULL;
+	params->bufalloc_func=NULL;
+	params->buffree_func=NULL;
+	params->check_int_func=wirelog_replay_int;
+	params->check_int_fast_func=wirelog_replay_int;
+	params->cancel_func=NULL;
+	params->sendreq_func=ptp_usb_sendreq;
+	params->senddata_func=ptp_usb_senddata;
+	params->getresp_func=ptp_usb_getresp;
+	params->getdata_func=ptp_usb_getdata;
+	params->getdatasink_func=ptp_usb_getdata_sink;
+	params->event_check=ptp_usb_event_check;
+	params->event_wait=ptp_usb_event_wait;
+	params->data=w;
+	params->wirelog=w;
+	w->start=wirelog_now_us();
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_wirelog_close:
+ * params:	PTPParams*
+ *
+ * Ends recording, giving params the recorded transport back, or ends
+ * a replay.
+ *
+ * Return values: Some PTP_RC_* code; PTP_ERROR_IO if the log could not
+ * be written completely.
+ **/
+uint16_t
+ptp_wirelog_close (PTPParams* params)
+{
+	PTPWireLog *w=params->wirelog;
+	uint16_t ret=PTP_RC_OK;
+
+	if (w==NULL)
+		return PTP_ERROR_BADPARAM;
+	if (w->replay) {
+		fclose(w->fint);
+		params->data=NULL;
+	} else {
+		params->read_func=w->read_func;
+		params->write_func=w->write_func;
+		params->writev_func=w->writev_func;
+		params->bufalloc_func=w->bufalloc_func;
+		params->buffree_func=w->buffree_func;
+		params->check_int_func=w->check_int_func;
+		params->check_int_fast_func=w->check_int_fast_func;
+		params->clearhalt_func=w->clearhalt_func;
+		params->reset_func=w->reset_func;
+		params->cancel_func=w->cancel_func;
+		params->data=w->data;
+	}
+	if (fclose(w->f)!=0 || w->error)
+		ret=PTP_ERROR_IO;
+	free(w);
+	params->wirelog=NULL;
+	return ret;
+}